@@ -0,0 +1,5173 @@
+/* cfb.c - Native compound file support.
+ *
+ * This file implements access to Microsoft compound files (also known
+ * as structured storage or docfiles) without using OLE. The file is
+ * mapped into memory and the header, DIFAT, FAT, MiniFAT and directory
+ * are parsed directly. Stream data is copied straight out of the
+ * mapped image.
+ *
+ * Both version 3 (512 byte sectors) and version 4 (4096 byte sectors)
+ * files are supported. See [MS-CFB] for details of the format.
+ *
+ * A compound file may also be held in memory. The image is then kept in
+ * an arena that grows as sectors are added instead of a file mapping.
+ * A file that is not to be mapped, or that cannot be mapped, is read
+ * through a cache of sectors of a fixed size instead.
+ *
+ * Files opened for writing are updated using shadow paging. Changes are
+ * held in memory and a commit writes them to sectors that the committed
+ * image does not use, followed by new copies of the directory and
+ * allocation tables. Replacing the header is the final step so the file
+ * is always either in the old state or the new state.
+ *
+ * LIMITATIONS
+ *   * Uncommitted changes are held in memory.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * @(#) $Id$
+ */
+
+#include "tclstorage.h"
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * The number of sectors that chains may refer to. This includes new
+ * sectors that have not yet been written when the file is writable.
+ */
+
+#define SECTOR_LIMIT(cfbPtr) \
+    ((cfbPtr)->fat ? (cfbPtr)->fatLen : (cfbPtr)->sectorCount)
+
+/*
+ * Direct mode files are committed when this much modified data is held.
+ */
+
+#define CFB_DIRECT_LIMIT (4UL << 20)
+
+/*
+ * The sector cache used when a file cannot be mapped holds this many
+ * bytes. Any cache holds at least CFB_CACHE_MIN sectors.
+ */
+
+#define CFB_CACHE_DEFAULT (1UL << 20)
+#define CFB_CACHE_MIN     8
+
+/*
+ * Bitsets of sectors or directory entries.
+ */
+
+#define BITSET_BYTES(n)      (((size_t)(n) + 7) >> 3)
+#define BITSET_TEST(bits, n) ((bits)[(n) >> 3] & (1U << ((n) & 7)))
+#define BITSET_SET(bits, n)  ((bits)[(n) >> 3] |= (1U << ((n) & 7)))
+
+/*
+ * The parts of the image to be copied by CfbReadRanges. They are sorted
+ * by address so the image is read in file order.
+ */
+
+typedef struct Piece {
+    const unsigned char *src;
+    char          *dst;
+    size_t         len;
+} Piece;
+
+typedef struct PieceList {
+    Piece         *pieces;
+    size_t         count;
+    size_t         space;
+} PieceList;
+
+/*
+ * The sector cache of a file that is not mapped. Frames are reused in
+ * CLOCK order: each hit sets the reference bit of a frame and a frame is
+ * only evicted once the hand has passed it with the bit clear. The
+ * sectors of the FAT, MiniFAT and mini stream are read on every lookup
+ * so they are held in frames of their own that are never evicted. The
+ * header is kept separately as it is not a sector.
+ */
+
+typedef struct CacheFrame {
+    CfbSect        sect;        /* the sector held or CFB_FREESECT */
+    int            referenced;  /* used since the hand last passed */
+    int            hot;         /* pinned and not part of the ring */
+    unsigned char *data;
+} CacheFrame;
+
+struct CfbCache {
+    unsigned char  header[CFB_HEADER_SIZE];
+    Tcl_HashTable  frames;      /* frame of each cached sector */
+    Tcl_HashTable  hot;         /* sectors that are pinned when read */
+    CacheFrame    *ring;        /* the frames that may be evicted */
+    CfbSect        ringSize;
+    CfbSect        hand;
+    CfbSect        used;
+    CfbSect        pinned;
+    Tcl_WideUInt   hits;
+    Tcl_WideUInt   misses;
+    Tcl_WideUInt   evictions;
+};
+
+/*
+ * The progress of CfbCheck. Bitmaps record the sectors and mini sectors
+ * reached by the chains checked so far.
+ */
+
+typedef struct CheckState {
+    Cfb           *cfbPtr;
+    CfbCheckProc  *proc;
+    ClientData     clientData;
+    int            stop;        /* the callback asked to stop */
+    unsigned char *owned;       /* sectors reached by a chain */
+    unsigned char *miniOwned;   /* mini sectors reached by a chain */
+    CfbSect        miniCount;   /* mini sectors in the mini stream */
+} CheckState;
+
+const unsigned char cfbSignature[8] = {
+    0xD0, 0xCF, 0x11, 0xE0, 0xA1, 0xB1, 0x1A, 0xE1
+};
+
+static int  MapFile(Tcl_Obj *pathObj, Cfb *cfbPtr);
+#ifdef _WIN32
+static int  MapView(Cfb *cfbPtr, Tcl_WideUInt length);
+#endif
+static int  RemapFile(Cfb *cfbPtr, Tcl_WideUInt length);
+static void UnmapFile(Cfb *cfbPtr);
+static int  WriteFileAt(Cfb *cfbPtr, Tcl_WideUInt offset,
+                const unsigned char *data, unsigned long len);
+static int  SyncFile(Cfb *cfbPtr);
+static void AdviseFile(Cfb *cfbPtr, Tcl_WideUInt offset, Tcl_WideUInt len);
+static int  ReadFileAt(Cfb *cfbPtr, Tcl_WideUInt offset,
+                unsigned char *buffer, unsigned long len);
+static int  OpenCache(Cfb *cfbPtr, Tcl_WideUInt length);
+static void FreeCache(Cfb *cfbPtr);
+static void CacheHotSectors(Cfb *cfbPtr);
+static const unsigned char *CacheSector(Cfb *cfbPtr, CfbSect sect);
+static void CacheUpdate(Cfb *cfbPtr, Tcl_WideUInt offset,
+                const unsigned char *data, unsigned long len);
+static void CacheDiscard(Cfb *cfbPtr, Tcl_WideUInt length);
+static const unsigned char *HeaderData(Cfb *cfbPtr);
+static int  LoadTables(Cfb *cfbPtr);
+static void FreeTables(Cfb *cfbPtr);
+static void InitWork(Cfb *cfbPtr);
+static void FreeWork(Cfb *cfbPtr);
+static int  Reload(Cfb *cfbPtr, int r);
+static int  ReplaceFile(Cfb *cfbPtr, Tcl_Obj *newObj);
+static void CheckProblem(CheckState *statePtr, const char *area,
+                CfbSect item, const char *message);
+static int  CheckHeader(CheckState *statePtr, CfbSect *dirStartPtr,
+                CfbSect *miniFatStartPtr);
+static void CheckFat(CheckState *statePtr);
+static void CheckTable(CheckState *statePtr, CfbSect sect, CfbSect mark,
+                const char *what);
+static CfbSect CheckChain(CheckState *statePtr, int mini, CfbSect start,
+                const char *area, CfbSect item, const char *what,
+                CfbSect **sectsPtrPtr);
+static int  CheckDirectory(CheckState *statePtr, CfbSect start);
+static void CheckMiniStream(CheckState *statePtr, CfbSect miniFatStart);
+static void CheckTree(CheckState *statePtr);
+static void CheckStream(CheckState *statePtr, CfbSect id);
+static void CheckUnused(CheckState *statePtr);
+static int  ParseHeader(Cfb *cfbPtr, CfbSect *dirStartPtr,
+                CfbSect *miniFatStartPtr);
+static int  LoadChain(Cfb *cfbPtr, CfbSect start,
+                CfbSect **sectsPtrPtr, CfbSect *countPtr);
+static int  LoadDirectory(Cfb *cfbPtr, CfbSect start);
+static void ParseEntry(Cfb *cfbPtr, const unsigned char *p,
+                CfbEntry *entryPtr);
+static void FreeCfb(Cfb *cfbPtr);
+static const unsigned char *SectorData(Cfb *cfbPtr, CfbSect sect,
+                unsigned long *availPtr);
+static const unsigned char *MiniSectorData(Cfb *cfbPtr, CfbSect sect,
+                unsigned long *availPtr);
+static int  NextSector(Cfb *cfbPtr, CfbSect sect, CfbSect *nextPtr);
+static int  NextMiniSector(Cfb *cfbPtr, CfbSect sect, CfbSect *nextPtr);
+static int  GetChain(Cfb *cfbPtr, CfbSect id, CfbChain **chainPtrPtr);
+static int  BuildChain(Cfb *cfbPtr, CfbSect id, CfbChain **chainPtrPtr);
+static void ChainAppend(CfbChain *chainPtr, CfbSect sect, Tcl_WideUInt pos);
+static void FreeChain(CfbChain *chainPtr);
+static CfbExtent *FindExtent(CfbStream *stmPtr, Tcl_WideUInt index);
+static int  ReadStream(CfbStream *stmPtr, char *buffer, int toRead,
+                PieceList *listPtr);
+static void ReadAhead(CfbStream *stmPtr, int toRead);
+static void AddPiece(PieceList *listPtr, const unsigned char *src,
+                char *dst, size_t len);
+static int  ComparePieces(const void *p1, const void *p2);
+static int  StreamCheck(CfbStream *stmPtr);
+static int  ResizeStream(Cfb *cfbPtr, CfbSect id, Tcl_WideUInt size);
+static int  ConvertStream(Cfb *cfbPtr, CfbSect id, Tcl_WideUInt size);
+static void InvalidateChain(Cfb *cfbPtr, CfbSect id);
+static Cfb *NewCfb(int mode);
+static int  OpenImage(Cfb *cfbPtr, int r, Cfb **cfbPtrPtr);
+static int  EmptyImage(Cfb *cfbPtr);
+static int  GrowArena(Cfb *cfbPtr, Tcl_WideUInt need);
+static int  WriteImage(Cfb *cfbPtr, Tcl_WideUInt offset,
+                const unsigned char *data, unsigned long len);
+static int  ResizeImage(Cfb *cfbPtr, Tcl_WideUInt length);
+static int  SyncImage(Cfb *cfbPtr);
+static void ReleaseImage(Cfb *cfbPtr);
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbOpen --
+ *
+ *	Open a compound file. The file is mapped into memory and the
+ *	header, DIFAT, FAT, MiniFAT and directory are parsed. With a
+ *	cacheSize the file is not mapped and up to that many bytes of
+ *	sectors are cached instead.
+ *
+ * Results:
+ *	A CFB status code. On success a new Cfb structure with a zero
+ *	reference count is stored in cfbPtrPtr.
+ *
+ * Side effects:
+ *	The file is opened and mapped until the last reference is released.
+ *	With STGM_CREATE a new empty file is created first. An empty path
+ *	with STGM_CREATE creates a compound file held in memory.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbOpen(Tcl_Obj *pathObj, int mode, Tcl_WideUInt cacheSize, Cfb **cfbPtrPtr)
+{
+    Cfb *cfbPtr;
+    int r = CFB_OK;
+
+    if (Tcl_GetCharLength(pathObj) == 0) {
+        return (mode & STGM_CREATE)
+            ? CfbOpenData(NULL, 0, mode, cfbPtrPtr) : CFB_ENOENT;
+    }
+
+    /*
+     * A new file is created empty by the builder and then opened.
+     */
+
+    if (mode & STGM_CREATE) {
+        CfbBuilder *builderPtr;
+        r = CfbBuilderCreate(pathObj, &builderPtr);
+        if (r == CFB_OK) {
+            CfbBuilderIncrRefCount(builderPtr);
+            r = CfbBuilderFinish(builderPtr);
+            CfbBuilderDecrRefCount(builderPtr);
+        }
+        if (r != CFB_OK) {
+            return r;
+        }
+    }
+
+    cfbPtr = NewCfb(mode);
+    cfbPtr->cacheSize = cacheSize;
+    r = MapFile(pathObj, cfbPtr);
+    if (r == CFB_OK) {
+        Tcl_Obj *normObj = Tcl_FSGetNormalizedPath(NULL, pathObj);
+        const char *path = Tcl_GetString(normObj ? normObj : pathObj);
+        cfbPtr->path = ckalloc(strlen(path) + 1);
+        strcpy(cfbPtr->path, path);
+    }
+    return OpenImage(cfbPtr, r, cfbPtrPtr);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbOpenData --
+ *
+ *	Open a compound file held in memory. The data is copied into an
+ *	arena owned by the compound file so the caller's buffer need not
+ *	remain valid. With STGM_CREATE the data is ignored and a new empty
+ *	compound file is created.
+ *
+ * Results:
+ *	A CFB status code. On success a new Cfb structure with a zero
+ *	reference count is stored in cfbPtrPtr.
+ *
+ * Side effects:
+ *	Memory is allocated until the last reference is released.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbOpenData(const unsigned char *data, Tcl_WideUInt length, int mode,
+    Cfb **cfbPtrPtr)
+{
+    Cfb *cfbPtr = NewCfb(mode);
+    int r;
+
+    cfbPtr->inMemory = 1;
+    if (mode & STGM_CREATE) {
+        r = EmptyImage(cfbPtr);
+    } else if (length == 0) {
+        r = CFB_EFORMAT;
+    } else {
+        r = GrowArena(cfbPtr, length);
+        if (r == CFB_OK) {
+            memcpy(cfbPtr->base, data, (size_t)length);
+            cfbPtr->length = length;
+        }
+    }
+    return OpenImage(cfbPtr, r, cfbPtrPtr);
+}
+
+static Cfb *
+NewCfb(int mode)
+{
+    Cfb *cfbPtr = (Cfb *)ckalloc(sizeof(Cfb));
+
+    memset(cfbPtr, 0, sizeof(Cfb));
+    cfbPtr->mode = mode;
+    cfbPtr->writable = (mode & (STGM_WRITE | STGM_READWRITE
+                                | STGM_CREATE | STGM_APPEND)) != 0;
+#ifdef _WIN32
+    cfbPtr->hFile = INVALID_HANDLE_VALUE;
+#else
+    cfbPtr->fd = -1;
+#endif
+    return cfbPtr;
+}
+
+/*
+ * Parse the tables of a newly opened image. The compound file is
+ * released if the image could not be obtained or is not valid.
+ */
+
+static int
+OpenImage(Cfb *cfbPtr, int r, Cfb **cfbPtrPtr)
+{
+    if (r == CFB_OK) {
+        r = LoadTables(cfbPtr);
+    }
+    if (r == CFB_OK && cfbPtr->writable) {
+        InitWork(cfbPtr);
+    }
+
+    if (r != CFB_OK) {
+        FreeCfb(cfbPtr);
+    } else {
+        *cfbPtrPtr = cfbPtr;
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbIncrRefCount, CfbDecrRefCount --
+ *
+ *	Manage the reference count of an open compound file.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	When the last reference is released the file is unmapped and
+ *	closed and all memory free'd. Unless the file was opened in
+ *	transacted mode any outstanding changes are committed first.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+void
+CfbIncrRefCount(Cfb *cfbPtr)
+{
+    if (cfbPtr->shared) {
+        Tcl_MutexLock(&cfbPtr->lock);
+        ++cfbPtr->refCount;
+        Tcl_MutexUnlock(&cfbPtr->lock);
+    } else {
+        ++cfbPtr->refCount;
+    }
+}
+
+void
+CfbDecrRefCount(Cfb *cfbPtr)
+{
+    int refCount;
+
+    if (cfbPtr->shared) {
+        Tcl_MutexLock(&cfbPtr->lock);
+        refCount = --cfbPtr->refCount;
+        Tcl_MutexUnlock(&cfbPtr->lock);
+    } else {
+        refCount = --cfbPtr->refCount;
+    }
+    if (refCount <= 0) {
+        FreeCfb(cfbPtr);
+    }
+}
+
+static void
+FreeCfb(Cfb *cfbPtr)
+{
+    if (cfbPtr->writable && cfbPtr->fat) {
+        /* a file held in memory is discarded anyway */
+        if (!(cfbPtr->mode & STGM_TRANSACTED) && !cfbPtr->inMemory) {
+            CfbCommit(cfbPtr);
+        }
+        if (cfbPtr->fat) {
+            FreeWork(cfbPtr);
+        }
+    }
+    FreeTables(cfbPtr);
+    ReleaseImage(cfbPtr);
+    if (cfbPtr->path) {
+        ckfree(cfbPtr->path);
+    }
+    Tcl_MutexFinalize(&cfbPtr->lock);
+    ckfree((char *)cfbPtr);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbShare --
+ *
+ *	Prepare a compound file to be read by several threads at once.
+ *	Only files that cannot be modified may be shared. The extents of
+ *	every stream are resolved now so that the tables are not changed
+ *	once other threads are using them. Reads take no lock as each
+ *	thread has its own stream positions and the image is not changed.
+ *	A file read through a sector cache cannot be shared.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	Reference counting and the building of any missing extent index
+ *	are done holding a lock from now on.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbShare(Cfb *cfbPtr)
+{
+    CfbChain *chainPtr;
+    CfbSect id;
+
+    if (cfbPtr->writable) {
+        return CFB_EACCES;
+    }
+    if (cfbPtr->cachePtr) {
+        /* sectors in the cache may be evicted while another thread
+         * is copying them */
+        return CFB_ENOTSUP;
+    }
+    if (!cfbPtr->shared) {
+        for (id = 0; id < cfbPtr->entryCount; id++) {
+            if (cfbPtr->entries[id].type == CFB_TYPE_STREAM) {
+                /* a damaged chain is reported when the stream is opened */
+                GetChain(cfbPtr, id, &chainPtr);
+            }
+        }
+        cfbPtr->shared = 1;
+    }
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbGetUsage --
+ *
+ *	Measure the space used by a compound file and how scattered the
+ *	streams are. A stream held in one run of consecutive sectors has
+ *	one fragment.
+ *
+ * Results:
+ *	A CFB status code. The usage is stored in usagePtr.
+ *
+ * Side effects:
+ *	The extents of every stream are resolved.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbGetUsage(Cfb *cfbPtr, CfbUsage *usagePtr)
+{
+    CfbSect miniCount, n, next;
+    CfbChain *chainPtr;
+    int r = CFB_OK;
+
+    memset(usagePtr, 0, sizeof(CfbUsage));
+    usagePtr->size = cfbPtr->length;
+    for (n = 0; n < cfbPtr->sectorCount; n++) {
+        if (NextSector(cfbPtr, n, &next) == CFB_OK && next == CFB_FREESECT) {
+            usagePtr->freeSize += cfbPtr->sectorSize;
+        }
+    }
+    miniCount = cfbPtr->miniSectCount
+        << (cfbPtr->sectorShift - cfbPtr->miniSectorShift);
+    for (n = 0; n < miniCount; n++) {
+        if (NextMiniSector(cfbPtr, n, &next) != CFB_OK
+            || next == CFB_FREESECT) {
+            usagePtr->freeSize += cfbPtr->miniSectorSize;
+        }
+    }
+    for (n = 1; r == CFB_OK && n < cfbPtr->entryCount; n++) {
+        if (cfbPtr->entries[n].type == CFB_TYPE_STREAM
+            && cfbPtr->entries[n].size > 0) {
+            r = GetChain(cfbPtr, n, &chainPtr);
+            if (r == CFB_OK) {
+                usagePtr->streams++;
+                usagePtr->fragments += chainPtr->extentCount;
+            }
+        }
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbAnalyze --
+ *
+ *	Describe the layout of a compound file. The FAT and the MiniFAT
+ *	are each read once in sector order to count the free sectors and
+ *	find the longest free run. The directory below the given storage
+ *	is then visited once, using a bitset of the entries seen to stop
+ *	at any loop, to measure the nesting of storages and the depth of
+ *	the tree holding the items of each storage.
+ *
+ * Results:
+ *	A CFB status code. The analysis is stored in infoPtr.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbAnalyze(Cfb *cfbPtr, CfbSect dirId, CfbAnalysis *infoPtr)
+{
+    CfbSect count = SECTOR_LIMIT(cfbPtr), run = 0, n, next;
+    CfbSect *trees, *storages, treeTop = 0, storageTop = 0;
+    unsigned char *seen;
+    int r = CFB_OK;
+
+    memset(infoPtr, 0, sizeof(CfbAnalysis));
+    infoPtr->sectors = count;
+    for (n = 0; n < count; n++) {
+        if (NextSector(cfbPtr, n, &next) != CFB_OK) {
+            next = CFB_FREESECT;
+        }
+        if (next == CFB_FREESECT) {
+            infoPtr->freeSectors++;
+            if (++run > infoPtr->largestFree) {
+                infoPtr->largestFree = run;
+            }
+        } else {
+            run = 0;
+            if (next == CFB_FATSECT || next == CFB_DIFSECT) {
+                infoPtr->tableSectors++;
+            }
+        }
+    }
+    infoPtr->miniSectors = cfbPtr->miniSectCount
+        << (cfbPtr->sectorShift - cfbPtr->miniSectorShift);
+    for (n = 0; n < infoPtr->miniSectors; n++) {
+        if (NextMiniSector(cfbPtr, n, &next) != CFB_OK
+            || next == CFB_FREESECT) {
+            infoPtr->miniFree++;
+        }
+    }
+
+    if (dirId >= cfbPtr->entryCount
+        || cfbPtr->entries[dirId].type == CFB_TYPE_STREAM) {
+        return CFB_ENOENT;
+    }
+
+    /*
+     * Each stack holds pairs of an entry and its depth. A storage is
+     * pushed once and each entry visited in a tree adds at most one
+     * pair to the tree stack, so neither can hold more pairs than there
+     * are entries.
+     */
+
+    seen = (unsigned char *)ckalloc(BITSET_BYTES(cfbPtr->entryCount));
+    memset(seen, 0, BITSET_BYTES(cfbPtr->entryCount));
+    trees = (CfbSect *)ckalloc(sizeof(CfbSect) * 2
+        * (cfbPtr->entryCount + 1));
+    storages = (CfbSect *)ckalloc(sizeof(CfbSect) * 2
+        * (cfbPtr->entryCount + 1));
+    BITSET_SET(seen, dirId);
+    storages[storageTop++] = dirId;
+    storages[storageTop++] = 0;
+    while (r == CFB_OK && storageTop > 0) {
+        CfbSect level = storages[--storageTop];
+        CfbSect parent = storages[--storageTop];
+        CfbSect items = 0, depth = 0;
+
+        if (level > infoPtr->depth) {
+            infoPtr->depth = level;
+        }
+        trees[treeTop++] = cfbPtr->entries[parent].child;
+        trees[treeTop++] = 1;
+        while (treeTop > 0) {
+            CfbSect height = trees[--treeTop];
+            CfbSect id = trees[--treeTop];
+            const CfbEntry *entryPtr;
+
+            if (id == CFB_NOSTREAM) {
+                continue;
+            }
+            if (id >= cfbPtr->entryCount || BITSET_TEST(seen, id)) {
+                r = CFB_EFORMAT;
+                break;
+            }
+            BITSET_SET(seen, id);
+            entryPtr = &cfbPtr->entries[id];
+            items++;
+            if (height > depth) {
+                depth = height;
+            }
+            if (entryPtr->type == CFB_TYPE_STORAGE) {
+                infoPtr->storages++;
+                storages[storageTop++] = id;
+                storages[storageTop++] = level + 1;
+            } else if (entryPtr->type == CFB_TYPE_STREAM) {
+                infoPtr->streams++;
+            } else {
+                r = CFB_EFORMAT;
+                break;
+            }
+            trees[treeTop++] = entryPtr->left;
+            trees[treeTop++] = height + 1;
+            trees[treeTop++] = entryPtr->right;
+            trees[treeTop++] = height + 1;
+        }
+        infoPtr->entries += items;
+        if (depth > infoPtr->treeDepth) {
+            infoPtr->treeDepth = depth;
+        }
+        for (depth = 0; items > 0; items >>= 1) {
+            depth++;
+        }
+        if (depth > infoPtr->balancedDepth) {
+            infoPtr->balancedDepth = depth;
+        }
+    }
+    ckfree((char *)storages);
+    ckfree((char *)trees);
+    ckfree((char *)seen);
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * LoadTables, FreeTables --
+ *
+ *	Parse the header, DIFAT, MiniFAT and directory of the mapped
+ *	image or release the tables built from them.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The table fields of cfbPtr are filled in or free'd. Any cached
+ *	stream extents are discarded. The sector cache, if any, is
+ *	emptied and told which sectors to pin.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+LoadTables(Cfb *cfbPtr)
+{
+    CfbSect dirStart, miniFatStart;
+    int r;
+
+    r = ParseHeader(cfbPtr, &dirStart, &miniFatStart);
+    if (r == CFB_OK) {
+        r = LoadChain(cfbPtr, miniFatStart,
+            &cfbPtr->miniFatSects, &cfbPtr->miniFatSectCount);
+    }
+    if (r == CFB_OK) {
+        r = LoadDirectory(cfbPtr, dirStart);
+    }
+    if (r == CFB_OK) {
+        r = LoadChain(cfbPtr, cfbPtr->entries[0].start,
+            &cfbPtr->miniSects, &cfbPtr->miniSectCount);
+    }
+    if (r == CFB_OK && cfbPtr->cachePtr) {
+        CacheHotSectors(cfbPtr);
+    }
+    return r;
+}
+
+static void
+FreeTables(Cfb *cfbPtr)
+{
+    if (cfbPtr->fatSects)
+        ckfree((char *)cfbPtr->fatSects);
+    if (cfbPtr->difatSects)
+        ckfree((char *)cfbPtr->difatSects);
+    if (cfbPtr->miniFatSects)
+        ckfree((char *)cfbPtr->miniFatSects);
+    if (cfbPtr->miniSects)
+        ckfree((char *)cfbPtr->miniSects);
+    if (cfbPtr->dirSects)
+        ckfree((char *)cfbPtr->dirSects);
+    if (cfbPtr->chains) {
+        CfbSect n;
+        for (n = 0; n < cfbPtr->entryCount; n++) {
+            if (cfbPtr->chains[n])
+                FreeChain(cfbPtr->chains[n]);
+        }
+        ckfree((char *)cfbPtr->chains);
+    }
+    if (cfbPtr->entries)
+        ckfree((char *)cfbPtr->entries);
+    cfbPtr->fatSects = cfbPtr->difatSects = NULL;
+    cfbPtr->miniFatSects = cfbPtr->miniSects = cfbPtr->dirSects = NULL;
+    cfbPtr->fatSectCount = cfbPtr->difatSectCount = 0;
+    cfbPtr->miniFatSectCount = cfbPtr->miniSectCount = 0;
+    cfbPtr->dirSectCount = 0;
+    cfbPtr->chains = NULL;
+    cfbPtr->entries = NULL;
+    cfbPtr->entryCount = 0;
+    cfbPtr->generation++;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbError --
+ *
+ *	Convert CFB status codes into Tcl string objects.
+ *
+ * Results:
+ *	A tcl string object
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+CfbError(const char *szPrefix, int code)
+{
+    Tcl_Obj *msgObj = Tcl_NewStringObj(szPrefix, -1);
+    const char *msg = NULL;
+
+    switch (code) {
+        case CFB_ENOENT:  msg = "file not found"; break;
+        case CFB_EACCES:  msg = "permission denied"; break;
+        case CFB_EFORMAT: msg = "not a valid compound file"; break;
+        case CFB_ENOTSUP: msg = "operation not supported"; break;
+        case CFB_EINVAL:  msg = "invalid name"; break;
+        case CFB_EEXIST:  msg = "file already exists"; break;
+        case CFB_EBUSY:   msg = "another stream is open for writing"; break;
+        case CFB_ENOSPC:  msg = "no space left on device"; break;
+        case CFB_EINUSE:  msg = "storage is in use"; break;
+        case CFB_EIO:     msg = Tcl_ErrnoMsg(Tcl_GetErrno()); break;
+        default:          msg = "unknown error"; break;
+    }
+    Tcl_AppendStringsToObj(msgObj, ": ", msg, (char *)NULL);
+    return msgObj;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbFileTimeNow --
+ *
+ *	Get the current time as a FILETIME value for directory entries.
+ *
+ * Results:
+ *	100ns intervals since 1 January 1601.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_WideUInt
+CfbFileTimeNow(void)
+{
+    Tcl_Time now;
+
+    Tcl_GetTime(&now);
+    return ((Tcl_WideUInt)now.sec + 11644473600ULL) * 10000000ULL
+        + (Tcl_WideUInt)now.usec * 10;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * MapFile, RemapFile, UnmapFile, WriteFileAt, ReadFileAt, SyncFile,
+ * AdviseFile --
+ *
+ *	Map the whole file read-only into our address space. The file
+ *	itself is opened for writing when the compound file is writable.
+ *	Changes are written with WriteFileAt and SyncFile waits for them
+ *	to reach the disk. RemapFile replaces the mapping afterwards.
+ *	AdviseFile asks the system to start reading part of the file that
+ *	will soon be needed. A file given a cache size, or too large for
+ *	the address space, is not mapped and is read with ReadFileAt
+ *	through the sector cache.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The file remains open until UnmapFile is called. RemapFile sets
+ *	the file length and this may truncate the file.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+#ifdef _WIN32
+
+static int
+MapFile(Tcl_Obj *pathObj, Cfb *cfbPtr)
+{
+    const WCHAR *nativePath = Tcl_FSGetNativePath(pathObj);
+    LARGE_INTEGER size;
+
+    if (nativePath == NULL) {
+        return CFB_ENOENT;
+    }
+    cfbPtr->hFile = CreateFileW(nativePath, cfbPtr->writable
+        ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+        cfbPtr->writable ? 0 : FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (cfbPtr->hFile == INVALID_HANDLE_VALUE) {
+        switch (GetLastError()) {
+            case ERROR_FILE_NOT_FOUND:
+            case ERROR_PATH_NOT_FOUND:
+                return CFB_ENOENT;
+            case ERROR_ACCESS_DENIED:
+            case ERROR_SHARING_VIOLATION:
+                return CFB_EACCES;
+        }
+        Tcl_SetErrno(EIO);
+        return CFB_EIO;
+    }
+    if (!GetFileSizeEx(cfbPtr->hFile, &size) || size.QuadPart == 0) {
+        return CFB_EFORMAT;
+    }
+    if (cfbPtr->cacheSize > 0) {
+        return OpenCache(cfbPtr, (Tcl_WideUInt)size.QuadPart);
+    }
+    return MapView(cfbPtr, (Tcl_WideUInt)size.QuadPart);
+}
+
+static int
+MapView(Cfb *cfbPtr, Tcl_WideUInt length)
+{
+    cfbPtr->hMapping = CreateFileMappingW(cfbPtr->hFile, NULL,
+        PAGE_READONLY, 0, 0, NULL);
+    if (cfbPtr->hMapping != NULL) {
+        cfbPtr->base = MapViewOfFile(cfbPtr->hMapping, FILE_MAP_READ,
+            0, 0, 0);
+    }
+    if (cfbPtr->base == NULL) {
+        /* no room in the address space: read through a cache */
+        if (cfbPtr->hMapping != NULL) {
+            CloseHandle(cfbPtr->hMapping);
+            cfbPtr->hMapping = NULL;
+        }
+        return OpenCache(cfbPtr, length);
+    }
+    cfbPtr->length = length;
+    return CFB_OK;
+}
+
+static int
+RemapFile(Cfb *cfbPtr, Tcl_WideUInt length)
+{
+    LARGE_INTEGER size;
+
+    if (cfbPtr->base)
+        UnmapViewOfFile(cfbPtr->base);
+    if (cfbPtr->hMapping)
+        CloseHandle(cfbPtr->hMapping);
+    cfbPtr->base = NULL;
+    cfbPtr->hMapping = NULL;
+    size.QuadPart = (LONGLONG)length;
+    if (!SetFilePointerEx(cfbPtr->hFile, size, NULL, FILE_BEGIN)
+        || !SetEndOfFile(cfbPtr->hFile)) {
+        Tcl_SetErrno(EIO);
+        return CFB_EIO;
+    }
+    if (cfbPtr->cachePtr) {
+        CacheDiscard(cfbPtr, length < cfbPtr->length ? length
+            : cfbPtr->length);
+        cfbPtr->length = length;
+        return CFB_OK;
+    }
+    return MapView(cfbPtr, length);
+}
+
+static void
+UnmapFile(Cfb *cfbPtr)
+{
+    FreeCache(cfbPtr);
+    if (cfbPtr->base)
+        UnmapViewOfFile(cfbPtr->base);
+    if (cfbPtr->hMapping)
+        CloseHandle(cfbPtr->hMapping);
+    if (cfbPtr->hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(cfbPtr->hFile);
+    cfbPtr->base = NULL;
+    cfbPtr->hMapping = NULL;
+    cfbPtr->hFile = INVALID_HANDLE_VALUE;
+}
+
+static int
+WriteFileAt(Cfb *cfbPtr, Tcl_WideUInt offset, const unsigned char *data,
+    unsigned long len)
+{
+    OVERLAPPED ov;
+    DWORD cb;
+
+    while (len > 0) {
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile(cfbPtr->hFile, data, len, &cb, &ov) || cb == 0) {
+            Tcl_SetErrno(EIO);
+            return CFB_EIO;
+        }
+        data += cb;
+        offset += cb;
+        len -= cb;
+    }
+    return CFB_OK;
+}
+
+static int
+ReadFileAt(Cfb *cfbPtr, Tcl_WideUInt offset, unsigned char *buffer,
+    unsigned long len)
+{
+    OVERLAPPED ov;
+    DWORD cb;
+
+    while (len > 0) {
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!ReadFile(cfbPtr->hFile, buffer, len, &cb, &ov) || cb == 0) {
+            Tcl_SetErrno(EIO);
+            return CFB_EIO;
+        }
+        buffer += cb;
+        offset += cb;
+        len -= cb;
+    }
+    return CFB_OK;
+}
+
+static int
+SyncFile(Cfb *cfbPtr)
+{
+    if (!FlushFileBuffers(cfbPtr->hFile)) {
+        Tcl_SetErrno(EIO);
+        return CFB_EIO;
+    }
+    return CFB_OK;
+}
+
+static void
+AdviseFile(Cfb *cfbPtr, Tcl_WideUInt offset, Tcl_WideUInt len)
+{
+    /* the system reads ahead on mapped views by itself */
+}
+
+#else /* !_WIN32 */
+
+static int
+MapFile(Tcl_Obj *pathObj, Cfb *cfbPtr)
+{
+    const char *nativePath = Tcl_FSGetNativePath(pathObj);
+    struct stat st;
+    void *base;
+
+    if (nativePath == NULL) {
+        return CFB_ENOENT;
+    }
+    cfbPtr->fd = open(nativePath, cfbPtr->writable ? O_RDWR : O_RDONLY);
+    if (cfbPtr->fd < 0 || fstat(cfbPtr->fd, &st) != 0) {
+        switch (errno) {
+            case ENOENT:
+            case ENOTDIR:
+                return CFB_ENOENT;
+            case EACCES:
+            case EPERM:
+                return CFB_EACCES;
+        }
+        Tcl_SetErrno(errno);
+        return CFB_EIO;
+    }
+    if (st.st_size == 0) {
+        return CFB_EFORMAT;
+    }
+    if (cfbPtr->cacheSize > 0
+        || (Tcl_WideUInt)(size_t)st.st_size != (Tcl_WideUInt)st.st_size) {
+        return OpenCache(cfbPtr, (Tcl_WideUInt)st.st_size);
+    }
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+        cfbPtr->fd, 0);
+    if (base == MAP_FAILED) {
+        if (errno == ENOMEM) {
+            /* no room in the address space: read through a cache */
+            return OpenCache(cfbPtr, (Tcl_WideUInt)st.st_size);
+        }
+        Tcl_SetErrno(errno);
+        return CFB_EIO;
+    }
+    cfbPtr->base = (unsigned char *)base;
+    cfbPtr->length = (Tcl_WideUInt)st.st_size;
+    return CFB_OK;
+}
+
+static int
+RemapFile(Cfb *cfbPtr, Tcl_WideUInt length)
+{
+    void *base;
+
+    if (cfbPtr->base)
+        munmap(cfbPtr->base, (size_t)cfbPtr->length);
+    cfbPtr->base = NULL;
+    if (ftruncate(cfbPtr->fd, (off_t)length) != 0) {
+        Tcl_SetErrno(errno);
+        return CFB_EIO;
+    }
+    if (cfbPtr->cachePtr) {
+        CacheDiscard(cfbPtr, length < cfbPtr->length ? length
+            : cfbPtr->length);
+        cfbPtr->length = length;
+        return CFB_OK;
+    }
+    base = mmap(NULL, (size_t)length, PROT_READ, MAP_SHARED, cfbPtr->fd, 0);
+    if (base == MAP_FAILED) {
+        if (errno == ENOMEM) {
+            return OpenCache(cfbPtr, length);
+        }
+        Tcl_SetErrno(errno);
+        return CFB_EIO;
+    }
+    cfbPtr->base = (unsigned char *)base;
+    cfbPtr->length = length;
+    return CFB_OK;
+}
+
+static void
+UnmapFile(Cfb *cfbPtr)
+{
+    FreeCache(cfbPtr);
+    if (cfbPtr->base)
+        munmap(cfbPtr->base, (size_t)cfbPtr->length);
+    if (cfbPtr->fd >= 0)
+        close(cfbPtr->fd);
+    cfbPtr->base = NULL;
+    cfbPtr->fd = -1;
+}
+
+static int
+WriteFileAt(Cfb *cfbPtr, Tcl_WideUInt offset, const unsigned char *data,
+    unsigned long len)
+{
+    while (len > 0) {
+        ssize_t cb = pwrite(cfbPtr->fd, data, len, (off_t)offset);
+        if (cb < 0 && errno == EINTR) {
+            continue;
+        }
+        if (cb <= 0) {
+            Tcl_SetErrno(cb < 0 ? errno : EIO);
+            return CFB_EIO;
+        }
+        data += cb;
+        offset += (Tcl_WideUInt)cb;
+        len -= (unsigned long)cb;
+    }
+    return CFB_OK;
+}
+
+static int
+ReadFileAt(Cfb *cfbPtr, Tcl_WideUInt offset, unsigned char *buffer,
+    unsigned long len)
+{
+    while (len > 0) {
+        ssize_t cb = pread(cfbPtr->fd, buffer, len, (off_t)offset);
+        if (cb < 0 && errno == EINTR) {
+            continue;
+        }
+        if (cb <= 0) {
+            Tcl_SetErrno(cb < 0 ? errno : EIO);
+            return CFB_EIO;
+        }
+        buffer += cb;
+        offset += (Tcl_WideUInt)cb;
+        len -= (unsigned long)cb;
+    }
+    return CFB_OK;
+}
+
+static int
+SyncFile(Cfb *cfbPtr)
+{
+    if (fsync(cfbPtr->fd) != 0) {
+        Tcl_SetErrno(errno);
+        return CFB_EIO;
+    }
+    return CFB_OK;
+}
+
+static void
+AdviseFile(Cfb *cfbPtr, Tcl_WideUInt offset, Tcl_WideUInt len)
+{
+#ifdef MADV_WILLNEED
+    if (cfbPtr->base) {
+        size_t skip = (size_t)(offset
+            % (Tcl_WideUInt)sysconf(_SC_PAGESIZE));
+
+        madvise(cfbPtr->base + offset - skip, (size_t)len + skip,
+            MADV_WILLNEED);
+        return;
+    }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(cfbPtr->fd, (off_t)offset, (off_t)len,
+        POSIX_FADV_WILLNEED);
+#endif
+}
+
+#endif /* !_WIN32 */
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * OpenCache, FreeCache, CacheHotSectors --
+ *
+ *	Create or release the sector cache of a file that is not mapped.
+ *	The header is read when the cache is created. The frames are
+ *	allocated once the sector size is known. CacheHotSectors is
+ *	called whenever the tables are loaded to empty the cache and
+ *	record the sectors to be pinned.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	Memory is allocated or free'd.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+OpenCache(Cfb *cfbPtr, Tcl_WideUInt length)
+{
+    CfbCache *cachePtr = (CfbCache *)ckalloc(sizeof(CfbCache));
+
+    memset(cachePtr, 0, sizeof(CfbCache));
+    Tcl_InitHashTable(&cachePtr->frames, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&cachePtr->hot, TCL_ONE_WORD_KEYS);
+    cfbPtr->cachePtr = cachePtr;
+    cfbPtr->length = length;
+    if (cfbPtr->cacheSize == 0) {
+        cfbPtr->cacheSize = CFB_CACHE_DEFAULT;
+    }
+    return ReadFileAt(cfbPtr, 0, cachePtr->header,
+        length < CFB_HEADER_SIZE ? (unsigned long)length : CFB_HEADER_SIZE);
+}
+
+static void
+FreeCache(Cfb *cfbPtr)
+{
+    CfbCache *cachePtr = cfbPtr->cachePtr;
+    CfbSect n;
+
+    if (cachePtr == NULL) {
+        return;
+    }
+    CacheDiscard(cfbPtr, 0);
+    for (n = 0; n < cachePtr->ringSize; n++) {
+        if (cachePtr->ring[n].data)
+            ckfree((char *)cachePtr->ring[n].data);
+    }
+    if (cachePtr->ring)
+        ckfree((char *)cachePtr->ring);
+    Tcl_DeleteHashTable(&cachePtr->frames);
+    Tcl_DeleteHashTable(&cachePtr->hot);
+    ckfree((char *)cachePtr);
+    cfbPtr->cachePtr = NULL;
+}
+
+static void
+CacheHotSectors(Cfb *cfbPtr)
+{
+    CfbCache *cachePtr = cfbPtr->cachePtr;
+    CfbSect *tables[3], counts[3], n;
+    int i, isNew;
+
+    tables[0] = cfbPtr->fatSects;
+    counts[0] = cfbPtr->fatSectCount;
+    tables[1] = cfbPtr->miniFatSects;
+    counts[1] = cfbPtr->miniFatSectCount;
+    tables[2] = cfbPtr->miniSects;
+    counts[2] = cfbPtr->miniSectCount;
+
+    CacheDiscard(cfbPtr, 0);
+    Tcl_DeleteHashTable(&cachePtr->hot);
+    Tcl_InitHashTable(&cachePtr->hot, TCL_ONE_WORD_KEYS);
+    for (i = 0; i < 3; i++) {
+        for (n = 0; n < counts[i]; n++) {
+            Tcl_CreateHashEntry(&cachePtr->hot,
+                (char *)(size_t)tables[i][n], &isNew);
+        }
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CacheSector --
+ *
+ *	Find a sector in the cache, reading it from the file if it is not
+ *	there. A sector that is not pinned replaces the first frame found
+ *	by the CLOCK hand that has not been used since the hand last
+ *	passed it. Any part of the sector beyond the end of the file reads
+ *	as zeros.
+ *
+ * Results:
+ *	A pointer to the sector data or NULL if it could not be read. The
+ *	pointer remains valid until the next sector is read.
+ *
+ * Side effects:
+ *	Another sector may be evicted from the cache.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static const unsigned char *
+CacheSector(Cfb *cfbPtr, CfbSect sect)
+{
+    CfbCache *cachePtr = cfbPtr->cachePtr;
+    Tcl_WideUInt offset = ((Tcl_WideUInt)sect + 1) << cfbPtr->sectorShift;
+    unsigned long len = cfbPtr->sectorSize;
+    CacheFrame *framePtr;
+    Tcl_HashEntry *hPtr;
+    CfbSect n;
+    int isNew;
+
+    hPtr = Tcl_FindHashEntry(&cachePtr->frames, (char *)(size_t)sect);
+    if (hPtr) {
+        framePtr = (CacheFrame *)Tcl_GetHashValue(hPtr);
+        framePtr->referenced = 1;
+        cachePtr->hits++;
+        return framePtr->data;
+    }
+    cachePtr->misses++;
+
+    if (Tcl_FindHashEntry(&cachePtr->hot, (char *)(size_t)sect)) {
+        framePtr = (CacheFrame *)ckalloc(sizeof(CacheFrame));
+        framePtr->data = (unsigned char *)ckalloc(cfbPtr->sectorSize);
+        framePtr->hot = 1;
+    } else {
+        if (cachePtr->ring == NULL) {
+            Tcl_WideUInt frames = cfbPtr->cacheSize >> cfbPtr->sectorShift;
+            cachePtr->ringSize = (frames < CFB_CACHE_MIN) ? CFB_CACHE_MIN
+                : (frames > CFB_MAXREGSECT) ? CFB_MAXREGSECT
+                : (CfbSect)frames;
+            cachePtr->ring = (CacheFrame *)ckalloc(sizeof(CacheFrame)
+                * cachePtr->ringSize);
+            memset(cachePtr->ring, 0, sizeof(CacheFrame)
+                * cachePtr->ringSize);
+            for (n = 0; n < cachePtr->ringSize; n++) {
+                cachePtr->ring[n].sect = CFB_FREESECT;
+            }
+        }
+        for (;;) {
+            framePtr = &cachePtr->ring[cachePtr->hand];
+            cachePtr->hand = (cachePtr->hand + 1) % cachePtr->ringSize;
+            if (framePtr->sect == CFB_FREESECT) {
+                break;
+            }
+            if (!framePtr->referenced) {
+                Tcl_DeleteHashEntry(Tcl_FindHashEntry(&cachePtr->frames,
+                    (char *)(size_t)framePtr->sect));
+                cachePtr->evictions++;
+                cachePtr->used--;
+                break;
+            }
+            framePtr->referenced = 0;
+        }
+        if (framePtr->data == NULL) {
+            framePtr->data = (unsigned char *)ckalloc(cfbPtr->sectorSize);
+        }
+    }
+
+    if (cfbPtr->length - offset < len) {
+        len = (unsigned long)(cfbPtr->length - offset);
+        memset(framePtr->data + len, 0, cfbPtr->sectorSize - len);
+    }
+    if (ReadFileAt(cfbPtr, offset, framePtr->data, len) != CFB_OK) {
+        if (framePtr->hot) {
+            ckfree((char *)framePtr->data);
+            ckfree((char *)framePtr);
+        } else {
+            framePtr->sect = CFB_FREESECT;
+        }
+        return NULL;
+    }
+
+    framePtr->sect = sect;
+    framePtr->referenced = 0;
+    if (framePtr->hot) {
+        cachePtr->pinned++;
+    } else {
+        cachePtr->used++;
+    }
+    hPtr = Tcl_CreateHashEntry(&cachePtr->frames, (char *)(size_t)sect,
+        &isNew);
+    Tcl_SetHashValue(hPtr, framePtr);
+    return framePtr->data;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CacheUpdate, CacheDiscard --
+ *
+ *	Keep the sector cache in step with the file. CacheUpdate copies
+ *	data written to the file into the header and any cached sectors it
+ *	covers. CacheDiscard drops every cached sector that extends past
+ *	the given length, so a length of 0 empties the cache.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The cache is changed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+CacheUpdate(Cfb *cfbPtr, Tcl_WideUInt offset, const unsigned char *data,
+    unsigned long len)
+{
+    CfbCache *cachePtr = cfbPtr->cachePtr;
+    Tcl_WideUInt end = offset + len, pos;
+
+    if (offset < CFB_HEADER_SIZE) {
+        memcpy(cachePtr->header + offset, data, (size_t)((end
+            < CFB_HEADER_SIZE ? end : CFB_HEADER_SIZE) - offset));
+    }
+    if (cachePtr->frames.numEntries == 0) {
+        return;
+    }
+    pos = (offset >> cfbPtr->sectorShift) << cfbPtr->sectorShift;
+    if (pos < cfbPtr->sectorSize) {
+        pos = cfbPtr->sectorSize;
+    }
+    for ( ; pos < end; pos += cfbPtr->sectorSize) {
+        CfbSect sect = (CfbSect)((pos >> cfbPtr->sectorShift) - 1);
+        Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&cachePtr->frames,
+            (char *)(size_t)sect);
+        if (hPtr) {
+            CacheFrame *framePtr = (CacheFrame *)Tcl_GetHashValue(hPtr);
+            Tcl_WideUInt from = (pos > offset) ? pos : offset;
+            Tcl_WideUInt to = pos + cfbPtr->sectorSize;
+            if (to > end) {
+                to = end;
+            }
+            memcpy(framePtr->data + (from - pos), data + (from - offset),
+                (size_t)(to - from));
+        }
+    }
+}
+
+static void
+CacheDiscard(Cfb *cfbPtr, Tcl_WideUInt length)
+{
+    CfbCache *cachePtr = cfbPtr->cachePtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    for (hPtr = Tcl_FirstHashEntry(&cachePtr->frames, &search); hPtr;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        CacheFrame *framePtr = (CacheFrame *)Tcl_GetHashValue(hPtr);
+        if ((((Tcl_WideUInt)framePtr->sect + 2) << cfbPtr->sectorShift)
+            <= length) {
+            continue;
+        }
+        if (framePtr->hot) {
+            ckfree((char *)framePtr->data);
+            ckfree((char *)framePtr);
+            cachePtr->pinned--;
+        } else {
+            framePtr->sect = CFB_FREESECT;
+            cachePtr->used--;
+        }
+        Tcl_DeleteHashEntry(hPtr);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbGetCacheInfo --
+ *
+ *	Report the size and use of the sector cache of a compound file.
+ *	All values are zero for a file that is mapped or held in memory.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+void
+CfbGetCacheInfo(Cfb *cfbPtr, CfbCacheInfo *infoPtr)
+{
+    CfbCache *cachePtr = cfbPtr->cachePtr;
+
+    memset(infoPtr, 0, sizeof(CfbCacheInfo));
+    if (cachePtr) {
+        infoPtr->size = cfbPtr->cacheSize;
+        infoPtr->frames = cachePtr->ringSize;
+        infoPtr->used = cachePtr->used;
+        infoPtr->pinned = cachePtr->pinned;
+        infoPtr->hits = cachePtr->hits;
+        infoPtr->misses = cachePtr->misses;
+        infoPtr->evictions = cachePtr->evictions;
+    }
+}
+
+/*
+ * The header of the image, which is held by the cache when the file is
+ * not mapped.
+ */
+
+static const unsigned char *
+HeaderData(Cfb *cfbPtr)
+{
+    return cfbPtr->cachePtr ? cfbPtr->cachePtr->header : cfbPtr->base;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * WriteImage, ResizeImage, SyncImage, ReleaseImage --
+ *
+ *	Update the image of a compound file. A file held in memory keeps
+ *	its image in an arena that doubles in size when it is full. The
+ *	arena beyond the image is kept zeroed so that sectors written past
+ *	the end read back correctly once the image is extended. Other
+ *	files use the file functions above and keep any sector cache up
+ *	to date.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The arena may be moved which changes the base of the image.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+GrowArena(Cfb *cfbPtr, Tcl_WideUInt need)
+{
+    Tcl_WideUInt space = cfbPtr->arenaSpace ? cfbPtr->arenaSpace : 4096;
+    unsigned char *base;
+
+    if (need <= cfbPtr->arenaSpace) {
+        return CFB_OK;
+    }
+    while (space < need) {
+        space *= 2;
+    }
+    if (space > (unsigned int)-1) {
+        return CFB_ENOSPC;
+    }
+    base = (unsigned char *)attemptckrealloc((char *)cfbPtr->base,
+        (unsigned int)space);
+    if (base == NULL) {
+        return CFB_ENOSPC;
+    }
+    memset(base + cfbPtr->arenaSpace, 0,
+        (size_t)(space - cfbPtr->arenaSpace));
+    cfbPtr->base = base;
+    cfbPtr->arenaSpace = space;
+    return CFB_OK;
+}
+
+static int
+WriteImage(Cfb *cfbPtr, Tcl_WideUInt offset, const unsigned char *data,
+    unsigned long len)
+{
+    int r;
+
+    if (!cfbPtr->inMemory) {
+        r = WriteFileAt(cfbPtr, offset, data, len);
+        if (r == CFB_OK && cfbPtr->cachePtr) {
+            CacheUpdate(cfbPtr, offset, data, len);
+        }
+        return r;
+    }
+    r = GrowArena(cfbPtr, offset + len);
+    if (r == CFB_OK) {
+        memcpy(cfbPtr->base + offset, data, len);
+    }
+    return r;
+}
+
+static int
+ResizeImage(Cfb *cfbPtr, Tcl_WideUInt length)
+{
+    int r;
+
+    if (!cfbPtr->inMemory) {
+        return RemapFile(cfbPtr, length);
+    }
+    r = GrowArena(cfbPtr, length);
+    if (r == CFB_OK && length < cfbPtr->arenaSpace) {
+        memset(cfbPtr->base + length, 0,
+            (size_t)(cfbPtr->arenaSpace - length));
+    }
+    if (r == CFB_OK) {
+        cfbPtr->length = length;
+    }
+    return r;
+}
+
+static int
+SyncImage(Cfb *cfbPtr)
+{
+    return cfbPtr->inMemory ? CFB_OK : SyncFile(cfbPtr);
+}
+
+static void
+ReleaseImage(Cfb *cfbPtr)
+{
+    if (!cfbPtr->inMemory) {
+        UnmapFile(cfbPtr);
+    } else if (cfbPtr->base) {
+        ckfree((char *)cfbPtr->base);
+    }
+}
+
+/*
+ * Build the image of a compound file with an empty root storage. This
+ * holds one directory sector and one FAT sector.
+ */
+
+static int
+EmptyImage(Cfb *cfbPtr)
+{
+    CfbHeader hdr;
+    CfbEntry root;
+    CfbSect n;
+    static const char *rootName = "Root Entry";
+    unsigned char *p;
+    int r;
+
+    r = ResizeImage(cfbPtr, 3 * CFB_HEADER_SIZE);
+    if (r != CFB_OK) {
+        return r;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = 3;
+    hdr.dirStart = 0;
+    hdr.fatCount = 1;
+    hdr.miniFatStart = CFB_ENDOFCHAIN;
+    hdr.difatStart = CFB_ENDOFCHAIN;
+    for (n = 0; n < CFB_HEADER_DIFAT; n++) {
+        hdr.difat[n] = CFB_FREESECT;
+    }
+    hdr.difat[0] = 1;
+    CfbPutHeader(cfbPtr->base, &hdr);
+
+    memset(&root, 0, sizeof(root));
+    for (n = 0; rootName[n]; n++) {
+        root.name[n] = (unsigned short)rootName[n];
+    }
+    root.nameLen = (int)n;
+    root.type = CFB_TYPE_ROOT;
+    root.color = CFB_BLACK;
+    root.left = root.right = root.child = CFB_NOSTREAM;
+    root.mtime = CfbFileTimeNow();
+    root.start = CFB_ENDOFCHAIN;
+    p = cfbPtr->base + CFB_HEADER_SIZE;
+    CfbPutEntry(p, &root);
+    root.type = CFB_TYPE_EMPTY;
+    for (n = 1; n < CFB_HEADER_SIZE / CFB_DIRENT_SIZE; n++) {
+        CfbPutEntry(p + n * CFB_DIRENT_SIZE, &root);
+    }
+
+    p = cfbPtr->base + 2 * CFB_HEADER_SIZE;
+    for (n = 0; n < CFB_HEADER_SIZE / 4; n++) {
+        PUT32(p + 4 * n, CFB_FREESECT);
+    }
+    PUT32(p, CFB_ENDOFCHAIN);
+    PUT32(p + 4, CFB_FATSECT);
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbSerialize --
+ *
+ *	Obtain the image of a compound file as a byte array. A file that
+ *	is not transacted is committed first. Uncommitted changes of a
+ *	transacted file are not included.
+ *
+ * Results:
+ *	A CFB status code. A new byte array object is stored in objPtrPtr.
+ *
+ * Side effects:
+ *	The file may be committed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbSerialize(Cfb *cfbPtr, Tcl_Obj **objPtrPtr)
+{
+    int r = CFB_OK;
+
+    if (!(cfbPtr->mode & STGM_TRANSACTED)) {
+        r = CfbCommit(cfbPtr);
+    }
+    if (r == CFB_OK && cfbPtr->length > (Tcl_WideUInt)INT_MAX) {
+        r = CFB_ENOSPC;
+    }
+    if (r == CFB_OK && cfbPtr->cachePtr) {
+        Tcl_Obj *objPtr = Tcl_NewByteArrayObj(NULL, 0);
+        unsigned char *buffer = Tcl_SetByteArrayLength(objPtr,
+            (int)cfbPtr->length);
+        r = ReadFileAt(cfbPtr, 0, buffer, (unsigned long)cfbPtr->length);
+        if (r == CFB_OK) {
+            *objPtrPtr = objPtr;
+        } else {
+            Tcl_DecrRefCount(objPtr);
+        }
+    } else if (r == CFB_OK) {
+        *objPtrPtr = Tcl_NewByteArrayObj(cfbPtr->base, (int)cfbPtr->length);
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ParseHeader --
+ *
+ *	Validate the compound file header and build the table of FAT
+ *	sector locations from the DIFAT.
+ *
+ * Results:
+ *	A CFB status code. The first directory and MiniFAT sectors are
+ *	returned for use in loading the rest of the file.
+ *
+ * Side effects:
+ *	The sector geometry, fatSects and difatSects fields of cfbPtr are
+ *	filled in.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+ParseHeader(Cfb *cfbPtr, CfbSect *dirStartPtr, CfbSect *miniFatStartPtr)
+{
+    const unsigned char *h = HeaderData(cfbPtr);
+    CfbSect fatCount, difatSect, difatCount, n, i;
+    unsigned long perDifat;
+
+    if (cfbPtr->length < CFB_HEADER_SIZE
+        || memcmp(h, cfbSignature, sizeof(cfbSignature)) != 0
+        || GET16(h + 0x1C) != 0xFFFE) {
+        return CFB_EFORMAT;
+    }
+
+    cfbPtr->version = (int)GET16(h + 0x1A);
+    cfbPtr->sectorShift = (int)GET16(h + 0x1E);
+    cfbPtr->miniSectorShift = (int)GET16(h + 0x20);
+    if (!((cfbPtr->version == 3 && cfbPtr->sectorShift == 9)
+          || (cfbPtr->version == 4 && cfbPtr->sectorShift == 12))
+        || cfbPtr->miniSectorShift != 6) {
+        return CFB_EFORMAT;
+    }
+    cfbPtr->sectorSize = 1UL << cfbPtr->sectorShift;
+    cfbPtr->miniSectorSize = 1UL << cfbPtr->miniSectorShift;
+    cfbPtr->miniCutoff = GET32(h + 0x38);
+    if (cfbPtr->length < cfbPtr->sectorSize) {
+        return CFB_EFORMAT;
+    }
+
+    /* The last sector may be short if the file was not padded. */
+    cfbPtr->sectorCount = (CfbSect)((cfbPtr->length - 1)
+        >> cfbPtr->sectorShift);
+
+    fatCount = GET32(h + 0x2C);
+    *dirStartPtr = GET32(h + 0x30);
+    *miniFatStartPtr = GET32(h + 0x3C);
+    difatSect = GET32(h + 0x44);
+    difatCount = GET32(h + 0x48);
+    if (fatCount > cfbPtr->sectorCount || difatCount > cfbPtr->sectorCount) {
+        return CFB_EFORMAT;
+    }
+
+    /*
+     * The first 109 FAT sector locations are held in the header. Any
+     * more are held in a chain of DIFAT sectors, each of which ends with
+     * the location of the next DIFAT sector.
+     */
+
+    cfbPtr->fatSects = (CfbSect *)ckalloc(sizeof(CfbSect) * (fatCount + 1));
+    cfbPtr->fatSectCount = fatCount;
+    for (i = 0; i < fatCount && i < 109; i++) {
+        cfbPtr->fatSects[i] = GET32(h + 0x4C + 4 * i);
+    }
+    perDifat = (cfbPtr->sectorSize >> 2) - 1;
+    cfbPtr->difatSects = (CfbSect *)ckalloc(sizeof(CfbSect)
+        * (difatCount + 1));
+    for (n = 0; i < fatCount; n++) {
+        unsigned long avail, j;
+        const unsigned char *p = SectorData(cfbPtr, difatSect, &avail);
+        if (p == NULL || avail < cfbPtr->sectorSize || n >= difatCount) {
+            return CFB_EFORMAT;
+        }
+        cfbPtr->difatSects[cfbPtr->difatSectCount++] = difatSect;
+        for (j = 0; j < perDifat && i < fatCount; j++) {
+            cfbPtr->fatSects[i++] = GET32(p + 4 * j);
+        }
+        difatSect = GET32(p + 4 * perDifat);
+    }
+    for (i = 0; i < fatCount; i++) {
+        if (cfbPtr->fatSects[i] >= cfbPtr->sectorCount) {
+            return CFB_EFORMAT;
+        }
+    }
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * LoadChain --
+ *
+ *	Follow a FAT chain from the given start sector and return an
+ *	array of the sectors that make up the chain.
+ *
+ * Results:
+ *	A CFB status code. The array (which may be NULL for an empty
+ *	chain) must be free'd by the caller using ckfree.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+LoadChain(Cfb *cfbPtr, CfbSect start, CfbSect **sectsPtrPtr,
+    CfbSect *countPtr)
+{
+    CfbSect *sects = NULL, count = 0, space = 0, sect = start;
+    int r = CFB_OK;
+
+    while (r == CFB_OK && sect != CFB_ENDOFCHAIN) {
+        /* a chain longer than the file must contain a loop */
+        if (sect >= SECTOR_LIMIT(cfbPtr) || count >= SECTOR_LIMIT(cfbPtr)) {
+            r = CFB_EFORMAT;
+            break;
+        }
+        if (count == space) {
+            space = space ? space * 2 : 16;
+            sects = (CfbSect *)ckrealloc((char *)sects,
+                sizeof(CfbSect) * space);
+        }
+        sects[count++] = sect;
+        r = NextSector(cfbPtr, sect, &sect);
+    }
+
+    if (r != CFB_OK) {
+        if (sects)
+            ckfree((char *)sects);
+        sects = NULL;
+        count = 0;
+    }
+    *sectsPtrPtr = sects;
+    *countPtr = count;
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * LoadDirectory --
+ *
+ *	Read all the directory entries into memory.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The entries and dirSects fields of cfbPtr are filled in.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+LoadDirectory(Cfb *cfbPtr, CfbSect start)
+{
+    CfbSect *sects = NULL, count = 0, n, id = 0;
+    unsigned long perSect = cfbPtr->sectorSize / CFB_DIRENT_SIZE, avail, i;
+    int r;
+
+    r = LoadChain(cfbPtr, start, &sects, &count);
+    if (r == CFB_OK && count == 0) {
+        r = CFB_EFORMAT;
+    }
+    if (r == CFB_OK) {
+        cfbPtr->entryCount = count * perSect;
+        cfbPtr->entries = (CfbEntry *)ckalloc(sizeof(CfbEntry)
+            * cfbPtr->entryCount);
+        for (n = 0; r == CFB_OK && n < count; n++) {
+            const unsigned char *p = SectorData(cfbPtr, sects[n], &avail);
+            if (p == NULL || avail < cfbPtr->sectorSize) {
+                r = CFB_EFORMAT;
+                break;
+            }
+            for (i = 0; i < perSect; i++, id++) {
+                ParseEntry(cfbPtr, p + i * CFB_DIRENT_SIZE,
+                    &cfbPtr->entries[id]);
+            }
+        }
+    }
+    if (r == CFB_OK && cfbPtr->entries[0].type != CFB_TYPE_ROOT) {
+        r = CFB_EFORMAT;
+    }
+    cfbPtr->dirSects = sects;
+    cfbPtr->dirSectCount = count;
+    return r;
+}
+
+static void
+ParseEntry(Cfb *cfbPtr, const unsigned char *p, CfbEntry *entryPtr)
+{
+    int n, cb = (int)GET16(p + 0x40);
+
+    entryPtr->nameLen = cb / 2 - 1;
+    if (entryPtr->nameLen < 0) {
+        entryPtr->nameLen = 0;
+    } else if (entryPtr->nameLen > CFB_NAME_MAX) {
+        entryPtr->nameLen = CFB_NAME_MAX;
+    }
+    for (n = 0; n < entryPtr->nameLen; n++) {
+        entryPtr->name[n] = (unsigned short)GET16(p + 2 * n);
+    }
+    entryPtr->name[n] = 0;
+
+    entryPtr->type = p[0x42];
+    if (entryPtr->type != CFB_TYPE_STORAGE
+        && entryPtr->type != CFB_TYPE_STREAM
+        && entryPtr->type != CFB_TYPE_ROOT) {
+        entryPtr->type = CFB_TYPE_EMPTY;
+    }
+    entryPtr->color = p[0x43];
+    entryPtr->left = GET32(p + 0x44);
+    entryPtr->right = GET32(p + 0x48);
+    entryPtr->child = GET32(p + 0x4C);
+    memcpy(entryPtr->clsid, p + 0x50, sizeof(entryPtr->clsid));
+    entryPtr->stateBits = GET32(p + 0x60);
+    entryPtr->ctime = GET64(p + 0x64);
+    entryPtr->mtime = GET64(p + 0x6C);
+    entryPtr->start = GET32(p + 0x74);
+    entryPtr->size = GET64(p + 0x78);
+    if (cfbPtr->version == 3) {
+        /* the high part may contain garbage in version 3 files */
+        entryPtr->size &= 0xFFFFFFFFUL;
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPutEntry, CfbPutHeader --
+ *
+ *	Encode a directory entry or the file header. These are the
+ *	inverse of ParseEntry and ParseHeader.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	CFB_DIRENT_SIZE or CFB_HEADER_SIZE bytes are written to p.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+void
+CfbPutEntry(unsigned char *p, const CfbEntry *entryPtr)
+{
+    int n;
+
+    memset(p, 0, CFB_DIRENT_SIZE);
+    if (entryPtr->type == CFB_TYPE_EMPTY) {
+        PUT32(p + 0x44, CFB_NOSTREAM);
+        PUT32(p + 0x48, CFB_NOSTREAM);
+        PUT32(p + 0x4C, CFB_NOSTREAM);
+        return;
+    }
+    for (n = 0; n < entryPtr->nameLen; n++) {
+        PUT16(p + 2 * n, entryPtr->name[n]);
+    }
+    PUT16(p + 0x40, (entryPtr->nameLen + 1) * 2);
+    p[0x42] = (unsigned char)entryPtr->type;
+    p[0x43] = (unsigned char)entryPtr->color;
+    PUT32(p + 0x44, entryPtr->left);
+    PUT32(p + 0x48, entryPtr->right);
+    PUT32(p + 0x4C, entryPtr->child);
+    memcpy(p + 0x50, entryPtr->clsid, sizeof(entryPtr->clsid));
+    PUT32(p + 0x60, entryPtr->stateBits);
+    PUT64(p + 0x64, entryPtr->ctime);
+    PUT64(p + 0x6C, entryPtr->mtime);
+    PUT32(p + 0x74, entryPtr->start);
+    PUT64(p + 0x78, entryPtr->size);
+}
+
+void
+CfbPutHeader(unsigned char *p, const CfbHeader *hdrPtr)
+{
+    int n, v4 = (hdrPtr->version == 4);
+
+    memset(p, 0, CFB_HEADER_SIZE);
+    memcpy(p, cfbSignature, sizeof(cfbSignature));
+    PUT16(p + 0x18, 0x003E);
+    PUT16(p + 0x1A, hdrPtr->version);
+    PUT16(p + 0x1C, 0xFFFE);
+    PUT16(p + 0x1E, v4 ? 12 : 9);
+    PUT16(p + 0x20, 6);
+    PUT32(p + 0x28, v4 ? hdrPtr->dirCount : 0);
+    PUT32(p + 0x2C, hdrPtr->fatCount);
+    PUT32(p + 0x30, hdrPtr->dirStart);
+    PUT32(p + 0x38, 4096);
+    PUT32(p + 0x3C, hdrPtr->miniFatStart);
+    PUT32(p + 0x40, hdrPtr->miniFatCount);
+    PUT32(p + 0x44, hdrPtr->difatStart);
+    PUT32(p + 0x48, hdrPtr->difatCount);
+    for (n = 0; n < CFB_HEADER_DIFAT; n++) {
+        PUT32(p + 0x4C + 4 * n, hdrPtr->difat[n]);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbFatLayout --
+ *
+ *	Calculate the number of FAT and DIFAT sectors required for a file
+ *	that uses the given number of other sectors. The FAT must also
+ *	describe its own sectors and those of the DIFAT.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The counts are stored in fatCountPtr and difatCountPtr.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+void
+CfbFatLayout(CfbSect used, int sectorShift, CfbSect *fatCountPtr,
+    CfbSect *difatCountPtr)
+{
+    CfbSect perSector = 1U << (sectorShift - 2);
+    CfbSect fatCount = 0, difatCount = 0, need;
+
+    for (;;) {
+        need = (used + fatCount + difatCount + perSector - 1) / perSector;
+        if (need <= fatCount) {
+            break;
+        }
+        fatCount = need;
+        difatCount = 0;
+        if (fatCount > CFB_HEADER_DIFAT) {
+            difatCount = (fatCount - CFB_HEADER_DIFAT + perSector - 2)
+                / (perSector - 1);
+        }
+    }
+    *fatCountPtr = fatCount;
+    *difatCountPtr = difatCount;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * SectorData, MiniSectorData --
+ *
+ *	Locate the data for a sector or mini sector within the image or
+ *	the modified copy of the sector if there is one.
+ *
+ * Results:
+ *	A pointer to the data or NULL if the sector lies outside the
+ *	file. The number of bytes available is stored in availPtr. This
+ *	can be less than a full sector for the last sector of an unpadded
+ *	file.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static const unsigned char *
+SectorData(Cfb *cfbPtr, CfbSect sect, unsigned long *availPtr)
+{
+    Tcl_WideUInt offset = ((Tcl_WideUInt)sect + 1) << cfbPtr->sectorShift;
+
+    if (cfbPtr->fat && cfbPtr->dirty.numEntries > 0) {
+        Tcl_HashEntry *hPtr = Tcl_FindHashEntry(&cfbPtr->dirty,
+            (char *)(size_t)sect);
+        if (hPtr) {
+            *availPtr = cfbPtr->sectorSize;
+            return (const unsigned char *)Tcl_GetHashValue(hPtr);
+        }
+    }
+    if (sect > CFB_MAXREGSECT || offset >= cfbPtr->length) {
+        return NULL;
+    }
+    *availPtr = cfbPtr->sectorSize;
+    if (cfbPtr->length - offset < cfbPtr->sectorSize) {
+        *availPtr = (unsigned long)(cfbPtr->length - offset);
+    }
+    if (cfbPtr->cachePtr) {
+        return CacheSector(cfbPtr, sect);
+    }
+    return cfbPtr->base + offset;
+}
+
+static const unsigned char *
+MiniSectorData(Cfb *cfbPtr, CfbSect sect, unsigned long *availPtr)
+{
+    Tcl_WideUInt offset = (Tcl_WideUInt)sect << cfbPtr->miniSectorShift;
+    Tcl_WideUInt index = offset >> cfbPtr->sectorShift;
+    unsigned long skip = (unsigned long)offset & (cfbPtr->sectorSize - 1);
+    unsigned long avail;
+    const unsigned char *p;
+
+    if (sect > CFB_MAXREGSECT || index >= cfbPtr->miniSectCount) {
+        return NULL;
+    }
+    p = SectorData(cfbPtr, cfbPtr->miniSects[index], &avail);
+    if (p == NULL || avail <= skip) {
+        return NULL;
+    }
+    *availPtr = avail - skip;
+    if (*availPtr > cfbPtr->miniSectorSize) {
+        *availPtr = cfbPtr->miniSectorSize;
+    }
+    return p + skip;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * NextSector, NextMiniSector --
+ *
+ *	Look up the following sector in a FAT or MiniFAT chain. The
+ *	working tables are used once the file has been opened for writing.
+ *
+ * Results:
+ *	A CFB status code. The next sector is stored in nextPtr.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+NextSector(Cfb *cfbPtr, CfbSect sect, CfbSect *nextPtr)
+{
+    int shift = cfbPtr->sectorShift - 2;
+    CfbSect index = sect >> shift;
+    unsigned long avail;
+    const unsigned char *p;
+
+    if (cfbPtr->fat) {
+        if (sect >= cfbPtr->fatLen) {
+            return CFB_EFORMAT;
+        }
+        *nextPtr = cfbPtr->fat[sect];
+        return CFB_OK;
+    }
+    if (sect > CFB_MAXREGSECT || index >= cfbPtr->fatSectCount) {
+        return CFB_EFORMAT;
+    }
+    p = SectorData(cfbPtr, cfbPtr->fatSects[index], &avail);
+    if (p == NULL || avail < cfbPtr->sectorSize) {
+        return CFB_EFORMAT;
+    }
+    *nextPtr = GET32(p + 4 * (sect & ((1U << shift) - 1)));
+    return CFB_OK;
+}
+
+static int
+NextMiniSector(Cfb *cfbPtr, CfbSect sect, CfbSect *nextPtr)
+{
+    int shift = cfbPtr->sectorShift - 2;
+    CfbSect index = sect >> shift;
+    unsigned long avail;
+    const unsigned char *p;
+
+    if (cfbPtr->miniFat) {
+        if (sect >= cfbPtr->miniFatLen) {
+            return CFB_EFORMAT;
+        }
+        *nextPtr = cfbPtr->miniFat[sect];
+        return CFB_OK;
+    }
+    if (sect > CFB_MAXREGSECT || index >= cfbPtr->miniFatSectCount) {
+        return CFB_EFORMAT;
+    }
+    p = SectorData(cfbPtr, cfbPtr->miniFatSects[index], &avail);
+    if (p == NULL || avail < cfbPtr->sectorSize) {
+        return CFB_EFORMAT;
+    }
+    *nextPtr = GET32(p + 4 * (sect & ((1U << shift) - 1)));
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbListChildren --
+ *
+ *	Obtain the directory entry ids of all the items contained in a
+ *	storage. The children of a storage are held in a binary tree and
+ *	an in-order walk returns them sorted by the compound file name
+ *	ordering.
+ *
+ * Results:
+ *	A CFB status code. The array of ids must be free'd by the caller
+ *	using ckfree.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbListChildren(Cfb *cfbPtr, CfbSect parent, CfbSect **idsPtrPtr,
+    CfbSect *countPtr)
+{
+    CfbSect *ids, *stack, count = 0, depth = 0, id;
+    int r = CFB_OK;
+
+    if (parent >= cfbPtr->entryCount
+        || cfbPtr->entries[parent].type == CFB_TYPE_STREAM
+        || cfbPtr->entries[parent].type == CFB_TYPE_EMPTY) {
+        return CFB_ENOENT;
+    }
+
+    /*
+     * The tree cannot hold more nodes than the directory so anything
+     * that needs more space than that is a loop in a corrupt file.
+     */
+
+    ids = (CfbSect *)ckalloc(sizeof(CfbSect) * cfbPtr->entryCount);
+    stack = (CfbSect *)ckalloc(sizeof(CfbSect) * cfbPtr->entryCount);
+    id = cfbPtr->entries[parent].child;
+    while (r == CFB_OK && (id != CFB_NOSTREAM || depth > 0)) {
+        while (id != CFB_NOSTREAM) {
+            if (id >= cfbPtr->entryCount || depth >= cfbPtr->entryCount
+                || cfbPtr->entries[id].type == CFB_TYPE_EMPTY
+                || cfbPtr->entries[id].type == CFB_TYPE_ROOT) {
+                r = CFB_EFORMAT;
+                break;
+            }
+            stack[depth++] = id;
+            id = cfbPtr->entries[id].left;
+        }
+        if (r == CFB_OK) {
+            if (count >= cfbPtr->entryCount) {
+                r = CFB_EFORMAT;
+                break;
+            }
+            id = stack[--depth];
+            ids[count++] = id;
+            id = cfbPtr->entries[id].right;
+        }
+    }
+    ckfree((char *)stack);
+
+    if (r != CFB_OK) {
+        ckfree((char *)ids);
+    } else {
+        *idsPtrPtr = ids;
+        *countPtr = count;
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbFindChild --
+ *
+ *	Look for an item by name within a storage. The children of a
+ *	storage form a binary search tree using the compound file name
+ *	ordering so we descend the tree rather than examine every child.
+ *
+ * Results:
+ *	A CFB status code. The directory entry id of the item is stored
+ *	in idPtr.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbFindChild(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *nameObj, CfbSect *idPtr)
+{
+    unsigned short name[CFB_NAME_MAX + 1];
+    CfbSect id, steps = 0;
+    int len;
+
+    if (parent >= cfbPtr->entryCount
+        || cfbPtr->entries[parent].type == CFB_TYPE_STREAM
+        || cfbPtr->entries[parent].type == CFB_TYPE_EMPTY
+        || !CfbNameFromObj(nameObj, name, &len)) {
+        return CFB_ENOENT;
+    }
+
+    id = cfbPtr->entries[parent].child;
+    while (id != CFB_NOSTREAM) {
+        CfbEntry *entryPtr;
+        int cmp;
+
+        /* a valid tree cannot be deeper than the directory is long */
+        if (id >= cfbPtr->entryCount || steps++ >= cfbPtr->entryCount) {
+            return CFB_EFORMAT;
+        }
+        entryPtr = &cfbPtr->entries[id];
+        if (entryPtr->type == CFB_TYPE_EMPTY
+            || entryPtr->type == CFB_TYPE_ROOT) {
+            return CFB_EFORMAT;
+        }
+        cmp = CfbCompareNames(name, len, entryPtr->name, entryPtr->nameLen);
+        if (cmp == 0) {
+            *idPtr = id;
+            return CFB_OK;
+        }
+        id = (cmp < 0) ? entryPtr->left : entryPtr->right;
+    }
+    return CFB_ENOENT;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbCompareNames --
+ *
+ *	Compare two item names using the compound file ordering. Shorter
+ *	names sort first and names of equal length are compared one
+ *	UTF-16 unit at a time after conversion to upper case. This is the
+ *	ordering of the directory tree and it makes names that differ
+ *	only by case equal.
+ *
+ * Results:
+ *	Negative, zero or positive as the first name sorts before, the
+ *	same as or after the second.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbCompareNames(const unsigned short *name1, int len1,
+    const unsigned short *name2, int len2)
+{
+    int n;
+
+    if (len1 != len2) {
+        return len1 - len2;
+    }
+    for (n = 0; n < len1; n++) {
+        int ch1 = Tcl_UniCharToUpper(name1[n]);
+        int ch2 = Tcl_UniCharToUpper(name2[n]);
+        if (ch1 != ch2) {
+            return ch1 - ch2;
+        }
+    }
+    return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbLinkChildren --
+ *
+ *	Arrange the given directory entries into the tree used to hold
+ *	the contents of a storage. The entries are sorted by name and
+ *	linked into a balanced binary tree. Every node is black except
+ *	those on the deepest level of an incomplete tree which are red.
+ *	This satisfies the red-black rules as every path holds the same
+ *	number of black nodes.
+ *
+ * Results:
+ *	The id of the root of the tree or CFB_NOSTREAM if there are no
+ *	entries. The ids array is left sorted.
+ *
+ * Side effects:
+ *	The left, right and color fields of the entries are changed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+SortIds(CfbEntry *entries, CfbSect *ids, CfbSect *tmp, CfbSect count)
+{
+    CfbSect half = count / 2, i = 0, j = half, k = 0;
+
+    if (count < 2) {
+        return;
+    }
+    SortIds(entries, ids, tmp, half);
+    SortIds(entries, ids + half, tmp, count - half);
+    while (i < half && j < count) {
+        const CfbEntry *a = &entries[ids[i]], *b = &entries[ids[j]];
+        if (CfbCompareNames(a->name, a->nameLen, b->name, b->nameLen) <= 0) {
+            tmp[k++] = ids[i++];
+        } else {
+            tmp[k++] = ids[j++];
+        }
+    }
+    while (i < half) {
+        tmp[k++] = ids[i++];
+    }
+    while (j < count) {
+        tmp[k++] = ids[j++];
+    }
+    memcpy(ids, tmp, count * sizeof(CfbSect));
+}
+
+static CfbSect
+LinkTree(CfbEntry *entries, CfbSect *ids, CfbSect count, int depth,
+    int *maxDepthPtr)
+{
+    CfbSect mid = count / 2;
+    CfbEntry *entryPtr;
+
+    if (count == 0) {
+        return CFB_NOSTREAM;
+    }
+    entryPtr = &entries[ids[mid]];
+    entryPtr->left = LinkTree(entries, ids, mid, depth + 1, maxDepthPtr);
+    entryPtr->right = LinkTree(entries, ids + mid + 1, count - mid - 1,
+        depth + 1, maxDepthPtr);
+    entryPtr->color = depth;  /* replaced once the depth is known */
+    if (depth > *maxDepthPtr) {
+        *maxDepthPtr = depth;
+    }
+    return ids[mid];
+}
+
+CfbSect
+CfbLinkChildren(CfbEntry *entries, CfbSect *ids, CfbSect count)
+{
+    CfbSect *tmp, root, n;
+    int maxDepth = 0;
+
+    tmp = (CfbSect *)ckalloc(sizeof(CfbSect) * (count + 1));
+    SortIds(entries, ids, tmp, count);
+    ckfree((char *)tmp);
+
+    root = LinkTree(entries, ids, count, 0, &maxDepth);
+    for (n = 0; n < count; n++) {
+        CfbEntry *entryPtr = &entries[ids[n]];
+        entryPtr->color = (maxDepth > 0 && entryPtr->color == maxDepth)
+            ? CFB_RED : CFB_BLACK;
+    }
+    return root;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbNameFromObj, CfbNameObj --
+ *
+ *	Convert item names between Tcl objects and the UTF-16 form used
+ *	in the compound file directory.
+ *
+ * Results:
+ *	CfbNameFromObj returns 0 if the name is too long to be stored.
+ *	CfbNameObj returns a new Tcl object.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbNameFromObj(Tcl_Obj *nameObj, unsigned short *name, int *lenPtr)
+{
+    int n, len, cch = 0;
+    const Tcl_UniChar *uni = Tcl_GetUnicodeFromObj(nameObj, &len);
+
+    for (n = 0; n < len; n++) {
+        unsigned int ch = uni[n];
+        if (ch > 0xFFFF) {
+            if (cch + 2 > CFB_NAME_MAX)
+                return 0;
+            ch -= 0x10000;
+            name[cch++] = (unsigned short)(0xD800 | (ch >> 10));
+            name[cch++] = (unsigned short)(0xDC00 | (ch & 0x3FF));
+        } else {
+            if (cch + 1 > CFB_NAME_MAX)
+                return 0;
+            name[cch++] = (unsigned short)ch;
+        }
+    }
+    name[cch] = 0;
+    *lenPtr = cch;
+    return 1;
+}
+
+Tcl_Obj *
+CfbNameObj(const CfbEntry *entryPtr)
+{
+    Tcl_UniChar uni[CFB_NAME_MAX + 1];
+    int n, len = 0;
+
+    for (n = 0; n < entryPtr->nameLen; n++) {
+        unsigned int ch = entryPtr->name[n];
+        if (sizeof(Tcl_UniChar) > 2 && (ch & 0xFC00) == 0xD800
+            && n + 1 < entryPtr->nameLen
+            && (entryPtr->name[n + 1] & 0xFC00) == 0xDC00) {
+            ch = 0x10000 + (((ch & 0x3FF) << 10)
+                | (entryPtr->name[++n] & 0x3FF));
+        }
+        uni[len++] = (Tcl_UniChar)ch;
+    }
+    return Tcl_NewUnicodeObj(uni, len);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * GetChain --
+ *
+ *	Obtain the extent index for a stream. The sector chain is followed
+ *	once and consecutive sectors are merged into extents. The index is
+ *	kept with the compound file and shared by every stream opened on
+ *	the same directory entry. For a file shared between threads the
+ *	index is built holding the file lock.
+ *
+ * Results:
+ *	A CFB status code. The index is stored in chainPtrPtr.
+ *
+ * Side effects:
+ *	The index is cached until the compound file is released.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+GetChain(Cfb *cfbPtr, CfbSect id, CfbChain **chainPtrPtr)
+{
+    int r;
+
+    if (cfbPtr->shared) {
+        Tcl_MutexLock(&cfbPtr->lock);
+        r = BuildChain(cfbPtr, id, chainPtrPtr);
+        Tcl_MutexUnlock(&cfbPtr->lock);
+    } else {
+        r = BuildChain(cfbPtr, id, chainPtrPtr);
+    }
+    return r;
+}
+
+static int
+BuildChain(Cfb *cfbPtr, CfbSect id, CfbChain **chainPtrPtr)
+{
+    const CfbEntry *entryPtr = &cfbPtr->entries[id];
+    CfbChain *chainPtr;
+    CfbSect sect, need, limit, space = 8;
+    Tcl_WideUInt n;
+    int shift, r = CFB_OK;
+
+    if (cfbPtr->chains == NULL) {
+        cfbPtr->chains = (CfbChain **)
+            ckalloc(sizeof(CfbChain *) * cfbPtr->entryCount);
+        memset(cfbPtr->chains, 0, sizeof(CfbChain *) * cfbPtr->entryCount);
+    }
+    if (cfbPtr->chains[id]) {
+        *chainPtrPtr = cfbPtr->chains[id];
+        return CFB_OK;
+    }
+
+    chainPtr = (CfbChain *)ckalloc(sizeof(CfbChain));
+    chainPtr->mini = (entryPtr->size < cfbPtr->miniCutoff);
+    chainPtr->extentCount = 0;
+    chainPtr->extentSpace = space;
+    chainPtr->extents = (CfbExtent *)ckalloc(sizeof(CfbExtent) * space);
+    if (chainPtr->mini) {
+        shift = cfbPtr->miniSectorShift;
+        limit = cfbPtr->miniSectCount
+            << (cfbPtr->sectorShift - cfbPtr->miniSectorShift);
+    } else {
+        shift = cfbPtr->sectorShift;
+        limit = SECTOR_LIMIT(cfbPtr);
+    }
+
+    /*
+     * Only the sectors needed to hold the stream size are followed. A
+     * chain longer than the sectors available must contain a loop.
+     */
+
+    n = (entryPtr->size + (1U << shift) - 1) >> shift;
+    if (n > limit) {
+        r = CFB_EFORMAT;
+    }
+    need = (CfbSect)n;
+    sect = entryPtr->start;
+    for (n = 0; r == CFB_OK && n < need; n++) {
+        if (sect > CFB_MAXREGSECT || sect >= limit) {
+            r = CFB_EFORMAT;
+            break;
+        }
+        ChainAppend(chainPtr, sect, n);
+        if (n + 1 < need) {
+            r = chainPtr->mini ? NextMiniSector(cfbPtr, sect, &sect)
+                : NextSector(cfbPtr, sect, &sect);
+        }
+    }
+
+    if (r != CFB_OK) {
+        FreeChain(chainPtr);
+    } else {
+        cfbPtr->chains[id] = chainPtr;
+        *chainPtrPtr = chainPtr;
+    }
+    return r;
+}
+
+/*
+ * Add the sector at the given position to the end of an extent index.
+ */
+
+static void
+ChainAppend(CfbChain *chainPtr, CfbSect sect, Tcl_WideUInt pos)
+{
+    CfbExtent *extPtr = &chainPtr->extents[chainPtr->extentCount - 1];
+
+    if (chainPtr->extentCount > 0 && sect == extPtr->start + extPtr->count) {
+        extPtr->count++;
+        return;
+    }
+    if (chainPtr->extentCount == chainPtr->extentSpace) {
+        chainPtr->extentSpace *= 2;
+        chainPtr->extents = (CfbExtent *)ckrealloc((char *)chainPtr->extents,
+            sizeof(CfbExtent) * chainPtr->extentSpace);
+    }
+    extPtr = &chainPtr->extents[chainPtr->extentCount++];
+    extPtr->start = sect;
+    extPtr->count = 1;
+    extPtr->pos = pos;
+}
+
+static void
+FreeChain(CfbChain *chainPtr)
+{
+    ckfree((char *)chainPtr->extents);
+    ckfree((char *)chainPtr);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbStreamOpen --
+ *
+ *	Prepare to read the stream held in the given directory entry.
+ *
+ * Results:
+ *	A CFB status code. The new stream is stored in stmPtrPtr.
+ *
+ * Side effects:
+ *	The stream holds a reference to the compound file.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbStreamOpen(Cfb *cfbPtr, CfbSect id, CfbStream **stmPtrPtr)
+{
+    CfbStream *stmPtr;
+    CfbChain *chainPtr;
+    int r;
+
+    if (id >= cfbPtr->entryCount
+        || cfbPtr->entries[id].type != CFB_TYPE_STREAM) {
+        return CFB_ENOENT;
+    }
+    r = GetChain(cfbPtr, id, &chainPtr);
+    if (r != CFB_OK) {
+        return r;
+    }
+    stmPtr = (CfbStream *)ckalloc(sizeof(CfbStream));
+    stmPtr->cfbPtr = cfbPtr;
+    stmPtr->id = id;
+    stmPtr->size = cfbPtr->entries[id].size;
+    stmPtr->offset = 0;
+    stmPtr->chainPtr = chainPtr;
+    stmPtr->extent = 0;
+    stmPtr->generation = cfbPtr->generation;
+    stmPtr->raNext = 0;
+    stmPtr->raEnd = 0;
+    stmPtr->raWindow = 0;
+    stmPtr->raLimit = CFB_READAHEAD_MAX;
+    stmPtr->raSequential = 0;
+    CfbIncrRefCount(cfbPtr);
+    *stmPtrPtr = stmPtr;
+    return CFB_OK;
+}
+
+void
+CfbStreamClose(CfbStream *stmPtr)
+{
+    CfbDecrRefCount(stmPtr->cfbPtr);
+    ckfree((char *)stmPtr);
+}
+
+/*
+ * Refresh the size and extents of a stream after the file has changed.
+ * This fails if the stream has been removed.
+ */
+
+static int
+StreamCheck(CfbStream *stmPtr)
+{
+    Cfb *cfbPtr = stmPtr->cfbPtr;
+    int r;
+
+    if (stmPtr->generation == cfbPtr->generation) {
+        return CFB_OK;
+    }
+    if (stmPtr->id >= cfbPtr->entryCount
+        || cfbPtr->entries[stmPtr->id].type != CFB_TYPE_STREAM) {
+        return CFB_ENOENT;
+    }
+    r = GetChain(cfbPtr, stmPtr->id, &stmPtr->chainPtr);
+    if (r == CFB_OK) {
+        stmPtr->size = cfbPtr->entries[stmPtr->id].size;
+        stmPtr->extent = 0;
+        stmPtr->generation = cfbPtr->generation;
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * FindExtent --
+ *
+ *	Locate the extent that holds the given sector of a stream. The
+ *	extent used last and the one following it are tried first as these
+ *	satisfy sequential reading. Otherwise we search the index.
+ *
+ * Results:
+ *	The extent or NULL if the index does not reach the sector.
+ *
+ * Side effects:
+ *	Remembers the extent found in the stream.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static CfbExtent *
+FindExtent(CfbStream *stmPtr, Tcl_WideUInt index)
+{
+    CfbChain *chainPtr = stmPtr->chainPtr;
+    CfbExtent *extents = chainPtr->extents;
+    CfbSect lo = 0, hi = chainPtr->extentCount, mid = stmPtr->extent;
+    int tries;
+
+    for (tries = 0; tries < 2 && mid < hi; tries++, mid++) {
+        if (index >= extents[mid].pos
+            && index < extents[mid].pos + extents[mid].count) {
+            stmPtr->extent = mid;
+            return &extents[mid];
+        }
+    }
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index < extents[mid].pos) {
+            hi = mid;
+        } else if (index >= extents[mid].pos + extents[mid].count) {
+            lo = mid + 1;
+        } else {
+            stmPtr->extent = mid;
+            return &extents[mid];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbStreamRead --
+ *
+ *	Copy data from the current stream position into the buffer.
+ *	Streams smaller than the mini stream cutoff are held in 64 byte
+ *	sectors within the mini stream. Larger streams are copied an
+ *	extent at a time directly from the image unless the file has
+ *	been opened for writing when sectors are copied one at a time as
+ *	any of them may have been modified.
+ *
+ * Results:
+ *	The number of bytes read or -1 if the sector chain is corrupt.
+ *
+ * Side effects:
+ *	The stream position is advanced.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbStreamRead(CfbStream *stmPtr, char *buffer, int toRead)
+{
+    ReadAhead(stmPtr, toRead);
+    return ReadStream(stmPtr, buffer, toRead, NULL);
+}
+
+/*
+ * Locate the data for a read. Without a piece list the data is copied
+ * into the buffer. Otherwise each contiguous piece of the image is
+ * added to the list to be copied later.
+ */
+
+static int
+ReadStream(CfbStream *stmPtr, char *buffer, int toRead, PieceList *listPtr)
+{
+    Cfb *cfbPtr = stmPtr->cfbPtr;
+    int mini, shift, cb = 0;
+
+    if (StreamCheck(stmPtr) != CFB_OK) {
+        return -1;
+    }
+    mini = stmPtr->chainPtr->mini;
+    shift = mini ? cfbPtr->miniSectorShift : cfbPtr->sectorShift;
+    if (toRead <= 0 || stmPtr->offset >= stmPtr->size) {
+        return 0;
+    }
+    if ((Tcl_WideUInt)toRead > stmPtr->size - stmPtr->offset) {
+        toRead = (int)(stmPtr->size - stmPtr->offset);
+    }
+
+    while (cb < toRead) {
+        Tcl_WideUInt index = stmPtr->offset >> shift;
+        unsigned long skip, avail;
+        Tcl_WideUInt n, have, run;
+        const unsigned char *p;
+        CfbExtent *extPtr;
+        CfbSect sect;
+
+        extPtr = FindExtent(stmPtr, index);
+        if (extPtr == NULL) {
+            return -1;
+        }
+        sect = extPtr->start + (CfbSect)(index - extPtr->pos);
+        skip = (unsigned long)(stmPtr->offset & ((1U << shift) - 1));
+        p = mini ? MiniSectorData(cfbPtr, sect, &avail)
+            : SectorData(cfbPtr, sect, &avail);
+        if (p == NULL) {
+            return -1;
+        }
+        if (mini || cfbPtr->fat || cfbPtr->cachePtr) {
+            /* mini sectors, modified sectors and cached sectors are
+             * read one at a time */
+            run = (1UL << shift) - skip;
+            have = avail;
+        } else {
+            run = ((extPtr->pos + extPtr->count - index) << shift) - skip;
+            have = cfbPtr->length - (Tcl_WideUInt)(p - cfbPtr->base);
+        }
+        n = (Tcl_WideUInt)(toRead - cb);
+        if (n > run) {
+            n = run;
+        }
+        if (!mini && !cfbPtr->fat && !cfbPtr->cachePtr
+            && ((skip + n - 1) >> shift) > ((have - 1) >> shift)) {
+            /* the data runs past the sector containing the end of file */
+            return -1;
+        }
+        have = (have > skip) ? have - skip : 0;
+        if (listPtr && have > 0) {
+            AddPiece(listPtr, p + skip, buffer + cb,
+                (size_t)(have < n ? have : n));
+            if (have < n) {
+                memset(buffer + cb + have, 0, (size_t)(n - have));
+            }
+        } else if (have >= n) {
+            memcpy(buffer + cb, p + skip, (size_t)n);
+        } else {
+            /* short final sector: the missing tail reads as zeros */
+            memcpy(buffer + cb, p + skip, (size_t)have);
+            memset(buffer + cb + have, 0, (size_t)(n - have));
+        }
+        cb += (int)n;
+        stmPtr->offset += n;
+    }
+    return cb;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbReadRanges --
+ *
+ *	Read several ranges of one or more streams at once. The sectors
+ *	needed by every range are located first and adjacent sectors are
+ *	merged. The data is then copied in the order it appears in the
+ *	file so the image is read in a single pass. Each range is
+ *	limited to the data held in the stream and its length updated.
+ *
+ * Results:
+ *	A CFB status code. The code of each range is also set.
+ *
+ * Side effects:
+ *	The buffers are filled.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbReadRanges(Cfb *cfbPtr, CfbRange *ranges, int count)
+{
+    PieceList list;
+    CfbStream *stmPtr;
+    size_t n;
+    int i, r = CFB_OK;
+
+    list.count = 0;
+    list.space = 64;
+    list.pieces = (Piece *)ckalloc(sizeof(Piece) * list.space);
+
+    for (i = 0; i < count; i++) {
+        CfbRange *rangePtr = &ranges[i];
+        rangePtr->code = CfbStreamOpen(cfbPtr, rangePtr->id, &stmPtr);
+        if (rangePtr->code != CFB_OK) {
+            rangePtr->length = 0;
+            r = rangePtr->code;
+            continue;
+        }
+        if (rangePtr->offset >= stmPtr->size) {
+            rangePtr->length = 0;
+        } else if ((Tcl_WideUInt)rangePtr->length
+                   > stmPtr->size - rangePtr->offset) {
+            rangePtr->length = (int)(stmPtr->size - rangePtr->offset);
+        }
+        stmPtr->offset = rangePtr->offset;
+        /* cached sectors may be evicted so they are copied at once */
+        if (ReadStream(stmPtr, (char *)rangePtr->buffer, rangePtr->length,
+                cfbPtr->cachePtr ? NULL : &list) != rangePtr->length) {
+            rangePtr->code = r = CFB_EFORMAT;
+        }
+        CfbStreamClose(stmPtr);
+    }
+
+    qsort(list.pieces, list.count, sizeof(Piece), ComparePieces);
+    for (n = 0; n < list.count; n++) {
+        memcpy(list.pieces[n].dst, list.pieces[n].src, list.pieces[n].len);
+    }
+    ckfree((char *)list.pieces);
+    return r;
+}
+
+static void
+AddPiece(PieceList *listPtr, const unsigned char *src, char *dst, size_t len)
+{
+    Piece *pPtr = listPtr->count ? &listPtr->pieces[listPtr->count - 1] : NULL;
+
+    if (pPtr && pPtr->src + pPtr->len == src && pPtr->dst + pPtr->len == dst) {
+        pPtr->len += len;
+        return;
+    }
+    if (listPtr->count == listPtr->space) {
+        listPtr->space *= 2;
+        listPtr->pieces = (Piece *)ckrealloc((char *)listPtr->pieces,
+            sizeof(Piece) * listPtr->space);
+    }
+    pPtr = &listPtr->pieces[listPtr->count++];
+    pPtr->src = src;
+    pPtr->dst = dst;
+    pPtr->len = len;
+}
+
+static int
+ComparePieces(const void *p1, const void *p2)
+{
+    const Piece *a = (const Piece *)p1, *b = (const Piece *)p2;
+    return (a->src < b->src) ? -1 : (a->src > b->src) ? 1 : 0;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbStreamCopy --
+ *
+ *	Write the remainder of a stream to a channel. Where the file is
+ *	not open for writing each run of consecutive sectors is written
+ *	directly from the mapped image in one call. Mini streams, modified
+ *	or cached files and a short final sector are copied through a
+ *	buffer.
+ *
+ *	This does not change the compound file so several streams of the
+ *	same file may be copied at once by different threads provided
+ *	each stream is used by only one of them.
+ *
+ * Results:
+ *	A CFB status code. The number of bytes written is stored in
+ *	countPtr.
+ *
+ * Side effects:
+ *	The stream position is advanced to the end.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbStreamCopy(CfbStream *stmPtr, Tcl_Channel chan, Tcl_WideUInt *countPtr)
+{
+    Cfb *cfbPtr = stmPtr->cfbPtr;
+    char buffer[16384];
+    int r = StreamCheck(stmPtr), shift = cfbPtr->sectorShift;
+
+    *countPtr = 0;
+    while (r == CFB_OK && stmPtr->offset < stmPtr->size) {
+        Tcl_WideUInt index = stmPtr->offset >> shift, start, n = 0;
+        const char *p = NULL;
+        CfbExtent *extPtr;
+
+        if (!stmPtr->chainPtr->mini && !cfbPtr->fat && !cfbPtr->cachePtr) {
+            extPtr = FindExtent(stmPtr, index);
+            if (extPtr == NULL) {
+                r = CFB_EFORMAT;
+                break;
+            }
+            start = (((Tcl_WideUInt)extPtr->start + 1 + index - extPtr->pos)
+                << shift) + (stmPtr->offset & ((1U << shift) - 1));
+            n = ((extPtr->pos + extPtr->count) << shift) - stmPtr->offset;
+            if (n > stmPtr->size - stmPtr->offset) {
+                n = stmPtr->size - stmPtr->offset;
+            }
+            if (n > 0x1000000) {
+                n = 0x1000000;
+            }
+            if (start + n <= cfbPtr->length) {
+                p = (const char *)cfbPtr->base + start;
+                stmPtr->offset += n;
+                if (!cfbPtr->inMemory) {
+                    AdviseFile(cfbPtr, start, n);
+                }
+            }
+        }
+        if (p == NULL) {
+            int cb = CfbStreamRead(stmPtr, buffer, sizeof(buffer));
+            if (cb <= 0) {
+                r = CFB_EFORMAT;
+                break;
+            }
+            p = buffer;
+            n = (Tcl_WideUInt)cb;
+        }
+        if (Tcl_WriteRaw(chan, p, (int)n) != (int)n) {
+            r = CFB_EIO;
+        } else {
+            *countPtr += n;
+        }
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ReadAhead, CfbStreamReadAhead --
+ *
+ *	Ask the system to fetch the part of a stream that a sequential
+ *	reader will want next. A read that starts where the previous one
+ *	ended doubles the read-ahead window up to the stream's limit and
+ *	once the reader is half way through the window the sectors of the
+ *	next window are requested, following the extents of the chain.
+ *	Any other read closes the window so random access fetches nothing
+ *	extra. Mini streams and files held in memory are not affected.
+ *
+ *	CfbStreamReadAhead sets the limit. A limit of 0 disables
+ *	read-ahead and with sequential set the window starts at the limit.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The system may begin reading the file.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+ReadAhead(CfbStream *stmPtr, int toRead)
+{
+    Cfb *cfbPtr = stmPtr->cfbPtr;
+    Tcl_WideUInt pos, end;
+    CfbSect extent = stmPtr->extent;
+    int shift = cfbPtr->sectorShift;
+
+    if (stmPtr->raLimit == 0 || cfbPtr->inMemory || toRead <= 0
+        || StreamCheck(stmPtr) != CFB_OK || stmPtr->chainPtr->mini) {
+        return;
+    }
+    if (stmPtr->offset != stmPtr->raNext) {
+        stmPtr->raNext = stmPtr->offset + toRead;
+        stmPtr->raEnd = stmPtr->raNext;
+        stmPtr->raWindow = stmPtr->raSequential ? stmPtr->raLimit : 0;
+        return;
+    }
+    stmPtr->raNext = stmPtr->offset + toRead;
+    if (stmPtr->raNext + stmPtr->raWindow / 2 < stmPtr->raEnd) {
+        return;
+    }
+
+    stmPtr->raWindow = stmPtr->raWindow ? stmPtr->raWindow * 2
+        : CFB_READAHEAD_MIN;
+    if (stmPtr->raWindow > stmPtr->raLimit) {
+        stmPtr->raWindow = stmPtr->raLimit;
+    }
+    pos = (stmPtr->raEnd > stmPtr->raNext) ? stmPtr->raEnd : stmPtr->raNext;
+    end = stmPtr->raNext + stmPtr->raWindow;
+    if (end > stmPtr->size) {
+        end = stmPtr->size;
+    }
+    stmPtr->raEnd = end;
+
+    while (pos < end) {
+        Tcl_WideUInt index = pos >> shift, offset, len;
+        CfbExtent *extPtr = FindExtent(stmPtr, index);
+
+        if (extPtr == NULL) {
+            break;
+        }
+        offset = ((Tcl_WideUInt)extPtr->start + 1 + index - extPtr->pos)
+            << shift;
+        len = ((extPtr->pos + extPtr->count) << shift) - (index << shift);
+        if (len > end - (index << shift)) {
+            len = end - (index << shift);
+        }
+        if (offset >= cfbPtr->length) {
+            break;
+        }
+        if (len > cfbPtr->length - offset) {
+            len = cfbPtr->length - offset;
+        }
+        AdviseFile(cfbPtr, offset, len);
+        pos = (extPtr->pos + extPtr->count) << shift;
+    }
+
+    /* leave the extent hint where the reader is */
+    stmPtr->extent = extent;
+}
+
+void
+CfbStreamReadAhead(CfbStream *stmPtr, Tcl_WideUInt limit, int sequential)
+{
+    stmPtr->raLimit = limit;
+    stmPtr->raSequential = sequential;
+    stmPtr->raWindow = sequential ? limit : 0;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbStreamLayout --
+ *
+ *	Describe how the data of a stream is held in the file: the size
+ *	of its sectors and the number of runs of consecutive sectors.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The stream size and extents are refreshed if the file changed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbStreamLayout(CfbStream *stmPtr, unsigned long *sectorSizePtr,
+    CfbSect *fragmentsPtr)
+{
+    int r = StreamCheck(stmPtr);
+
+    if (r == CFB_OK) {
+        *sectorSizePtr = stmPtr->chainPtr->mini
+            ? stmPtr->cfbPtr->miniSectorSize : stmPtr->cfbPtr->sectorSize;
+        *fragmentsPtr = stmPtr->chainPtr->extentCount;
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbEntryLayout --
+ *
+ *	Describe the sectors holding the stream in a directory entry
+ *	without opening it.
+ *
+ * Results:
+ *	A CFB status code. The sector size, the length of the sector
+ *	chain and the number of runs of consecutive sectors are stored.
+ *
+ * Side effects:
+ *	The extents of the stream are resolved.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbEntryLayout(Cfb *cfbPtr, CfbSect id, unsigned long *sectorSizePtr,
+    CfbSect *lengthPtr, CfbSect *fragmentsPtr)
+{
+    CfbChain *chainPtr;
+    int r;
+
+    if (id >= cfbPtr->entryCount
+        || cfbPtr->entries[id].type != CFB_TYPE_STREAM) {
+        return CFB_ENOENT;
+    }
+    r = GetChain(cfbPtr, id, &chainPtr);
+    if (r == CFB_OK) {
+        *sectorSizePtr = chainPtr->mini
+            ? cfbPtr->miniSectorSize : cfbPtr->sectorSize;
+        *lengthPtr = 0;
+        if (chainPtr->extentCount > 0) {
+            CfbExtent *lastPtr =
+                &chainPtr->extents[chainPtr->extentCount - 1];
+            *lengthPtr = (CfbSect)lastPtr->pos + lastPtr->count;
+        }
+        *fragmentsPtr = chainPtr->extentCount;
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbStreamSeek --
+ *
+ *	Change the stream position.
+ *
+ * Results:
+ *	The new position or -1 on error.
+ *
+ * Side effects:
+ *	Moves the stream position.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_WideInt
+CfbStreamSeek(CfbStream *stmPtr, Tcl_WideInt offset, int seekMode,
+    int *errorCodePtr)
+{
+    Tcl_WideInt base = 0;
+
+    StreamCheck(stmPtr);
+    if (seekMode == SEEK_CUR) {
+        base = (Tcl_WideInt)stmPtr->offset;
+    } else if (seekMode == SEEK_END) {
+        base = (Tcl_WideInt)stmPtr->size;
+    }
+    if (base + offset < 0) {
+        *errorCodePtr = EINVAL;
+        return -1;
+    }
+    stmPtr->offset = (Tcl_WideUInt)(base + offset);
+    *errorCodePtr = 0;
+    return (Tcl_WideInt)stmPtr->offset;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * InitWork, FreeWork --
+ *
+ *	Build or release the working copies of the FAT and MiniFAT used
+ *	while the file is open for writing. Every sector used by the
+ *	committed image is pinned so that it is not reused before the
+ *	changes are committed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is allocated or free'd. FreeWork discards any modified
+ *	sectors.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+InitWork(Cfb *cfbPtr)
+{
+    CfbSect perSect = cfbPtr->sectorSize >> 2;
+    CfbSect *fat, *miniFat, n, next, count;
+    unsigned char *pinned;
+
+    count = cfbPtr->sectorCount;
+    fat = (CfbSect *)ckalloc(sizeof(CfbSect) * (count + 1));
+    pinned = (unsigned char *)ckalloc(count + 1);
+    for (n = 0; n < count; n++) {
+        if (NextSector(cfbPtr, n, &next) != CFB_OK) {
+            next = CFB_FREESECT;
+        }
+        fat[n] = next;
+        pinned[n] = (next != CFB_FREESECT);
+    }
+
+#define PIN(sects, sectCount) \
+    for (n = 0; n < (sectCount); n++) { \
+        if ((sects)[n] < count) pinned[(sects)[n]] = 1; \
+    }
+    PIN(cfbPtr->fatSects, cfbPtr->fatSectCount);
+    PIN(cfbPtr->difatSects, cfbPtr->difatSectCount);
+    PIN(cfbPtr->dirSects, cfbPtr->dirSectCount);
+    PIN(cfbPtr->miniFatSects, cfbPtr->miniFatSectCount);
+#undef PIN
+
+    cfbPtr->miniFatLen = cfbPtr->miniFatSectCount * perSect;
+    cfbPtr->miniFatSpace = cfbPtr->miniFatLen + 1;
+    miniFat = (CfbSect *)ckalloc(sizeof(CfbSect) * cfbPtr->miniFatSpace);
+    for (n = 0; n < cfbPtr->miniFatLen; n++) {
+        if (NextMiniSector(cfbPtr, n, &next) != CFB_OK) {
+            next = CFB_FREESECT;
+        }
+        miniFat[n] = next;
+    }
+
+    cfbPtr->fat = fat;
+    cfbPtr->fatLen = count;
+    cfbPtr->fatSpace = count + 1;
+    cfbPtr->miniFat = miniFat;
+    cfbPtr->pinned = pinned;
+    cfbPtr->allocHint = 0;
+    cfbPtr->miniAllocHint = 0;
+    cfbPtr->modified = 0;
+    Tcl_InitHashTable(&cfbPtr->dirty, TCL_ONE_WORD_KEYS);
+}
+
+static void
+FreeWork(Cfb *cfbPtr)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+
+    for (hPtr = Tcl_FirstHashEntry(&cfbPtr->dirty, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        ckfree((char *)Tcl_GetHashValue(hPtr));
+    }
+    Tcl_DeleteHashTable(&cfbPtr->dirty);
+    ckfree((char *)cfbPtr->fat);
+    ckfree((char *)cfbPtr->miniFat);
+    ckfree((char *)cfbPtr->pinned);
+    cfbPtr->fat = cfbPtr->miniFat = NULL;
+    cfbPtr->pinned = NULL;
+    cfbPtr->fatLen = cfbPtr->fatSpace = 0;
+    cfbPtr->miniFatLen = cfbPtr->miniFatSpace = 0;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Sector allocation --
+ *
+ *	New sectors are taken from those free in both the working FAT and
+ *	the committed image. A modified sector is held in memory as a
+ *	buffer in the dirty table until it is committed. Mini sectors are
+ *	modified by modifying the mini stream sector that holds them.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+SectorFree(Cfb *cfbPtr, CfbSect sect)
+{
+    if (sect < cfbPtr->sectorCount && cfbPtr->pinned[sect]) {
+        return 0;
+    }
+    return (sect >= cfbPtr->fatLen || cfbPtr->fat[sect] == CFB_FREESECT);
+}
+
+static void
+GrowFat(Cfb *cfbPtr, CfbSect need)
+{
+    if (need > cfbPtr->fatSpace) {
+        cfbPtr->fatSpace = (need > cfbPtr->fatSpace * 2)
+            ? need : cfbPtr->fatSpace * 2;
+        cfbPtr->fat = (CfbSect *)ckrealloc((char *)cfbPtr->fat,
+            sizeof(CfbSect) * cfbPtr->fatSpace);
+    }
+    while (cfbPtr->fatLen < need) {
+        cfbPtr->fat[cfbPtr->fatLen++] = CFB_FREESECT;
+    }
+}
+
+/*
+ * Return the buffer holding the modified copy of a sector. The buffer
+ * is created from the image, or the sector cache, if the sector has not
+ * already been modified. Sectors beyond the end of the image read as
+ * zeros. NULL is returned if the sector cannot be read from the file
+ * and the caller reports CFB_EIO. ZeroSector returns the buffer for a
+ * newly allocated sector, cleared without reading the old contents.
+ */
+
+static unsigned char *
+DirtySector(Cfb *cfbPtr, CfbSect sect)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_WideUInt offset;
+    unsigned char *buffer;
+    int isNew;
+
+    hPtr = Tcl_CreateHashEntry(&cfbPtr->dirty, (char *)(size_t)sect, &isNew);
+    if (!isNew) {
+        return (unsigned char *)Tcl_GetHashValue(hPtr);
+    }
+    buffer = (unsigned char *)ckalloc(cfbPtr->sectorSize);
+    memset(buffer, 0, cfbPtr->sectorSize);
+    offset = ((Tcl_WideUInt)sect + 1) << cfbPtr->sectorShift;
+    if (offset < cfbPtr->length) {
+        Tcl_WideUInt avail = cfbPtr->length - offset;
+        const unsigned char *p = cfbPtr->cachePtr
+            ? CacheSector(cfbPtr, sect) : cfbPtr->base + offset;
+        if (p == NULL) {
+            /* never write back a sector that could not be read */
+            Tcl_DeleteHashEntry(hPtr);
+            ckfree((char *)buffer);
+            return NULL;
+        }
+        if (avail > cfbPtr->sectorSize) {
+            avail = cfbPtr->sectorSize;
+        }
+        memcpy(buffer, p, (size_t)avail);
+    }
+    Tcl_SetHashValue(hPtr, buffer);
+    return buffer;
+}
+
+static unsigned char *
+ZeroSector(Cfb *cfbPtr, CfbSect sect)
+{
+    Tcl_HashEntry *hPtr;
+    unsigned char *buffer;
+    int isNew;
+
+    hPtr = Tcl_CreateHashEntry(&cfbPtr->dirty, (char *)(size_t)sect, &isNew);
+    if (isNew) {
+        buffer = (unsigned char *)ckalloc(cfbPtr->sectorSize);
+        Tcl_SetHashValue(hPtr, buffer);
+    } else {
+        buffer = (unsigned char *)Tcl_GetHashValue(hPtr);
+    }
+    memset(buffer, 0, cfbPtr->sectorSize);
+    return buffer;
+}
+
+static unsigned char *
+DirtyMiniSector(Cfb *cfbPtr, CfbSect sect)
+{
+    Tcl_WideUInt offset = (Tcl_WideUInt)sect << cfbPtr->miniSectorShift;
+    CfbSect index = (CfbSect)(offset >> cfbPtr->sectorShift);
+    unsigned char *p = DirtySector(cfbPtr, cfbPtr->miniSects[index]);
+
+    return p ? p + (offset & (cfbPtr->sectorSize - 1)) : NULL;
+}
+
+static int
+AllocSector(Cfb *cfbPtr, CfbSect *sectPtr)
+{
+    CfbSect sect = cfbPtr->allocHint;
+
+    while (sect < cfbPtr->fatLen && !SectorFree(cfbPtr, sect)) {
+        sect++;
+    }
+    if (sect > CFB_MAXREGSECT) {
+        return CFB_ENOSPC;
+    }
+    GrowFat(cfbPtr, sect + 1);
+    cfbPtr->fat[sect] = CFB_ENDOFCHAIN;
+    cfbPtr->allocHint = sect + 1;
+    ZeroSector(cfbPtr, sect);
+    *sectPtr = sect;
+    return CFB_OK;
+}
+
+static void
+ReleaseSector(Cfb *cfbPtr, CfbSect sect)
+{
+    Tcl_HashEntry *hPtr;
+
+    hPtr = Tcl_FindHashEntry(&cfbPtr->dirty, (char *)(size_t)sect);
+    if (hPtr) {
+        ckfree((char *)Tcl_GetHashValue(hPtr));
+        Tcl_DeleteHashEntry(hPtr);
+    }
+    cfbPtr->fat[sect] = CFB_FREESECT;
+    if (sect < cfbPtr->allocHint) {
+        cfbPtr->allocHint = sect;
+    }
+}
+
+/*
+ * Allocate a mini sector, extending the mini stream held in the root
+ * entry when it is full.
+ */
+
+static int
+AllocMiniSector(Cfb *cfbPtr, CfbSect *sectPtr)
+{
+    CfbEntry *rootPtr = &cfbPtr->entries[0];
+    int shift = cfbPtr->sectorShift - cfbPtr->miniSectorShift;
+    CfbSect sect = cfbPtr->miniAllocHint;
+    Tcl_WideUInt end;
+    unsigned char *p;
+    int r;
+
+    while (sect < cfbPtr->miniFatLen && cfbPtr->miniFat[sect] != CFB_FREESECT) {
+        sect++;
+    }
+    if (sect > CFB_MAXREGSECT) {
+        return CFB_ENOSPC;
+    }
+    while ((sect >> shift) >= cfbPtr->miniSectCount) {
+        CfbSect newSect;
+        r = AllocSector(cfbPtr, &newSect);
+        if (r != CFB_OK) {
+            return r;
+        }
+        if (cfbPtr->miniSectCount == 0) {
+            rootPtr->start = newSect;
+        } else {
+            cfbPtr->fat[cfbPtr->miniSects[cfbPtr->miniSectCount - 1]] = newSect;
+        }
+        cfbPtr->miniSects = (CfbSect *)ckrealloc((char *)cfbPtr->miniSects,
+            sizeof(CfbSect) * (cfbPtr->miniSectCount + 1));
+        cfbPtr->miniSects[cfbPtr->miniSectCount++] = newSect;
+        InvalidateChain(cfbPtr, 0);
+    }
+    p = DirtyMiniSector(cfbPtr, sect);
+    if (p == NULL) {
+        return CFB_EIO;
+    }
+    if (sect >= cfbPtr->miniFatSpace) {
+        cfbPtr->miniFatSpace = cfbPtr->miniFatSpace * 2 + 16;
+        cfbPtr->miniFat = (CfbSect *)ckrealloc((char *)cfbPtr->miniFat,
+            sizeof(CfbSect) * cfbPtr->miniFatSpace);
+    }
+    while (cfbPtr->miniFatLen <= sect) {
+        cfbPtr->miniFat[cfbPtr->miniFatLen++] = CFB_FREESECT;
+    }
+    cfbPtr->miniFat[sect] = CFB_ENDOFCHAIN;
+    cfbPtr->miniAllocHint = sect + 1;
+    end = ((Tcl_WideUInt)sect + 1) << cfbPtr->miniSectorShift;
+    if (rootPtr->size < end) {
+        rootPtr->size = end;
+    }
+    memset(p, 0, cfbPtr->miniSectorSize);
+    *sectPtr = sect;
+    return CFB_OK;
+}
+
+static void
+ReleaseMiniSector(Cfb *cfbPtr, CfbSect sect)
+{
+    cfbPtr->miniFat[sect] = CFB_FREESECT;
+    if (sect < cfbPtr->miniAllocHint) {
+        cfbPtr->miniAllocHint = sect;
+    }
+}
+
+/*
+ * Forget the cached extents of an entry whose sectors have changed.
+ */
+
+static void
+InvalidateChain(Cfb *cfbPtr, CfbSect id)
+{
+    if (cfbPtr->chains && cfbPtr->chains[id]) {
+        FreeChain(cfbPtr->chains[id]);
+        cfbPtr->chains[id] = NULL;
+    }
+    cfbPtr->generation++;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ResizeStream --
+ *
+ *	Change the size of the stream held in a directory entry. Sectors
+ *	are added to or released from the end of the chain. A stream that
+ *	crosses the mini stream cutoff is moved between the mini stream and
+ *	regular sectors.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The working tables are modified. Any new space reads as zeros.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+ResizeStream(Cfb *cfbPtr, CfbSect id, Tcl_WideUInt size)
+{
+    CfbEntry *entryPtr = &cfbPtr->entries[id];
+    Tcl_WideUInt old = entryPtr->size, n;
+    int mini = ((size > 0 ? size : old) < cfbPtr->miniCutoff);
+    CfbSect *table, have, need, keep, last = CFB_ENDOFCHAIN, sect, next;
+    CfbChain *chainPtr = NULL;
+    unsigned long mask;
+    int shift, r = CFB_OK;
+
+    if (old > 0 && size > 0 && mini != (old < cfbPtr->miniCutoff)) {
+        return ConvertStream(cfbPtr, id, size);
+    }
+
+    shift = mini ? cfbPtr->miniSectorShift : cfbPtr->sectorShift;
+    mask = (1UL << shift) - 1;
+    table = mini ? cfbPtr->miniFat : cfbPtr->fat;
+    n = (size + mask) >> shift;
+    if (n > CFB_MAXREGSECT) {
+        return CFB_ENOSPC;
+    }
+    need = (CfbSect)n;
+    have = (CfbSect)((old + mask) >> shift);
+
+    /*
+     * Locate the last sector that is kept.
+     */
+
+    keep = (need < have) ? need : have;
+    if (keep > 0) {
+        CfbStream tmp;
+        CfbExtent *extPtr;
+
+        r = GetChain(cfbPtr, id, &chainPtr);
+        if (r != CFB_OK) {
+            return r;
+        }
+        tmp.chainPtr = chainPtr;
+        tmp.extent = chainPtr->extentCount - 1;
+        extPtr = FindExtent(&tmp, keep - 1);
+        if (extPtr == NULL) {
+            return CFB_EFORMAT;
+        }
+        last = extPtr->start + (keep - 1 - (CfbSect)extPtr->pos);
+    }
+
+    if (need < have) {
+        sect = (keep > 0) ? table[last] : entryPtr->start;
+        if (keep > 0) {
+            table[last] = CFB_ENDOFCHAIN;
+        } else {
+            entryPtr->start = CFB_ENDOFCHAIN;
+        }
+        for (n = keep; n < have && sect <= CFB_MAXREGSECT; n++) {
+            if (mini) {
+                if (sect >= cfbPtr->miniFatLen) break;
+                next = table[sect];
+                ReleaseMiniSector(cfbPtr, sect);
+            } else {
+                if (sect >= cfbPtr->fatLen) break;
+                next = table[sect];
+                ReleaseSector(cfbPtr, sect);
+            }
+            sect = next;
+        }
+        InvalidateChain(cfbPtr, id);
+    } else if (need > have) {
+        if (have > 0 && (old & mask)) {
+            /* the end of the last sector may hold stale data */
+            unsigned char *p = mini ? DirtyMiniSector(cfbPtr, last)
+                : DirtySector(cfbPtr, last);
+            if (p == NULL) {
+                return CFB_EIO;
+            }
+            memset(p + (old & mask), 0, (size_t)((mask + 1) - (old & mask)));
+        }
+        if (have == 0) {
+            InvalidateChain(cfbPtr, id);
+            chainPtr = NULL;
+        }
+        for (n = have; n < need; n++) {
+            r = mini ? AllocMiniSector(cfbPtr, &sect)
+                : AllocSector(cfbPtr, &sect);
+            if (r != CFB_OK) {
+                break;
+            }
+            /* AllocMiniSector may extend the mini stream */
+            table = mini ? cfbPtr->miniFat : cfbPtr->fat;
+            if (last == CFB_ENDOFCHAIN) {
+                entryPtr->start = sect;
+            } else {
+                table[last] = sect;
+            }
+            if (chainPtr) {
+                ChainAppend(chainPtr, sect, n);
+            }
+            last = sect;
+        }
+        if (r != CFB_OK) {
+            /* keep the space that was allocated */
+            if ((n << shift) < size) {
+                size = n << shift;
+            }
+        }
+    } else if (size > old && (old & mask)) {
+        unsigned char *p = mini ? DirtyMiniSector(cfbPtr, last)
+            : DirtySector(cfbPtr, last);
+        if (p == NULL) {
+            return CFB_EIO;
+        }
+        memset(p + (old & mask), 0, (size_t)((mask + 1) - (old & mask)));
+    }
+
+    entryPtr->size = size;
+    cfbPtr->generation++;
+    cfbPtr->modified = 1;
+    return r;
+}
+
+/*
+ * Copy data to or from a stream in the working image. The stream must
+ * already be large enough.
+ */
+
+static int
+TransferStream(Cfb *cfbPtr, CfbSect id, Tcl_WideUInt offset,
+    char *buffer, Tcl_WideUInt length, int write)
+{
+    CfbStream tmp;
+    int mini, shift, r;
+
+    tmp.cfbPtr = cfbPtr;
+    tmp.id = id;
+    tmp.offset = offset;
+    tmp.generation = cfbPtr->generation - 1;
+    r = StreamCheck(&tmp);
+    if (r != CFB_OK) {
+        return r;
+    }
+    if (!write) {
+        return (ReadStream(&tmp, buffer, (int)length, NULL) == (int)length)
+            ? CFB_OK : CFB_EFORMAT;
+    }
+
+    mini = tmp.chainPtr->mini;
+    shift = mini ? cfbPtr->miniSectorShift : cfbPtr->sectorShift;
+    while (length > 0) {
+        Tcl_WideUInt index = offset >> shift;
+        unsigned long skip = (unsigned long)(offset & ((1U << shift) - 1));
+        unsigned long n = (1UL << shift) - skip;
+        CfbExtent *extPtr = FindExtent(&tmp, index);
+        CfbSect sect;
+        unsigned char *p;
+
+        if (extPtr == NULL) {
+            return CFB_EFORMAT;
+        }
+        sect = extPtr->start + (CfbSect)(index - extPtr->pos);
+        p = mini ? DirtyMiniSector(cfbPtr, sect) : DirtySector(cfbPtr, sect);
+        if (p == NULL) {
+            return CFB_EIO;
+        }
+        if (n > length) {
+            n = (unsigned long)length;
+        }
+        memcpy(p + skip, buffer, n);
+        buffer += n;
+        offset += n;
+        length -= n;
+    }
+    return CFB_OK;
+}
+
+/*
+ * Move a stream between the mini stream and regular sectors. Only the
+ * smaller of the two sizes is copied and this is less than the cutoff.
+ */
+
+static int
+ConvertStream(Cfb *cfbPtr, CfbSect id, Tcl_WideUInt size)
+{
+    Tcl_WideUInt keep = cfbPtr->entries[id].size;
+    char *buffer;
+    int r;
+
+    if (keep > size) {
+        keep = size;
+    }
+    buffer = ckalloc((unsigned int)keep);
+    r = TransferStream(cfbPtr, id, 0, buffer, keep, 0);
+    if (r == CFB_OK) {
+        r = ResizeStream(cfbPtr, id, 0);
+    }
+    if (r == CFB_OK) {
+        r = ResizeStream(cfbPtr, id, size);
+    }
+    if (r == CFB_OK) {
+        r = TransferStream(cfbPtr, id, 0, buffer, keep, 1);
+    }
+    ckfree(buffer);
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbStreamWrite --
+ *
+ *	Copy data from the buffer to the current stream position,
+ *	extending the stream if necessary. The data is held in memory until
+ *	it is committed. A file opened in direct mode is committed each
+ *	time a few megabytes of changes have collected.
+ *
+ * Results:
+ *	The number of bytes written or -1 with a CFB status code in
+ *	codePtr.
+ *
+ * Side effects:
+ *	The stream position is advanced.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbStreamWrite(CfbStream *stmPtr, const char *buffer, int toWrite,
+    int *codePtr)
+{
+    Cfb *cfbPtr = stmPtr->cfbPtr;
+    Tcl_WideUInt end = stmPtr->offset + toWrite;
+    int r;
+
+    r = cfbPtr->writable ? StreamCheck(stmPtr) : CFB_EACCES;
+    if (r == CFB_OK && end > stmPtr->size) {
+        r = ResizeStream(cfbPtr, stmPtr->id, end);
+    }
+    if (r == CFB_OK) {
+        r = TransferStream(cfbPtr, stmPtr->id, stmPtr->offset,
+            (char *)buffer, (Tcl_WideUInt)toWrite, 1);
+    }
+    if (r == CFB_OK) {
+        stmPtr->offset = end;
+        cfbPtr->modified = 1;
+        if (!(cfbPtr->mode & STGM_TRANSACTED) && !cfbPtr->inMemory
+            && (unsigned long)cfbPtr->dirty.numEntries * cfbPtr->sectorSize
+                >= CFB_DIRECT_LIMIT) {
+            r = CfbCommit(cfbPtr);
+        }
+    }
+    if (r != CFB_OK) {
+        *codePtr = r;
+        return -1;
+    }
+    return toWrite;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbStreamSetSize --
+ *
+ *	Truncate or extend a stream. The stream position is unchanged.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	Sectors are allocated or released.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbStreamSetSize(CfbStream *stmPtr, Tcl_WideUInt size)
+{
+    Cfb *cfbPtr = stmPtr->cfbPtr;
+    int r;
+
+    r = cfbPtr->writable ? StreamCheck(stmPtr) : CFB_EACCES;
+    if (r == CFB_OK && size != stmPtr->size) {
+        r = ResizeStream(cfbPtr, stmPtr->id, size);
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbValidName --
+ *
+ *	Check that a name may be used for a new storage or stream. Names
+ *	must not be empty and may not contain the characters / \ : or !.
+ *
+ * Results:
+ *	Non-zero if the name is acceptable.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbValidName(const unsigned short *name, int len)
+{
+    int n;
+
+    if (len <= 0 || len > CFB_NAME_MAX) {
+        return 0;
+    }
+    for (n = 0; n < len; n++) {
+        if (name[n] == '/' || name[n] == '\\'
+            || name[n] == ':' || name[n] == '!') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Directory changes --
+ *
+ *	New entries reuse unused directory slots or extend the directory by
+ *	a sector's worth of entries. Whenever the children of a storage
+ *	change the storage's tree is rebuilt as a balanced tree.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+AllocEntry(Cfb *cfbPtr, CfbSect *idPtr)
+{
+    CfbSect id, n, perSect = cfbPtr->sectorSize / CFB_DIRENT_SIZE;
+
+    for (id = 1; id < cfbPtr->entryCount; id++) {
+        if (cfbPtr->entries[id].type == CFB_TYPE_EMPTY) {
+            *idPtr = id;
+            return CFB_OK;
+        }
+    }
+    if (id + perSect > CFB_MAXREGSECT) {
+        return CFB_ENOSPC;
+    }
+    cfbPtr->entries = (CfbEntry *)ckrealloc((char *)cfbPtr->entries,
+        sizeof(CfbEntry) * (id + perSect));
+    if (cfbPtr->chains) {
+        cfbPtr->chains = (CfbChain **)ckrealloc((char *)cfbPtr->chains,
+            sizeof(CfbChain *) * (id + perSect));
+        memset(cfbPtr->chains + id, 0, sizeof(CfbChain *) * perSect);
+    }
+    for (n = id; n < id + perSect; n++) {
+        CfbEntry *entryPtr = &cfbPtr->entries[n];
+        memset(entryPtr, 0, sizeof(CfbEntry));
+        entryPtr->type = CFB_TYPE_EMPTY;
+        entryPtr->left = entryPtr->right = CFB_NOSTREAM;
+        entryPtr->child = CFB_NOSTREAM;
+    }
+    cfbPtr->entryCount = id + perSect;
+    *idPtr = id;
+    return CFB_OK;
+}
+
+static int
+Relink(Cfb *cfbPtr, CfbSect parent, CfbSect add, CfbSect remove)
+{
+    CfbSect *ids, *list, count, n, k = 0;
+    int r;
+
+    r = CfbListChildren(cfbPtr, parent, &ids, &count);
+    if (r != CFB_OK) {
+        return r;
+    }
+    list = (CfbSect *)ckalloc(sizeof(CfbSect) * (count + 1));
+    for (n = 0; n < count; n++) {
+        if (ids[n] != remove) {
+            list[k++] = ids[n];
+        }
+    }
+    if (add != CFB_NOSTREAM) {
+        list[k++] = add;
+    }
+    cfbPtr->entries[parent].child =
+        CfbLinkChildren(cfbPtr->entries, list, k);
+    ckfree((char *)list);
+    ckfree((char *)ids);
+    cfbPtr->modified = 1;
+    return CFB_OK;
+}
+
+static void
+DestroyEntry(Cfb *cfbPtr, CfbSect id)
+{
+    CfbEntry *entryPtr = &cfbPtr->entries[id];
+
+    if (entryPtr->type == CFB_TYPE_STORAGE) {
+        CfbSect *ids, count, n;
+        if (CfbListChildren(cfbPtr, id, &ids, &count) == CFB_OK) {
+            for (n = 0; n < count; n++) {
+                DestroyEntry(cfbPtr, ids[n]);
+            }
+            ckfree((char *)ids);
+        }
+    } else if (entryPtr->type == CFB_TYPE_STREAM) {
+        ResizeStream(cfbPtr, id, 0);
+    }
+    InvalidateChain(cfbPtr, id);
+    entryPtr = &cfbPtr->entries[id];
+    memset(entryPtr, 0, sizeof(CfbEntry));
+    entryPtr->type = CFB_TYPE_EMPTY;
+    entryPtr->left = entryPtr->right = CFB_NOSTREAM;
+    entryPtr->child = CFB_NOSTREAM;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbCreateEntry, CfbRemoveEntry, CfbRenameEntry --
+ *
+ *	Add, delete or rename an item contained in a storage. Removing a
+ *	storage removes everything it contains.
+ *
+ * Results:
+ *	A CFB status code. CfbCreateEntry stores the new id in idPtr.
+ *
+ * Side effects:
+ *	The working directory is modified.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbCreateEntry(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *nameObj, int type,
+    CfbSect *idPtr)
+{
+    unsigned short name[CFB_NAME_MAX + 1];
+    CfbEntry *entryPtr;
+    CfbSect id;
+    int len, r;
+
+    if (!cfbPtr->writable) {
+        return CFB_EACCES;
+    }
+    if (!CfbNameFromObj(nameObj, name, &len) || !CfbValidName(name, len)) {
+        return CFB_EINVAL;
+    }
+    r = CfbFindChild(cfbPtr, parent, nameObj, &id);
+    if (r != CFB_ENOENT) {
+        return (r == CFB_OK) ? CFB_EEXIST : r;
+    }
+    r = AllocEntry(cfbPtr, &id);
+    if (r != CFB_OK) {
+        return r;
+    }
+    entryPtr = &cfbPtr->entries[id];
+    memcpy(entryPtr->name, name, sizeof(unsigned short) * len);
+    entryPtr->nameLen = len;
+    entryPtr->type = type;
+    entryPtr->color = CFB_BLACK;
+    entryPtr->start = CFB_ENDOFCHAIN;
+    entryPtr->size = 0;
+    entryPtr->ctime = entryPtr->mtime = CfbFileTimeNow();
+    r = Relink(cfbPtr, parent, id, CFB_NOSTREAM);
+    if (r != CFB_OK) {
+        entryPtr->type = CFB_TYPE_EMPTY;
+        return r;
+    }
+    *idPtr = id;
+    return CFB_OK;
+}
+
+int
+CfbRemoveEntry(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *nameObj)
+{
+    CfbSect id;
+    int r;
+
+    if (!cfbPtr->writable) {
+        return CFB_EACCES;
+    }
+    r = CfbFindChild(cfbPtr, parent, nameObj, &id);
+    if (r == CFB_OK) {
+        r = Relink(cfbPtr, parent, CFB_NOSTREAM, id);
+    }
+    if (r == CFB_OK) {
+        DestroyEntry(cfbPtr, id);
+    }
+    return r;
+}
+
+int
+CfbRenameEntry(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *oldObj, Tcl_Obj *newObj)
+{
+    unsigned short name[CFB_NAME_MAX + 1];
+    CfbSect id, other;
+    int len, r;
+
+    if (!cfbPtr->writable) {
+        return CFB_EACCES;
+    }
+    r = CfbFindChild(cfbPtr, parent, oldObj, &id);
+    if (r != CFB_OK) {
+        return r;
+    }
+    if (!CfbNameFromObj(newObj, name, &len) || !CfbValidName(name, len)) {
+        return CFB_EINVAL;
+    }
+    r = CfbFindChild(cfbPtr, parent, newObj, &other);
+    if (r == CFB_OK && other != id) {
+        return CFB_EEXIST;
+    } else if (r != CFB_OK && r != CFB_ENOENT) {
+        return r;
+    }
+    memcpy(cfbPtr->entries[id].name, name, sizeof(unsigned short) * len);
+    cfbPtr->entries[id].nameLen = len;
+    return Relink(cfbPtr, parent, CFB_NOSTREAM, CFB_NOSTREAM);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Relocate --
+ *
+ *	Move every modified sector that belongs to the committed image to
+ *	a free sector. The chain or directory entry that refers to each
+ *	moved sector is updated to match.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The working FAT, the directory and the dirty table are modified and
+ *	all cached extents are discarded.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+Relocate(Cfb *cfbPtr)
+{
+    Tcl_HashTable owners;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+    CfbSect *moves, *prev, count = 0, n, id;
+    unsigned char *moving;
+    int isNew, r = CFB_OK;
+
+    moves = (CfbSect *)ckalloc(sizeof(CfbSect)
+        * (cfbPtr->dirty.numEntries + 1));
+    for (hPtr = Tcl_FirstHashEntry(&cfbPtr->dirty, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        CfbSect sect = (CfbSect)(size_t)Tcl_GetHashKey(&cfbPtr->dirty, hPtr);
+        if (sect < cfbPtr->sectorCount && cfbPtr->pinned[sect]) {
+            moves[count++] = sect;
+        }
+    }
+    if (count == 0) {
+        ckfree((char *)moves);
+        return CFB_OK;
+    }
+
+    /*
+     * Find the predecessor of each sector to be moved. The first sector
+     * of a chain is referred to by a directory entry instead.
+     */
+
+    moving = (unsigned char *)ckalloc(cfbPtr->sectorCount);
+    prev = (CfbSect *)ckalloc(sizeof(CfbSect) * cfbPtr->sectorCount);
+    memset(moving, 0, cfbPtr->sectorCount);
+    for (n = 0; n < count; n++) {
+        moving[moves[n]] = 1;
+        prev[moves[n]] = CFB_NOSTREAM;
+    }
+    for (n = 0; n < cfbPtr->fatLen; n++) {
+        CfbSect next = cfbPtr->fat[n];
+        if (next < cfbPtr->sectorCount && moving[next]) {
+            prev[next] = n;
+        }
+    }
+    Tcl_InitHashTable(&owners, TCL_ONE_WORD_KEYS);
+    for (id = 0; id < cfbPtr->entryCount; id++) {
+        CfbEntry *entryPtr = &cfbPtr->entries[id];
+        if ((entryPtr->type == CFB_TYPE_ROOT
+             || (entryPtr->type == CFB_TYPE_STREAM
+                 && entryPtr->size >= cfbPtr->miniCutoff))
+            && entryPtr->start < cfbPtr->sectorCount
+            && moving[entryPtr->start]) {
+            hPtr = Tcl_CreateHashEntry(&owners,
+                (char *)(size_t)entryPtr->start, &isNew);
+            Tcl_SetHashValue(hPtr, (ClientData)(size_t)id);
+        }
+    }
+
+    for (n = 0; r == CFB_OK && n < count; n++) {
+        CfbSect sect = moves[n], dest = cfbPtr->allocHint, next;
+        void *buffer;
+
+        while (dest < cfbPtr->fatLen && !SectorFree(cfbPtr, dest)) {
+            dest++;
+        }
+        if (dest > CFB_MAXREGSECT) {
+            r = CFB_ENOSPC;
+            break;
+        }
+        GrowFat(cfbPtr, dest + 1);
+        cfbPtr->allocHint = dest + 1;
+        next = cfbPtr->fat[sect];
+        cfbPtr->fat[dest] = next;
+        cfbPtr->fat[sect] = CFB_FREESECT;
+        if (next < cfbPtr->sectorCount && moving[next]) {
+            prev[next] = dest;
+        }
+        if (prev[sect] != CFB_NOSTREAM) {
+            cfbPtr->fat[prev[sect]] = dest;
+        } else {
+            hPtr = Tcl_FindHashEntry(&owners, (char *)(size_t)sect);
+            if (hPtr) {
+                id = (CfbSect)(size_t)Tcl_GetHashValue(hPtr);
+                cfbPtr->entries[id].start = dest;
+            }
+        }
+        hPtr = Tcl_FindHashEntry(&cfbPtr->dirty, (char *)(size_t)sect);
+        buffer = Tcl_GetHashValue(hPtr);
+        Tcl_DeleteHashEntry(hPtr);
+        hPtr = Tcl_CreateHashEntry(&cfbPtr->dirty, (char *)(size_t)dest,
+            &isNew);
+        Tcl_SetHashValue(hPtr, buffer);
+    }
+
+    Tcl_DeleteHashTable(&owners);
+    ckfree((char *)prev);
+    ckfree((char *)moving);
+    ckfree((char *)moves);
+
+    /*
+     * The mini stream may have moved.
+     */
+
+    ckfree((char *)cfbPtr->miniSects);
+    cfbPtr->miniSects = NULL;
+    cfbPtr->miniSectCount = 0;
+    if (r == CFB_OK) {
+        r = LoadChain(cfbPtr, cfbPtr->entries[0].start,
+            &cfbPtr->miniSects, &cfbPtr->miniSectCount);
+    }
+    for (id = 0; id < cfbPtr->entryCount; id++) {
+        if (cfbPtr->chains && cfbPtr->chains[id]) {
+            InvalidateChain(cfbPtr, id);
+        }
+    }
+    cfbPtr->generation++;
+    return r;
+}
+
+/*
+ * Find the first run of sectors that is free in both the working FAT and
+ * the committed image.
+ */
+
+static CfbSect
+FindFreeRun(Cfb *cfbPtr, CfbSect count)
+{
+    CfbSect start = 0, sect;
+
+    for (sect = 0; sect - start < count; sect++) {
+        if (sect < cfbPtr->fatLen && !SectorFree(cfbPtr, sect)) {
+            start = sect + 1;
+        }
+    }
+    return start;
+}
+
+static int
+CompareSects(const void *p1, const void *p2)
+{
+    CfbSect s1 = *(const CfbSect *)p1, s2 = *(const CfbSect *)p2;
+    return (s1 < s2) ? -1 : (s1 > s2);
+}
+
+/*
+ * Write all the modified sectors in sector order. Adjacent sectors are
+ * collected into a single write.
+ */
+
+static int
+WriteDirty(Cfb *cfbPtr)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+    CfbSect *sects, count = 0, n, first = 0, run = 0, runMax = 64;
+    unsigned char *buffer;
+    int r = CFB_OK;
+
+    sects = (CfbSect *)ckalloc(sizeof(CfbSect)
+        * (cfbPtr->dirty.numEntries + 1));
+    for (hPtr = Tcl_FirstHashEntry(&cfbPtr->dirty, &search); hPtr != NULL;
+         hPtr = Tcl_NextHashEntry(&search)) {
+        sects[count++] = (CfbSect)(size_t)Tcl_GetHashKey(&cfbPtr->dirty, hPtr);
+    }
+    qsort(sects, count, sizeof(CfbSect), CompareSects);
+
+    buffer = (unsigned char *)ckalloc(cfbPtr->sectorSize * runMax);
+    for (n = 0; r == CFB_OK && n <= count; n++) {
+        if (run > 0 && (n == count || run == runMax
+                        || sects[n] != first + run)) {
+            r = WriteImage(cfbPtr,
+                ((Tcl_WideUInt)first + 1) << cfbPtr->sectorShift,
+                buffer, (size_t)run << cfbPtr->sectorShift);
+            run = 0;
+        }
+        if (n < count) {
+            hPtr = Tcl_FindHashEntry(&cfbPtr->dirty, (char *)(size_t)sects[n]);
+            if (run == 0) {
+                first = sects[n];
+            }
+            memcpy(buffer + ((size_t)run << cfbPtr->sectorShift),
+                Tcl_GetHashValue(hPtr), cfbPtr->sectorSize);
+            run++;
+        }
+    }
+    ckfree((char *)buffer);
+    ckfree((char *)sects);
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbCommit --
+ *
+ *	Write the changes made to a compound file. Modified sectors that
+ *	belong to the committed image are first moved to free sectors.
+ *	The modified sectors are then written in sector order followed by
+ *	new copies of the directory, MiniFAT, FAT and DIFAT placed in free
+ *	sectors. Once these are on disk the header is replaced to switch
+ *	to the new image. A failure before then leaves the file as it was.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The file is written and mapped again. Sectors only used by the old
+ *	image become free.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbCommit(Cfb *cfbPtr)
+{
+    CfbSect perSect = cfbPtr->sectorSize >> 2;
+    CfbSect perDir = cfbPtr->sectorSize / CFB_DIRENT_SIZE;
+    CfbSect dirCount, miniFatCount, fatCount = 0, difatCount = 0;
+    CfbSect start, total, used, tail, fatStart, n;
+    unsigned char *buffer, *p, header[CFB_HEADER_SIZE];
+    CfbSect *fat;
+    CfbHeader hdr;
+    int r;
+
+    if (!cfbPtr->writable || !cfbPtr->modified) {
+        return CFB_OK;
+    }
+
+    /*
+     * The committed tables are replaced so their sectors will be free
+     * once the header has been written.
+     */
+
+#define RELEASE(sects, sectCount) \
+    for (n = 0; n < (sectCount); n++) { \
+        if ((sects)[n] < cfbPtr->fatLen) \
+            cfbPtr->fat[(sects)[n]] = CFB_FREESECT; \
+    }
+    RELEASE(cfbPtr->fatSects, cfbPtr->fatSectCount);
+    RELEASE(cfbPtr->difatSects, cfbPtr->difatSectCount);
+    RELEASE(cfbPtr->dirSects, cfbPtr->dirSectCount);
+    RELEASE(cfbPtr->miniFatSects, cfbPtr->miniFatSectCount);
+#undef RELEASE
+
+    r = Relocate(cfbPtr);
+    if (r != CFB_OK) {
+        return r;
+    }
+
+    /*
+     * Place the new tables. The FAT must describe every sector in the
+     * file including its own so the layout is repeated until it fits.
+     */
+
+    dirCount = (cfbPtr->entryCount + perDir - 1) / perDir;
+    miniFatCount = (cfbPtr->miniFatLen + perSect - 1) / perSect;
+    used = cfbPtr->fatLen;
+    while (used > 0 && cfbPtr->fat[used - 1] == CFB_FREESECT) {
+        used--;
+    }
+    for (;;) {
+        CfbSect fc, dc;
+        tail = dirCount + miniFatCount + fatCount + difatCount;
+        start = FindFreeRun(cfbPtr, tail);
+        total = (start + tail > used) ? start + tail : used;
+        CfbFatLayout(total - fatCount - difatCount, cfbPtr->sectorShift,
+            &fc, &dc);
+        if (fc <= fatCount && dc <= difatCount) {
+            break;
+        }
+        fatCount = (fc > fatCount) ? fc : fatCount;
+        difatCount = (dc > difatCount) ? dc : difatCount;
+    }
+    if (total > CFB_MAXREGSECT) {
+        return CFB_ENOSPC;
+    }
+    fatStart = start + dirCount + miniFatCount;
+
+    /*
+     * Build the new FAT and the tail of the file.
+     */
+
+    fat = (CfbSect *)ckalloc(sizeof(CfbSect) * fatCount * perSect);
+    for (n = 0; n < fatCount * perSect; n++) {
+        fat[n] = (n < used) ? cfbPtr->fat[n] : CFB_FREESECT;
+    }
+    for (n = 0; n < dirCount + miniFatCount; n++) {
+        fat[start + n] = start + n + 1;
+    }
+    if (dirCount > 0) {
+        fat[start + dirCount - 1] = CFB_ENDOFCHAIN;
+    }
+    if (miniFatCount > 0) {
+        fat[start + dirCount + miniFatCount - 1] = CFB_ENDOFCHAIN;
+    }
+    for (n = 0; n < fatCount; n++) {
+        fat[fatStart + n] = CFB_FATSECT;
+    }
+    for (n = 0; n < difatCount; n++) {
+        fat[fatStart + fatCount + n] = CFB_DIFSECT;
+    }
+
+    buffer = (unsigned char *)ckalloc((size_t)tail << cfbPtr->sectorShift);
+    memset(buffer, 0, (size_t)tail << cfbPtr->sectorShift);
+    if (cfbPtr->miniSectCount == 0) {
+        cfbPtr->entries[0].start = CFB_ENDOFCHAIN;
+        cfbPtr->entries[0].size = 0;
+    }
+    p = buffer;
+    for (n = 0; n < dirCount * perDir; n++, p += CFB_DIRENT_SIZE) {
+        if (n < cfbPtr->entryCount) {
+            CfbPutEntry(p, &cfbPtr->entries[n]);
+        } else {
+            CfbEntry empty;
+            memset(&empty, 0, sizeof(empty));
+            empty.left = empty.right = empty.child = CFB_NOSTREAM;
+            CfbPutEntry(p, &empty);
+        }
+    }
+    for (n = 0; n < miniFatCount * perSect; n++, p += 4) {
+        PUT32(p, (n < cfbPtr->miniFatLen) ? cfbPtr->miniFat[n] : CFB_FREESECT);
+    }
+    for (n = 0; n < fatCount * perSect; n++, p += 4) {
+        PUT32(p, fat[n]);
+    }
+    for (n = 0; n < difatCount; n++) {
+        CfbSect k;
+        for (k = 0; k < perSect - 1; k++, p += 4) {
+            CfbSect index = CFB_HEADER_DIFAT + n * (perSect - 1) + k;
+            PUT32(p, (index < fatCount) ? fatStart + index : CFB_FREESECT);
+        }
+        PUT32(p, (n + 1 < difatCount)
+            ? fatStart + fatCount + n + 1 : CFB_ENDOFCHAIN);
+        p += 4;
+    }
+    ckfree((char *)fat);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = cfbPtr->version;
+    hdr.dirStart = (dirCount > 0) ? start : CFB_ENDOFCHAIN;
+    hdr.dirCount = (cfbPtr->version == 4) ? dirCount : 0;
+    hdr.fatCount = fatCount;
+    hdr.miniFatStart = (miniFatCount > 0)
+        ? start + dirCount : CFB_ENDOFCHAIN;
+    hdr.miniFatCount = miniFatCount;
+    hdr.difatStart = (difatCount > 0)
+        ? fatStart + fatCount : CFB_ENDOFCHAIN;
+    hdr.difatCount = difatCount;
+    for (n = 0; n < CFB_HEADER_DIFAT; n++) {
+        hdr.difat[n] = (n < fatCount) ? fatStart + n : CFB_FREESECT;
+    }
+    CfbPutHeader(header, &hdr);
+
+    /*
+     * Write the data and the tables and make sure they are on disk
+     * before the header is replaced.
+     */
+
+    r = WriteDirty(cfbPtr);
+    if (r == CFB_OK) {
+        r = WriteImage(cfbPtr,
+            ((Tcl_WideUInt)start + 1) << cfbPtr->sectorShift,
+            buffer, (unsigned long)tail << cfbPtr->sectorShift);
+    }
+    ckfree((char *)buffer);
+    if (r == CFB_OK) {
+        r = SyncImage(cfbPtr);
+    }
+    if (r == CFB_OK) {
+        r = WriteImage(cfbPtr, 0, header, CFB_HEADER_SIZE);
+    }
+    if (r == CFB_OK) {
+        r = SyncImage(cfbPtr);
+    }
+    if (r != CFB_OK) {
+        return r;
+    }
+
+    /*
+     * Load the new image. Sectors beyond the last one used are dropped.
+     */
+
+    FreeWork(cfbPtr);
+    FreeTables(cfbPtr);
+    r = ResizeImage(cfbPtr, ((Tcl_WideUInt)total + 1) << cfbPtr->sectorShift);
+    if (r == CFB_OK) {
+        r = LoadTables(cfbPtr);
+    }
+    return Reload(cfbPtr, r);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbRevert --
+ *
+ *	Discard the changes made since the last commit.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The tables are loaded again from the committed image.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbRevert(Cfb *cfbPtr)
+{
+    if (!cfbPtr->writable) {
+        return CFB_OK;
+    }
+    FreeWork(cfbPtr);
+    FreeTables(cfbPtr);
+    return Reload(cfbPtr, LoadTables(cfbPtr));
+}
+
+/*
+ * Start a new set of changes once the tables have been loaded again. If
+ * they could not be loaded the file can no longer be used.
+ */
+
+static int
+Reload(Cfb *cfbPtr, int r)
+{
+    if (r == CFB_OK) {
+        InitWork(cfbPtr);
+    } else {
+        FreeTables(cfbPtr);
+        cfbPtr->writable = 0;
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbCompact --
+ *
+ *	Write a copy of a compound file with every stream held in
+ *	consecutive sectors and no free space. The items of each storage
+ *	are given consecutive directory entries and their data follows
+ *	in the same order. Any outstanding changes are committed first.
+ *	With a NULL path the file itself is replaced by the copy. This
+ *	needs a file opened for writing that is not in use by any other
+ *	storage or stream. The copy is written beside the file and then
+ *	renamed over it so the file is intact if compaction fails.
+ *
+ * Results:
+ *	A CFB status code. The usage of the file and of the copy are
+ *	stored in beforePtr and afterPtr.
+ *
+ * Side effects:
+ *	A new file is written. The copy is always a version 3 file.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbCompact(Cfb *cfbPtr, Tcl_Obj *pathObj, CfbUsage *beforePtr,
+    CfbUsage *afterPtr)
+{
+    CfbBuilder *builderPtr;
+    Tcl_Obj *targetObj;
+    Cfb *copyPtr;
+    int r;
+
+    if (pathObj == NULL) {
+        if (cfbPtr->path == NULL) {
+            return CFB_ENOTSUP;
+        }
+        if (!cfbPtr->writable) {
+            return CFB_EACCES;
+        }
+        if (cfbPtr->refCount > 1) {
+            return CFB_EINUSE;
+        }
+    }
+    r = CfbCommit(cfbPtr);
+    if (r == CFB_OK) {
+        r = CfbGetUsage(cfbPtr, beforePtr);
+    }
+    if (r != CFB_OK) {
+        return r;
+    }
+
+    targetObj = pathObj ? pathObj
+        : Tcl_ObjPrintf("%s.compact", cfbPtr->path);
+    Tcl_IncrRefCount(targetObj);
+    r = CfbBuilderCreate(targetObj, &builderPtr);
+    if (r == CFB_OK) {
+        CfbBuilderIncrRefCount(builderPtr);
+        r = CfbBuilderCopy(builderPtr, cfbPtr);
+        if (r == CFB_OK) {
+            r = CfbBuilderFinish(builderPtr);
+        }
+        CfbBuilderDecrRefCount(builderPtr);
+        if (r != CFB_OK) {
+            Tcl_FSDeleteFile(targetObj);
+        }
+    }
+
+    if (r == CFB_OK && pathObj == NULL) {
+        r = ReplaceFile(cfbPtr, targetObj);
+        if (r == CFB_OK) {
+            r = CfbGetUsage(cfbPtr, afterPtr);
+        }
+    } else if (r == CFB_OK) {
+        r = CfbOpen(targetObj, STGM_READ, 0, &copyPtr);
+        if (r == CFB_OK) {
+            CfbIncrRefCount(copyPtr);
+            r = CfbGetUsage(copyPtr, afterPtr);
+            CfbDecrRefCount(copyPtr);
+        }
+    }
+    Tcl_DecrRefCount(targetObj);
+    return r;
+}
+
+/*
+ * Rename a new image over the file and load it in place of the old one.
+ * If the rename fails the old file is loaded again.
+ */
+
+static int
+ReplaceFile(Cfb *cfbPtr, Tcl_Obj *newObj)
+{
+    Tcl_Obj *pathObj = Tcl_NewStringObj(cfbPtr->path, -1);
+    int r = CFB_OK, code;
+
+    Tcl_IncrRefCount(pathObj);
+    FreeWork(cfbPtr);
+    FreeTables(cfbPtr);
+    UnmapFile(cfbPtr);
+    if (Tcl_FSRenameFile(newObj, pathObj) != TCL_OK) {
+        int err = Tcl_GetErrno();
+        Tcl_FSDeleteFile(newObj);
+        Tcl_SetErrno(err);
+        r = CFB_EIO;
+    }
+    code = MapFile(pathObj, cfbPtr);
+    if (code == CFB_OK) {
+        code = LoadTables(cfbPtr);
+    }
+    Reload(cfbPtr, code);
+    Tcl_DecrRefCount(pathObj);
+    return (r == CFB_OK) ? code : r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbCheck --
+ *
+ *	Check the structure of a compound file without opening it for
+ *	use. The header and DIFAT are checked first as nothing else can
+ *	be found without them. The FAT is then read once in sector order
+ *	to check each value. Every chain is followed once, marking each
+ *	sector reached in a bitmap so that a chain that loops or that
+ *	shares sectors with another is found as soon as it reaches a
+ *	marked sector. The MiniFAT chains are checked the same way. The
+ *	directory trees are walked in order to check the ordering of
+ *	names and each stream size is compared with its chain length.
+ *	Lastly any allocated sector that no chain reached is reported.
+ *
+ * Results:
+ *	A CFB status code. CFB_OK means that the file was read whether
+ *	or not problems were found. Each problem is passed to the
+ *	callback.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbCheck(Tcl_Obj *pathObj, CfbCheckProc *proc, ClientData clientData)
+{
+    Cfb *cfbPtr = NewCfb(STGM_READ);
+    CfbSect dirStart, miniFatStart;
+    CheckState state;
+    int r;
+
+    memset(&state, 0, sizeof(state));
+    state.cfbPtr = cfbPtr;
+    state.proc = proc;
+    state.clientData = clientData;
+
+    r = MapFile(pathObj, cfbPtr);
+    if (r == CFB_EFORMAT) {
+        CheckProblem(&state, "header", CFB_NOSTREAM, "the file is empty");
+        r = CFB_OK;
+    } else if (r == CFB_OK && CheckHeader(&state, &dirStart,
+            &miniFatStart) == CFB_OK) {
+        state.owned = (unsigned char *)ckalloc(
+            BITSET_BYTES(cfbPtr->sectorCount));
+        memset(state.owned, 0, BITSET_BYTES(cfbPtr->sectorCount));
+        CheckFat(&state);
+        if (CheckDirectory(&state, dirStart) == CFB_OK) {
+            CheckMiniStream(&state, miniFatStart);
+            CheckTree(&state);
+            CheckUnused(&state);
+        }
+    }
+
+    if (state.owned) {
+        ckfree((char *)state.owned);
+    }
+    if (state.miniOwned) {
+        ckfree((char *)state.miniOwned);
+    }
+    FreeCfb(cfbPtr);
+    return r;
+}
+
+static void
+CheckProblem(CheckState *statePtr, const char *area, CfbSect item,
+    const char *message)
+{
+    if (!statePtr->stop
+        && statePtr->proc(statePtr->clientData, area, item, message)) {
+        statePtr->stop = 1;
+    }
+}
+
+/*
+ * Check the fixed fields of the header and locate the FAT sectors. The
+ * file cannot be checked further if this fails.
+ */
+
+static int
+CheckHeader(CheckState *statePtr, CfbSect *dirStartPtr,
+    CfbSect *miniFatStartPtr)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    const unsigned char *h = HeaderData(cfbPtr);
+    char msg[100];
+
+    if (cfbPtr->length < CFB_HEADER_SIZE) {
+        CheckProblem(statePtr, "header", CFB_NOSTREAM,
+            "the file is too short");
+        return CFB_EFORMAT;
+    }
+    if (memcmp(h, cfbSignature, sizeof(cfbSignature)) != 0) {
+        CheckProblem(statePtr, "header", CFB_NOSTREAM,
+            "the signature is not valid");
+        return CFB_EFORMAT;
+    }
+    if (GET16(h + 0x1C) != 0xFFFE) {
+        CheckProblem(statePtr, "header", CFB_NOSTREAM,
+            "the byte order mark is not valid");
+        return CFB_EFORMAT;
+    }
+    if (!((GET16(h + 0x1A) == 3 && GET16(h + 0x1E) == 9)
+          || (GET16(h + 0x1A) == 4 && GET16(h + 0x1E) == 12))
+        || GET16(h + 0x20) != 6) {
+        _snprintf(msg, sizeof(msg), "version %u with sector shift %u"
+            " and mini sector shift %u is not supported", GET16(h + 0x1A),
+            GET16(h + 0x1E), GET16(h + 0x20));
+        CheckProblem(statePtr, "header", CFB_NOSTREAM, msg);
+        return CFB_EFORMAT;
+    }
+    if (ParseHeader(cfbPtr, dirStartPtr, miniFatStartPtr) != CFB_OK) {
+        CheckProblem(statePtr, "difat", CFB_NOSTREAM,
+            "the FAT sectors cannot all be located");
+        return CFB_EFORMAT;
+    }
+    if (cfbPtr->miniCutoff != 4096) {
+        _snprintf(msg, sizeof(msg), "the mini stream cutoff is %lu bytes",
+            cfbPtr->miniCutoff);
+        CheckProblem(statePtr, "header", CFB_NOSTREAM, msg);
+    }
+    return CFB_OK;
+}
+
+/*
+ * Check each value in the FAT and that the sectors holding the FAT and
+ * DIFAT are marked as such. These sectors are marked as reached.
+ */
+
+static void
+CheckFat(CheckState *statePtr)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    CfbSect count = cfbPtr->sectorCount, fatCount = 0, difatCount = 0;
+    CfbSect n, next;
+    char msg[80];
+
+    for (n = 0; !statePtr->stop && n < count; n++) {
+        if (NextSector(cfbPtr, n, &next) != CFB_OK) {
+            CheckProblem(statePtr, "fat", n, "the FAT entry cannot be read");
+        } else if (next == CFB_FATSECT) {
+            fatCount++;
+        } else if (next == CFB_DIFSECT) {
+            difatCount++;
+        } else if (next >= count && next != CFB_FREESECT
+                   && next != CFB_ENDOFCHAIN) {
+            _snprintf(msg, sizeof(msg), "the next sector %lu is not valid",
+                (unsigned long)next);
+            CheckProblem(statePtr, "fat", n, msg);
+        }
+    }
+    for (n = 0; !statePtr->stop && n < cfbPtr->fatSectCount; n++) {
+        CheckTable(statePtr, cfbPtr->fatSects[n], CFB_FATSECT, "FAT");
+    }
+    for (n = 0; !statePtr->stop && n < cfbPtr->difatSectCount; n++) {
+        CheckTable(statePtr, cfbPtr->difatSects[n], CFB_DIFSECT, "DIFAT");
+    }
+    if (fatCount != cfbPtr->fatSectCount) {
+        _snprintf(msg, sizeof(msg), "%lu sectors are marked as FAT sectors"
+            " but the header lists %lu", (unsigned long)fatCount,
+            (unsigned long)cfbPtr->fatSectCount);
+        CheckProblem(statePtr, "fat", CFB_NOSTREAM, msg);
+    }
+    if (difatCount != cfbPtr->difatSectCount) {
+        _snprintf(msg, sizeof(msg), "%lu sectors are marked as DIFAT"
+            " sectors but the header lists %lu", (unsigned long)difatCount,
+            (unsigned long)cfbPtr->difatSectCount);
+        CheckProblem(statePtr, "fat", CFB_NOSTREAM, msg);
+    }
+}
+
+static void
+CheckTable(CheckState *statePtr, CfbSect sect, CfbSect mark,
+    const char *what)
+{
+    CfbSect next;
+    char msg[80];
+
+    if (BITSET_TEST(statePtr->owned, sect)) {
+        _snprintf(msg, sizeof(msg), "the %s sector is already in use", what);
+        CheckProblem(statePtr, "fat", sect, msg);
+        return;
+    }
+    BITSET_SET(statePtr->owned, sect);
+    if (NextSector(statePtr->cfbPtr, sect, &next) == CFB_OK
+        && next != mark) {
+        _snprintf(msg, sizeof(msg), "the %s sector is not marked as one",
+            what);
+        CheckProblem(statePtr, "fat", sect, msg);
+    }
+}
+
+/*
+ * Follow a FAT or MiniFAT chain marking each sector reached. The chain
+ * ends at the first sector that is not valid or is already marked.
+ * Sectors are collected if sectsPtrPtr is not NULL.
+ */
+
+static CfbSect
+CheckChain(CheckState *statePtr, int mini, CfbSect start, const char *area,
+    CfbSect item, const char *what, CfbSect **sectsPtrPtr)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    unsigned char *owned = mini ? statePtr->miniOwned : statePtr->owned;
+    CfbSect limit = mini ? statePtr->miniCount : cfbPtr->sectorCount;
+    CfbSect sect = start, next, length = 0, space = 0, *sects = NULL;
+    char msg[200];
+
+    msg[0] = 0;
+    while (sect != CFB_ENDOFCHAIN) {
+        if (sect >= limit) {
+            _snprintf(msg, sizeof(msg), "%s refers to %ssector %lu beyond"
+                " the end of the %s", what, mini ? "mini " : "",
+                (unsigned long)sect, mini ? "mini stream" : "file");
+            break;
+        }
+        if (BITSET_TEST(owned, sect)) {
+            _snprintf(msg, sizeof(msg), "%s reaches %ssector %lu which is"
+                " already in use", what, mini ? "mini " : "",
+                (unsigned long)sect);
+            break;
+        }
+        BITSET_SET(owned, sect);
+        if (sectsPtrPtr) {
+            if (length == space) {
+                space = space ? space * 2 : 16;
+                sects = (CfbSect *)ckrealloc((char *)sects,
+                    sizeof(CfbSect) * space);
+            }
+            sects[length] = sect;
+        }
+        length++;
+        if ((mini ? NextMiniSector(cfbPtr, sect, &next)
+                : NextSector(cfbPtr, sect, &next)) != CFB_OK) {
+            _snprintf(msg, sizeof(msg), "%s reaches %ssector %lu which has"
+                " no %s entry", what, mini ? "mini " : "",
+                (unsigned long)sect, mini ? "MiniFAT" : "FAT");
+            break;
+        }
+        if (next == CFB_FREESECT || next == CFB_FATSECT
+            || next == CFB_DIFSECT) {
+            _snprintf(msg, sizeof(msg), "%s is not terminated at %ssector"
+                " %lu", what, mini ? "mini " : "", (unsigned long)sect);
+            break;
+        }
+        sect = next;
+    }
+    if (msg[0]) {
+        CheckProblem(statePtr, area, item, msg);
+    }
+    if (sectsPtrPtr) {
+        *sectsPtrPtr = sects;
+    }
+    return length;
+}
+
+/*
+ * Read the directory. Entries are parsed as when the file is opened
+ * but the raw type and name length are checked first.
+ */
+
+static int
+CheckDirectory(CheckState *statePtr, CfbSect start)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    unsigned long perSect = cfbPtr->sectorSize / CFB_DIRENT_SIZE, avail, i;
+    CfbSect count, n, id = 0;
+    char msg[80];
+
+    count = CheckChain(statePtr, 0, start, "directory", CFB_NOSTREAM,
+        "the directory", &cfbPtr->dirSects);
+    cfbPtr->dirSectCount = count;
+    if (count == 0) {
+        CheckProblem(statePtr, "directory", CFB_NOSTREAM,
+            "the directory is empty");
+        return CFB_EFORMAT;
+    }
+    cfbPtr->entryCount = count * perSect;
+    cfbPtr->entries = (CfbEntry *)ckalloc(sizeof(CfbEntry)
+        * cfbPtr->entryCount);
+    for (n = 0; n < count; n++) {
+        const unsigned char *p = SectorData(cfbPtr, cfbPtr->dirSects[n],
+            &avail);
+        for (i = 0; i < perSect; i++, id++) {
+            const unsigned char *q = p + i * CFB_DIRENT_SIZE;
+            unsigned int cb;
+            if (p == NULL || avail < cfbPtr->sectorSize) {
+                memset(&cfbPtr->entries[id], 0, sizeof(CfbEntry));
+                continue;
+            }
+            ParseEntry(cfbPtr, q, &cfbPtr->entries[id]);
+            if (q[0x42] == CFB_TYPE_EMPTY) {
+                continue;
+            }
+            cb = GET16(q + 0x40);
+            if (q[0x42] != CFB_TYPE_STORAGE && q[0x42] != CFB_TYPE_STREAM
+                && q[0x42] != CFB_TYPE_ROOT) {
+                _snprintf(msg, sizeof(msg), "the entry type %u is not"
+                    " valid", q[0x42]);
+                CheckProblem(statePtr, "directory", id, msg);
+            } else if (cb < 4 || cb > 2 * (CFB_NAME_MAX + 1) || (cb & 1)) {
+                _snprintf(msg, sizeof(msg), "the name length %u is not"
+                    " valid", cb);
+                CheckProblem(statePtr, "directory", id, msg);
+            } else if ((q[0x42] == CFB_TYPE_ROOT) != (id == 0)) {
+                CheckProblem(statePtr, "directory", id, (id == 0)
+                    ? "the first entry is not the root"
+                    : "the entry is marked as the root");
+            }
+        }
+    }
+    if (cfbPtr->entries[0].type != CFB_TYPE_ROOT) {
+        return CFB_EFORMAT;
+    }
+    return CFB_OK;
+}
+
+/*
+ * Check the chains of the MiniFAT and the mini stream. The tables are
+ * kept so that the mini streams can be followed.
+ */
+
+static void
+CheckMiniStream(CheckState *statePtr, CfbSect miniFatStart)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    const CfbEntry *rootPtr = &cfbPtr->entries[0];
+    const unsigned char *h = HeaderData(cfbPtr);
+    Tcl_WideUInt need;
+    char msg[100];
+
+    cfbPtr->miniFatSectCount = CheckChain(statePtr, 0, miniFatStart,
+        "minifat", CFB_NOSTREAM, "the MiniFAT", &cfbPtr->miniFatSects);
+    if (cfbPtr->miniFatSectCount != GET32(h + 0x40)) {
+        _snprintf(msg, sizeof(msg), "the MiniFAT has %lu sectors but the"
+            " header gives %lu", (unsigned long)cfbPtr->miniFatSectCount,
+            (unsigned long)GET32(h + 0x40));
+        CheckProblem(statePtr, "minifat", CFB_NOSTREAM, msg);
+    }
+    cfbPtr->miniSectCount = CheckChain(statePtr, 0, rootPtr->start,
+        "directory", 0, "the mini stream", &cfbPtr->miniSects);
+    need = (rootPtr->size + cfbPtr->sectorSize - 1) >> cfbPtr->sectorShift;
+    if (need > cfbPtr->miniSectCount) {
+        _snprintf(msg, sizeof(msg), "the mini stream of %" TCL_LL_MODIFIER
+            "u bytes is held in %lu sectors", rootPtr->size,
+            (unsigned long)cfbPtr->miniSectCount);
+        CheckProblem(statePtr, "directory", 0, msg);
+    }
+    statePtr->miniCount = cfbPtr->miniSectCount
+        << (cfbPtr->sectorShift - cfbPtr->miniSectorShift);
+    statePtr->miniOwned = (unsigned char *)ckalloc(
+        BITSET_BYTES(statePtr->miniCount));
+    memset(statePtr->miniOwned, 0, BITSET_BYTES(statePtr->miniCount));
+}
+
+/*
+ * Walk the tree of every storage in order. Each entry may be linked
+ * once and the names within a storage must be in increasing order. The
+ * chain of each stream is checked against its size.
+ */
+
+static void
+CheckTree(CheckState *statePtr)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    CfbSect count = cfbPtr->entryCount, *stack, *storages;
+    CfbSect top, storageCount = 0, n;
+    unsigned char *seen;
+    char msg[100];
+
+    seen = (unsigned char *)ckalloc(BITSET_BYTES(count));
+    memset(seen, 0, BITSET_BYTES(count));
+    stack = (CfbSect *)ckalloc(sizeof(CfbSect) * (count + 1));
+    storages = (CfbSect *)ckalloc(sizeof(CfbSect) * (count + 1));
+    BITSET_SET(seen, 0);
+    storages[storageCount++] = 0;
+
+    for (n = 0; !statePtr->stop && n < storageCount; n++) {
+        CfbSect parent = storages[n], id = cfbPtr->entries[parent].child;
+        const CfbEntry *prevPtr = NULL;
+        int ordered = 1;
+
+        top = 0;
+        for (;;) {
+            while (id != CFB_NOSTREAM) {
+                if (id >= count) {
+                    _snprintf(msg, sizeof(msg), "the storage refers to"
+                        " entry %lu beyond the directory", (unsigned long)id);
+                    CheckProblem(statePtr, "directory", parent, msg);
+                    break;
+                }
+                if (BITSET_TEST(seen, id)) {
+                    CheckProblem(statePtr, "directory", id,
+                        "the entry is linked more than once");
+                    break;
+                }
+                BITSET_SET(seen, id);
+                stack[top++] = id;
+                id = cfbPtr->entries[id].left;
+            }
+            if (top == 0 || statePtr->stop) {
+                break;
+            }
+            id = stack[--top];
+            if (cfbPtr->entries[id].type != CFB_TYPE_STORAGE
+                && cfbPtr->entries[id].type != CFB_TYPE_STREAM) {
+                CheckProblem(statePtr, "directory", id,
+                    "an unused entry is linked into a storage");
+            } else {
+                const CfbEntry *entryPtr = &cfbPtr->entries[id];
+                if (ordered && prevPtr && CfbCompareNames(prevPtr->name,
+                        prevPtr->nameLen, entryPtr->name,
+                        entryPtr->nameLen) >= 0) {
+                    CheckProblem(statePtr, "directory", parent,
+                        "the items of the storage are not in order");
+                    ordered = 0;
+                }
+                prevPtr = entryPtr;
+                if (entryPtr->type == CFB_TYPE_STORAGE) {
+                    storages[storageCount++] = id;
+                } else {
+                    CheckStream(statePtr, id);
+                }
+            }
+            id = cfbPtr->entries[id].right;
+        }
+    }
+    for (n = 1; !statePtr->stop && n < count; n++) {
+        if (cfbPtr->entries[n].type != CFB_TYPE_EMPTY && !BITSET_TEST(seen, n)) {
+            CheckProblem(statePtr, "directory", n,
+                "the entry is not linked into any storage");
+        }
+    }
+    ckfree((char *)storages);
+    ckfree((char *)stack);
+    ckfree((char *)seen);
+}
+
+static void
+CheckStream(CheckState *statePtr, CfbSect id)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    const CfbEntry *entryPtr = &cfbPtr->entries[id];
+    int mini = (entryPtr->size < cfbPtr->miniCutoff);
+    int shift = mini ? cfbPtr->miniSectorShift : cfbPtr->sectorShift;
+    Tcl_WideUInt need;
+    Tcl_Obj *nameObj;
+    char what[120], msg[200];
+    CfbSect length;
+
+    if (entryPtr->size == 0) {
+        return;
+    }
+    nameObj = CfbNameObj(entryPtr);
+    Tcl_IncrRefCount(nameObj);
+    _snprintf(what, sizeof(what), "stream \"%.96s\"", Tcl_GetString(nameObj));
+    Tcl_DecrRefCount(nameObj);
+
+    length = CheckChain(statePtr, mini, entryPtr->start, "stream", id,
+        what, NULL);
+    need = (entryPtr->size + (1U << shift) - 1) >> shift;
+    if (need != length) {
+        _snprintf(msg, sizeof(msg), "%s of %" TCL_LL_MODIFIER "u bytes"
+            " needs %" TCL_LL_MODIFIER "u %ssectors but its chain has %lu",
+            what, entryPtr->size, need, mini ? "mini " : "",
+            (unsigned long)length);
+        CheckProblem(statePtr, "stream", id, msg);
+    }
+}
+
+/*
+ * Report sectors and mini sectors that are allocated but that were not
+ * reached by any chain.
+ */
+
+static void
+CheckUnused(CheckState *statePtr)
+{
+    Cfb *cfbPtr = statePtr->cfbPtr;
+    CfbSect n, next, lost = 0, first = CFB_NOSTREAM;
+    char msg[80];
+
+    for (n = 0; n < cfbPtr->sectorCount; n++) {
+        if (!BITSET_TEST(statePtr->owned, n)
+            && NextSector(cfbPtr, n, &next) == CFB_OK
+            && next != CFB_FREESECT) {
+            if (lost++ == 0) {
+                first = n;
+            }
+        }
+    }
+    if (lost > 0) {
+        _snprintf(msg, sizeof(msg), "%lu sectors are allocated but not"
+            " used", (unsigned long)lost);
+        CheckProblem(statePtr, "fat", first, msg);
+    }
+    for (n = 0, lost = 0; n < statePtr->miniCount; n++) {
+        if (!BITSET_TEST(statePtr->miniOwned, n)
+            && NextMiniSector(cfbPtr, n, &next) == CFB_OK
+            && next != CFB_FREESECT) {
+            if (lost++ == 0) {
+                first = n;
+            }
+        }
+    }
+    if (lost > 0) {
+        _snprintf(msg, sizeof(msg), "%lu mini sectors are allocated but not"
+            " used", (unsigned long)lost);
+        CheckProblem(statePtr, "minifat", first, msg);
+    }
+}
+
+/* ----------------------------------------------------------------------
+ *
+ * Local variables:
+ * mode: c
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,521 @@
+/* cfb.h - Native compound file support.
+ *
+ * Declarations for the native implementation of the Microsoft compound
+ * file binary format (MS-CFB). This is used where OLE is not available
+ * and reads the file directly from a memory mapped image.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * @(#) $Id$
+ */
+
+#ifndef _CFB_H_INCLUDE
+#define _CFB_H_INCLUDE
+
+typedef unsigned int CfbSect;   /* sector number or directory entry id */
+
+#define CFB_MAXREGSECT   0xFFFFFFFAU
+#define CFB_DIFSECT      0xFFFFFFFCU
+#define CFB_FATSECT      0xFFFFFFFDU
+#define CFB_ENDOFCHAIN   0xFFFFFFFEU
+#define CFB_FREESECT     0xFFFFFFFFU
+#define CFB_NOSTREAM     0xFFFFFFFFU
+
+#define CFB_TYPE_EMPTY   0
+#define CFB_TYPE_STORAGE 1
+#define CFB_TYPE_STREAM  2
+#define CFB_TYPE_ROOT    5
+
+#define CFB_RED          0      /* directory entry colors */
+#define CFB_BLACK        1
+
+#define CFB_HEADER_SIZE  512
+#define CFB_DIRENT_SIZE  128
+#define CFB_NAME_MAX     31     /* UTF-16 units, excluding the terminator */
+
+/*
+ * Status codes returned by the Cfb functions. CfbError converts these
+ * into a message in the same style as Win32Error.
+ */
+
+#define CFB_OK           0
+#define CFB_ENOENT       1      /* no such stream or storage */
+#define CFB_EACCES       2      /* access denied */
+#define CFB_EFORMAT      3      /* not a valid compound file */
+#define CFB_EIO          4      /* system error - see Tcl_GetErrno */
+#define CFB_ENOTSUP      5      /* operation not supported */
+#define CFB_EINVAL       6      /* invalid name */
+#define CFB_EEXIST       7      /* an item of that name already exists */
+#define CFB_EBUSY        8      /* another stream is being written */
+#define CFB_ENOSPC       9      /* the file has reached its maximum size */
+#define CFB_EINUSE       10     /* the file is open by other storages */
+
+/*
+ * All values in a compound file are little-endian.
+ */
+
+#define GET16(p) ((unsigned int)(p)[0] | ((unsigned int)(p)[1] << 8))
+#define GET32(p) ((CfbSect)(p)[0] | ((CfbSect)(p)[1] << 8) \
+                  | ((CfbSect)(p)[2] << 16) | ((CfbSect)(p)[3] << 24))
+#define GET64(p) ((Tcl_WideUInt)GET32(p) | ((Tcl_WideUInt)GET32((p)+4) << 32))
+
+#define PUT16(p, v) ((p)[0] = (unsigned char)(v), \
+                     (p)[1] = (unsigned char)((v) >> 8))
+#define PUT32(p, v) (PUT16((p), (v)), PUT16((p)+2, (CfbSect)(v) >> 16))
+#define PUT64(p, v) (PUT32((p), (CfbSect)(v)), \
+                     PUT32((p)+4, (CfbSect)((Tcl_WideUInt)(v) >> 32)))
+
+extern const unsigned char cfbSignature[8];
+
+/*
+ * A parsed directory entry.
+ */
+
+typedef struct CfbEntry {
+    unsigned short name[CFB_NAME_MAX + 1]; /* UTF-16 name */
+    int            nameLen;     /* name length in UTF-16 units */
+    int            type;        /* one of the CFB_TYPE_* values */
+    int            color;       /* red-black tree node color */
+    CfbSect        left;        /* left sibling entry id */
+    CfbSect        right;       /* right sibling entry id */
+    CfbSect        child;       /* root of the child tree for storages */
+    unsigned char  clsid[16];
+    unsigned long  stateBits;
+    Tcl_WideUInt   ctime;       /* creation time as a FILETIME value */
+    Tcl_WideUInt   mtime;       /* modification time as a FILETIME value */
+    CfbSect        start;       /* first sector of the stream */
+    Tcl_WideUInt   size;        /* stream size in bytes */
+} CfbEntry;
+
+/*
+ * The values written into a file header. The DIFAT array holds the
+ * location of the first 109 FAT sectors.
+ */
+
+#define CFB_HEADER_DIFAT 109
+
+typedef struct CfbHeader {
+    int            version;
+    CfbSect        dirStart;
+    CfbSect        dirCount;    /* directory sectors, 0 for version 3 */
+    CfbSect        fatCount;
+    CfbSect        miniFatStart;
+    CfbSect        miniFatCount;
+    CfbSect        difatStart;
+    CfbSect        difatCount;
+    CfbSect        difat[CFB_HEADER_DIFAT];
+} CfbHeader;
+
+/*
+ * The sector chain of a stream resolved into runs of consecutive sectors.
+ * The extents are sorted by stream position so that the sector holding
+ * any offset is found with a binary search.
+ */
+
+typedef struct CfbExtent {
+    CfbSect        start;       /* first sector of the run */
+    CfbSect        count;       /* number of consecutive sectors */
+    Tcl_WideUInt   pos;         /* index of the first sector in the stream */
+} CfbExtent;
+
+typedef struct CfbChain {
+    int            mini;        /* sectors are in the mini stream */
+    CfbExtent     *extents;
+    CfbSect        extentCount;
+    CfbSect        extentSpace;
+} CfbChain;
+
+/*
+ * An open compound file. The file is mapped into memory and the sector
+ * tables needed to locate data are resolved when the file is opened.
+ * A file that is not mapped is read through a cache of sectors instead.
+ * The structure is reference counted and is shared by every storage
+ * command and stream channel opened on the file.
+ */
+
+typedef struct CfbCache CfbCache;
+
+typedef struct Cfb {
+    int            refCount;
+    int            shared;      /* may be used by more than one thread */
+    Tcl_Mutex      lock;        /* guards refCount and chains if shared */
+    int            mode;        /* STGM flags used to open the file */
+    unsigned char *base;        /* the mapped file image */
+    Tcl_WideUInt   length;      /* length of the mapped image */
+    int            inMemory;    /* the image is held in an arena */
+    char          *path;        /* the mapped file or NULL */
+    Tcl_WideUInt   arenaSpace;  /* allocated size of the arena */
+    Tcl_WideUInt   cacheSize;   /* bytes of sectors to cache, 0 to map */
+    CfbCache      *cachePtr;    /* sector cache if the file is not mapped */
+#ifdef _WIN32
+    HANDLE         hFile;
+    HANDLE         hMapping;
+#else
+    int            fd;
+#endif
+    int            version;     /* major version: 3 or 4 */
+    int            sectorShift;
+    unsigned long  sectorSize;
+    int            miniSectorShift;
+    unsigned long  miniSectorSize;
+    unsigned long  miniCutoff;  /* streams smaller than this are mini */
+    CfbSect        sectorCount; /* number of sectors in the image */
+    CfbSect       *fatSects;    /* location of each FAT sector */
+    CfbSect        fatSectCount;
+    CfbSect       *miniFatSects; /* location of each MiniFAT sector */
+    CfbSect        miniFatSectCount;
+    CfbSect       *miniSects;   /* sectors holding the mini stream */
+    CfbSect        miniSectCount;
+    CfbSect       *difatSects;  /* location of each DIFAT sector */
+    CfbSect        difatSectCount;
+    CfbSect       *dirSects;    /* sectors holding the directory */
+    CfbSect        dirSectCount;
+    CfbEntry      *entries;     /* the directory */
+    CfbSect        entryCount;
+    CfbChain     **chains;      /* stream extents, built on first use */
+    unsigned long  generation;  /* changed when any chain or size changes */
+
+    /*
+     * Uncommitted changes of a file opened for writing. Modified sectors
+     * are held in memory. When the changes are committed any modified
+     * sector that belongs to the committed image is moved to a free
+     * sector so the image remains intact until the header is replaced.
+     */
+
+    int            writable;
+    int            modified;    /* there are uncommitted changes */
+    CfbSect       *fat;         /* working copy of the FAT */
+    CfbSect        fatLen;      /* sectors described by the working FAT */
+    CfbSect        fatSpace;
+    CfbSect       *miniFat;     /* working copy of the MiniFAT */
+    CfbSect        miniFatLen;
+    CfbSect        miniFatSpace;
+    unsigned char *pinned;      /* sectors used by the committed image */
+    CfbSect        allocHint;   /* no free sectors below this one */
+    CfbSect        miniAllocHint;
+    Tcl_HashTable  dirty;       /* modified sector buffers keyed by sector */
+} Cfb;
+
+/*
+ * Limits of the read-ahead window of a stream read sequentially.
+ */
+
+#define CFB_READAHEAD_MIN (64UL << 10)
+#define CFB_READAHEAD_MAX (4UL << 20)
+
+/*
+ * Read position within an open stream. The extent index is shared by all
+ * the streams opened on the same directory entry. We remember the extent
+ * last used so that sequential reads do not need to search.
+ */
+
+typedef struct CfbStream {
+    Cfb           *cfbPtr;
+    CfbSect        id;          /* directory entry of the stream */
+    Tcl_WideUInt   size;
+    Tcl_WideUInt   offset;      /* current read position */
+    CfbChain      *chainPtr;    /* extents of the stream data */
+    CfbSect        extent;      /* extent holding the last position read */
+    unsigned long  generation;  /* chainPtr and size are valid for this */
+    Tcl_WideUInt   raNext;      /* where a sequential read would start */
+    Tcl_WideUInt   raEnd;       /* end of the data requested in advance */
+    Tcl_WideUInt   raWindow;    /* current read-ahead size */
+    Tcl_WideUInt   raLimit;     /* largest read-ahead, 0 to disable */
+    int            raSequential; /* start with the largest read-ahead */
+} CfbStream;
+
+/*
+ * A range of a stream to be read by CfbReadRanges.
+ */
+
+typedef struct CfbRange {
+    CfbSect        id;          /* directory entry of the stream */
+    Tcl_WideUInt   offset;
+    int            length;      /* bytes wanted, set to the bytes read */
+    unsigned char *buffer;
+    int            code;        /* CFB status code for this range */
+} CfbRange;
+
+/*
+ * Space used by a compound file as reported by CfbGetUsage. Free space
+ * counts the unused sectors and the unused mini sectors of the mini
+ * stream.
+ */
+
+typedef struct CfbUsage {
+    Tcl_WideUInt   size;        /* length of the file */
+    Tcl_WideUInt   freeSize;    /* bytes held in unused sectors */
+    CfbSect        streams;     /* streams holding any data */
+    CfbSect        fragments;   /* runs of consecutive sectors holding them */
+} CfbUsage;
+
+/*
+ * The layout of a compound file as reported by CfbAnalyze. The sector
+ * counts cover the whole file while the directory counts cover the
+ * items below the storage analysed.
+ */
+
+typedef struct CfbAnalysis {
+    CfbSect        sectors;     /* sectors described by the FAT */
+    CfbSect        freeSectors;
+    CfbSect        tableSectors; /* sectors holding the FAT and DIFAT */
+    CfbSect        largestFree; /* longest run of free sectors */
+    CfbSect        miniSectors; /* mini sectors held in the mini stream */
+    CfbSect        miniFree;
+    CfbSect        entries;     /* directory entries below the storage */
+    CfbSect        storages;
+    CfbSect        streams;
+    CfbSect        depth;       /* deepest nesting of storages */
+    CfbSect        treeDepth;   /* deepest tree holding a storage's items */
+    CfbSect        balancedDepth; /* the same if every tree were balanced */
+} CfbAnalysis;
+
+/*
+ * The state of the sector cache of a file that is not mapped as
+ * reported by CfbGetCacheInfo. Sectors of the FAT, MiniFAT and mini
+ * stream are pinned once read and are held in addition to the frames.
+ */
+
+typedef struct CfbCacheInfo {
+    Tcl_WideUInt   size;        /* bytes of sectors that may be cached */
+    CfbSect        frames;      /* sectors that may be cached */
+    CfbSect        used;        /* frames holding a sector */
+    CfbSect        pinned;      /* sectors held that are never evicted */
+    Tcl_WideUInt   hits;
+    Tcl_WideUInt   misses;
+    Tcl_WideUInt   evictions;
+} CfbCacheInfo;
+
+/*
+ * Called by CfbCheck for each problem found. The area names the part
+ * of the file concerned and the item is a sector or directory entry or
+ * CFB_NOSTREAM if there is none. Returning non-zero ends the check.
+ */
+
+typedef int (CfbCheckProc)(ClientData clientData, const char *area,
+    CfbSect item, const char *message);
+
+/*
+ * A compound file being generated in a single pass by CfbBuilder*. Each
+ * stream is written in full before the next is started. Small streams are
+ * collected in memory for the mini stream while larger ones are written
+ * directly to the file. The directory and allocation tables are held in
+ * memory until the builder is finished.
+ */
+
+typedef struct CfbBuilder {
+    int            refCount;
+    Tcl_Channel    chan;        /* the file being written */
+    int            finished;    /* set once the tables have been written */
+    CfbEntry      *entries;     /* the directory */
+    CfbSect       *parents;     /* storage holding each directory entry */
+    CfbSect        entryCount;
+    CfbSect        entrySpace;
+    Tcl_HashTable  names;       /* parent/name keys used to reject duplicates */
+    CfbSect       *fat;
+    CfbSect        fatCount;    /* sectors written after the header */
+    CfbSect        fatSpace;
+    CfbSect       *miniFat;
+    CfbSect        miniFatCount;
+    CfbSect        miniFatSpace;
+    unsigned char *mini;        /* the mini stream */
+    CfbSect        miniSpace;
+    CfbSect        current;     /* stream being written or CFB_NOSTREAM */
+    int            regular;     /* current stream is being written to sectors */
+    Tcl_WideUInt   written;     /* bytes of the current stream in sectors */
+    unsigned char  pending[4096]; /* current stream while below the cutoff */
+} CfbBuilder;
+
+/*
+ * Property value types used in property set streams [MS-OLEPS]. These
+ * have the same values as the OLE VARENUM constants.
+ */
+
+#define CFB_VT_EMPTY            0
+#define CFB_VT_NULL             1
+#define CFB_VT_I2               2
+#define CFB_VT_I4               3
+#define CFB_VT_R4               4
+#define CFB_VT_R8               5
+#define CFB_VT_CY               6
+#define CFB_VT_DATE             7
+#define CFB_VT_BSTR             8
+#define CFB_VT_ERROR            10
+#define CFB_VT_BOOL             11
+#define CFB_VT_VARIANT          12
+#define CFB_VT_DECIMAL          14
+#define CFB_VT_I1               16
+#define CFB_VT_UI1              17
+#define CFB_VT_UI2              18
+#define CFB_VT_UI4              19
+#define CFB_VT_I8               20
+#define CFB_VT_UI8              21
+#define CFB_VT_INT              22
+#define CFB_VT_UINT             23
+#define CFB_VT_LPSTR            30
+#define CFB_VT_LPWSTR           31
+#define CFB_VT_FILETIME         64
+#define CFB_VT_BLOB             65
+#define CFB_VT_STREAM           66
+#define CFB_VT_STORAGE          67
+#define CFB_VT_STREAMED_OBJECT  68
+#define CFB_VT_STORED_OBJECT    69
+#define CFB_VT_BLOB_OBJECT      70
+#define CFB_VT_CF               71
+#define CFB_VT_CLSID            72
+#define CFB_VT_VERSIONED_STREAM 73
+#define CFB_VT_VECTOR           0x1000
+#define CFB_VT_ARRAY            0x2000
+#define CFB_VT_TYPEMASK         0x0FFF
+
+#define CFB_PID_DICTIONARY      0
+#define CFB_PID_CODEPAGE        1
+#define CFB_PID_EDITTIME        10  /* a duration in SummaryInformation */
+
+/*
+ * A property set stream decoded into memory. Each section holds the
+ * properties of one format identifier with their values converted to
+ * Tcl objects. Values of a type that cannot be decoded are kept as a
+ * byte array of the encoded value. The encoded form of each property is
+ * kept too so that the stream can be written again without converting
+ * the values that were not changed. The dictionary of property names is
+ * held separately from the properties.
+ */
+
+typedef struct CfbProperty {
+    unsigned long  propid;
+    int            type;        /* one of the CFB_VT_* values */
+    Tcl_Obj       *valueObj;
+    const unsigned char *data;  /* the encoded type and value */
+    unsigned long  length;
+    int            owned;       /* data was allocated for a new value */
+} CfbProperty;
+
+typedef struct CfbPropName {
+    unsigned long  propid;
+    Tcl_Obj       *nameObj;
+} CfbPropName;
+
+typedef struct CfbPropSection {
+    unsigned char  fmtid[16];
+    int            codepage;    /* code page of 8 bit strings */
+    CfbProperty   *props;       /* properties in stream order */
+    int            propCount;
+    int            propSpace;
+    CfbPropName   *names;       /* the property name dictionary */
+    int            nameCount;
+    int            nameSpace;
+} CfbPropSection;
+
+typedef struct CfbPropSet {
+    int            version;
+    unsigned long  systemId;
+    unsigned char  clsid[16];
+    CfbPropSection *sections;
+    int            sectionCount;
+    unsigned char *data;        /* the stream that was decoded or NULL */
+} CfbPropSet;
+
+extern const unsigned char cfbFmtidSummary[16];
+extern const unsigned char cfbFmtidDocSummary[16];
+extern const unsigned char cfbFmtidUserDefined[16];
+
+int          CfbOpen(Tcl_Obj *pathObj, int mode, Tcl_WideUInt cacheSize,
+                     Cfb **cfbPtrPtr);
+int          CfbOpenData(const unsigned char *data, Tcl_WideUInt length,
+                 int mode, Cfb **cfbPtrPtr);
+int          CfbSerialize(Cfb *cfbPtr, Tcl_Obj **objPtrPtr);
+void         CfbIncrRefCount(Cfb *cfbPtr);
+void         CfbDecrRefCount(Cfb *cfbPtr);
+Tcl_Obj     *CfbError(const char *szPrefix, int code);
+Tcl_WideUInt CfbFileTimeNow(void);
+int          CfbCommit(Cfb *cfbPtr);
+int          CfbRevert(Cfb *cfbPtr);
+int          CfbShare(Cfb *cfbPtr);
+int          CfbGetUsage(Cfb *cfbPtr, CfbUsage *usagePtr);
+int          CfbAnalyze(Cfb *cfbPtr, CfbSect dirId, CfbAnalysis *infoPtr);
+void         CfbGetCacheInfo(Cfb *cfbPtr, CfbCacheInfo *infoPtr);
+int          CfbCheck(Tcl_Obj *pathObj, CfbCheckProc *proc,
+                 ClientData clientData);
+int          CfbCompact(Cfb *cfbPtr, Tcl_Obj *pathObj, CfbUsage *beforePtr,
+                 CfbUsage *afterPtr);
+
+int          CfbListChildren(Cfb *cfbPtr, CfbSect parent,
+                 CfbSect **idsPtrPtr, CfbSect *countPtr);
+int          CfbFindChild(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *nameObj,
+                 CfbSect *idPtr);
+int          CfbCompareNames(const unsigned short *name1, int len1,
+                 const unsigned short *name2, int len2);
+int          CfbNameFromObj(Tcl_Obj *nameObj, unsigned short *name,
+                 int *lenPtr);
+Tcl_Obj     *CfbNameObj(const CfbEntry *entryPtr);
+int          CfbValidName(const unsigned short *name, int len);
+int          CfbCreateEntry(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *nameObj,
+                 int type, CfbSect *idPtr);
+int          CfbRemoveEntry(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *nameObj);
+int          CfbRenameEntry(Cfb *cfbPtr, CfbSect parent, Tcl_Obj *oldObj,
+                 Tcl_Obj *newObj);
+CfbSect      CfbLinkChildren(CfbEntry *entries, CfbSect *ids,
+                 CfbSect count);
+void         CfbPutEntry(unsigned char *p, const CfbEntry *entryPtr);
+void         CfbPutHeader(unsigned char *p, const CfbHeader *hdrPtr);
+void         CfbFatLayout(CfbSect used, int sectorShift,
+                 CfbSect *fatCountPtr, CfbSect *difatCountPtr);
+
+int          CfbStreamOpen(Cfb *cfbPtr, CfbSect id, CfbStream **stmPtrPtr);
+int          CfbStreamRead(CfbStream *stmPtr, char *buffer, int toRead);
+int          CfbStreamCopy(CfbStream *stmPtr, Tcl_Channel chan,
+                 Tcl_WideUInt *countPtr);
+int          CfbReadRanges(Cfb *cfbPtr, CfbRange *ranges, int count);
+int          CfbStreamLayout(CfbStream *stmPtr, unsigned long *sectorSizePtr,
+                 CfbSect *fragmentsPtr);
+int          CfbEntryLayout(Cfb *cfbPtr, CfbSect id,
+                 unsigned long *sectorSizePtr, CfbSect *lengthPtr,
+                 CfbSect *fragmentsPtr);
+void         CfbStreamReadAhead(CfbStream *stmPtr, Tcl_WideUInt limit,
+                 int sequential);
+int          CfbStreamWrite(CfbStream *stmPtr, const char *buffer,
+                 int toWrite, int *codePtr);
+int          CfbStreamSetSize(CfbStream *stmPtr, Tcl_WideUInt size);
+Tcl_WideInt  CfbStreamSeek(CfbStream *stmPtr, Tcl_WideInt offset,
+                 int seekMode, int *errorCodePtr);
+void         CfbStreamClose(CfbStream *stmPtr);
+
+int          CfbBuilderCreate(Tcl_Obj *pathObj, CfbBuilder **builderPtrPtr);
+void         CfbBuilderIncrRefCount(CfbBuilder *builderPtr);
+void         CfbBuilderDecrRefCount(CfbBuilder *builderPtr);
+int          CfbBuilderAdd(CfbBuilder *builderPtr, CfbSect parent,
+                 Tcl_Obj *nameObj, int type, CfbSect *idPtr);
+int          CfbBuilderWrite(CfbBuilder *builderPtr, CfbSect id,
+                 const char *data, int len);
+int          CfbBuilderEndStream(CfbBuilder *builderPtr, CfbSect id);
+int          CfbBuilderFinish(CfbBuilder *builderPtr);
+int          CfbBuilderCopy(CfbBuilder *builderPtr, Cfb *cfbPtr);
+
+int          CfbPropDecode(const unsigned char *data, unsigned long length,
+                 CfbPropSet **setPtrPtr);
+void         CfbPropFree(CfbPropSet *setPtr);
+CfbPropSet  *CfbPropCreate(void);
+CfbPropSection *CfbPropNewSection(CfbPropSet *setPtr,
+                 const unsigned char *fmtid);
+int          CfbPropSetValue(Tcl_Interp *interp, CfbPropSection *secPtr,
+                 unsigned long propid, int type, Tcl_Obj *valueObj);
+void         CfbPropUnset(CfbPropSection *secPtr, unsigned long propid);
+unsigned long CfbPropAddName(CfbPropSection *secPtr, Tcl_Obj *nameObj);
+Tcl_Obj     *CfbPropEncode(CfbPropSet *setPtr);
+CfbPropSection *CfbPropFindSection(CfbPropSet *setPtr,
+                 const unsigned char *fmtid);
+CfbProperty *CfbPropFind(CfbPropSection *secPtr, unsigned long propid);
+Tcl_Obj     *CfbPropTypeObj(int type);
+Tcl_Obj     *CfbFileTimeObj(Tcl_WideUInt ft, int duration);
+Tcl_WideUInt CfbFileTimeFromSeconds(Tcl_WideInt secs, int duration);
+Tcl_Obj     *CfbGuidObj(const unsigned char *guid);
+int          CfbGuidFromObj(Tcl_Obj *objPtr, unsigned char *guid);
+Tcl_Obj     *CfbPropStreamName(const unsigned char *fmtid);
+
+#endif /* _CFB_H_INCLUDE */
@@ -0,0 +1,779 @@
+/* cfbbuild.c - Sequential compound file builder.
+ *
+ * This file implements a write-only compound file generator. Stream
+ * data is written to the file as it is produced with the sectors of each
+ * stream laid out contiguously. The FAT, MiniFAT, mini stream and
+ * directory are accumulated in memory and written once when the builder
+ * is finished, followed by the header. The file is therefore produced in
+ * a single forward pass without reading back any sectors.
+ *
+ * LIMITATIONS
+ *   * Only one stream may be written at a time.
+ *   * Items cannot be read, renamed or removed once added.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * @(#) $Id$
+ */
+
+#include "tclstorage.h"
+
+#define BUILD_SHIFT      9      /* we write version 3 files */
+#define BUILD_SECTOR     (1U << BUILD_SHIFT)
+#define BUILD_MINISHIFT  6
+#define BUILD_MINISECTOR (1U << BUILD_MINISHIFT)
+#define BUILD_CUTOFF     4096
+
+static void *Grow(void *ptr, CfbSect *spacePtr, CfbSect need, size_t size);
+static int  AddSector(CfbBuilder *builderPtr);
+static int  PutData(CfbBuilder *builderPtr, const unsigned char *data,
+                unsigned long len);
+static int  PutSects(CfbBuilder *builderPtr, const CfbSect *sects,
+                CfbSect count, CfbSect *startPtr);
+static int  PutDirectory(CfbBuilder *builderPtr, CfbSect *startPtr);
+static int  EndStream(CfbBuilder *builderPtr);
+static void FreeBuilder(CfbBuilder *builderPtr);
+static int  CopyStorage(CfbBuilder *builderPtr, Cfb *cfbPtr, CfbSect from,
+                CfbSect to);
+static int  CopyStream(CfbBuilder *builderPtr, Cfb *cfbPtr, CfbSect from,
+                CfbSect to);
+static void CopyAttributes(CfbEntry *entryPtr, const CfbEntry *fromPtr);
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbBuilderCreate --
+ *
+ *	Create a new compound file for sequential generation. Space for the
+ *	header is reserved at the start of the file.
+ *
+ * Results:
+ *	A CFB status code. On success a new builder with a zero reference
+ *	count is stored in builderPtrPtr.
+ *
+ * Side effects:
+ *	The file is created or truncated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbBuilderCreate(Tcl_Obj *pathObj, CfbBuilder **builderPtrPtr)
+{
+    static const char rootName[] = "Root Entry";
+    unsigned char header[CFB_HEADER_SIZE];
+    CfbBuilder *builderPtr;
+    CfbEntry *rootPtr;
+    Tcl_Channel chan;
+    int n;
+
+    chan = Tcl_FSOpenFileChannel(NULL, pathObj, "w", 0666);
+    if (chan == NULL) {
+        return CFB_EIO;
+    }
+    Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+    Tcl_SetChannelOption(NULL, chan, "-buffersize", "65536");
+    memset(header, 0, sizeof(header));
+    if (Tcl_Write(chan, (const char *)header, CFB_HEADER_SIZE) < 0) {
+        Tcl_Close(NULL, chan);
+        return CFB_EIO;
+    }
+
+    builderPtr = (CfbBuilder *)ckalloc(sizeof(CfbBuilder));
+    memset(builderPtr, 0, sizeof(CfbBuilder));
+    builderPtr->chan = chan;
+    builderPtr->current = CFB_NOSTREAM;
+    Tcl_InitHashTable(&builderPtr->names, TCL_STRING_KEYS);
+
+    builderPtr->entries = Grow(NULL, &builderPtr->entrySpace, 1,
+        sizeof(CfbEntry));
+    builderPtr->parents = (CfbSect *)ckalloc(
+        sizeof(CfbSect) * builderPtr->entrySpace);
+    builderPtr->entryCount = 1;
+    builderPtr->parents[0] = CFB_NOSTREAM;
+
+    rootPtr = &builderPtr->entries[0];
+    memset(rootPtr, 0, sizeof(CfbEntry));
+    for (n = 0; rootName[n]; n++) {
+        rootPtr->name[n] = (unsigned short)rootName[n];
+    }
+    rootPtr->nameLen = n;
+    rootPtr->type = CFB_TYPE_ROOT;
+    rootPtr->color = CFB_BLACK;
+    rootPtr->left = rootPtr->right = rootPtr->child = CFB_NOSTREAM;
+    rootPtr->start = CFB_ENDOFCHAIN;
+    rootPtr->mtime = CfbFileTimeNow();
+
+    *builderPtrPtr = builderPtr;
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbBuilderIncrRefCount, CfbBuilderDecrRefCount --
+ *
+ *	Manage the reference count of a builder. The builder is shared
+ *	by the storage commands and stream channels that add to it.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	When the last reference is released the memory is free'd. If the
+ *	builder was never finished the file is closed incomplete.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+void
+CfbBuilderIncrRefCount(CfbBuilder *builderPtr)
+{
+    ++builderPtr->refCount;
+}
+
+void
+CfbBuilderDecrRefCount(CfbBuilder *builderPtr)
+{
+    if (--builderPtr->refCount <= 0) {
+        FreeBuilder(builderPtr);
+    }
+}
+
+static void
+FreeBuilder(CfbBuilder *builderPtr)
+{
+    if (builderPtr->chan) {
+        Tcl_Close(NULL, builderPtr->chan);
+    }
+    Tcl_DeleteHashTable(&builderPtr->names);
+    ckfree((char *)builderPtr->entries);
+    ckfree((char *)builderPtr->parents);
+    if (builderPtr->fat)
+        ckfree((char *)builderPtr->fat);
+    if (builderPtr->miniFat)
+        ckfree((char *)builderPtr->miniFat);
+    if (builderPtr->mini)
+        ckfree((char *)builderPtr->mini);
+    ckfree((char *)builderPtr);
+}
+
+/*
+ * Grow an array so that it can hold at least need elements.
+ */
+
+static void *
+Grow(void *ptr, CfbSect *spacePtr, CfbSect need, size_t size)
+{
+    CfbSect space = *spacePtr;
+
+    if (need <= space && ptr != NULL) {
+        return ptr;
+    }
+    if (space < 16) {
+        space = 16;
+    }
+    while (space < need) {
+        space *= 2;
+    }
+    *spacePtr = space;
+    return (ptr == NULL) ? ckalloc(space * size)
+        : ckrealloc((char *)ptr, space * size);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbBuilderAdd --
+ *
+ *	Add a storage or stream to a storage of the file being built.
+ *	Adding a stream makes it the current stream and any previous
+ *	stream must have been ended first.
+ *
+ * Results:
+ *	A CFB status code. The id of the new entry is stored in idPtr.
+ *
+ * Side effects:
+ *	A new directory entry is created.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbBuilderAdd(CfbBuilder *builderPtr, CfbSect parent, Tcl_Obj *nameObj,
+    int type, CfbSect *idPtr)
+{
+    unsigned short name[CFB_NAME_MAX + 1];
+    char key[TCL_INTEGER_SPACE + 4 * CFB_NAME_MAX + 2];
+    CfbEntry *entryPtr;
+    int len, n, isNew;
+    CfbSect id;
+
+    if (builderPtr->finished) {
+        return CFB_EACCES;
+    }
+    if (type == CFB_TYPE_STREAM && builderPtr->current != CFB_NOSTREAM) {
+        return CFB_EBUSY;
+    }
+    if (parent >= builderPtr->entryCount
+        || builderPtr->entries[parent].type == CFB_TYPE_STREAM) {
+        return CFB_ENOENT;
+    }
+    if (!CfbNameFromObj(nameObj, name, &len) || !CfbValidName(name, len)) {
+        return CFB_EINVAL;
+    }
+
+    /*
+     * Names are unique within a storage regardless of case.
+     */
+
+    n = sprintf(key, "%lu/", (unsigned long)parent);
+    for (len = 0; name[len]; len++) {
+        n += sprintf(key + n, "%04x", Tcl_UniCharToUpper(name[len]));
+    }
+    Tcl_CreateHashEntry(&builderPtr->names, key, &isNew);
+    if (!isNew) {
+        return CFB_EEXIST;
+    }
+
+    id = builderPtr->entryCount++;
+    if (id >= builderPtr->entrySpace) {
+        CfbSect space = builderPtr->entrySpace;
+        builderPtr->entries = Grow(builderPtr->entries,
+            &builderPtr->entrySpace, id + 1, sizeof(CfbEntry));
+        builderPtr->parents = Grow(builderPtr->parents, &space, id + 1,
+            sizeof(CfbSect));
+    }
+    builderPtr->parents[id] = parent;
+    entryPtr = &builderPtr->entries[id];
+    memset(entryPtr, 0, sizeof(CfbEntry));
+    memcpy(entryPtr->name, name, sizeof(name));
+    entryPtr->nameLen = len;
+    entryPtr->type = type;
+    entryPtr->left = entryPtr->right = entryPtr->child = CFB_NOSTREAM;
+    entryPtr->start = CFB_ENDOFCHAIN;
+    entryPtr->ctime = entryPtr->mtime = CfbFileTimeNow();
+    if (type != CFB_TYPE_STORAGE) {
+        builderPtr->current = id;
+        builderPtr->regular = 0;
+    }
+    *idPtr = id;
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbBuilderWrite --
+ *
+ *	Append data to the current stream. The start of each stream is
+ *	held in memory until it reaches the mini stream cutoff. Beyond
+ *	that the data is written directly to the file in consecutive
+ *	sectors.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	Data is written to the file.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbBuilderWrite(CfbBuilder *builderPtr, CfbSect id, const char *data,
+    int len)
+{
+    CfbEntry *entryPtr;
+    int r = CFB_OK;
+
+    if (builderPtr->finished || id != builderPtr->current) {
+        return CFB_EACCES;
+    }
+    entryPtr = &builderPtr->entries[id];
+    if (!builderPtr->regular) {
+        if (entryPtr->size + len < BUILD_CUTOFF) {
+            memcpy(builderPtr->pending + entryPtr->size, data, len);
+            entryPtr->size += len;
+            return CFB_OK;
+        }
+
+        /* too large for the mini stream so switch to sectors */
+        builderPtr->regular = 1;
+        builderPtr->written = 0;
+        entryPtr->start = builderPtr->fatCount;
+        r = PutData(builderPtr, builderPtr->pending,
+            (unsigned long)entryPtr->size);
+    }
+    if (r == CFB_OK) {
+        r = PutData(builderPtr, (const unsigned char *)data,
+            (unsigned long)len);
+    }
+    return r;
+}
+
+/*
+ * Append stream data to the file extending the chain of the current
+ * stream as each new sector is started.
+ */
+
+static int
+PutData(CfbBuilder *builderPtr, const unsigned char *data, unsigned long len)
+{
+    Tcl_WideUInt offset = builderPtr->written;
+    int r = CFB_OK;
+
+    if (len > 0 && Tcl_Write(builderPtr->chan, (const char *)data,
+            (int)len) < 0) {
+        return CFB_EIO;
+    }
+    builderPtr->written += len;
+    while (r == CFB_OK && offset < builderPtr->written) {
+        if ((offset & (BUILD_SECTOR - 1)) == 0) {
+            r = AddSector(builderPtr);
+        }
+        offset = (offset | (BUILD_SECTOR - 1)) + 1;
+    }
+    builderPtr->entries[builderPtr->current].size = builderPtr->written;
+    return r;
+}
+
+/*
+ * Allocate the next sector of the file to the current stream.
+ */
+
+static int
+AddSector(CfbBuilder *builderPtr)
+{
+    CfbSect sect = builderPtr->fatCount;
+
+    if (sect >= CFB_MAXREGSECT) {
+        return CFB_ENOSPC;
+    }
+    builderPtr->fat = Grow(builderPtr->fat, &builderPtr->fatSpace,
+        sect + 1, sizeof(CfbSect));
+    if (sect > builderPtr->entries[builderPtr->current].start) {
+        builderPtr->fat[sect - 1] = sect;
+    }
+    builderPtr->fat[sect] = CFB_ENDOFCHAIN;
+    builderPtr->fatCount++;
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbBuilderEndStream --
+ *
+ *	Complete the current stream. A small stream is copied into the
+ *	mini stream while a large one has its final sector padded.
+ *
+ * Results:
+ *	A CFB status code. Ending a stream that is not current does
+ *	nothing as the stream is ended when the builder is finished.
+ *
+ * Side effects:
+ *	There is no longer a current stream.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbBuilderEndStream(CfbBuilder *builderPtr, CfbSect id)
+{
+    if (id != builderPtr->current) {
+        return CFB_OK;          /* already ended or finished */
+    }
+    return EndStream(builderPtr);
+}
+
+static int
+EndStream(CfbBuilder *builderPtr)
+{
+    CfbEntry *entryPtr = &builderPtr->entries[builderPtr->current];
+    unsigned long size = (unsigned long)entryPtr->size;
+    int r = CFB_OK;
+
+    if (builderPtr->regular) {
+        unsigned long tail = size & (BUILD_SECTOR - 1);
+        if (tail) {
+            unsigned char pad[BUILD_SECTOR];
+            memset(pad, 0, sizeof(pad));
+            if (Tcl_Write(builderPtr->chan, (const char *)pad,
+                    (int)(BUILD_SECTOR - tail)) < 0) {
+                r = CFB_EIO;
+            }
+        }
+    } else if (size > 0) {
+        CfbSect count = (size + BUILD_MINISECTOR - 1) >> BUILD_MINISHIFT;
+        CfbSect first = builderPtr->miniFatCount, n;
+        CfbSect space = builderPtr->miniSpace;
+
+        builderPtr->miniFat = Grow(builderPtr->miniFat,
+            &builderPtr->miniFatSpace, first + count, sizeof(CfbSect));
+        builderPtr->mini = Grow(builderPtr->mini, &space,
+            (first + count) << BUILD_MINISHIFT, 1);
+        builderPtr->miniSpace = space;
+        for (n = 0; n < count; n++) {
+            builderPtr->miniFat[first + n] = first + n + 1;
+        }
+        builderPtr->miniFat[first + count - 1] = CFB_ENDOFCHAIN;
+        builderPtr->miniFatCount += count;
+        memset(builderPtr->mini + (first << BUILD_MINISHIFT), 0,
+            count << BUILD_MINISHIFT);
+        memcpy(builderPtr->mini + (first << BUILD_MINISHIFT),
+            builderPtr->pending, size);
+        entryPtr->start = first;
+    }
+    builderPtr->current = CFB_NOSTREAM;
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbBuilderFinish --
+ *
+ *	Complete the file. The mini stream, MiniFAT, directory, FAT and
+ *	DIFAT are appended in that order and finally the header is
+ *	written into the space reserved at the start of the file.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The file is closed. No further items may be added.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbBuilderFinish(CfbBuilder *builderPtr)
+{
+    unsigned char header[CFB_HEADER_SIZE];
+    CfbEntry *rootPtr = &builderPtr->entries[0];
+    CfbSect fatCount, difatCount, fatStart, n;
+    CfbHeader hdr;
+    int r = CFB_OK;
+
+    if (builderPtr->finished) {
+        return CFB_OK;
+    }
+    builderPtr->finished = 1;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = 3;
+
+    if (builderPtr->current != CFB_NOSTREAM) {
+        r = EndStream(builderPtr);
+    }
+
+    /*
+     * The mini stream is held in the chain of the root entry.
+     */
+
+    if (r == CFB_OK && builderPtr->miniFatCount > 0) {
+        CfbSect size = builderPtr->miniFatCount << BUILD_MINISHIFT;
+        builderPtr->current = 0;
+        builderPtr->regular = 1;
+        rootPtr->start = builderPtr->fatCount;
+        builderPtr->written = 0;
+        r = PutData(builderPtr, builderPtr->mini, size);
+        if (r == CFB_OK) {
+            r = EndStream(builderPtr);
+        }
+        rootPtr->size = size;
+    }
+    hdr.miniFatStart = CFB_ENDOFCHAIN;
+    if (r == CFB_OK && builderPtr->miniFatCount > 0) {
+        r = PutSects(builderPtr, builderPtr->miniFat,
+            builderPtr->miniFatCount, &hdr.miniFatStart);
+        hdr.miniFatCount = (builderPtr->miniFatCount + 127) >> 7;
+    }
+    if (r == CFB_OK) {
+        r = PutDirectory(builderPtr, &hdr.dirStart);
+    }
+
+    /*
+     * The FAT follows and must describe itself and the DIFAT.
+     */
+
+    if (r == CFB_OK) {
+        CfbFatLayout(builderPtr->fatCount, BUILD_SHIFT,
+            &fatCount, &difatCount);
+        fatStart = builderPtr->fatCount;
+        builderPtr->fat = Grow(builderPtr->fat, &builderPtr->fatSpace,
+            fatStart + fatCount + difatCount, sizeof(CfbSect));
+        for (n = 0; n < fatCount; n++) {
+            builderPtr->fat[fatStart + n] = CFB_FATSECT;
+        }
+        for (n = 0; n < difatCount; n++) {
+            builderPtr->fat[fatStart + fatCount + n] = CFB_DIFSECT;
+        }
+        builderPtr->fatCount += fatCount + difatCount;
+        r = PutSects(builderPtr, builderPtr->fat, builderPtr->fatCount,
+            NULL);
+
+        hdr.fatCount = fatCount;
+        hdr.difatStart = difatCount ? fatStart + fatCount : CFB_ENDOFCHAIN;
+        hdr.difatCount = difatCount;
+        for (n = 0; n < CFB_HEADER_DIFAT; n++) {
+            hdr.difat[n] = (n < fatCount) ? fatStart + n : CFB_FREESECT;
+        }
+    }
+    for (n = 0; r == CFB_OK && n < difatCount; n++) {
+        unsigned char sector[BUILD_SECTOR];
+        CfbSect perSector = (BUILD_SECTOR / 4) - 1, i;
+        CfbSect first = CFB_HEADER_DIFAT + n * perSector;
+        for (i = 0; i < perSector; i++) {
+            PUT32(sector + 4 * i, (first + i < fatCount)
+                ? fatStart + first + i : CFB_FREESECT);
+        }
+        PUT32(sector + 4 * perSector, (n + 1 < difatCount)
+            ? fatStart + fatCount + n + 1 : CFB_ENDOFCHAIN);
+        if (Tcl_Write(builderPtr->chan, (const char *)sector,
+                BUILD_SECTOR) < 0) {
+            r = CFB_EIO;
+        }
+    }
+
+    if (r == CFB_OK) {
+        CfbPutHeader(header, &hdr);
+        if (Tcl_Seek(builderPtr->chan, 0, SEEK_SET) < 0
+            || Tcl_Write(builderPtr->chan, (const char *)header,
+                CFB_HEADER_SIZE) < 0) {
+            r = CFB_EIO;
+        }
+    }
+    if (Tcl_Close(NULL, builderPtr->chan) != TCL_OK && r == CFB_OK) {
+        r = CFB_EIO;
+    }
+    builderPtr->chan = NULL;
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbBuilderCopy --
+ *
+ *	Add the entire contents of an open compound file to a builder.
+ *	The items of each storage are added together so that they have
+ *	consecutive directory entries and the data of its streams is
+ *	written in the same order, before any sub-storages are visited.
+ *	The class, state bits and times of each item are preserved.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	Stream data is written to the file.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbBuilderCopy(CfbBuilder *builderPtr, Cfb *cfbPtr)
+{
+    if (builderPtr->finished || builderPtr->entryCount != 1) {
+        return CFB_EACCES;
+    }
+    CopyAttributes(&builderPtr->entries[0], &cfbPtr->entries[0]);
+    return CopyStorage(builderPtr, cfbPtr, 0, 0);
+}
+
+static int
+CopyStorage(CfbBuilder *builderPtr, Cfb *cfbPtr, CfbSect from, CfbSect to)
+{
+    CfbSect *ids, *newIds, count, n;
+    int r;
+
+    r = CfbListChildren(cfbPtr, from, &ids, &count);
+    if (r != CFB_OK) {
+        return r;
+    }
+    newIds = (CfbSect *)ckalloc(sizeof(CfbSect) * (count + 1));
+    for (n = 0; r == CFB_OK && n < count; n++) {
+        const CfbEntry *fromPtr = &cfbPtr->entries[ids[n]];
+        Tcl_Obj *nameObj = CfbNameObj(fromPtr);
+
+        Tcl_IncrRefCount(nameObj);
+        r = CfbBuilderAdd(builderPtr, to, nameObj, fromPtr->type,
+            &newIds[n]);
+        Tcl_DecrRefCount(nameObj);
+        if (r == CFB_OK && fromPtr->type == CFB_TYPE_STREAM) {
+            r = CopyStream(builderPtr, cfbPtr, ids[n], newIds[n]);
+        }
+        if (r == CFB_OK) {
+            CopyAttributes(&builderPtr->entries[newIds[n]], fromPtr);
+        }
+    }
+    for (n = 0; r == CFB_OK && n < count; n++) {
+        if (cfbPtr->entries[ids[n]].type == CFB_TYPE_STORAGE) {
+            r = CopyStorage(builderPtr, cfbPtr, ids[n], newIds[n]);
+        }
+    }
+    ckfree((char *)newIds);
+    ckfree((char *)ids);
+    return r;
+}
+
+static int
+CopyStream(CfbBuilder *builderPtr, Cfb *cfbPtr, CfbSect from, CfbSect to)
+{
+    CfbStream *stmPtr;
+    char *buffer;
+    int r, cb;
+
+    r = CfbStreamOpen(cfbPtr, from, &stmPtr);
+    if (r != CFB_OK) {
+        return r;
+    }
+    buffer = ckalloc(65536);
+    while (r == CFB_OK) {
+        cb = CfbStreamRead(stmPtr, buffer, 65536);
+        if (cb < 0) {
+            r = CFB_EFORMAT;
+        } else if (cb == 0) {
+            break;
+        } else {
+            r = CfbBuilderWrite(builderPtr, to, buffer, cb);
+        }
+    }
+    ckfree(buffer);
+    CfbStreamClose(stmPtr);
+    if (r == CFB_OK) {
+        r = CfbBuilderEndStream(builderPtr, to);
+    }
+    return r;
+}
+
+static void
+CopyAttributes(CfbEntry *entryPtr, const CfbEntry *fromPtr)
+{
+    memcpy(entryPtr->clsid, fromPtr->clsid, sizeof(entryPtr->clsid));
+    entryPtr->stateBits = fromPtr->stateBits;
+    entryPtr->ctime = fromPtr->ctime;
+    entryPtr->mtime = fromPtr->mtime;
+}
+
+/*
+ * Write an array of sector numbers, such as the FAT, into consecutive
+ * sectors padding the last with free entries. Returns the first sector
+ * used which must be described by the FAT later.
+ */
+
+static int
+PutSects(CfbBuilder *builderPtr, const CfbSect *sects, CfbSect count,
+    CfbSect *startPtr)
+{
+    unsigned char sector[BUILD_SECTOR];
+    CfbSect perSector = BUILD_SECTOR / 4, n, i;
+    CfbSect start = builderPtr->fatCount;
+    int r = CFB_OK;
+
+    for (n = 0; r == CFB_OK && n < count; n += perSector) {
+        for (i = 0; i < perSector; i++) {
+            PUT32(sector + 4 * i, (n + i < count) ? sects[n + i]
+                : CFB_FREESECT);
+        }
+        if (Tcl_Write(builderPtr->chan, (const char *)sector,
+                BUILD_SECTOR) < 0) {
+            r = CFB_EIO;
+        }
+        if (startPtr && r == CFB_OK) {
+            /* these sectors form a chain of their own */
+            builderPtr->fat = Grow(builderPtr->fat, &builderPtr->fatSpace,
+                builderPtr->fatCount + 1, sizeof(CfbSect));
+            if (builderPtr->fatCount > start) {
+                builderPtr->fat[builderPtr->fatCount - 1]
+                    = builderPtr->fatCount;
+            }
+            builderPtr->fat[builderPtr->fatCount++] = CFB_ENDOFCHAIN;
+        }
+    }
+    if (startPtr) {
+        *startPtr = start;
+    }
+    return r;
+}
+
+/*
+ * Link the children of each storage into trees and write the directory.
+ */
+
+static int
+PutDirectory(CfbBuilder *builderPtr, CfbSect *startPtr)
+{
+    CfbEntry *entries = builderPtr->entries;
+    CfbSect count = builderPtr->entryCount, *ids, *first, n, k;
+    CfbSect start = builderPtr->fatCount;
+    unsigned char sector[BUILD_SECTOR];
+    int r = CFB_OK;
+
+    /*
+     * Group the ids by parent using a counting sort and link each
+     * group into the tree held by the parent.
+     */
+
+    ids = (CfbSect *)ckalloc(sizeof(CfbSect) * count);
+    first = (CfbSect *)ckalloc(sizeof(CfbSect) * (count + 1));
+    memset(first, 0, sizeof(CfbSect) * (count + 1));
+    for (n = 1; n < count; n++) {
+        first[builderPtr->parents[n] + 1]++;
+    }
+    for (n = 1; n <= count; n++) {
+        first[n] += first[n - 1];
+    }
+    for (n = 1; n < count; n++) {
+        ids[first[builderPtr->parents[n]]++] = n;
+    }
+    for (n = 0, k = 0; n < count; n++) {
+        CfbSect end = first[n];
+        if (entries[n].type != CFB_TYPE_STREAM) {
+            entries[n].child = CfbLinkChildren(entries, ids + k, end - k);
+        }
+        k = end;
+    }
+    ckfree((char *)first);
+    ckfree((char *)ids);
+
+    for (n = 0; r == CFB_OK && n < count; n += BUILD_SECTOR / CFB_DIRENT_SIZE) {
+        CfbSect i;
+        for (i = 0; i < BUILD_SECTOR / CFB_DIRENT_SIZE; i++) {
+            CfbEntry empty;
+            if (n + i < count) {
+                CfbPutEntry(sector + i * CFB_DIRENT_SIZE, &entries[n + i]);
+            } else {
+                memset(&empty, 0, sizeof(empty));
+                CfbPutEntry(sector + i * CFB_DIRENT_SIZE, &empty);
+            }
+        }
+        if (Tcl_Write(builderPtr->chan, (const char *)sector,
+                BUILD_SECTOR) < 0) {
+            r = CFB_EIO;
+        } else {
+            builderPtr->fat = Grow(builderPtr->fat, &builderPtr->fatSpace,
+                builderPtr->fatCount + 1, sizeof(CfbSect));
+            if (builderPtr->fatCount > start) {
+                builderPtr->fat[builderPtr->fatCount - 1]
+                    = builderPtr->fatCount;
+            }
+            builderPtr->fat[builderPtr->fatCount++] = CFB_ENDOFCHAIN;
+        }
+    }
+    *startPtr = start;
+    return r;
+}
+
+/* ----------------------------------------------------------------------
+ *
+ * Local variables:
+ * mode: c
+ * indent-tabs-mode: nil
+ * End:
+ */
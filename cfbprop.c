@@ -0,0 +1,1708 @@
+/* cfbprop.c - Property set streams.
+ *
+ * This file decodes and encodes the property set stream format
+ * [MS-OLEPS] used to hold the summary information and other metadata of
+ * compound files. The whole stream is decoded in one pass and each
+ * property value is converted to a Tcl object of the natural type:
+ * integers are wide integers, floating point and currency values are
+ * doubles, FILETIME and DATE values are seconds since the epoch, blobs
+ * and clipboard data are byte arrays and vectors are lists. Changes are
+ * made to the decoded sections and the stream is encoded again in full.
+ *
+ * LIMITATIONS
+ *   * VT_ARRAY values and the rarely used object and stream types are
+ *     kept as the undecoded bytes of the value.
+ *   * VT_UI8 values above the range of a wide integer wrap around.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ *
+ * ----------------------------------------------------------------------
+ *
+ * @(#) $Id$
+ */
+
+#include "tclstorage.h"
+#include <stdlib.h>
+#include <math.h>
+
+#define PROP_HEADER_SIZE  28    /* stream header before the sections */
+#define PROP_SECTION_REF  20    /* FMTID and offset of each section */
+#define PROP_CODEPAGE_DEFAULT 1252
+#define PROP_CODEPAGE_UNICODE 1200
+#define PROP_SYSTEM_ID    0x00020006 /* Win32 */
+
+#define PAD4(n) (((n) + 3) & ~3UL)
+
+/*
+ * The well known property set format identifiers in their serialized
+ * form.
+ */
+
+const unsigned char cfbFmtidSummary[16] = {
+    0xE0, 0x85, 0x9F, 0xF2, 0xF9, 0x4F, 0x68, 0x10,
+    0xAB, 0x91, 0x08, 0x00, 0x2B, 0x27, 0xB3, 0xD9
+};
+const unsigned char cfbFmtidDocSummary[16] = {
+    0x02, 0xD5, 0xCD, 0xD5, 0x9C, 0x2E, 0x1B, 0x10,
+    0x93, 0x97, 0x08, 0x00, 0x2B, 0x2C, 0xF9, 0xAE
+};
+const unsigned char cfbFmtidUserDefined[16] = {
+    0x05, 0xD5, 0xCD, 0xD5, 0x9C, 0x2E, 0x1B, 0x10,
+    0x93, 0x97, 0x08, 0x00, 0x2B, 0x2C, 0xF9, 0xAE
+};
+
+/*
+ * State used while decoding or encoding the values of one section.
+ * Positions are offsets from the start of the section.
+ */
+
+typedef struct Decoder {
+    const unsigned char *base;  /* start of the section */
+    unsigned long  size;        /* bytes available to the section */
+    int            codepage;
+    Tcl_Encoding   encoding;    /* for 8 bit strings, NULL for UTF-16 */
+    int            duration;    /* FILETIME values are intervals */
+} Decoder;
+
+static const struct {
+    int         type;
+    const char *name;
+} typeNames[] = {
+    { CFB_VT_EMPTY, "VT_EMPTY" }, { CFB_VT_NULL, "VT_NULL" },
+    { CFB_VT_I2, "VT_I2" }, { CFB_VT_I4, "VT_I4" },
+    { CFB_VT_R4, "VT_R4" }, { CFB_VT_R8, "VT_R8" },
+    { CFB_VT_CY, "VT_CY" }, { CFB_VT_DATE, "VT_DATE" },
+    { CFB_VT_BSTR, "VT_BSTR" }, { CFB_VT_ERROR, "VT_ERROR" },
+    { CFB_VT_BOOL, "VT_BOOL" }, { CFB_VT_VARIANT, "VT_VARIANT" },
+    { CFB_VT_DECIMAL, "VT_DECIMAL" }, { CFB_VT_I1, "VT_I1" },
+    { CFB_VT_UI1, "VT_UI1" }, { CFB_VT_UI2, "VT_UI2" },
+    { CFB_VT_UI4, "VT_UI4" }, { CFB_VT_I8, "VT_I8" },
+    { CFB_VT_UI8, "VT_UI8" }, { CFB_VT_INT, "VT_INT" },
+    { CFB_VT_UINT, "VT_UINT" }, { CFB_VT_LPSTR, "VT_LPSTR" },
+    { CFB_VT_LPWSTR, "VT_LPWSTR" }, { CFB_VT_FILETIME, "VT_FILETIME" },
+    { CFB_VT_BLOB, "VT_BLOB" }, { CFB_VT_STREAM, "VT_STREAM" },
+    { CFB_VT_STORAGE, "VT_STORAGE" },
+    { CFB_VT_STREAMED_OBJECT, "VT_STREAMED_OBJECT" },
+    { CFB_VT_STORED_OBJECT, "VT_STORED_OBJECT" },
+    { CFB_VT_BLOB_OBJECT, "VT_BLOB_OBJECT" }, { CFB_VT_CF, "VT_CF" },
+    { CFB_VT_CLSID, "VT_CLSID" },
+    { CFB_VT_VERSIONED_STREAM, "VT_VERSIONED_STREAM" },
+    { 0, NULL }
+};
+
+static const struct {
+    int         codepage;
+    const char *name;
+} codePages[] = {
+    { 65001, "utf-8" }, { 20127, "ascii" }, { 10000, "macRoman" },
+    { 20866, "koi8-r" }, { 20932, "euc-jp" }, { 51949, "euc-kr" },
+    { 50220, "iso2022-jp" }, { 28591, "iso8859-1" },
+    { 28592, "iso8859-2" }, { 28593, "iso8859-3" },
+    { 28594, "iso8859-4" }, { 28595, "iso8859-5" },
+    { 28596, "iso8859-6" }, { 28597, "iso8859-7" },
+    { 28598, "iso8859-8" }, { 28599, "iso8859-9" },
+    { 28605, "iso8859-15" },
+    { 0, NULL }
+};
+
+static int  DecodeSection(const unsigned char *base, unsigned long size,
+                CfbPropSection *secPtr);
+static int  DecodeDictionary(Decoder *decPtr, unsigned long pos,
+                unsigned long end, CfbPropSection *secPtr);
+static int  DecodeValue(Decoder *decPtr, int type, unsigned long pos,
+                unsigned long end, Tcl_Obj **objPtrPtr);
+static int  DecodeScalar(Decoder *decPtr, int type, unsigned long *posPtr,
+                unsigned long end, Tcl_Obj **objPtrPtr);
+static void SkipPadding(Decoder *decPtr, unsigned long *posPtr,
+                unsigned long end);
+static Tcl_Obj *StringObj(Decoder *decPtr, const unsigned char *p,
+                unsigned long len);
+static Tcl_Obj *Utf16Obj(const unsigned char *p, unsigned long units);
+static Tcl_Encoding GetCodePageEncoding(int codepage);
+static unsigned long NextOffset(const unsigned long *offsets, int count,
+                unsigned long offset, unsigned long size);
+static int  CompareOffsets(const void *a, const void *b);
+static void FreeSection(CfbPropSection *secPtr);
+static void SetCodePage(Decoder *decPtr, int codepage);
+static void EncodeSection(CfbPropSection *secPtr, Tcl_DString *dsPtr);
+static int  EncodeValue(Tcl_Interp *interp, Decoder *decPtr, int type,
+                Tcl_Obj *valueObj, Tcl_DString *dsPtr);
+static void PutString(Decoder *decPtr, Tcl_Obj *objPtr, int chars,
+                Tcl_DString *dsPtr);
+static unsigned long PutUtf16(Tcl_Obj *objPtr, Tcl_DString *dsPtr);
+static void Put32(Tcl_DString *dsPtr, unsigned long value);
+static void PutPadding(Tcl_DString *dsPtr, int start);
+static int  HexDigit(int c);
+
+/*
+ * Check that n bytes are available at pos without overflowing.
+ */
+
+#define HAVE(pos, n, end) ((n) <= (end) && (pos) <= (end) - (n))
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropDecode --
+ *
+ *	Decode a property set stream held in memory. The stream header
+ *	and every section are validated and all the property values are
+ *	converted to Tcl objects.
+ *
+ * Results:
+ *	A CFB status code. On success the decoded property set is stored
+ *	in setPtrPtr and must be released with CfbPropFree.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbPropDecode(const unsigned char *data, unsigned long length,
+    CfbPropSet **setPtrPtr)
+{
+    CfbPropSet *setPtr;
+    unsigned long count, n;
+    int code = CFB_OK;
+
+    if (length < PROP_HEADER_SIZE || GET16(data) != 0xFFFE
+        || GET16(data + 2) > 1) {
+        return CFB_EFORMAT;
+    }
+    count = GET32(data + 24);
+    if (count < 1 || count > (length - PROP_HEADER_SIZE) / PROP_SECTION_REF) {
+        return CFB_EFORMAT;
+    }
+
+    setPtr = (CfbPropSet *)ckalloc(sizeof(CfbPropSet));
+    setPtr->data = (unsigned char *)ckalloc(length);
+    memcpy(setPtr->data, data, length);
+    data = setPtr->data;
+    setPtr->version = (int)GET16(data + 2);
+    setPtr->systemId = GET32(data + 4);
+    memcpy(setPtr->clsid, data + 8, 16);
+    setPtr->sections = (CfbPropSection *)
+        ckalloc(count * sizeof(CfbPropSection));
+    memset(setPtr->sections, 0, count * sizeof(CfbPropSection));
+    setPtr->sectionCount = 0;
+
+    for (n = 0; code == CFB_OK && n < count; n++) {
+        const unsigned char *p = data + PROP_HEADER_SIZE
+            + n * PROP_SECTION_REF;
+        unsigned long offset = GET32(p + 16);
+        CfbPropSection *secPtr = setPtr->sections + n;
+
+        memcpy(secPtr->fmtid, p, 16);
+        setPtr->sectionCount++;
+        if (offset > length - 8) {
+            code = CFB_EFORMAT;
+        } else {
+            code = DecodeSection(data + offset, length - offset, secPtr);
+        }
+    }
+
+    if (code != CFB_OK) {
+        CfbPropFree(setPtr);
+        return code;
+    }
+    *setPtrPtr = setPtr;
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * DecodeSection --
+ *
+ *	Decode the properties of one section. The code page is found first
+ *	as it determines the encoding of every string in the section. The
+ *	extent of each value runs to the start of the next value so that
+ *	values that cannot be decoded may be kept as bytes.
+ *
+ * Results:
+ *	A CFB status code. CFB_EFORMAT is returned if the section header
+ *	or the property offsets are invalid.
+ *
+ * Side effects:
+ *	The properties and dictionary of the section are filled in.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+DecodeSection(const unsigned char *base, unsigned long avail,
+    CfbPropSection *secPtr)
+{
+    Decoder dec;
+    unsigned long size = GET32(base), count = GET32(base + 4);
+    unsigned long *offsets, n;
+    int isSummary, code = CFB_OK;
+
+    if (size < 8 || size > avail || count > (size - 8) / 8) {
+        return CFB_EFORMAT;
+    }
+
+    dec.base = base;
+    dec.size = size;
+    dec.duration = 0;
+
+    secPtr->codepage = PROP_CODEPAGE_DEFAULT;
+    offsets = (unsigned long *)ckalloc((count + 1) * sizeof(unsigned long));
+    for (n = 0; n < count; n++) {
+        const unsigned char *p = base + 8 + n * 8;
+        offsets[n] = GET32(p + 4);
+        if (offsets[n] < 8 + count * 8 || offsets[n] > size - 4) {
+            code = CFB_EFORMAT;
+        } else if (GET32(p) == CFB_PID_CODEPAGE
+                   && offsets[n] + 6 <= size
+                   && GET16(base + offsets[n]) == CFB_VT_I2) {
+            secPtr->codepage = (int)GET16(base + offsets[n] + 4);
+        }
+    }
+    if (code != CFB_OK) {
+        ckfree((char *)offsets);
+        return code;
+    }
+    qsort(offsets, count, sizeof(unsigned long), CompareOffsets);
+
+    SetCodePage(&dec, secPtr->codepage);
+    secPtr->props = (CfbProperty *)ckalloc((count + 1) * sizeof(CfbProperty));
+    secPtr->propCount = 0;
+    secPtr->propSpace = (int)count + 1;
+    isSummary = memcmp(secPtr->fmtid, cfbFmtidSummary, 16) == 0;
+
+    for (n = 0; code == CFB_OK && n < count; n++) {
+        const unsigned char *p = base + 8 + n * 8;
+        unsigned long propid = GET32(p), offset = GET32(p + 4);
+        unsigned long end = NextOffset(offsets, (int)count, offset, size);
+
+        if (propid == CFB_PID_DICTIONARY) {
+            code = DecodeDictionary(&dec, offset, end, secPtr);
+        } else {
+            CfbProperty *propPtr = secPtr->props + secPtr->propCount;
+            propPtr->propid = propid;
+            propPtr->type = (int)GET16(base + offset);
+            propPtr->data = base + offset;
+            propPtr->length = end - offset;
+            propPtr->owned = 0;
+            dec.duration = isSummary && propid == CFB_PID_EDITTIME;
+            if (DecodeValue(&dec, propPtr->type, offset + 4, end,
+                    &propPtr->valueObj) != CFB_OK) {
+                propPtr->valueObj = Tcl_NewByteArrayObj(base + offset + 4,
+                    (int)(end - offset - 4));
+            }
+            Tcl_IncrRefCount(propPtr->valueObj);
+            secPtr->propCount++;
+        }
+    }
+
+    if (dec.encoding) {
+        Tcl_FreeEncoding(dec.encoding);
+    }
+    ckfree((char *)offsets);
+    return code;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * DecodeDictionary --
+ *
+ *	Decode the dictionary held as property 0 which maps property ids
+ *	to names. Names are stored in the section code page and are padded
+ *	to four bytes when the code page is UTF-16.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The names of the section are filled in.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+DecodeDictionary(Decoder *decPtr, unsigned long pos, unsigned long end,
+    CfbPropSection *secPtr)
+{
+    const unsigned char *base = decPtr->base;
+    unsigned long count, n;
+
+    if (secPtr->names != NULL || !HAVE(pos, 4, end)) {
+        return CFB_EFORMAT;
+    }
+    count = GET32(base + pos);
+    pos += 4;
+    if (count > (end - pos) / 8) {
+        return CFB_EFORMAT;
+    }
+    secPtr->names = (CfbPropName *)ckalloc((count + 1) * sizeof(CfbPropName));
+    secPtr->nameSpace = (int)count + 1;
+    for (n = 0; n < count; n++) {
+        CfbPropName *namePtr = secPtr->names + n;
+        unsigned long len;
+
+        if (!HAVE(pos, 8, end)) {
+            return CFB_EFORMAT;
+        }
+        namePtr->propid = GET32(base + pos);
+        len = GET32(base + pos + 4);
+        pos += 8;
+        if (decPtr->encoding == NULL) {
+            if (len > (end - pos) / 2) {
+                return CFB_EFORMAT;
+            }
+            namePtr->nameObj = Utf16Obj(base + pos, len);
+            pos += len * 2;
+            SkipPadding(decPtr, &pos, end);
+        } else {
+            if (!HAVE(pos, len, end)) {
+                return CFB_EFORMAT;
+            }
+            namePtr->nameObj = StringObj(decPtr, base + pos, len);
+            pos += len;
+        }
+        Tcl_IncrRefCount(namePtr->nameObj);
+        secPtr->nameCount++;
+    }
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * DecodeValue --
+ *
+ *	Decode the value of a property of the given type. The value starts
+ *	after the type field and may extend up to end. A vector is a count
+ *	followed by the elements packed together.
+ *
+ * Results:
+ *	A CFB status code. CFB_ENOTSUP is returned for types that are not
+ *	decoded and CFB_EFORMAT if the value runs beyond the end.
+ *
+ * Side effects:
+ *	A new object is stored in objPtrPtr on success.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+DecodeValue(Decoder *decPtr, int type, unsigned long pos, unsigned long end,
+    Tcl_Obj **objPtrPtr)
+{
+    Tcl_Obj *listObj;
+    unsigned long count, n;
+    int base = type & CFB_VT_TYPEMASK, code = CFB_OK;
+
+    if (type == base) {
+        return DecodeScalar(decPtr, type, &pos, end, objPtrPtr);
+    }
+    if (type != (CFB_VT_VECTOR | base)
+        || base == CFB_VT_EMPTY || base == CFB_VT_NULL) {
+        return CFB_ENOTSUP;
+    }
+    if (!HAVE(pos, 4, end)) {
+        return CFB_EFORMAT;
+    }
+    count = GET32(decPtr->base + pos);
+    pos += 4;
+    if (count > end - pos) {
+        return CFB_EFORMAT;
+    }
+
+    listObj = Tcl_NewListObj(0, NULL);
+    for (n = 0; code == CFB_OK && n < count; n++) {
+        Tcl_Obj *elemObj;
+        code = DecodeScalar(decPtr, base, &pos, end, &elemObj);
+        if (code == CFB_OK) {
+            Tcl_ListObjAppendElement(NULL, listObj, elemObj);
+        }
+    }
+    if (code != CFB_OK) {
+        Tcl_DecrRefCount(listObj);
+        return code;
+    }
+    *objPtrPtr = listObj;
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * DecodeScalar --
+ *
+ *	Decode a single value at *posPtr. Fixed size values occupy their
+ *	natural size so that the elements of a vector are packed. Strings,
+ *	blobs and variants are followed by padding to a multiple of four
+ *	bytes.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	A new object is stored in objPtrPtr and *posPtr is moved past the
+ *	value on success.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+DecodeScalar(Decoder *decPtr, int type, unsigned long *posPtr,
+    unsigned long end, Tcl_Obj **objPtrPtr)
+{
+    const unsigned char *p = decPtr->base + *posPtr;
+    unsigned long pos = *posPtr, len = 0;
+    Tcl_Obj *objPtr = NULL;
+    union { unsigned long u; float f; } r4;
+    union { Tcl_WideUInt u; double d; } r8;
+
+    switch (type) {
+    case CFB_VT_EMPTY: case CFB_VT_NULL:
+        objPtr = Tcl_NewObj();
+        break;
+    case CFB_VT_I1: case CFB_VT_UI1:
+        len = 1;
+        break;
+    case CFB_VT_I2: case CFB_VT_UI2: case CFB_VT_BOOL:
+        len = 2;
+        break;
+    case CFB_VT_I4: case CFB_VT_UI4: case CFB_VT_INT: case CFB_VT_UINT:
+    case CFB_VT_ERROR: case CFB_VT_R4:
+        len = 4;
+        break;
+    case CFB_VT_I8: case CFB_VT_UI8: case CFB_VT_R8: case CFB_VT_CY:
+    case CFB_VT_DATE: case CFB_VT_FILETIME:
+        len = 8;
+        break;
+    case CFB_VT_CLSID: case CFB_VT_DECIMAL:
+        len = 16;
+        break;
+    case CFB_VT_LPSTR: case CFB_VT_BSTR: case CFB_VT_LPWSTR:
+    case CFB_VT_BLOB: case CFB_VT_CF: case CFB_VT_VARIANT:
+        len = 4;
+        break;
+    default:
+        return CFB_ENOTSUP;
+    }
+    if (!HAVE(pos, len, end)) {
+        return CFB_EFORMAT;
+    }
+    pos += len;
+
+    switch (type) {
+    case CFB_VT_I1:
+        objPtr = Tcl_NewWideIntObj((signed char)p[0]);
+        break;
+    case CFB_VT_UI1:
+        objPtr = Tcl_NewWideIntObj(p[0]);
+        break;
+    case CFB_VT_I2:
+        objPtr = Tcl_NewWideIntObj((short)GET16(p));
+        break;
+    case CFB_VT_UI2:
+        objPtr = Tcl_NewWideIntObj(GET16(p));
+        break;
+    case CFB_VT_BOOL:
+        objPtr = Tcl_NewBooleanObj(GET16(p) != 0);
+        break;
+    case CFB_VT_I4: case CFB_VT_INT:
+        objPtr = Tcl_NewWideIntObj((int)GET32(p));
+        break;
+    case CFB_VT_UI4: case CFB_VT_UINT: case CFB_VT_ERROR:
+        objPtr = Tcl_NewWideIntObj(GET32(p));
+        break;
+    case CFB_VT_I8: case CFB_VT_UI8:
+        objPtr = Tcl_NewWideIntObj((Tcl_WideInt)GET64(p));
+        break;
+    case CFB_VT_R4:
+        r4.u = GET32(p);
+        objPtr = Tcl_NewDoubleObj(r4.f);
+        break;
+    case CFB_VT_R8:
+        r8.u = GET64(p);
+        objPtr = Tcl_NewDoubleObj(r8.d);
+        break;
+    case CFB_VT_CY:
+        objPtr = Tcl_NewDoubleObj((Tcl_WideInt)GET64(p) / 10000.0);
+        break;
+    case CFB_VT_DATE:
+        /* days since 30 December 1899 */
+        r8.u = GET64(p);
+        objPtr = Tcl_NewWideIntObj((Tcl_WideInt)
+            floor((r8.d - 25569.0) * 86400.0 + 0.5));
+        break;
+    case CFB_VT_FILETIME:
+        objPtr = CfbFileTimeObj(GET64(p), decPtr->duration);
+        break;
+    case CFB_VT_CLSID:
+        objPtr = CfbGuidObj(p);
+        break;
+    case CFB_VT_DECIMAL: {
+        /* reserved, scale, sign, high 32 bits and low 64 bits */
+        double d = GET32(p + 4) * 18446744073709551616.0
+            + (double)GET64(p + 8);
+        int scale = p[2];
+        while (scale-- > 0) {
+            d /= 10.0;
+        }
+        objPtr = Tcl_NewDoubleObj((p[3] & 0x80) ? -d : d);
+        break;
+    }
+    case CFB_VT_LPSTR: case CFB_VT_BSTR:
+        len = GET32(p);
+        if (!HAVE(pos, len, end)) {
+            return CFB_EFORMAT;
+        }
+        objPtr = StringObj(decPtr, p + 4, len);
+        pos += len;
+        SkipPadding(decPtr, &pos, end);
+        break;
+    case CFB_VT_LPWSTR:
+        len = GET32(p);
+        if (len > (end - pos) / 2) {
+            return CFB_EFORMAT;
+        }
+        objPtr = Utf16Obj(p + 4, len);
+        pos += len * 2;
+        SkipPadding(decPtr, &pos, end);
+        break;
+    case CFB_VT_BLOB: case CFB_VT_CF:
+        /* clipboard data is the format followed by the data */
+        len = GET32(p);
+        if (!HAVE(pos, len, end) || len > INT_MAX) {
+            return CFB_EFORMAT;
+        }
+        objPtr = Tcl_NewByteArrayObj(p + 4, (int)len);
+        pos += len;
+        SkipPadding(decPtr, &pos, end);
+        break;
+    case CFB_VT_VARIANT: {
+        int code, elemType = (int)GET16(p);
+        if (elemType == CFB_VT_VARIANT
+            || (elemType & ~CFB_VT_TYPEMASK) != 0) {
+            return CFB_ENOTSUP;
+        }
+        code = DecodeScalar(decPtr, elemType, &pos, end, &objPtr);
+        if (code != CFB_OK) {
+            return code;
+        }
+        pos = PAD4(pos) < end ? PAD4(pos) : end;
+        break;
+    }
+    }
+
+    *posPtr = pos;
+    *objPtrPtr = objPtr;
+    return CFB_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * SkipPadding --
+ *
+ *	Move past the padding after a variable length value. Some writers
+ *	do not pad the strings held in a vector so only zero bytes are
+ *	skipped. The length of a following element is never zero in its
+ *	low byte when it is unpadded.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	*posPtr is advanced to the next multiple of four if possible.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+SkipPadding(Decoder *decPtr, unsigned long *posPtr, unsigned long end)
+{
+    unsigned long pos = *posPtr;
+    while ((pos & 3) && pos < end && decPtr->base[pos] == 0) {
+        pos++;
+    }
+    *posPtr = pos;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StringObj, Utf16Obj --
+ *
+ *	Convert a string in the section code page or in UTF-16 into a Tcl
+ *	object. Trailing null characters are removed.
+ *
+ * Results:
+ *	A new Tcl object.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+StringObj(Decoder *decPtr, const unsigned char *p, unsigned long len)
+{
+    Tcl_DString ds;
+    Tcl_Obj *objPtr;
+
+    if (decPtr->encoding == NULL) {
+        return Utf16Obj(p, len / 2);
+    }
+    while (len > 0 && p[len - 1] == 0) {
+        len--;
+    }
+    Tcl_ExternalToUtfDString(decPtr->encoding, (const char *)p, (int)len,
+        &ds);
+    objPtr = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    return objPtr;
+}
+
+static Tcl_Obj *
+Utf16Obj(const unsigned char *p, unsigned long units)
+{
+    Tcl_Obj *objPtr;
+    Tcl_UniChar *uni;
+    unsigned long n;
+    int len = 0;
+
+    while (units > 0 && GET16(p + (units - 1) * 2) == 0) {
+        units--;
+    }
+    uni = (Tcl_UniChar *)ckalloc((units + 1) * sizeof(Tcl_UniChar));
+    for (n = 0; n < units; n++) {
+        unsigned int ch = GET16(p + n * 2);
+        if (sizeof(Tcl_UniChar) > 2 && (ch & 0xFC00) == 0xD800
+            && n + 1 < units && (GET16(p + n * 2 + 2) & 0xFC00) == 0xDC00) {
+            n++;
+            ch = 0x10000 + (((ch & 0x3FF) << 10) | (GET16(p + n * 2) & 0x3FF));
+        }
+        uni[len++] = (Tcl_UniChar)ch;
+    }
+    objPtr = Tcl_NewUnicodeObj(uni, len);
+    ckfree((char *)uni);
+    return objPtr;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * GetCodePageEncoding --
+ *
+ *	Find the Tcl encoding for a Windows code page. Unknown code pages
+ *	are read as ISO 8859-1 so that no bytes are lost.
+ *
+ * Results:
+ *	A Tcl encoding that must be released with Tcl_FreeEncoding.
+ *
+ * Side effects:
+ *	The encoding may be loaded.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static Tcl_Encoding
+GetCodePageEncoding(int codepage)
+{
+    Tcl_Encoding encoding;
+    char name[4 + TCL_INTEGER_SPACE];
+    int n;
+
+    sprintf(name, "cp%d", codepage);
+    for (n = 0; codePages[n].name != NULL; n++) {
+        if (codePages[n].codepage == codepage) {
+            strcpy(name, codePages[n].name);
+            break;
+        }
+    }
+    encoding = Tcl_GetEncoding(NULL, name);
+    if (encoding == NULL) {
+        encoding = Tcl_GetEncoding(NULL, "iso8859-1");
+    }
+    return encoding;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * SetCodePage --
+ *
+ *	Prepare a decoder for the strings of a section in the given code
+ *	page.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	An encoding may be stored in the decoder which must be released
+ *	with Tcl_FreeEncoding.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+SetCodePage(Decoder *decPtr, int codepage)
+{
+    decPtr->codepage = codepage;
+    decPtr->encoding = NULL;
+    if (codepage != PROP_CODEPAGE_UNICODE) {
+        decPtr->encoding = GetCodePageEncoding(codepage);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * NextOffset --
+ *
+ *	Find the end of the value at offset from the sorted offsets of
+ *	all the values in the section.
+ *
+ * Results:
+ *	The next larger offset or the size of the section.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static unsigned long
+NextOffset(const unsigned long *offsets, int count, unsigned long offset,
+    unsigned long size)
+{
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (offsets[mid] <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < count ? offsets[lo] : size;
+}
+
+static int
+CompareOffsets(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : (x > y);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropFree --
+ *
+ *	Release a decoded property set.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed and the value objects are released.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+void
+CfbPropFree(CfbPropSet *setPtr)
+{
+    int n;
+    for (n = 0; n < setPtr->sectionCount; n++) {
+        FreeSection(setPtr->sections + n);
+    }
+    if (setPtr->sections) {
+        ckfree((char *)setPtr->sections);
+    }
+    if (setPtr->data) {
+        ckfree((char *)setPtr->data);
+    }
+    ckfree((char *)setPtr);
+}
+
+static void
+FreeSection(CfbPropSection *secPtr)
+{
+    int n;
+    for (n = 0; n < secPtr->propCount; n++) {
+        Tcl_DecrRefCount(secPtr->props[n].valueObj);
+        if (secPtr->props[n].owned) {
+            ckfree((char *)secPtr->props[n].data);
+        }
+    }
+    for (n = 0; n < secPtr->nameCount; n++) {
+        Tcl_DecrRefCount(secPtr->names[n].nameObj);
+    }
+    if (secPtr->props) {
+        ckfree((char *)secPtr->props);
+    }
+    if (secPtr->names) {
+        ckfree((char *)secPtr->names);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropCreate --
+ *
+ *	Create an empty property set to which sections may be added with
+ *	CfbPropNewSection.
+ *
+ * Results:
+ *	A property set that must be released with CfbPropFree.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+CfbPropSet *
+CfbPropCreate(void)
+{
+    CfbPropSet *setPtr = (CfbPropSet *)ckalloc(sizeof(CfbPropSet));
+    memset(setPtr, 0, sizeof(CfbPropSet));
+    setPtr->version = 0;
+    setPtr->systemId = PROP_SYSTEM_ID;
+    return setPtr;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropNewSection --
+ *
+ *	Add an empty section for a format identifier or empty the section
+ *	if it is already present. New sections hold their strings in
+ *	UTF-16. The user defined properties must follow a document summary
+ *	section which is added first if necessary.
+ *
+ * Results:
+ *	The section. Adding a section may move the other sections so any
+ *	pointers to them must be looked up again.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+CfbPropSection *
+CfbPropNewSection(CfbPropSet *setPtr, const unsigned char *fmtid)
+{
+    CfbPropSection *secPtr = CfbPropFindSection(setPtr, fmtid);
+    Tcl_Obj *objPtr;
+
+    if (secPtr != NULL) {
+        FreeSection(secPtr);
+    } else {
+        if (memcmp(fmtid, cfbFmtidUserDefined, 16) == 0
+            && CfbPropFindSection(setPtr, cfbFmtidDocSummary) == NULL) {
+            CfbPropNewSection(setPtr, cfbFmtidDocSummary);
+        }
+        setPtr->sections = (CfbPropSection *)ckrealloc(
+            (char *)setPtr->sections,
+            (setPtr->sectionCount + 1) * sizeof(CfbPropSection));
+        secPtr = setPtr->sections + setPtr->sectionCount++;
+    }
+    memset(secPtr, 0, sizeof(CfbPropSection));
+    memcpy(secPtr->fmtid, fmtid, 16);
+    secPtr->codepage = PROP_CODEPAGE_UNICODE;
+
+    objPtr = Tcl_NewIntObj(PROP_CODEPAGE_UNICODE);
+    Tcl_IncrRefCount(objPtr);
+    CfbPropSetValue(NULL, secPtr, CFB_PID_CODEPAGE, CFB_VT_I2, objPtr);
+    Tcl_DecrRefCount(objPtr);
+    return secPtr;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropSetValue --
+ *
+ *	Set the value of a property, replacing any existing value. The
+ *	value is encoded immediately and then decoded again so that the
+ *	value held is the one that will be read back from the stream.
+ *
+ * Results:
+ *	A standard Tcl result. An error is left in interp if the value
+ *	cannot be converted to the type.
+ *
+ * Side effects:
+ *	The property is added to the section or its value is replaced.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbPropSetValue(Tcl_Interp *interp, CfbPropSection *secPtr,
+    unsigned long propid, int type, Tcl_Obj *valueObj)
+{
+    CfbProperty *propPtr;
+    Decoder dec;
+    Tcl_DString ds;
+    Tcl_Obj *objPtr;
+    unsigned char *data;
+    unsigned long length;
+
+    dec.base = NULL;
+    dec.size = 0;
+    dec.duration = memcmp(secPtr->fmtid, cfbFmtidSummary, 16) == 0
+        && propid == CFB_PID_EDITTIME;
+    SetCodePage(&dec, secPtr->codepage);
+    Tcl_DStringInit(&ds);
+    Put32(&ds, (unsigned long)type);
+    if (EncodeValue(interp, &dec, type, valueObj, &ds) != TCL_OK) {
+        Tcl_DStringFree(&ds);
+        if (dec.encoding) {
+            Tcl_FreeEncoding(dec.encoding);
+        }
+        return TCL_ERROR;
+    }
+
+    length = (unsigned long)Tcl_DStringLength(&ds);
+    data = (unsigned char *)ckalloc(length);
+    memcpy(data, Tcl_DStringValue(&ds), length);
+    Tcl_DStringFree(&ds);
+    dec.base = data;
+    dec.size = length;
+    if (DecodeValue(&dec, type, 4, length, &objPtr) != CFB_OK) {
+        objPtr = Tcl_NewByteArrayObj(data + 4, (int)length - 4);
+    }
+    Tcl_IncrRefCount(objPtr);
+    if (dec.encoding) {
+        Tcl_FreeEncoding(dec.encoding);
+    }
+
+    propPtr = CfbPropFind(secPtr, propid);
+    if (propPtr != NULL) {
+        Tcl_DecrRefCount(propPtr->valueObj);
+        if (propPtr->owned) {
+            ckfree((char *)propPtr->data);
+        }
+    } else {
+        if (secPtr->propCount == secPtr->propSpace) {
+            secPtr->propSpace = secPtr->propSpace ? secPtr->propSpace * 2 : 8;
+            secPtr->props = (CfbProperty *)ckrealloc((char *)secPtr->props,
+                secPtr->propSpace * sizeof(CfbProperty));
+        }
+        propPtr = secPtr->props + secPtr->propCount++;
+        propPtr->propid = propid;
+    }
+    propPtr->type = type;
+    propPtr->valueObj = objPtr;
+    propPtr->data = data;
+    propPtr->length = length;
+    propPtr->owned = 1;
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropUnset --
+ *
+ *	Remove a property and its name from a section.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The property is released if present.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+void
+CfbPropUnset(CfbPropSection *secPtr, unsigned long propid)
+{
+    int n;
+
+    for (n = 0; n < secPtr->propCount; n++) {
+        CfbProperty *propPtr = secPtr->props + n;
+        if (propPtr->propid == propid) {
+            Tcl_DecrRefCount(propPtr->valueObj);
+            if (propPtr->owned) {
+                ckfree((char *)propPtr->data);
+            }
+            memmove(propPtr, propPtr + 1,
+                (secPtr->propCount - n - 1) * sizeof(CfbProperty));
+            secPtr->propCount--;
+            break;
+        }
+    }
+    for (n = 0; n < secPtr->nameCount; n++) {
+        CfbPropName *namePtr = secPtr->names + n;
+        if (namePtr->propid == propid) {
+            Tcl_DecrRefCount(namePtr->nameObj);
+            memmove(namePtr, namePtr + 1,
+                (secPtr->nameCount - n - 1) * sizeof(CfbPropName));
+            secPtr->nameCount--;
+            break;
+        }
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropAddName --
+ *
+ *	Add a name to the dictionary of a section. The name is given the
+ *	next property id above those in use.
+ *
+ * Results:
+ *	The property id for the name.
+ *
+ * Side effects:
+ *	The dictionary is extended.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+unsigned long
+CfbPropAddName(CfbPropSection *secPtr, Tcl_Obj *nameObj)
+{
+    unsigned long propid = CFB_PID_CODEPAGE;
+    CfbPropName *namePtr;
+    int n;
+
+    for (n = 0; n < secPtr->propCount; n++) {
+        unsigned long id = secPtr->props[n].propid;
+        if (id > propid && id < 0x80000000UL) {
+            propid = id;
+        }
+    }
+    for (n = 0; n < secPtr->nameCount; n++) {
+        unsigned long id = secPtr->names[n].propid;
+        if (id > propid && id < 0x80000000UL) {
+            propid = id;
+        }
+    }
+    propid++;
+
+    if (secPtr->nameCount == secPtr->nameSpace) {
+        secPtr->nameSpace = secPtr->nameSpace ? secPtr->nameSpace * 2 : 8;
+        secPtr->names = (CfbPropName *)ckrealloc((char *)secPtr->names,
+            secPtr->nameSpace * sizeof(CfbPropName));
+    }
+    namePtr = secPtr->names + secPtr->nameCount++;
+    namePtr->propid = propid;
+    namePtr->nameObj = nameObj;
+    Tcl_IncrRefCount(nameObj);
+    return propid;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropEncode --
+ *
+ *	Encode a property set as a complete property set stream. The
+ *	properties are written from their encoded form so values that
+ *	were not changed are copied unaltered.
+ *
+ * Results:
+ *	A new byte array object holding the stream.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+CfbPropEncode(CfbPropSet *setPtr)
+{
+    Tcl_DString ds;
+    Tcl_Obj *objPtr;
+    int n;
+
+    Tcl_DStringInit(&ds);
+    Put32(&ds, 0xFFFEUL | ((unsigned long)setPtr->version << 16));
+    Put32(&ds, setPtr->systemId);
+    Tcl_DStringAppend(&ds, (const char *)setPtr->clsid, 16);
+    Put32(&ds, (unsigned long)setPtr->sectionCount);
+    for (n = 0; n < setPtr->sectionCount; n++) {
+        Tcl_DStringAppend(&ds, (const char *)setPtr->sections[n].fmtid, 16);
+        Put32(&ds, 0);
+    }
+    for (n = 0; n < setPtr->sectionCount; n++) {
+        char *p = Tcl_DStringValue(&ds) + PROP_HEADER_SIZE
+            + n * PROP_SECTION_REF + 16;
+        PUT32(p, Tcl_DStringLength(&ds));
+        EncodeSection(setPtr->sections + n, &ds);
+    }
+    objPtr = Tcl_NewByteArrayObj((unsigned char *)Tcl_DStringValue(&ds),
+        Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    return objPtr;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * EncodeSection --
+ *
+ *	Append a section to a stream being encoded. The dictionary is
+ *	written first followed by the properties in order. The offsets in
+ *	the section header are filled in as each value is written.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The section is appended to the dynamic string.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+EncodeSection(CfbPropSection *secPtr, Tcl_DString *dsPtr)
+{
+    Decoder dec;
+    int start = Tcl_DStringLength(dsPtr), index, n;
+    int count = secPtr->propCount + (secPtr->nameCount > 0);
+    char *p;
+
+    Put32(dsPtr, 0);
+    Put32(dsPtr, (unsigned long)count);
+    for (n = 0; n < count; n++) {
+        Put32(dsPtr, 0);
+        Put32(dsPtr, 0);
+    }
+    index = start + 8;
+
+    SetCodePage(&dec, secPtr->codepage);
+    if (secPtr->nameCount > 0) {
+        p = Tcl_DStringValue(dsPtr) + index;
+        PUT32(p, CFB_PID_DICTIONARY);
+        PUT32(p + 4, Tcl_DStringLength(dsPtr) - start);
+        index += 8;
+        Put32(dsPtr, (unsigned long)secPtr->nameCount);
+        for (n = 0; n < secPtr->nameCount; n++) {
+            Put32(dsPtr, secPtr->names[n].propid);
+            PutString(&dec, secPtr->names[n].nameObj, 1, dsPtr);
+            if (dec.encoding == NULL) {
+                PutPadding(dsPtr, start);
+            }
+        }
+        PutPadding(dsPtr, start);
+    }
+    for (n = 0; n < secPtr->propCount; n++) {
+        const CfbProperty *propPtr = secPtr->props + n;
+        p = Tcl_DStringValue(dsPtr) + index;
+        PUT32(p, propPtr->propid);
+        PUT32(p + 4, Tcl_DStringLength(dsPtr) - start);
+        index += 8;
+        Tcl_DStringAppend(dsPtr, (const char *)propPtr->data,
+            (int)propPtr->length);
+        PutPadding(dsPtr, start);
+    }
+    p = Tcl_DStringValue(dsPtr) + start;
+    PUT32(p, Tcl_DStringLength(dsPtr) - start);
+    if (dec.encoding) {
+        Tcl_FreeEncoding(dec.encoding);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * EncodeValue --
+ *
+ *	Append the encoding of a value of the given type to a dynamic
+ *	string. The type field has already been written.
+ *
+ * Results:
+ *	A standard Tcl result. An error is left in interp if the value is
+ *	not valid for the type or the type cannot be written.
+ *
+ * Side effects:
+ *	The value is appended to the dynamic string.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+EncodeValue(Tcl_Interp *interp, Decoder *decPtr, int type,
+    Tcl_Obj *valueObj, Tcl_DString *dsPtr)
+{
+    int start = Tcl_DStringLength(dsPtr) - 4, i, len;
+    unsigned char buf[8], *bytes;
+    Tcl_WideInt w;
+    union { Tcl_WideUInt u; double d; } r8;
+
+    switch (type) {
+    case CFB_VT_I2:
+        if (Tcl_GetIntFromObj(interp, valueObj, &i) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Put32(dsPtr, (unsigned long)i & 0xFFFF);
+        break;
+    case CFB_VT_BOOL:
+        if (Tcl_GetBooleanFromObj(interp, valueObj, &i) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Put32(dsPtr, i ? 0xFFFF : 0);
+        break;
+    case CFB_VT_I4:
+        if (Tcl_GetIntFromObj(interp, valueObj, &i) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Put32(dsPtr, (unsigned long)i);
+        break;
+    case CFB_VT_I8: case CFB_VT_FILETIME:
+        if (Tcl_GetWideIntFromObj(interp, valueObj, &w) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (type == CFB_VT_FILETIME) {
+            /* seconds since the epoch or a number of seconds */
+            w = (Tcl_WideInt)CfbFileTimeFromSeconds(w, decPtr->duration);
+        }
+        PUT64(buf, (Tcl_WideUInt)w);
+        Tcl_DStringAppend(dsPtr, (const char *)buf, 8);
+        break;
+    case CFB_VT_R8:
+        if (Tcl_GetDoubleFromObj(interp, valueObj, &r8.d) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        PUT64(buf, r8.u);
+        Tcl_DStringAppend(dsPtr, (const char *)buf, 8);
+        break;
+    case CFB_VT_LPSTR: case CFB_VT_BSTR:
+        PutString(decPtr, valueObj, 0, dsPtr);
+        PutPadding(dsPtr, start);
+        break;
+    case CFB_VT_LPWSTR:
+        /* always UTF-16 and counted in characters */
+        Put32(dsPtr, PutUtf16(valueObj, NULL) + 1);
+        PutUtf16(valueObj, dsPtr);
+        Tcl_DStringAppend(dsPtr, "\0\0", 2);
+        PutPadding(dsPtr, start);
+        break;
+    case CFB_VT_BLOB:
+        bytes = Tcl_GetByteArrayFromObj(valueObj, &len);
+        Put32(dsPtr, (unsigned long)len);
+        Tcl_DStringAppend(dsPtr, (const char *)bytes, len);
+        PutPadding(dsPtr, start);
+        break;
+    default:
+        if (interp) {
+            Tcl_Obj *errObj = Tcl_NewStringObj("cannot set a value of type ",
+                -1);
+            Tcl_AppendObjToObj(errObj, CfbPropTypeObj(type));
+            Tcl_SetObjResult(interp, errObj);
+        }
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PutString, PutUtf16 --
+ *
+ *	Append a string in the code page of the section preceded by its
+ *	length and followed by a null. The length of a UTF-16 string is
+ *	given in bytes unless chars is set, as it is for the names in the
+ *	dictionary. PutUtf16 appends the UTF-16 form of a string alone or
+ *	only counts it if dsPtr is NULL.
+ *
+ * Results:
+ *	PutUtf16 returns the number of 16 bit units appended.
+ *
+ * Side effects:
+ *	The string is appended to the dynamic string.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+PutString(Decoder *decPtr, Tcl_Obj *objPtr, int chars, Tcl_DString *dsPtr)
+{
+    int pos = Tcl_DStringLength(dsPtr);
+    unsigned long length;
+    char *p;
+
+    Put32(dsPtr, 0);
+    if (decPtr->encoding == NULL) {
+        length = PutUtf16(objPtr, dsPtr) + 1;
+        Tcl_DStringAppend(dsPtr, "\0\0", 2);
+        if (!chars) {
+            length *= 2;
+        }
+    } else {
+        Tcl_DString ext;
+        Tcl_UtfToExternalDString(decPtr->encoding, Tcl_GetString(objPtr), -1,
+            &ext);
+        length = (unsigned long)Tcl_DStringLength(&ext) + 1;
+        Tcl_DStringAppend(dsPtr, Tcl_DStringValue(&ext), (int)length);
+        Tcl_DStringFree(&ext);
+    }
+    p = Tcl_DStringValue(dsPtr) + pos;
+    PUT32(p, length);
+}
+
+static unsigned long
+PutUtf16(Tcl_Obj *objPtr, Tcl_DString *dsPtr)
+{
+    Tcl_UniChar *uni;
+    unsigned long units = 0;
+    unsigned char buf[4];
+    int len, n;
+
+    uni = Tcl_GetUnicodeFromObj(objPtr, &len);
+    for (n = 0; n < len; n++) {
+        unsigned long ch = (unsigned long)uni[n];
+        if (ch > 0xFFFF) {
+            ch -= 0x10000;
+            PUT16(buf, 0xD800 | (ch >> 10));
+            PUT16(buf + 2, 0xDC00 | (ch & 0x3FF));
+            if (dsPtr) {
+                Tcl_DStringAppend(dsPtr, (const char *)buf, 4);
+            }
+            units += 2;
+        } else {
+            PUT16(buf, ch);
+            if (dsPtr) {
+                Tcl_DStringAppend(dsPtr, (const char *)buf, 2);
+            }
+            units++;
+        }
+    }
+    return units;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Put32, PutPadding --
+ *
+ *	Append a 32 bit little endian value or the zero bytes needed to
+ *	align the dynamic string to four bytes from start.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The dynamic string is extended.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+Put32(Tcl_DString *dsPtr, unsigned long value)
+{
+    unsigned char buf[4];
+    PUT32(buf, value);
+    Tcl_DStringAppend(dsPtr, (const char *)buf, 4);
+}
+
+static void
+PutPadding(Tcl_DString *dsPtr, int start)
+{
+    while ((Tcl_DStringLength(dsPtr) - start) & 3) {
+        Tcl_DStringAppend(dsPtr, "", 1);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropFindSection, CfbPropFind --
+ *
+ *	Locate the section for a format identifier or a property within a
+ *	section.
+ *
+ * Results:
+ *	A pointer to the section or property or NULL if not present.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+CfbPropSection *
+CfbPropFindSection(CfbPropSet *setPtr, const unsigned char *fmtid)
+{
+    int n;
+    for (n = 0; n < setPtr->sectionCount; n++) {
+        if (memcmp(setPtr->sections[n].fmtid, fmtid, 16) == 0) {
+            return setPtr->sections + n;
+        }
+    }
+    return NULL;
+}
+
+CfbProperty *
+CfbPropFind(CfbPropSection *secPtr, unsigned long propid)
+{
+    int n;
+    for (n = 0; n < secPtr->propCount; n++) {
+        if (secPtr->props[n].propid == propid) {
+            return secPtr->props + n;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropTypeObj --
+ *
+ *	Get the name of a property type such as VT_LPSTR. Vector types are
+ *	given as VT_VECTOR|VT_LPSTR.
+ *
+ * Results:
+ *	A new Tcl object. Unknown types are returned as integers.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+CfbPropTypeObj(int type)
+{
+    Tcl_Obj *objPtr;
+    int n, base = type & CFB_VT_TYPEMASK;
+
+    for (n = 0; typeNames[n].name != NULL; n++) {
+        if (typeNames[n].type == base) {
+            break;
+        }
+    }
+    if (typeNames[n].name == NULL
+        || (type & ~(CFB_VT_TYPEMASK | CFB_VT_VECTOR | CFB_VT_ARRAY))
+        || (type & CFB_VT_VECTOR && type & CFB_VT_ARRAY)) {
+        return Tcl_NewIntObj(type);
+    }
+    objPtr = Tcl_NewStringObj(NULL, 0);
+    if (type & CFB_VT_VECTOR) {
+        Tcl_AppendToObj(objPtr, "VT_VECTOR|", -1);
+    } else if (type & CFB_VT_ARRAY) {
+        Tcl_AppendToObj(objPtr, "VT_ARRAY|", -1);
+    }
+    Tcl_AppendToObj(objPtr, typeNames[n].name, -1);
+    return objPtr;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbFileTimeObj, CfbFileTimeFromSeconds --
+ *
+ *	Convert a FILETIME property value to and from seconds. Most
+ *	FILETIME properties are times and are given as seconds since the
+ *	epoch but some, such as the total editing time, hold an interval.
+ *	A zero FILETIME means no time was set and is kept as 0 both ways.
+ *
+ * Results:
+ *	A new Tcl object or the FILETIME value.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+CfbFileTimeObj(Tcl_WideUInt ft, int duration)
+{
+    if (duration || ft == 0) {
+        return Tcl_NewWideIntObj((Tcl_WideInt)(ft / 10000000));
+    }
+    return Tcl_NewWideIntObj(((Tcl_WideInt)ft - 116444736000000000)
+        / 10000000);
+}
+
+Tcl_WideUInt
+CfbFileTimeFromSeconds(Tcl_WideInt secs, int duration)
+{
+    if (duration || secs == 0) {
+        return (Tcl_WideUInt)secs * 10000000;
+    }
+    return (Tcl_WideUInt)(secs * 10000000 + 116444736000000000);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbGuidObj --
+ *
+ *	Format a serialized GUID in the registry form used by OLE.
+ *
+ * Results:
+ *	A new Tcl object such as {F29F85E0-4FF9-1068-AB91-08002B27B3D9}.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+CfbGuidObj(const unsigned char *guid)
+{
+    char buf[40];
+    sprintf(buf, "{%08lX-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+        (unsigned long)GET32(guid), GET16(guid + 4), GET16(guid + 6),
+        guid[8], guid[9], guid[10], guid[11], guid[12], guid[13],
+        guid[14], guid[15]);
+    return Tcl_NewStringObj(buf, -1);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbGuidFromObj --
+ *
+ *	Parse a GUID in registry form into its serialized form. The braces
+ *	are optional.
+ *
+ * Results:
+ *	CFB_OK or CFB_EINVAL if the object is not a GUID.
+ *
+ * Side effects:
+ *	The GUID is stored in guid on success.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+CfbGuidFromObj(Tcl_Obj *objPtr, unsigned char *guid)
+{
+    /* the byte at each pair of hex digits in the registry form */
+    static const int order[16] = {
+        3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15
+    };
+    const char *s = Tcl_GetString(objPtr);
+    int len = objPtr->length, n, k = 0;
+
+    if (len == 38 && s[0] == '{' && s[37] == '}') {
+        s++;
+        len -= 2;
+    }
+    if (len != 36 || s[8] != '-' || s[13] != '-' || s[18] != '-'
+        || s[23] != '-') {
+        return CFB_EINVAL;
+    }
+    for (n = 0; n < 36; n += 2) {
+        int hi, lo;
+        if (s[n] == '-') {
+            n--;
+            continue;
+        }
+        hi = HexDigit(s[n]);
+        lo = HexDigit(s[n + 1]);
+        if (hi < 0 || lo < 0) {
+            return CFB_EINVAL;
+        }
+        guid[order[k++]] = (unsigned char)((hi << 4) | lo);
+    }
+    return CFB_OK;
+}
+
+static int
+HexDigit(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CfbPropStreamName --
+ *
+ *	Get the name of the stream holding the property set for a format
+ *	identifier. The standard property sets have fixed names and the
+ *	user defined properties share the document summary stream. Other
+ *	names are \005 followed by the identifier in base 32, five bits at
+ *	a time from the least significant bit of the first byte. A letter
+ *	that starts a byte is given in upper case as OLE does.
+ *
+ * Results:
+ *	A new Tcl object.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+CfbPropStreamName(const unsigned char *fmtid)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz012345";
+    const unsigned char *q = fmtid, *end = fmtid + 16;
+    char name[32], *p = name;
+    int avail = 8;
+
+    if (memcmp(fmtid, cfbFmtidSummary, 16) == 0) {
+        return Tcl_NewStringObj("\005SummaryInformation", -1);
+    }
+    if (memcmp(fmtid, cfbFmtidDocSummary, 16) == 0
+        || memcmp(fmtid, cfbFmtidUserDefined, 16) == 0) {
+        return Tcl_NewStringObj("\005DocumentSummaryInformation", -1);
+    }
+
+    *p++ = '\005';
+    while (q < end) {
+        unsigned int bits = *q >> (8 - avail);
+        if (avail >= 5) {
+            char c = alphabet[bits & 0x1F];
+            if (avail == 8 && c >= 'a' && c <= 'z') {
+                c += 'A' - 'a';
+            }
+            *p++ = c;
+            avail -= 5;
+            if (avail == 0) {
+                q++;
+                avail = 8;
+            }
+        } else {
+            if (++q < end) {
+                bits |= (unsigned int)*q << avail;
+            }
+            *p++ = alphabet[bits & 0x1F];
+            avail += 8 - 5;
+        }
+    }
+    return Tcl_NewStringObj(name, (int)(p - name));
+}
+
+/* ----------------------------------------------------------------------
+ *
+ * Local variables:
+ * mode: c
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -138,24 +138,35 @@ proc vfs::stg::stat {token path} {
 proc vfs::stg::matchindirectory {token path actualpath pattern type} {
     ::vfs::log [list matchindirectory: $token $path $actualpath $pattern $type]
 
+    set dirs [::vfs::matchDirectories $type]
+    set files [::vfs::matchFiles $type]
     set names {}
     if {[string length $pattern] > 0} {
+        # Let the storage filter on type so we avoid a stat per item.
         set stg [PathToStg $token $path]
-        foreach name [$stg names] {
+        set cmd [list $stg names]
+        if {$dirs && !$files} {
+            lappend cmd -type directory
+        } elseif {$files && !$dirs} {
+            lappend cmd -type file
+        }
+        foreach name [eval $cmd] {
             if {[string match $pattern $name]} {lappend names $name}
         }
     } else {
         set stg [PathToStg $token [file dirname $path]]
-        set names [file tail $path]
         set actualpath [file dirname $actualpath]
-        if {[catch {$stg stat $names sd}]} {
+        if {[catch {$stg stat [file tail $path] sd}]} {
             ::vfs::filesystem posixerror ::vfs::posix(ENOENT)
             return {}
         }
+        if {($sd(type) eq "directory") ? $dirs : $files} {
+            set names [list [file tail $path]]
+        }
     }
 
     set glob {}
-    foreach name [::vfs::matchCorrectTypes $type $names $actualpath] {
+    foreach name $names {
 	lappend glob [file join $actualpath $name]
     }
     return $glob
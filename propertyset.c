@@ -3,11 +3,14 @@
  * Subcommands for manipulating and inspecting property sets within
  * structured storages. 
  *
- * LIMITATIONS
- *   * At this time we only support the standard property sets pre-defined
- *     for COM and Microsoft Office documents.
- *   * The conversion for FILETIME is crap.
- *   * We can currently only set LPSTR values.
+ * Property values are returned as Tcl objects of the natural type. With
+ * OLE the PROPVARIANT values are converted directly. Native storages
+ * read the whole property set stream and decode it with cfbprop.c and
+ * write it again in full when it has been changed.
+ *
+ * Property sets and the names of their properties are held in a
+ * registry. The standard sets are always present and applications may
+ * register their own with "storage propertyset register".
  *
  * ----------------------------------------------------------------------
  *
@@ -20,186 +23,352 @@
  */
 
 #include "tclstorage.h"
-
-typedef struct _PropertySet {
-    IPropertyStorage *propPtr;
-    FMTID             fmtid;
-    DWORD             mode;
-} PropertySet;
+#include <math.h>
 
 static long PROPSETID = 0;
 
-       Tcl_ObjCmdProc PropertySetOpenCmd;
-       Tcl_ObjCmdProc PropertySetDeleteCmd;
-       Tcl_ObjCmdProc PropertySetNamesCmd;
-
-       Tcl_ObjCmdProc PropertyNamesCmd;
-static Tcl_ObjCmdProc PropertyGetCmd;
-static Tcl_ObjCmdProc PropertySetCmd;
-static Tcl_ObjCmdProc PropertyDeleteCmd;
+static int  GetFMTIDFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr,
+                unsigned char *fmtid);
+static Tcl_Obj *GetNameFromPROPID(const unsigned char *fmtid,
+                unsigned long propid);
+static unsigned long GetPROPIDFromName(const unsigned char *fmtid,
+                const char *name);
 static Tcl_ObjCmdProc PropertyCloseCmd;
+static Tcl_ObjCmdProc PropertyGetAllCmd;
+static int  GetAllArgs(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[],
+                int *rawPtr);
+static int  NoPropertySets(Tcl_Interp *interp);
+static int  GetTypeFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr,
+                int *typePtr);
+static int  InferType(Tcl_Obj *objPtr);
+static int  ChooseType(int existing, const unsigned char *fmtid,
+                unsigned long propid, Tcl_Obj *valueObj);
 
-static Tcl_CmdDeleteProc PropertyCmdDeleteProc;
-static void ConvertValueToString( const PROPVARIANT *propvar, 
-                                  WCHAR *pwszValue, ULONG cchValue );
+/*
+ * The registry of property sets. Each set is found by its format
+ * identifier or by the name used to open it and holds the names of its
+ * properties both ways. The standard sets are registered when the
+ * registry is first used. The registry is shared by all interpreters.
+ */
 
-Ensemble PropertyEnsemble[] = {
-    { "names",    PropertyNamesCmd,   0 },
-    { "get",      PropertyGetCmd,     0 },
-    { "set",      PropertySetCmd,     0 },
-    { "unset",    PropertyDeleteCmd,   0 },
-    { "close",    PropertyCloseCmd,   0 },
-    { NULL,       0,                  0 }
+typedef struct PropSetType {
+    unsigned char fmtid[16];
+    char         *name;         /* name used to open the property set */
+    Tcl_HashTable ids;          /* property id to name */
+    Tcl_HashTable names;        /* lower case name to property id */
+} PropSetType;
+
+#define FMTID_KEY_WORDS (16 / sizeof(int))
+
+TCL_DECLARE_MUTEX(registryMutex)
+static int registryInit = 0;
+static Tcl_HashTable fmtidTable;    /* format identifier to PropSetType */
+static Tcl_HashTable setNameTable;  /* property set name to PropSetType */
+
+static void InitRegistry(void);
+static PropSetType *RegisterSet(const unsigned char *fmtid,
+                const char *name);
+static void AddPropName(PropSetType *typePtr, unsigned long propid,
+                const char *name);
+static PropSetType *FindSet(const unsigned char *fmtid);
+
+/*
+ * The property types that may be given when setting a value.
+ */
+
+static const struct {
+    const char *name;
+    int         type;
+} propTypes[] = {
+    { "VT_LPSTR", CFB_VT_LPSTR }, { "VT_LPWSTR", CFB_VT_LPWSTR },
+    { "VT_I4", CFB_VT_I4 }, { "VT_I8", CFB_VT_I8 },
+    { "VT_R8", CFB_VT_R8 }, { "VT_BOOL", CFB_VT_BOOL },
+    { "VT_FILETIME", CFB_VT_FILETIME }, { "VT_BLOB", CFB_VT_BLOB },
+    { NULL, 0 }
 };
-
+
 /*
  * ----------------------------------------------------------------------
  *
- * GetFMTIDFromObj --
+ * InitRegistry --
  *
- *	Convert a string name into a format identifier that may be used
- *	to access a property set. At the moment we only support the 
- *	standard identifiers - but custom identifiers are possible.
+ *	Fill the property set registry with the standard property sets the
+ *	first time it is used. The registry must be locked.
  *
  * Results:
- *	A property set identifier or a Tcl error.
+ *	None.
  *
  * Side effects:
- *	None.
+ *	The registry hash tables are created.
  *
  * ----------------------------------------------------------------------
  */
 
-static int
-GetFMTIDFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, FMTID *fmtidPtr)
+static const char *summary_names[] = {
+    NULL, NULL, "title", "subject", "author", "keywords", "comments",
+    "template", "last saved by", "revision number", "total editing time",
+    "last printed", "create time", "last saved time", "pages", "words",
+     "chars", "thumbnail", "appname", "security"
+};
+
+static const char *document_names[] = {
+    NULL, NULL, "category", "presentation target", "bytes", "lines",
+    "paragraphs", "slides", "notes", "hidden slides", "mmclips", "scalecrop",
+    "heading pairs", "titles of parts", "manager", "company", "linksuptodate"
+};
+
+/*
+ * The types of the standard properties, used when a new property is set
+ * without a type. Zero marks a type that cannot be set here.
+ */
+
+static const int summary_types[] = {
+    0, 0, CFB_VT_LPSTR, CFB_VT_LPSTR, CFB_VT_LPSTR, CFB_VT_LPSTR,
+    CFB_VT_LPSTR, CFB_VT_LPSTR, CFB_VT_LPSTR, CFB_VT_LPSTR,
+    CFB_VT_FILETIME, CFB_VT_FILETIME, CFB_VT_FILETIME, CFB_VT_FILETIME,
+    CFB_VT_I4, CFB_VT_I4, CFB_VT_I4, 0, CFB_VT_LPSTR, CFB_VT_I4
+};
+
+static const int document_types[] = {
+    0, 0, CFB_VT_LPSTR, CFB_VT_LPSTR, CFB_VT_I4, CFB_VT_I4, CFB_VT_I4,
+    CFB_VT_I4, CFB_VT_I4, CFB_VT_I4, CFB_VT_I4, CFB_VT_BOOL, 0, 0,
+    CFB_VT_LPSTR, CFB_VT_LPSTR, CFB_VT_BOOL
+};
+
+static void
+InitRegistry(void)
 {
-    const char *name = Tcl_GetString(objPtr);
-    if (strcmp("\005SummaryInformation", name) == 0) {
-        memcpy(fmtidPtr, &FMTID_SummaryInformation, sizeof(FMTID));
-    } else if (strcmp("\005DocumentSummaryInformation", name) == 0) {
-        memcpy(fmtidPtr, &FMTID_DocSummaryInformation, sizeof(FMTID));
-    } else if (strcmp("\005UserDefined", name) == 0) {
-        memcpy(fmtidPtr, &FMTID_UserDefinedProperties, sizeof(FMTID));
-    } else {
-        Tcl_Obj *errObj = Tcl_NewStringObj("", -1);
-        Tcl_AppendStringsToObj(errObj, "invalid identifier \"", name,
-            "\": only \\005SummaryInformation, \\005DocumentSummaryInformation "
-            "and \\005UserDefined are supported", (char *)NULL);
-        Tcl_SetObjResult(interp, errObj);
-        return TCL_ERROR;
+    PropSetType *typePtr;
+    unsigned long n;
+
+    if (registryInit) {
+        return;
     }
-    return TCL_OK;
-    /*
-    typedef struct fmtid_map_type { const char *name; const FMTID fmtid; } fmtid_map_t;
-    static const fmtid_map_t map[] = {
-        { "\005SummaryInformation", FMTID_SummaryInformation, },
-        { "\005DocumentSummaryInformation", FMTID_DocSummaryInformation , },
-        { "\005UserDefined", FMTID_UserDefinedProperties , },
-        { NULL, 0 }
-    };
-    int index;
-    int r = Tcl_GetIndexFromObjStruct(interp, objPtr, map, sizeof(map[0]), "", 0, &index);
-    if (r == TCL_OK) {
-        memcpy(fmtidPtr, &map[index].fmtid, sizeof(FMTID));
+    Tcl_InitHashTable(&fmtidTable, FMTID_KEY_WORDS);
+    Tcl_InitHashTable(&setNameTable, TCL_STRING_KEYS);
+    registryInit = 1;
+
+    typePtr = RegisterSet(cfbFmtidSummary, "\005SummaryInformation");
+    for (n = 0; n < sizeof(summary_names)/sizeof(summary_names[0]); n++) {
+        if (summary_names[n]) {
+            AddPropName(typePtr, n, summary_names[n]);
+        }
     }
-    return r;
-    */
+    typePtr = RegisterSet(cfbFmtidDocSummary,
+        "\005DocumentSummaryInformation");
+    for (n = 0; n < sizeof(document_names)/sizeof(document_names[0]); n++) {
+        if (document_names[n]) {
+            AddPropName(typePtr, n, document_names[n]);
+        }
+    }
+    RegisterSet(cfbFmtidUserDefined, "\005UserDefined");
 }
 
 /*
  * ----------------------------------------------------------------------
  *
- * GetNameFromPROPID --
+ * RegisterSet, AddPropName, FindSet --
  *
- *	Property set items are given integer ids. For the standard
- *	sets these are predefined. This functions returns the name
- *	for a given id in a given property set.
+ *	Add a property set to the registry or find it by its format
+ *	identifier. Registering a set again replaces its name and removes
+ *	its property names. Giving a property id a new name, or a name a
+ *	new id, replaces the earlier pair in both directions. The registry
+ *	must be locked.
  *
  * Results:
- *	The name for the property id for this property set. NULL if no
- *	name can be provided.
+ *	The registered property set or NULL if FindSet does not know the
+ *	format identifier.
  *
  * Side effects:
- *	None.
+ *	The registry is changed.
  *
  * ----------------------------------------------------------------------
  */
 
-const char *summary_names[] = {
-    NULL, NULL, "title", "subject", "author", "keywords", "comments",
-    "template", "last saved by", "revision number", "total editing time",
-    "last printed", "create time", "last saved time", "pages", "words",
-     "chars", "thumbnail", "appname", "security"
-};
+static PropSetType *
+RegisterSet(const unsigned char *fmtid, const char *name)
+{
+    PropSetType *typePtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    int key[FMTID_KEY_WORDS], isNew;
 
-const char *document_names[] = {
-    NULL, NULL, "category", "presentation target", "bytes", "lines",
-    "paragraphs", "slides", "notes", "hidden slides", "mmclips", "scalecrop",
-    "heading pairs", "titles of parts", "manager", "company", "linksuptodate"
-};
+    memcpy(key, fmtid, 16);
+    hPtr = Tcl_CreateHashEntry(&fmtidTable, (const char *)key, &isNew);
+    if (isNew) {
+        typePtr = (PropSetType *)ckalloc(sizeof(PropSetType));
+        memcpy(typePtr->fmtid, fmtid, 16);
+        Tcl_InitHashTable(&typePtr->ids, TCL_ONE_WORD_KEYS);
+        Tcl_InitHashTable(&typePtr->names, TCL_STRING_KEYS);
+        Tcl_SetHashValue(hPtr, typePtr);
+    } else {
+        typePtr = (PropSetType *)Tcl_GetHashValue(hPtr);
+        hPtr = Tcl_FindHashEntry(&setNameTable, typePtr->name);
+        if (hPtr && Tcl_GetHashValue(hPtr) == (ClientData)typePtr) {
+            Tcl_DeleteHashEntry(hPtr);
+        }
+        ckfree(typePtr->name);
+        for (hPtr = Tcl_FirstHashEntry(&typePtr->ids, &search);
+             hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+            ckfree((char *)Tcl_GetHashValue(hPtr));
+        }
+        Tcl_DeleteHashTable(&typePtr->ids);
+        Tcl_DeleteHashTable(&typePtr->names);
+        Tcl_InitHashTable(&typePtr->ids, TCL_ONE_WORD_KEYS);
+        Tcl_InitHashTable(&typePtr->names, TCL_STRING_KEYS);
+    }
+    typePtr->name = strcpy(ckalloc(strlen(name) + 1), name);
+    hPtr = Tcl_CreateHashEntry(&setNameTable, name, &isNew);
+    Tcl_SetHashValue(hPtr, typePtr);
+    return typePtr;
+}
 
-const char *
-GetNameFromPROPID(REFFMTID fmtid, PROPID propid)
+static void
+AddPropName(PropSetType *typePtr, unsigned long propid, const char *name)
 {
-    const char *name = NULL;
-    if (memcmp(&FMTID_SummaryInformation, fmtid, sizeof(FMTID)) == 0) {
-        if (propid > 0x01 && propid < 0x14) {
-            name = summary_names[(int)propid];
+    Tcl_HashEntry *hPtr, *oldPtr;
+    Tcl_DString ds;
+    int isNew;
+
+    /*
+     * Remove the reverse mappings of a name or id that is replaced so
+     * that both tables keep describing the same pairs.
+     */
+
+    Tcl_DStringInit(&ds);
+    hPtr = Tcl_FindHashEntry(&typePtr->ids, (const char *)(size_t)propid);
+    if (hPtr) {
+        Tcl_DStringAppend(&ds, (char *)Tcl_GetHashValue(hPtr), -1);
+        Tcl_UtfToLower(Tcl_DStringValue(&ds));
+        oldPtr = Tcl_FindHashEntry(&typePtr->names, Tcl_DStringValue(&ds));
+        if (oldPtr && (size_t)Tcl_GetHashValue(oldPtr) == propid) {
+            Tcl_DeleteHashEntry(oldPtr);
         }
-    } else if (memcmp(&FMTID_DocSummaryInformation, fmtid, sizeof(FMTID)) == 0) {
-        if (propid > 0x01 && propid < 0x11) {
-            name = document_names[(int)propid];
+        Tcl_DStringSetLength(&ds, 0);
+    }
+    Tcl_DStringAppend(&ds, name, -1);
+    Tcl_UtfToLower(Tcl_DStringValue(&ds));
+    hPtr = Tcl_CreateHashEntry(&typePtr->names, Tcl_DStringValue(&ds),
+        &isNew);
+    if (!isNew && (size_t)Tcl_GetHashValue(hPtr) != propid) {
+        oldPtr = Tcl_FindHashEntry(&typePtr->ids,
+            (const char *)Tcl_GetHashValue(hPtr));
+        if (oldPtr) {
+            ckfree((char *)Tcl_GetHashValue(oldPtr));
+            Tcl_DeleteHashEntry(oldPtr);
         }
     }
-    return name;
+    Tcl_SetHashValue(hPtr, (ClientData)(size_t)propid);
+    Tcl_DStringFree(&ds);
+
+    hPtr = Tcl_CreateHashEntry(&typePtr->ids, (const char *)(size_t)propid,
+        &isNew);
+    if (!isNew) {
+        ckfree((char *)Tcl_GetHashValue(hPtr));
+    }
+    Tcl_SetHashValue(hPtr, strcpy(ckalloc(strlen(name) + 1), name));
+}
+
+static PropSetType *
+FindSet(const unsigned char *fmtid)
+{
+    Tcl_HashEntry *hPtr;
+    int key[FMTID_KEY_WORDS];
+
+    InitRegistry();
+    memcpy(key, fmtid, 16);
+    hPtr = Tcl_FindHashEntry(&fmtidTable, (const char *)key);
+    return hPtr ? (PropSetType *)Tcl_GetHashValue(hPtr) : NULL;
 }
 
 /*
  * ----------------------------------------------------------------------
  *
- * GetPROPIDFromName --
+ * PropertySetRegisterCmd --
  *
- *	Convert a string name into a property id. This reverses the 
- *	GetNameFromPROPID function.
+ *	Implements "storage propertyset register fmtid name propnames".
+ *	Register a property set so that it may be opened by name and its
+ *	properties accessed by name. propnames is a list of property ids
+ *	and names.
  *
  * Results:
- *	A property identifier or 0 if no identifier can be found..
+ *	A standard Tcl result
  *
  * Side effects:
- *	None.
+ *	The registry is changed for every interpreter.
  *
  * ----------------------------------------------------------------------
  */
 
-static PROPID
-GetPROPIDFromName(REFFMTID fmtid, const char *name)
+int
+PropertySetRegisterCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
 {
-    int n;
-    if (memcmp(&FMTID_SummaryInformation, fmtid, sizeof(FMTID)) == 0) {
-        for (n = 0; n < sizeof(summary_names)/sizeof(summary_names[0]); n++) {
-            if (summary_names[n] && stricmp(summary_names[n], name) == 0) {
-                return (PROPID)n;
-            }
+    PropSetType *typePtr;
+    Tcl_Obj **names;
+    unsigned char fmtid[16];
+    long *ids;
+    int count, n;
+
+    if (objc != 6) {
+        Tcl_WrongNumArgs(interp, 3, objv, "fmtid name propnames");
+        return TCL_ERROR;
+    }
+    if (CfbGuidFromObj(objv[3], fmtid) != CFB_OK) {
+        Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+        Tcl_AppendStringsToObj(errObj, "invalid format identifier \"",
+            Tcl_GetString(objv[3]), "\"", (char *)NULL);
+        Tcl_SetObjResult(interp, errObj);
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, objv[5], &count, &names) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (count % 2) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "propnames must be a list of property ids and names", -1));
+        return TCL_ERROR;
+    }
+    ids = (long *)ckalloc((count / 2 + 1) * sizeof(long));
+    for (n = 0; n < count; n += 2) {
+        if (Tcl_GetLongFromObj(interp, names[n], ids + n / 2) != TCL_OK) {
+            ckfree((char *)ids);
+            return TCL_ERROR;
         }
-    } else if (memcmp(&FMTID_DocSummaryInformation, fmtid, sizeof(FMTID)) == 0) {
-        for (n = 0; n < sizeof(document_names)/sizeof(document_names[0]); n++) {
-            if (document_names[n] && stricmp(document_names[n], name) == 0) {
-                return (PROPID)n;
-            }
+        if ((unsigned long)ids[n / 2] <= CFB_PID_CODEPAGE
+            || (unsigned long)ids[n / 2] >= 0x80000000UL) {
+            Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+            Tcl_AppendStringsToObj(errObj, "invalid property id \"",
+                Tcl_GetString(names[n]), "\"", (char *)NULL);
+            Tcl_SetObjResult(interp, errObj);
+            ckfree((char *)ids);
+            return TCL_ERROR;
         }
     }
-    return 0;
+
+    Tcl_MutexLock(&registryMutex);
+    InitRegistry();
+    typePtr = RegisterSet(fmtid, Tcl_GetString(objv[4]));
+    for (n = 0; n < count; n += 2) {
+        AddPropName(typePtr, (unsigned long)ids[n / 2],
+            Tcl_GetString(names[n + 1]));
+    }
+    Tcl_MutexUnlock(&registryMutex);
+    ckfree((char *)ids);
+    return TCL_OK;
 }
 
 /*
  * ----------------------------------------------------------------------
  *
- * GetNameFromVarType --
+ * GetFMTIDFromObj --
  *
- *	Convert a PROPVARIANT type into a string representation.
+ *	Convert a string name into a format identifier that may be used
+ *	to access a property set. The name may be that of a registered
+ *	property set or any format identifier in registry form.
  *
  * Results:
- *	Stringify a PROPVARIANT vt type or returns a Tcl error.
+ *	A property set identifier or a Tcl error.
  *
  * Side effects:
  *	None.
@@ -207,30 +376,152 @@ GetPROPIDFromName(REFFMTID fmtid, const char *name)
  * ----------------------------------------------------------------------
  */
 
-typedef struct {
-    const char *desc;
-    VARTYPE vt;
-} vt_map_t;
-const vt_map_t vt_map[] = {
-    { "VT_EMPTY", VT_EMPTY }, {"VT_NULL", VT_NULL}, { "VT_BOOL", VT_BOOL }, { "VT_INT", VT_INT}, 
-    { "VT_LPSTR", VT_LPSTR }, { "VT_LPWSTR", VT_LPWSTR }, { "VT_CLSID", VT_CLSID },
-    { "VT_FILETIME", VT_FILETIME }, { "VT_DATE", VT_DATE }, {"VT_BSTR", VT_BSTR },
-    { NULL, 0 }
-};
-
 static int
-GetNameFromVarType(Tcl_Interp *interp, VARTYPE vt, Tcl_Obj **namePtrPtr)
+GetFMTIDFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, unsigned char *fmtid)
 {
-    const vt_map_t *p;
-    for (p = vt_map; p->desc != NULL; p++) {
-        if (p->vt == vt) {
-            *namePtrPtr = Tcl_NewStringObj(p->desc, -1);
-            return TCL_OK;
+    Tcl_HashEntry *hPtr;
+    const char *name = Tcl_GetString(objPtr);
+
+    Tcl_MutexLock(&registryMutex);
+    InitRegistry();
+    hPtr = Tcl_FindHashEntry(&setNameTable, name);
+    if (hPtr) {
+        memcpy(fmtid, ((PropSetType *)Tcl_GetHashValue(hPtr))->fmtid, 16);
+    }
+    Tcl_MutexUnlock(&registryMutex);
+
+    if (hPtr == NULL && CfbGuidFromObj(objPtr, fmtid) != CFB_OK) {
+        if (interp) {
+            Tcl_Obj *errObj = Tcl_NewStringObj("", -1);
+            Tcl_AppendStringsToObj(errObj, "invalid identifier \"", name,
+                "\": must be a registered property set or a format "
+                "identifier", (char *)NULL);
+            Tcl_SetObjResult(interp, errObj);
         }
+        return TCL_ERROR;
     }
-    Tcl_SetResult(interp, "vt not found", TCL_STATIC);
-    return TCL_ERROR;
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * GetNameFromPROPID --
+ *
+ *	Property set items are given integer ids. For the standard
+ *	sets these are predefined and others may be registered. This
+ *	function returns the name for a given id in a given property set.
+ *
+ * Results:
+ *	A new Tcl object holding the name for the property id for this
+ *	property set. NULL if no name can be provided.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+GetNameFromPROPID(const unsigned char *fmtid, unsigned long propid)
+{
+    PropSetType *typePtr;
+    Tcl_HashEntry *hPtr = NULL;
+    Tcl_Obj *nameObj = NULL;
+
+    Tcl_MutexLock(&registryMutex);
+    typePtr = FindSet(fmtid);
+    if (typePtr) {
+        hPtr = Tcl_FindHashEntry(&typePtr->ids, (const char *)(size_t)propid);
+    }
+    if (hPtr) {
+        nameObj = Tcl_NewStringObj((const char *)Tcl_GetHashValue(hPtr), -1);
+    }
+    Tcl_MutexUnlock(&registryMutex);
+    return nameObj;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * GetPROPIDFromName --
+ *
+ *	Convert a string name into a property id. This reverses the 
+ *	GetNameFromPROPID function. Names are matched ignoring case.
+ *
+ * Results:
+ *	A property identifier or 0 if no identifier can be found..
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static unsigned long
+GetPROPIDFromName(const unsigned char *fmtid, const char *name)
+{
+    PropSetType *typePtr;
+    Tcl_HashEntry *hPtr = NULL;
+    Tcl_DString ds;
+    unsigned long propid = 0;
+
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, name, -1);
+    Tcl_UtfToLower(Tcl_DStringValue(&ds));
+    Tcl_MutexLock(&registryMutex);
+    typePtr = FindSet(fmtid);
+    if (typePtr) {
+        hPtr = Tcl_FindHashEntry(&typePtr->names, Tcl_DStringValue(&ds));
+    }
+    if (hPtr) {
+        propid = (unsigned long)(size_t)Tcl_GetHashValue(hPtr);
+    }
+    Tcl_MutexUnlock(&registryMutex);
+    Tcl_DStringFree(&ds);
+    return propid;
 }
+
+#ifdef _WIN32
+
+typedef struct _PropertySet {
+    IPropertyStorage *propPtr;
+    FMTID             fmtid;
+    DWORD             mode;
+    int               dirty;    /* changes must be committed */
+} PropertySet;
+
+       Tcl_ObjCmdProc PropertySetOpenCmd;
+       Tcl_ObjCmdProc PropertySetDeleteCmd;
+       Tcl_ObjCmdProc PropertySetNamesCmd;
+
+       Tcl_ObjCmdProc PropertyNamesCmd;
+static Tcl_ObjCmdProc PropertyGetCmd;
+static Tcl_ObjCmdProc PropertySetCmd;
+static Tcl_ObjCmdProc PropertySetManyCmd;
+static Tcl_ObjCmdProc PropertyDeleteCmd;
+
+static Tcl_CmdDeleteProc PropertyCmdDeleteProc;
+static void GetPropSpec(PropertySet *setPtr, Tcl_Obj *nameObj,
+                PROPSPEC *specPtr);
+static int  PropSpecType(PropertySet *setPtr, PROPSPEC *specPtr,
+                Tcl_Obj *valueObj);
+static Tcl_Obj *PropVariantToObj(const PROPVARIANT *pv, int duration);
+static int  ObjToPropVariant(Tcl_Interp *interp, Tcl_Obj *objPtr, int type,
+                int duration, PROPVARIANT *pv);
+static Tcl_Obj *PropertyKeyObj(PropertySet *setPtr,
+                const STATPROPSTG *statPtr, int raw);
+
+Ensemble PropertyEnsemble[] = {
+    { "names",    PropertyNamesCmd,   0 },
+    { "get",      PropertyGetCmd,     0 },
+    { "getall",   PropertyGetAllCmd,  0 },
+    { "set",      PropertySetCmd,     0 },
+    { "setmany",  PropertySetManyCmd, 0 },
+    { "unset",    PropertyDeleteCmd,   0 },
+    { "close",    PropertyCloseCmd,   0 },
+    { NULL,       0,                  0 }
+};
 
 /*
  * ----------------------------------------------------------------------
@@ -261,6 +552,7 @@ CreatePropertySetCmd(Tcl_Interp *interp, FMTID fmtid, IPropertyStorage *propPtr,
     
     propsetPtr = (PropertySet *)ckalloc(sizeof(PropertySet));
     propsetPtr->mode = mode;
+    propsetPtr->dirty = 0;
     memcpy(&propsetPtr->fmtid, &fmtid, sizeof(FMTID));
     propsetPtr->propPtr = propPtr;
     propsetPtr->propPtr->lpVtbl->AddRef(propsetPtr->propPtr);
@@ -282,7 +574,7 @@ CreatePropertySetCmd(Tcl_Interp *interp, FMTID fmtid, IPropertyStorage *propPtr,
  * PropertyCmdDeleteProc -
  *
  *	Clean up the allocated memory associated with the property set
- *	command.
+ *	command. The property set is only committed if it was changed.
  *
  * Results:
  *	A standard Tcl result
@@ -298,7 +590,10 @@ PropertyCmdDeleteProc(ClientData clientData)
 {
     EnsembleCmdData *dataPtr = (EnsembleCmdData *)clientData;
     PropertySet *propsetPtr = (PropertySet *)dataPtr->clientData;
-    propsetPtr->propPtr->lpVtbl->Commit(propsetPtr->propPtr, STGC_DEFAULT);
+    if (propsetPtr->dirty) {
+        propsetPtr->propPtr->lpVtbl->Commit(propsetPtr->propPtr,
+            STGC_DEFAULT);
+    }
     propsetPtr->propPtr->lpVtbl->Release(propsetPtr->propPtr);
     ckfree((char *)propsetPtr);
     ckfree((char *)dataPtr);
@@ -335,6 +630,10 @@ PropertySetOpenCmd(ClientData clientData, Tcl_Interp *interp,
         Tcl_WrongNumArgs(interp, 3, objv, "id ?mode?");
         r = TCL_ERROR;
 
+    } else if (storagePtr->pstg == NULL) {
+
+        r = NoPropertySets(interp);
+
     } else {
         
         IStorage *stgPtr = storagePtr->pstg;
@@ -343,7 +642,7 @@ PropertySetOpenCmd(ClientData clientData, Tcl_Interp *interp,
         DWORD grfMode =  STGM_DIRECT | STGM_SHARE_EXCLUSIVE;
         FMTID fmtid;
         
-        if (GetFMTIDFromObj(interp, objv[3], &fmtid) != TCL_OK)
+        if (GetFMTIDFromObj(interp, objv[3], (unsigned char *)&fmtid) != TCL_OK)
             return TCL_ERROR;
 
         if (objc > 4) {
@@ -406,6 +705,10 @@ PropertySetDeleteCmd(ClientData clientData, Tcl_Interp *interp,
         Tcl_WrongNumArgs(interp, 3, objv, "id");
         r = TCL_ERROR;
 
+    } else if (storagePtr->pstg == NULL) {
+
+        r = NoPropertySets(interp);
+
     } else {
         
         IStorage *stgPtr = storagePtr->pstg;
@@ -455,6 +758,10 @@ PropertySetNamesCmd(ClientData clientData, Tcl_Interp *interp,
         Tcl_WrongNumArgs(interp, 3, objv, "");
         r = TCL_ERROR;
 
+    } else if (storagePtr->pstg == NULL) {
+
+        r = NoPropertySets(interp);
+
     } else {
         
         IStorage *stgPtr = storagePtr->pstg;
@@ -516,28 +823,14 @@ PropertyNamesCmd(ClientData clientData, Tcl_Interp *interp,
     if (SUCCEEDED(hr)) {
 	STATPROPSTG astat[12];
 	ULONG nret, n;
-    const char *propname = NULL;
 	Tcl_Obj *resObj = Tcl_NewListObj(0, NULL);
 	do {
 	    hr = enumPtr->lpVtbl->Next(enumPtr, 12, astat, &nret);
 	    for (n = 0; n < nret; n++) {
-		Tcl_Obj *vtObj;
-        
-        if (astat[n].lpwstrName != NULL) {
-		    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewUnicodeObj(astat[n].lpwstrName, -1));
-        } else {
-            if ((propname = GetNameFromPROPID(&setPtr->fmtid, astat[n].propid)) == NULL) {
-		        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewLongObj(astat[n].propid));
-            } else {
-                Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj(propname, -1));
-            }
-        }
-
-		if (GetNameFromVarType(interp, astat[n].vt, &vtObj) == TCL_OK) {
-		    Tcl_ListObjAppendElement(interp, resObj, vtObj);
-		} else {
-		    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewLongObj(astat[n].vt));
-		}
+		Tcl_ListObjAppendElement(interp, resObj,
+                    PropertyKeyObj(setPtr, astat + n, 0));
+		Tcl_ListObjAppendElement(interp, resObj,
+                    CfbPropTypeObj(astat[n].vt));
 
 		CoTaskMemFree(astat[n].lpwstrName);
 	    }
@@ -555,11 +848,14 @@ PropertyNamesCmd(ClientData clientData, Tcl_Interp *interp,
 /*
  * ----------------------------------------------------------------------
  *
- * PropertyGetCmd --
+ * PropertyKeyObj --
  *
+ *	Get the name used for an enumerated property. This is the
+ *	property name if it has one, the standard name for its id or the
+ *	id itself. With raw set the id is always used.
  *
  * Results:
- *	A standard Tcl result
+ *	A new Tcl object.
  *
  * Side effects:
  *	None.
@@ -567,48 +863,35 @@ PropertyNamesCmd(ClientData clientData, Tcl_Interp *interp,
  * ----------------------------------------------------------------------
  */
 
-int
-PropertyGetCmd(ClientData clientData, Tcl_Interp *interp,
-    int objc, Tcl_Obj *const objv[])
+static Tcl_Obj *
+PropertyKeyObj(PropertySet *setPtr, const STATPROPSTG *statPtr, int raw)
 {
-    PropertySet *setPtr = (PropertySet *)clientData;
-    PROPSPEC spec;
-    PROPVARIANT v;
-    HRESULT hr = S_OK;
+    Tcl_Obj *nameObj = NULL;
 
-    if (objc != 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "name");
-        return TCL_ERROR;
+    if (!raw && statPtr->lpwstrName != NULL) {
+        return Tcl_NewUnicodeObj(statPtr->lpwstrName, -1);
     }
-
-    PropVariantInit(&v);
-
-    spec.ulKind = PRSPEC_PROPID;
-    spec.propid = GetPROPIDFromName(&setPtr->fmtid, Tcl_GetString(objv[2]));
-    if (spec.propid == 0) {
-        spec.ulKind = PRSPEC_LPWSTR;
-        spec.lpwstr = Tcl_GetUnicode(objv[2]);
+    if (!raw) {
+        nameObj = GetNameFromPROPID((const unsigned char *)&setPtr->fmtid,
+            statPtr->propid);
     }
-    hr = setPtr->propPtr->lpVtbl->ReadMultiple(setPtr->propPtr, 1, &spec, &v);
-    if (SUCCEEDED(hr)) {
-        WCHAR wsz[1024];
-        ConvertValueToString(&v, wsz, 1024);
-        PropVariantClear(&v);
-        Tcl_SetObjResult(interp, Tcl_NewUnicodeObj(wsz, -1));
+    if (nameObj != NULL) {
+        return nameObj;
     }
-    if (FAILED(hr))
-        Tcl_SetObjResult(interp, Win32Error("error", hr));
-    return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
+    return Tcl_NewWideIntObj((Tcl_WideInt)statPtr->propid);
 }
 
 /*
  * ----------------------------------------------------------------------
  *
- * PropertySetCmd --
+ * PropertyGetAllCmd --
  *
+ *	Get the values of every property in the set. The properties are
+ *	enumerated and then read with a single ReadMultiple call.
  *
  * Results:
- *	A standard Tcl result
+ *	A standard Tcl result. The result is a dict of property names
+ *	and values.
  *
  * Side effects:
  *	None.
@@ -616,34 +899,76 @@ PropertyGetCmd(ClientData clientData, Tcl_Interp *interp,
  * ----------------------------------------------------------------------
  */
 
-int
-PropertySetCmd(ClientData clientData, Tcl_Interp *interp,
+static int
+PropertyGetAllCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     PropertySet *setPtr = (PropertySet *)clientData;
-    PROPSPEC spec;
-    PROPVARIANT v;
-    HRESULT hr = S_OK;
+    IPropertyStorage *propPtr = setPtr->propPtr;
+    IEnumSTATPROPSTG *enumPtr = NULL;
+    STATPROPSTG astat[12];
+    PROPSPEC *specs = NULL;
+    PROPVARIANT *values = NULL;
+    Tcl_Obj **keys = NULL;
+    ULONG count = 0, space = 0, nret, n;
+    int raw, isSummary;
+    HRESULT hr;
 
-    if (objc < 4 || objc > 5) {
-        Tcl_WrongNumArgs(interp, 2, objv, "name value ?type?");
+    if (GetAllArgs(interp, objc, objv, &raw) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    PropVariantInit(&v);
-
-    spec.ulKind = PRSPEC_PROPID;
-    spec.propid = GetPROPIDFromName(&setPtr->fmtid, Tcl_GetString(objv[2]));
-    if (spec.propid == 0) {
-        spec.ulKind = PRSPEC_LPWSTR;
-        spec.lpwstr = Tcl_GetUnicode(objv[2]);
+    hr = propPtr->lpVtbl->Enum(propPtr, &enumPtr);
+    if (SUCCEEDED(hr)) {
+        do {
+            hr = enumPtr->lpVtbl->Next(enumPtr, 12, astat, &nret);
+            for (n = 0; SUCCEEDED(hr) && n < nret; n++) {
+                if (count == space) {
+                    space = space ? space * 2 : 32;
+                    specs = (PROPSPEC *)ckrealloc((char *)specs,
+                        space * sizeof(PROPSPEC));
+                    keys = (Tcl_Obj **)ckrealloc((char *)keys,
+                        space * sizeof(Tcl_Obj *));
+                }
+                specs[count].ulKind = PRSPEC_PROPID;
+                specs[count].propid = astat[n].propid;
+                keys[count] = PropertyKeyObj(setPtr, astat + n, raw);
+                Tcl_IncrRefCount(keys[count]);
+                count++;
+                CoTaskMemFree(astat[n].lpwstrName);
+            }
+        } while (hr == S_OK);
+        enumPtr->lpVtbl->Release(enumPtr);
+    }
+    if (SUCCEEDED(hr) && count > 0) {
+        values = (PROPVARIANT *)ckalloc(count * sizeof(PROPVARIANT));
+        for (n = 0; n < count; n++) {
+            PropVariantInit(values + n);
+        }
+        hr = propPtr->lpVtbl->ReadMultiple(propPtr, count, specs, values);
+    }
+    if (SUCCEEDED(hr)) {
+        Tcl_Obj *dictObj = Tcl_NewDictObj();
+        isSummary = IsEqualGUID(&setPtr->fmtid, &FMTID_SummaryInformation);
+        for (n = 0; n < count; n++) {
+            int duration = isSummary && specs[n].propid == CFB_PID_EDITTIME;
+            Tcl_DictObjPut(NULL, dictObj, keys[n],
+                PropVariantToObj(values + n, duration));
+        }
+        Tcl_SetObjResult(interp, dictObj);
     }
 
-    v.vt = VT_LPSTR;
-    v.pszVal = Tcl_GetString(objv[3]);
-
-    hr = setPtr->propPtr->lpVtbl->WriteMultiple(setPtr->propPtr, 1, &spec, &v, 2);
-    /* PropVariantClear(&v); */
+    if (values) {
+        FreePropVariantArray(count, values);
+        ckfree((char *)values);
+    }
+    for (n = 0; n < count; n++) {
+        Tcl_DecrRefCount(keys[n]);
+    }
+    if (specs) {
+        ckfree((char *)specs);
+        ckfree((char *)keys);
+    }
     if (FAILED(hr))
         Tcl_SetObjResult(interp, Win32Error("error", hr));
     return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
@@ -652,7 +977,7 @@ PropertySetCmd(ClientData clientData, Tcl_Interp *interp,
 /*
  * ----------------------------------------------------------------------
  *
- * PropertyDeleteCmd --
+ * PropertyGetCmd --
  *
  *
  * Results:
@@ -665,11 +990,12 @@ PropertySetCmd(ClientData clientData, Tcl_Interp *interp,
  */
 
 int
-PropertyDeleteCmd(ClientData clientData, Tcl_Interp *interp,
+PropertyGetCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     PropertySet *setPtr = (PropertySet *)clientData;
     PROPSPEC spec;
+    PROPVARIANT v;
     HRESULT hr = S_OK;
 
     if (objc != 3) {
@@ -677,14 +1003,70 @@ PropertyDeleteCmd(ClientData clientData, Tcl_Interp *interp,
         return TCL_ERROR;
     }
 
-    spec.ulKind = PRSPEC_PROPID;
-    spec.propid = GetPROPIDFromName(&setPtr->fmtid, Tcl_GetString(objv[2]));
-    if (spec.propid == 0) {
-        spec.ulKind = PRSPEC_LPWSTR;
-        spec.lpwstr = Tcl_GetUnicode(objv[2]);
+    PropVariantInit(&v);
+    GetPropSpec(setPtr, objv[2], &spec);
+
+    hr = setPtr->propPtr->lpVtbl->ReadMultiple(setPtr->propPtr, 1, &spec, &v);
+    if (SUCCEEDED(hr)) {
+        int duration = spec.ulKind == PRSPEC_PROPID
+            && spec.propid == CFB_PID_EDITTIME
+            && IsEqualGUID(&setPtr->fmtid, &FMTID_SummaryInformation);
+        Tcl_SetObjResult(interp, PropVariantToObj(&v, duration));
+        PropVariantClear(&v);
     }
+    if (FAILED(hr))
+        Tcl_SetObjResult(interp, Win32Error("error", hr));
+    return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertySetCmd --
+ *
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
 
-    hr = setPtr->propPtr->lpVtbl->DeleteMultiple(setPtr->propPtr, 1, &spec);
+int
+PropertySetCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *setPtr = (PropertySet *)clientData;
+    PROPSPEC spec;
+    PROPVARIANT v;
+    HRESULT hr = S_OK;
+    int type, duration;
+
+    if (objc < 4 || objc > 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name value ?type?");
+        return TCL_ERROR;
+    }
+    PropVariantInit(&v);
+    GetPropSpec(setPtr, objv[2], &spec);
+    if (objc == 5) {
+        if (GetTypeFromObj(interp, objv[4], &type) != TCL_OK)
+            return TCL_ERROR;
+    } else {
+        type = PropSpecType(setPtr, &spec, objv[3]);
+    }
+
+    duration = spec.ulKind == PRSPEC_PROPID
+        && spec.propid == CFB_PID_EDITTIME
+        && IsEqualGUID(&setPtr->fmtid, &FMTID_SummaryInformation);
+    if (ObjToPropVariant(interp, objv[3], type, duration, &v) != TCL_OK)
+        return TCL_ERROR;
+
+    hr = setPtr->propPtr->lpVtbl->WriteMultiple(setPtr->propPtr, 1, &spec, &v, 2);
+    /* v refers to the Tcl objects and must not be cleared */
+    if (SUCCEEDED(hr))
+        setPtr->dirty = 1;
     if (FAILED(hr))
         Tcl_SetObjResult(interp, Win32Error("error", hr));
     return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
@@ -693,7 +1075,130 @@ PropertyDeleteCmd(ClientData clientData, Tcl_Interp *interp,
 /*
  * ----------------------------------------------------------------------
  *
- * PropertyCloseCmd --
+ * PropertySetManyCmd --
+ *
+ *	Set every property in a dict with a single WriteMultiple call. The
+ *	type of each value is chosen by PropSpecType.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	The properties are changed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertySetManyCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *setPtr = (PropertySet *)clientData;
+    PROPSPEC *specs;
+    PROPVARIANT *values;
+    Tcl_DictSearch search;
+    Tcl_Obj *keyObj, *valueObj;
+    int count, done, duration, n = 0;
+    HRESULT hr = S_OK;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "dict");
+        return TCL_ERROR;
+    }
+    if (Tcl_DictObjSize(interp, objv[2], &count) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (count == 0) {
+        return TCL_OK;
+    }
+
+    specs = (PROPSPEC *)ckalloc(count * sizeof(PROPSPEC));
+    values = (PROPVARIANT *)ckalloc(count * sizeof(PROPVARIANT));
+    Tcl_DictObjFirst(NULL, objv[2], &search, &keyObj, &valueObj, &done);
+    for (; !done; Tcl_DictObjNext(&search, &keyObj, &valueObj, &done)) {
+        GetPropSpec(setPtr, keyObj, specs + n);
+        PropVariantInit(values + n);
+        duration = specs[n].ulKind == PRSPEC_PROPID
+            && specs[n].propid == CFB_PID_EDITTIME
+            && IsEqualGUID(&setPtr->fmtid, &FMTID_SummaryInformation);
+        if (ObjToPropVariant(interp, valueObj,
+                PropSpecType(setPtr, specs + n, valueObj),
+                duration, values + n) != TCL_OK) {
+            Tcl_DictObjDone(&search);
+            hr = E_INVALIDARG;
+            break;
+        }
+        n++;
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = setPtr->propPtr->lpVtbl->WriteMultiple(setPtr->propPtr, count,
+            specs, values, 2);
+        if (FAILED(hr))
+            Tcl_SetObjResult(interp, Win32Error("error", hr));
+    }
+    ckfree((char *)specs);
+    ckfree((char *)values);
+    if (SUCCEEDED(hr))
+        setPtr->dirty = 1;
+    return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * GetPropSpec --
+ *
+ *	Identify a property by its standard id or else by its name.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The PROPSPEC is filled in. A name refers to the Tcl object.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+GetPropSpec(PropertySet *setPtr, Tcl_Obj *nameObj, PROPSPEC *specPtr)
+{
+    specPtr->ulKind = PRSPEC_PROPID;
+    specPtr->propid = GetPROPIDFromName((const unsigned char *)&setPtr->fmtid,
+        Tcl_GetString(nameObj));
+    if (specPtr->propid == 0) {
+        specPtr->ulKind = PRSPEC_LPWSTR;
+        specPtr->lpwstr = Tcl_GetUnicode(nameObj);
+    }
+}
+
+/*
+ * Choose the type of a value set without one from the type the property
+ * has now, if any.
+ */
+
+static int
+PropSpecType(PropertySet *setPtr, PROPSPEC *specPtr, Tcl_Obj *valueObj)
+{
+    PROPVARIANT v;
+    int existing = CFB_VT_EMPTY;
+    HRESULT hr;
+
+    PropVariantInit(&v);
+    hr = setPtr->propPtr->lpVtbl->ReadMultiple(setPtr->propPtr, 1,
+        specPtr, &v);
+    if (SUCCEEDED(hr)) {
+        existing = v.vt;
+    }
+    PropVariantClear(&v);
+    return ChooseType(existing, (const unsigned char *)&setPtr->fmtid,
+        (specPtr->ulKind == PRSPEC_PROPID) ? specPtr->propid : 0, valueObj);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertyDeleteCmd --
  *
  *
  * Results:
@@ -706,29 +1211,40 @@ PropertyDeleteCmd(ClientData clientData, Tcl_Interp *interp,
  */
 
 int
-PropertyCloseCmd(ClientData clientData, Tcl_Interp *interp,
+PropertyDeleteCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     PropertySet *setPtr = (PropertySet *)clientData;
-    if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 2, objv, "");
+    PROPSPEC spec;
+    HRESULT hr = S_OK;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name");
         return TCL_ERROR;
     }
-    Tcl_DeleteCommand(interp, Tcl_GetString(objv[0]));
-    return TCL_OK;
+
+    GetPropSpec(setPtr, objv[2], &spec);
+
+    hr = setPtr->propPtr->lpVtbl->DeleteMultiple(setPtr->propPtr, 1, &spec);
+    if (SUCCEEDED(hr))
+        setPtr->dirty = 1;
+    if (FAILED(hr))
+        Tcl_SetObjResult(interp, Win32Error("error", hr));
+    return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
 }
 
 /*
  * ----------------------------------------------------------------------
  *
- * ConvertValueToString --
+ * PropVariantToObj --
  *
- *	Convert a PROPVARIANT into a string value. This is modified from
- *	a Microsoft sample.
+ *	Convert a PROPVARIANT into a Tcl object of the natural type. The
+ *	conventions are those of the native decoder in cfbprop.c so that
+ *	the same values are returned for OLE and native storages.
  *
  * Results:
- *	The pwszValue value is set to the string representation of the 
- *	variant data.
+ *	A new Tcl object. Types that cannot be converted give an empty
+ *	object.
  *
  * Side effects:
  *	None.
@@ -736,88 +1252,1236 @@ PropertyCloseCmd(ClientData clientData, Tcl_Interp *interp,
  * ----------------------------------------------------------------------
  */
 
-void
-ConvertValueToString( const PROPVARIANT *propvar,
-                      WCHAR *pwszValue,
-                      ULONG cchValue )
+static Tcl_Obj *
+PropVariantToObj(const PROPVARIANT *pv, int duration)
 {
-    pwszValue[ cchValue - 1 ] = L'\0';
-    --cchValue;
+    Tcl_Obj *objPtr = NULL;
+    Tcl_DString ds;
+    unsigned char *bytes;
+    ULONG n;
 
-    switch( propvar->vt )
-    {
-    case VT_EMPTY:
-        wcsncpy( pwszValue, L"", cchValue );
+    if (pv->vt & VT_VECTOR) {
+        objPtr = Tcl_NewListObj(0, NULL);
+        for (n = 0; n < pv->cac.cElems; n++) {
+            PROPVARIANT elem;
+
+            /* a shallow copy of each element - it must not be cleared */
+            PropVariantInit(&elem);
+            elem.vt = pv->vt & ~VT_VECTOR;
+            switch (elem.vt) {
+            case VT_I1:       elem.cVal = pv->cac.pElems[n]; break;
+            case VT_UI1:      elem.bVal = pv->caub.pElems[n]; break;
+            case VT_I2:       elem.iVal = pv->cai.pElems[n]; break;
+            case VT_UI2:      elem.uiVal = pv->caui.pElems[n]; break;
+            case VT_BOOL:     elem.boolVal = pv->cabool.pElems[n]; break;
+            case VT_I4:       elem.lVal = pv->cal.pElems[n]; break;
+            case VT_UI4:      elem.ulVal = pv->caul.pElems[n]; break;
+            case VT_ERROR:    elem.scode = pv->cascode.pElems[n]; break;
+            case VT_R4:       elem.fltVal = pv->caflt.pElems[n]; break;
+            case VT_R8:       elem.dblVal = pv->cadbl.pElems[n]; break;
+            case VT_I8:       elem.hVal = pv->cah.pElems[n]; break;
+            case VT_UI8:      elem.uhVal = pv->cauh.pElems[n]; break;
+            case VT_CY:       elem.cyVal = pv->cacy.pElems[n]; break;
+            case VT_DATE:     elem.date = pv->cadate.pElems[n]; break;
+            case VT_FILETIME: elem.filetime = pv->cafiletime.pElems[n]; break;
+            case VT_CLSID:    elem.puuid = pv->cauuid.pElems + n; break;
+            case VT_CF:       elem.pclipdata = pv->caclipdata.pElems + n; break;
+            case VT_BSTR:     elem.bstrVal = pv->cabstr.pElems[n]; break;
+            case VT_LPSTR:    elem.pszVal = pv->calpstr.pElems[n]; break;
+            case VT_LPWSTR:   elem.pwszVal = pv->calpwstr.pElems[n]; break;
+            case VT_VARIANT:  elem = pv->capropvar.pElems[n]; break;
+            default:          elem.vt = VT_EMPTY; break;
+            }
+            Tcl_ListObjAppendElement(NULL, objPtr,
+                PropVariantToObj(&elem, duration));
+        }
+        return objPtr;
+    }
+
+    switch (pv->vt) {
+    case VT_I1:
+        objPtr = Tcl_NewWideIntObj(pv->cVal);
         break;
-    case VT_NULL:
-        wcsncpy( pwszValue, L"", cchValue );
+    case VT_UI1:
+        objPtr = Tcl_NewWideIntObj(pv->bVal);
         break;
     case VT_I2:
-        _snwprintf( pwszValue, cchValue, L"%i", propvar->iVal );
+        objPtr = Tcl_NewWideIntObj(pv->iVal);
         break;
-    case VT_I4:
-    case VT_INT:
-        _snwprintf( pwszValue, cchValue, L"%li", propvar->lVal );
+    case VT_UI2:
+        objPtr = Tcl_NewWideIntObj(pv->uiVal);
         break;
-    case VT_I8:
-        _snwprintf( pwszValue, cchValue, L"%I64i", propvar->hVal );
+    case VT_I4: case VT_INT:
+        objPtr = Tcl_NewWideIntObj(pv->lVal);
         break;
-    case VT_UI2:
-        _snwprintf ( pwszValue, cchValue, L"%u", propvar->uiVal );
+    case VT_UI4: case VT_UINT:
+        objPtr = Tcl_NewWideIntObj(pv->ulVal);
+        break;
+    case VT_ERROR:
+        objPtr = Tcl_NewWideIntObj((ULONG)pv->scode);
         break;
-    case VT_UI4:
-    case VT_UINT:
-        _snwprintf ( pwszValue, cchValue, L"%lu", propvar->ulVal );
+    case VT_I8:
+        objPtr = Tcl_NewWideIntObj(pv->hVal.QuadPart);
         break;
     case VT_UI8:
-        _snwprintf ( pwszValue, cchValue, L"%I64u", propvar->uhVal );
+        objPtr = Tcl_NewWideIntObj((Tcl_WideInt)pv->uhVal.QuadPart);
         break;
     case VT_R4:
-        _snwprintf ( pwszValue, cchValue, L"%f", propvar->fltVal );
+        objPtr = Tcl_NewDoubleObj(pv->fltVal);
         break;
     case VT_R8:
-        _snwprintf ( pwszValue, cchValue, L"%lf", propvar->dblVal );
+        objPtr = Tcl_NewDoubleObj(pv->dblVal);
         break;
-    case VT_BSTR:
-        _snwprintf ( pwszValue, cchValue, L"%s", propvar->bstrVal );
+    case VT_CY:
+        objPtr = Tcl_NewDoubleObj(pv->cyVal.int64 / 10000.0);
         break;
-    case VT_ERROR:
-        _snwprintf ( pwszValue, cchValue, L"0x%08X", propvar->scode );
+    case VT_DATE:
+        objPtr = Tcl_NewWideIntObj((Tcl_WideInt)
+            floor((pv->date - 25569.0) * 86400.0 + 0.5));
         break;
     case VT_BOOL:
-        _snwprintf ( pwszValue, cchValue, L"%s",
-                     VARIANT_TRUE == propvar->boolVal ? L"true" : L"false" );
+        objPtr = Tcl_NewBooleanObj(pv->boolVal != VARIANT_FALSE);
         break;
-    case VT_I1:
-        _snwprintf ( pwszValue, cchValue, L"%i", propvar->cVal );
+    case VT_FILETIME:
+        objPtr = CfbFileTimeObj(((Tcl_WideUInt)pv->filetime.dwHighDateTime
+            << 32) | pv->filetime.dwLowDateTime, duration);
         break;
-    case VT_UI1:
-        _snwprintf ( pwszValue, cchValue, L"%u", propvar->bVal );
+    case VT_CLSID:
+        objPtr = CfbGuidObj((const unsigned char *)pv->puuid);
         break;
-    case VT_VOID:
-        wcsncpy( pwszValue, L"", cchValue );
+    case VT_BSTR:
+        objPtr = Tcl_NewUnicodeObj(pv->bstrVal, SysStringLen(pv->bstrVal));
         break;
     case VT_LPSTR:
-        if( 0 >_snwprintf ( pwszValue, cchValue, L"%hs", propvar->pszVal ))
-            wcsncpy( pwszValue, L"...", cchValue );
+        Tcl_ExternalToUtfDString(NULL, pv->pszVal, -1, &ds);
+        objPtr = Tcl_NewStringObj(Tcl_DStringValue(&ds),
+            Tcl_DStringLength(&ds));
+        Tcl_DStringFree(&ds);
         break;
     case VT_LPWSTR:
-        if( 0 > _snwprintf ( pwszValue, cchValue, L"%s", propvar->pwszVal ))
-            wcsncpy( pwszValue, L"...", cchValue );
+        objPtr = Tcl_NewUnicodeObj(pv->pwszVal, -1);
+        break;
+    case VT_BLOB:
+        objPtr = Tcl_NewByteArrayObj(pv->blob.pBlobData, pv->blob.cbSize);
+        break;
+    case VT_CF:
+        /* the clipboard format followed by the data as in the stream */
+        objPtr = Tcl_NewByteArrayObj(NULL, 0);
+        bytes = Tcl_SetByteArrayLength(objPtr, pv->pclipdata->cbSize);
+        PUT32(bytes, pv->pclipdata->ulClipFmt);
+        memcpy(bytes + 4, pv->pclipdata->pClipData,
+            pv->pclipdata->cbSize - 4);
+        break;
+    default:
+        objPtr = Tcl_NewObj();
+        break;
+    }
+    return objPtr;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ObjToPropVariant --
+ *
+ *	Fill in a PROPVARIANT of the given type from a Tcl object. This is
+ *	the reverse of PropVariantToObj. Strings and blobs refer to the
+ *	Tcl object so the PROPVARIANT must not be cleared and is only
+ *	valid while the object is unchanged.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+ObjToPropVariant(Tcl_Interp *interp, Tcl_Obj *objPtr, int type,
+    int duration, PROPVARIANT *pv)
+{
+    Tcl_WideInt w;
+    int i, len;
+
+    PropVariantInit(pv);
+    switch (type) {
+    case VT_I4:
+        if (Tcl_GetIntFromObj(interp, objPtr, &i) != TCL_OK)
+            return TCL_ERROR;
+        pv->lVal = i;
+        break;
+    case VT_I8:
+        if (Tcl_GetWideIntFromObj(interp, objPtr, &w) != TCL_OK)
+            return TCL_ERROR;
+        pv->hVal.QuadPart = w;
+        break;
+    case VT_R8:
+        if (Tcl_GetDoubleFromObj(interp, objPtr, &pv->dblVal) != TCL_OK)
+            return TCL_ERROR;
+        break;
+    case VT_BOOL:
+        if (Tcl_GetBooleanFromObj(interp, objPtr, &i) != TCL_OK)
+            return TCL_ERROR;
+        pv->boolVal = i ? VARIANT_TRUE : VARIANT_FALSE;
         break;
     case VT_FILETIME:
-        _snwprintf ( pwszValue, cchValue, L"%08x:%08x",
-                     propvar->filetime.dwHighDateTime,
-                     propvar->filetime.dwLowDateTime );
+        if (Tcl_GetWideIntFromObj(interp, objPtr, &w) != TCL_OK)
+            return TCL_ERROR;
+        w = (Tcl_WideInt)CfbFileTimeFromSeconds(w, duration);
+        pv->filetime.dwLowDateTime = (DWORD)w;
+        pv->filetime.dwHighDateTime = (DWORD)(w >> 32);
         break;
-    case VT_CLSID:
-        pwszValue[0] = L'\0';
-        StringFromGUID2( propvar->puuid, pwszValue, cchValue );
+    case VT_LPWSTR:
+        pv->pwszVal = Tcl_GetUnicode(objPtr);
+        break;
+    case VT_BLOB:
+        pv->blob.pBlobData = Tcl_GetByteArrayFromObj(objPtr, &len);
+        pv->blob.cbSize = (ULONG)len;
         break;
     default:
-        wcsncpy( pwszValue, L"...", cchValue );
+        type = VT_LPSTR;
+        pv->pszVal = Tcl_GetString(objPtr);
         break;
     }
+    pv->vt = (VARTYPE)type;
+    return TCL_OK;
+}
+
+#else /* !_WIN32 */
+
+/*
+ * Native storages read the whole property set stream when it is opened
+ * and decode every section. The properties are then served from memory.
+ * Changes are made to the decoded section and the stream is encoded and
+ * written once when the property set is closed.
+ */
+
+typedef struct PropertySet {
+    Cfb            *cfbPtr;
+    CfbSect         dirId;      /* storage holding the stream */
+    Tcl_Obj        *streamObj;  /* name of the property set stream */
+    CfbPropSet     *setPtr;     /* the decoded property set stream */
+    CfbPropSection *secPtr;     /* the section for this property set */
+    int             mode;
+    int             dirty;      /* the stream must be written */
+} PropertySet;
+
+static Tcl_ObjCmdProc PropertyNamesCmd;
+static Tcl_ObjCmdProc PropertyGetCmd;
+static Tcl_ObjCmdProc PropertySetCmd;
+static Tcl_ObjCmdProc PropertySetManyCmd;
+static Tcl_ObjCmdProc PropertyDeleteCmd;
+static Tcl_CmdDeleteProc PropertyCmdDeleteProc;
+static int  ReadPropertySet(Cfb *cfbPtr, CfbSect id, CfbPropSet **setPtrPtr);
+static int  WritePropertySet(PropertySet *propsetPtr);
+static int  SetProperty(Tcl_Interp *interp, PropertySet *propsetPtr,
+                Tcl_Obj *nameObj, Tcl_Obj *valueObj, int type);
+static int  PropertySetWritable(Tcl_Interp *interp, PropertySet *propsetPtr);
+static int  FindProperty(PropertySet *propsetPtr, Tcl_Obj *nameObj,
+                unsigned long *propidPtr);
+static Tcl_Obj *PropertyNameObj(PropertySet *propsetPtr,
+                unsigned long propid);
+static Tcl_Obj *PropertySetError(Tcl_Obj *idObj, int code);
+
+static Ensemble PropertyEnsemble[] = {
+    { "names",    PropertyNamesCmd,   0 },
+    { "get",      PropertyGetCmd,     0 },
+    { "getall",   PropertyGetAllCmd,  0 },
+    { "set",      PropertySetCmd,     0 },
+    { "setmany",  PropertySetManyCmd, 0 },
+    { "unset",    PropertyDeleteCmd,  0 },
+    { "close",    PropertyCloseCmd,   0 },
+    { NULL,       0,                  0 }
+};
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ReadPropertySet --
+ *
+ *	Read a property set stream into memory and decode it.
+ *
+ * Results:
+ *	A CFB status code. The decoded property set is stored in
+ *	setPtrPtr and must be released with CfbPropFree.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+ReadPropertySet(Cfb *cfbPtr, CfbSect id, CfbPropSet **setPtrPtr)
+{
+    CfbStream *stmPtr = NULL;
+    unsigned char *data;
+    int code, size;
+
+    code = CfbStreamOpen(cfbPtr, id, &stmPtr);
+    if (code != CFB_OK) {
+        return code;
+    }
+    if (stmPtr->size > INT_MAX) {
+        CfbStreamClose(stmPtr);
+        return CFB_EFORMAT;
+    }
+    size = (int)stmPtr->size;
+    data = (unsigned char *)ckalloc(size + 1);
+    if (CfbStreamRead(stmPtr, (char *)data, size) != size) {
+        code = CFB_EFORMAT;
+    } else {
+        code = CfbPropDecode(data, (unsigned long)size, setPtrPtr);
+    }
+    ckfree((char *)data);
+    CfbStreamClose(stmPtr);
+    return code;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * WritePropertySet --
+ *
+ *	Encode the property set and replace the contents of its stream.
+ *	Nothing is written unless a property has been changed.
+ *
+ * Results:
+ *	A CFB status code.
+ *
+ * Side effects:
+ *	The stream is created if necessary and rewritten.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+WritePropertySet(PropertySet *propsetPtr)
+{
+    Cfb *cfbPtr = propsetPtr->cfbPtr;
+    CfbStream *stmPtr = NULL;
+    CfbSect id = 0;
+    Tcl_Obj *dataObj;
+    unsigned char *data;
+    int code, size;
+
+    if (!propsetPtr->dirty) {
+        return CFB_OK;
+    }
+    code = CfbFindChild(cfbPtr, propsetPtr->dirId, propsetPtr->streamObj,
+        &id);
+    if (code == CFB_ENOENT) {
+        code = CfbCreateEntry(cfbPtr, propsetPtr->dirId,
+            propsetPtr->streamObj, CFB_TYPE_STREAM, &id);
+    }
+    if (code == CFB_OK) {
+        code = CfbStreamOpen(cfbPtr, id, &stmPtr);
+    }
+    if (code != CFB_OK) {
+        return code;
+    }
+
+    dataObj = CfbPropEncode(propsetPtr->setPtr);
+    Tcl_IncrRefCount(dataObj);
+    data = Tcl_GetByteArrayFromObj(dataObj, &size);
+    if (CfbStreamWrite(stmPtr, (const char *)data, size, &code) == size) {
+        code = CfbStreamSetSize(stmPtr, (Tcl_WideUInt)size);
+    }
+    Tcl_DecrRefCount(dataObj);
+    CfbStreamClose(stmPtr);
+    if (code == CFB_OK) {
+        propsetPtr->dirty = 0;
+    }
+    return code;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertySetError --
+ *
+ *	Build the error message for a property set that cannot be used.
+ *
+ * Results:
+ *	A new Tcl object.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+PropertySetError(Tcl_Obj *idObj, int code)
+{
+    Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+    Tcl_AppendStringsToObj(errObj, "error opening property set \"",
+        Tcl_GetString(idObj), "\"", (char *)NULL);
+    if (code == CFB_EFORMAT) {
+        Tcl_AppendToObj(errObj, ": not a valid property set", -1);
+    } else {
+        Tcl_AppendObjToObj(errObj, CfbError("", code));
+    }
+    return errObj;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertySetOpenCmd --
+ *
+ *	Read and decode a property set of a native storage and create a
+ *	Tcl command to access the properties. With mode w the section is
+ *	emptied or created and with mode a it is created if it is not
+ *	present. A stream is only written when the property set is closed.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	A new Tcl command is created in the current interpreter.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+PropertySetOpenCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    Cfb *cfbPtr = storagePtr->cfbPtr;
+    CfbPropSet *setPtr = NULL;
+    CfbPropSection *secPtr = NULL;
+    EnsembleCmdData *dataPtr;
+    PropertySet *propsetPtr;
+    Tcl_Obj *streamObj;
+    unsigned char fmtid[16];
+    char name[7 + TCL_INTEGER_SPACE];
+    int mode = STGM_READ, code = CFB_OK, dirty = 0;
+    CfbSect id = 0;
+
+    if (objc < 4 || objc > 5) {
+        Tcl_WrongNumArgs(interp, 3, objv, "id ?mode?");
+        return TCL_ERROR;
+    }
+    if (cfbPtr == NULL) {
+        return NoPropertySets(interp);
+    }
+    if (GetFMTIDFromObj(interp, objv[3], fmtid) != TCL_OK
+        || (objc > 4
+            && GetStorageFlagsFromObj(interp, objv[4], &mode) != TCL_OK)) {
+        return TCL_ERROR;
+    }
+
+    streamObj = CfbPropStreamName(fmtid);
+    Tcl_IncrRefCount(streamObj);
+
+    if (mode & (STGM_WRITE|STGM_READWRITE|STGM_CREATE|STGM_APPEND)
+        && !StorageWritable(storagePtr)) {
+        code = CFB_EACCES;
+    } else {
+        code = CfbFindChild(cfbPtr, storagePtr->dirId, streamObj, &id);
+    }
+    if (code == CFB_OK) {
+        code = ReadPropertySet(cfbPtr, id, &setPtr);
+    }
+    if ((code == CFB_ENOENT && (mode & (STGM_CREATE|STGM_APPEND)))
+        || (code == CFB_EFORMAT && (mode & STGM_CREATE))) {
+        setPtr = CfbPropCreate();
+        code = CFB_OK;
+    }
+    if (code == CFB_OK) {
+        secPtr = CfbPropFindSection(setPtr, fmtid);
+        if ((mode & STGM_CREATE) || (secPtr == NULL
+                && (mode & STGM_APPEND))) {
+            secPtr = CfbPropNewSection(setPtr, fmtid);
+            dirty = 1;
+        } else if (secPtr == NULL) {
+            CfbPropFree(setPtr);
+            code = CFB_ENOENT;
+        }
+    }
+    if (code != CFB_OK) {
+        Tcl_DecrRefCount(streamObj);
+        Tcl_SetObjResult(interp, PropertySetError(objv[3], code));
+        return TCL_ERROR;
+    }
+
+    propsetPtr = (PropertySet *)ckalloc(sizeof(PropertySet));
+    propsetPtr->cfbPtr = cfbPtr;
+    propsetPtr->dirId = storagePtr->dirId;
+    propsetPtr->streamObj = streamObj;
+    propsetPtr->setPtr = setPtr;
+    propsetPtr->secPtr = secPtr;
+    propsetPtr->mode = mode;
+    propsetPtr->dirty = dirty;
+    CfbIncrRefCount(cfbPtr);
+
+    dataPtr = (EnsembleCmdData *)ckalloc(sizeof(EnsembleCmdData));
+    dataPtr->ensemble = PropertyEnsemble;
+    dataPtr->clientData = propsetPtr;
+    _snprintf(name, 7 + TCL_INTEGER_SPACE, "propset%lu",
+        (unsigned long)InterlockedIncrement(&PROPSETID));
+    Tcl_CreateObjCommand(interp, name, TclEnsembleCmd, (ClientData)dataPtr,
+        (Tcl_CmdDeleteProc *)PropertyCmdDeleteProc);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertyCmdDeleteProc -
+ *
+ *	Write any changes and release the decoded property set when the
+ *	command is deleted. Errors cannot be reported here - use the
+ *	close subcommand to see them.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory free'd, the compound file reference is released.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+PropertyCmdDeleteProc(ClientData clientData)
+{
+    EnsembleCmdData *dataPtr = (EnsembleCmdData *)clientData;
+    PropertySet *propsetPtr = (PropertySet *)dataPtr->clientData;
+    WritePropertySet(propsetPtr);
+    Tcl_DecrRefCount(propsetPtr->streamObj);
+    CfbPropFree(propsetPtr->setPtr);
+    CfbDecrRefCount(propsetPtr->cfbPtr);
+    ckfree((char *)propsetPtr);
+    ckfree((char *)dataPtr);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertySetDeleteCmd --
+ *
+ *	Delete the specified property set. Not implemented for native
+ *	storages.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+PropertySetDeleteCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 3, objv, "id");
+        return TCL_ERROR;
+    }
+    if (storagePtr->cfbPtr == NULL) {
+        return NoPropertySets(interp);
+    }
+    Tcl_SetResult(interp, "error: command not implemented", TCL_STATIC);
+    return TCL_ERROR;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertySetNamesCmd --
+ *
+ *	Enumerate the property sets in a native storage. Every stream
+ *	whose name begins with \005 and that holds a valid property set
+ *	contributes the format identifiers of its sections.
+ *
+ * Results:
+ *	A standard Tcl result. The interpreter result is set to a Tcl
+ *	list containing the property set identifiers.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+PropertySetNamesCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    Cfb *cfbPtr = storagePtr->cfbPtr;
+    CfbSect *ids = NULL, count = 0, n;
+    Tcl_Obj *resObj;
+    int code, s;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 3, objv, "");
+        return TCL_ERROR;
+    }
+    if (cfbPtr == NULL) {
+        return NoPropertySets(interp);
+    }
+    code = CfbListChildren(cfbPtr, storagePtr->dirId, &ids, &count);
+    if (code != CFB_OK) {
+        Tcl_SetObjResult(interp, CfbError("error", code));
+        return TCL_ERROR;
+    }
+    resObj = Tcl_NewListObj(0, NULL);
+    for (n = 0; n < count; n++) {
+        const CfbEntry *entryPtr = cfbPtr->entries + ids[n];
+        CfbPropSet *setPtr;
+        if (entryPtr->type != CFB_TYPE_STREAM || entryPtr->nameLen < 2
+            || entryPtr->name[0] != 5
+            || ReadPropertySet(cfbPtr, ids[n], &setPtr) != CFB_OK) {
+            continue;
+        }
+        for (s = 0; s < setPtr->sectionCount; s++) {
+            Tcl_ListObjAppendElement(NULL, resObj,
+                CfbGuidObj(setPtr->sections[s].fmtid));
+        }
+        CfbPropFree(setPtr);
+    }
+    ckfree((char *)ids);
+    Tcl_SetObjResult(interp, resObj);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * FindProperty, PropertyNameObj --
+ *
+ *	Map between property names and ids. Names are looked up in the
+ *	standard names and then in the dictionary of the section ignoring
+ *	case. Properties without a name are given by their id.
+ *
+ * Results:
+ *	FindProperty returns 1 and sets *propidPtr if the name is known.
+ *	PropertyNameObj returns a new Tcl object.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+FindProperty(PropertySet *propsetPtr, Tcl_Obj *nameObj,
+    unsigned long *propidPtr)
+{
+    CfbPropSection *secPtr = propsetPtr->secPtr;
+    const char *name = Tcl_GetString(nameObj);
+    unsigned long propid = GetPROPIDFromName(secPtr->fmtid, name);
+    long id;
+    int n, len;
+
+    if (propid == 0) {
+        len = Tcl_NumUtfChars(name, -1);
+        for (n = 0; n < secPtr->nameCount; n++) {
+            const char *s = Tcl_GetString(secPtr->names[n].nameObj);
+            if (Tcl_NumUtfChars(s, -1) == len
+                && Tcl_UtfNcasecmp(s, name, (unsigned long)len) == 0) {
+                propid = secPtr->names[n].propid;
+                break;
+            }
+        }
+    }
+    if (propid == 0 && Tcl_GetLongFromObj(NULL, nameObj, &id) == TCL_OK) {
+        propid = (unsigned long)id;
+    }
+    *propidPtr = propid;
+    return propid != 0;
+}
+
+static Tcl_Obj *
+PropertyNameObj(PropertySet *propsetPtr, unsigned long propid)
+{
+    CfbPropSection *secPtr = propsetPtr->secPtr;
+    Tcl_Obj *nameObj;
+    int n;
+
+    for (n = 0; n < secPtr->nameCount; n++) {
+        if (secPtr->names[n].propid == propid) {
+            return Tcl_DuplicateObj(secPtr->names[n].nameObj);
+        }
+    }
+    nameObj = GetNameFromPROPID(secPtr->fmtid, propid);
+    if (nameObj != NULL) {
+        return nameObj;
+    }
+    return Tcl_NewWideIntObj((Tcl_WideInt)propid);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertyNamesCmd --
+ *
+ *	List the properties of a native property set with their types.
+ *	The code page and the reserved properties are not included.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertyNamesCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *propsetPtr = (PropertySet *)clientData;
+    CfbPropSection *secPtr = propsetPtr->secPtr;
+    Tcl_Obj *resObj;
+    int n;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        return TCL_ERROR;
+    }
+    resObj = Tcl_NewListObj(0, NULL);
+    for (n = 0; n < secPtr->propCount; n++) {
+        const CfbProperty *propPtr = secPtr->props + n;
+        if (propPtr->propid == CFB_PID_CODEPAGE
+            || propPtr->propid >= 0x80000000UL) {
+            continue;
+        }
+        Tcl_ListObjAppendElement(NULL, resObj,
+            PropertyNameObj(propsetPtr, propPtr->propid));
+        Tcl_ListObjAppendElement(NULL, resObj,
+            CfbPropTypeObj(propPtr->type));
+    }
+    Tcl_SetObjResult(interp, resObj);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertyGetAllCmd --
+ *
+ *	Get the values of every property in the set. The section was
+ *	decoded when the property set was opened so no further reading is
+ *	needed. The same properties as for names are included.
+ *
+ * Results:
+ *	A standard Tcl result. The result is a dict of property names
+ *	and values.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertyGetAllCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *propsetPtr = (PropertySet *)clientData;
+    CfbPropSection *secPtr = propsetPtr->secPtr;
+    Tcl_Obj *dictObj;
+    int n, raw;
+
+    if (GetAllArgs(interp, objc, objv, &raw) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    dictObj = Tcl_NewDictObj();
+    for (n = 0; n < secPtr->propCount; n++) {
+        const CfbProperty *propPtr = secPtr->props + n;
+        Tcl_Obj *keyObj;
+        if (propPtr->propid == CFB_PID_CODEPAGE
+            || propPtr->propid >= 0x80000000UL) {
+            continue;
+        }
+        if (raw) {
+            keyObj = Tcl_NewWideIntObj((Tcl_WideInt)propPtr->propid);
+        } else {
+            keyObj = PropertyNameObj(propsetPtr, propPtr->propid);
+        }
+        Tcl_DictObjPut(NULL, dictObj, keyObj, propPtr->valueObj);
+    }
+    Tcl_SetObjResult(interp, dictObj);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertyGetCmd --
+ *
+ *	Get the value of a property. As with OLE a property that is not
+ *	present has an empty value.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertyGetCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *propsetPtr = (PropertySet *)clientData;
+    CfbProperty *propPtr = NULL;
+    unsigned long propid;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name");
+        return TCL_ERROR;
+    }
+    if (FindProperty(propsetPtr, objv[2], &propid)) {
+        propPtr = CfbPropFind(propsetPtr->secPtr, propid);
+    }
+    if (propPtr != NULL) {
+        Tcl_SetObjResult(interp, propPtr->valueObj);
+    }
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertySetWritable --
+ *
+ *	Check that the property set was opened for writing.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertySetWritable(Tcl_Interp *interp, PropertySet *propsetPtr)
+{
+    if (!(propsetPtr->mode
+            & (STGM_WRITE|STGM_READWRITE|STGM_CREATE|STGM_APPEND))) {
+        Tcl_SetObjResult(interp, CfbError("error", CFB_EACCES));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * SetProperty --
+ *
+ *	Set one property in the decoded section. A name that is neither a
+ *	standard name, a name in the dictionary nor a property id is
+ *	added to the dictionary. The value is encoded as the given type
+ *	or, for CFB_VT_EMPTY, as the type chosen by ChooseType.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	The section is changed and the property set marked for writing.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+SetProperty(Tcl_Interp *interp, PropertySet *propsetPtr, Tcl_Obj *nameObj,
+    Tcl_Obj *valueObj, int type)
+{
+    CfbPropSection *secPtr = propsetPtr->secPtr;
+    unsigned long propid;
+    int added = 0;
+
+    if (!FindProperty(propsetPtr, nameObj, &propid)) {
+        propid = CfbPropAddName(secPtr, nameObj);
+        added = 1;
+    }
+    if (propid <= CFB_PID_CODEPAGE || propid >= 0x80000000UL) {
+        Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+        Tcl_AppendStringsToObj(errObj, "cannot set property \"",
+            Tcl_GetString(nameObj), "\"", (char *)NULL);
+        Tcl_SetObjResult(interp, errObj);
+        return TCL_ERROR;
+    }
+    if (type == CFB_VT_EMPTY) {
+        CfbProperty *propPtr = added ? NULL : CfbPropFind(secPtr, propid);
+        type = ChooseType(propPtr ? propPtr->type : CFB_VT_EMPTY,
+            secPtr->fmtid, propid, valueObj);
+    }
+    if (CfbPropSetValue(interp, secPtr, propid, type, valueObj) != TCL_OK) {
+        if (added) {
+            CfbPropUnset(secPtr, propid);
+        }
+        return TCL_ERROR;
+    }
+    propsetPtr->dirty = 1;
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertySetCmd, PropertySetManyCmd --
+ *
+ *	Set the value of one property or of every property in a dict. The
+ *	changes are held in memory and the stream is written once when
+ *	the property set is closed. If a value cannot be set the values
+ *	before it in the dict remain set. Without a type argument the type
+ *	is chosen by ChooseType.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	The properties are changed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertySetCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *propsetPtr = (PropertySet *)clientData;
+    int type;
+
+    if (objc < 4 || objc > 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name value ?type?");
+        return TCL_ERROR;
+    }
+    if (PropertySetWritable(interp, propsetPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc == 5) {
+        if (GetTypeFromObj(interp, objv[4], &type) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    } else {
+        type = CFB_VT_EMPTY;
+    }
+    return SetProperty(interp, propsetPtr, objv[2], objv[3], type);
+}
+
+static int
+PropertySetManyCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *propsetPtr = (PropertySet *)clientData;
+    Tcl_DictSearch search;
+    Tcl_Obj *keyObj, *valueObj;
+    int done;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "dict");
+        return TCL_ERROR;
+    }
+    if (PropertySetWritable(interp, propsetPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (Tcl_DictObjFirst(interp, objv[2], &search, &keyObj, &valueObj,
+            &done) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    for (; !done; Tcl_DictObjNext(&search, &keyObj, &valueObj, &done)) {
+        if (SetProperty(interp, propsetPtr, keyObj, valueObj,
+                CFB_VT_EMPTY) != TCL_OK) {
+            Tcl_DictObjDone(&search);
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertyDeleteCmd --
+ *
+ *	Remove a property and its name. As with OLE it is not an error if
+ *	the property is not present.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	The property is removed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertyDeleteCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    PropertySet *propsetPtr = (PropertySet *)clientData;
+    unsigned long propid;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name");
+        return TCL_ERROR;
+    }
+    if (PropertySetWritable(interp, propsetPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (FindProperty(propsetPtr, objv[2], &propid)
+        && propid > CFB_PID_CODEPAGE) {
+        CfbPropUnset(propsetPtr->secPtr, propid);
+        propsetPtr->dirty = 1;
+    }
+    return TCL_OK;
+}
+
+#endif /* !_WIN32 */
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * GetAllArgs --
+ *
+ *	Parse the arguments of the getall subcommand.
+ *
+ * Results:
+ *	A standard Tcl result. *rawPtr is set if property ids rather than
+ *	names are wanted.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+GetAllArgs(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[], int *rawPtr)
+{
+    static const char *options[] = { "-raw", NULL };
+    int index;
+
+    *rawPtr = 0;
+    if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-raw?");
+        return TCL_ERROR;
+    }
+    if (objc == 3) {
+        if (Tcl_GetIndexFromObj(interp, objv[2], options, "option", 0,
+                &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        *rawPtr = 1;
+    }
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * GetTypeFromObj --
+ *
+ *	Get the property type named by the type argument of set.
+ *
+ * Results:
+ *	A standard Tcl result. The type is stored in typePtr.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+GetTypeFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, int *typePtr)
+{
+    int index;
+
+    if (Tcl_GetIndexFromObjStruct(interp, objPtr, propTypes,
+            sizeof(propTypes[0]), "type", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    *typePtr = propTypes[index].type;
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * InferType --
+ *
+ *	Choose the property type for a value that was set without one.
+ *	Only the internal representation is examined so a value is never
+ *	parsed to find its type. Integers are VT_I4 or VT_I8 depending on
+ *	their size, doubles are VT_R8, parsed booleans are VT_BOOL and
+ *	byte arrays are VT_BLOB. Anything else is stored as a string.
+ *
+ * Results:
+ *	A CFB_VT_* type.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+InferType(Tcl_Obj *objPtr)
+{
+    static const Tcl_ObjType *intType, *wideType, *doubleType;
+    static const Tcl_ObjType *booleanType, *byteArrayType;
+    Tcl_WideInt w;
+
+    if (intType == NULL) {
+        /* the boolean type is not registered so take it from a value */
+        Tcl_Obj *boolObj = Tcl_NewStringObj("true", -1);
+        int b;
+        Tcl_GetBooleanFromObj(NULL, boolObj, &b);
+        booleanType = boolObj->typePtr;
+        Tcl_DecrRefCount(boolObj);
+        wideType = Tcl_GetObjType("wideInt");
+        doubleType = Tcl_GetObjType("double");
+        byteArrayType = Tcl_GetObjType("bytearray");
+        intType = Tcl_GetObjType("int");
+    }
+    if (objPtr->typePtr == NULL) {
+        return CFB_VT_LPSTR;
+    }
+    if (objPtr->typePtr == intType || objPtr->typePtr == wideType) {
+        Tcl_GetWideIntFromObj(NULL, objPtr, &w);
+        return (w >= INT_MIN && w <= INT_MAX) ? CFB_VT_I4 : CFB_VT_I8;
+    }
+    if (objPtr->typePtr == doubleType) {
+        return CFB_VT_R8;
+    }
+    if (objPtr->typePtr == booleanType) {
+        return CFB_VT_BOOL;
+    }
+    if (objPtr->typePtr == byteArrayType) {
+        return CFB_VT_BLOB;
+    }
+    return CFB_VT_LPSTR;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ChooseType --
+ *
+ *	Choose the type for a value set without one. A property keeps the
+ *	type it already has if that type can be written. A new standard
+ *	property of the summary information sets takes its defined type
+ *	and anything else is left to InferType.
+ *
+ * Results:
+ *	A CFB_VT_* type.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+ChooseType(int existing, const unsigned char *fmtid, unsigned long propid,
+    Tcl_Obj *valueObj)
+{
+    int n;
+
+    for (n = 0; existing != CFB_VT_EMPTY && propTypes[n].name; n++) {
+        if (propTypes[n].type == existing) {
+            return existing;
+        }
+    }
+    if (memcmp(fmtid, cfbFmtidSummary, 16) == 0
+        && propid < sizeof(summary_types)/sizeof(summary_types[0])
+        && summary_types[propid]) {
+        return summary_types[propid];
+    }
+    if (memcmp(fmtid, cfbFmtidDocSummary, 16) == 0
+        && propid < sizeof(document_types)/sizeof(document_types[0])
+        && document_types[propid]) {
+        return document_types[propid];
+    }
+    return InferType(valueObj);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * PropertyCloseCmd --
+ *
+ *	Close the property set. Changes to a native property set are
+ *	written here so that any error can be reported.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	The property set command is deleted.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+PropertyCloseCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    int r = TCL_OK;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        return TCL_ERROR;
+    }
+#ifndef _WIN32
+    {
+        int code = WritePropertySet((PropertySet *)clientData);
+        if (code != CFB_OK) {
+            Tcl_SetObjResult(interp, CfbError("error", code));
+            r = TCL_ERROR;
+        }
+    }
+#endif
+    Tcl_DeleteCommand(interp, Tcl_GetString(objv[0]));
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * NoPropertySets --
+ *
+ *	Report that the storage does not support property sets. Only
+ *	OLE storages provide property sets at this time.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+NoPropertySets(Tcl_Interp *interp)
+{
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        "property sets are not supported for this storage", -1));
+    return TCL_ERROR;
 }
 
 /* ----------------------------------------------------------------------
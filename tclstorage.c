@@ -9,24 +9,43 @@
  * 
  * Notable users of structured storages are Microsoft Word and Excel.
  *
+ * On Windows the storages are accessed using OLE. Elsewhere the native
+ * compound file implementation in cfb.c is used.
+ *
  * Usage:
- *   storage open filename mode
+ *   storage open filename ?mode? ?-transacted?
  *      mode is as per the Tcl open command "[raw]+?"
  *      returns a storage command. The storage will remain open
  *      as long as the command exists. You can close the storage file
  *      using either the close subcommand or renaming the command.
+ *      With -transacted changes are only written by commit.
+ *   storage open -data bytes ?mode? ?-transacted?
+ *      open a storage held in a byte array. Changes are made in memory
+ *      and may be obtained using serialize.
  *   eg: % storage open document.doc r+
  *       stg1
+ *   storage create filename ?-stream?
+ *      create a new storage file. With -stream the file is generated
+ *      sequentially and only supports opendir, open and close.
+ *   storage attach token
+ *      open a read-only storage shared by another thread using share.
  *
  *  object commands:
  *   opendir name ?mode?     open or create a sub-storage
  *   open name ?mode?        open or create a stream as a Tcl channel
+ *   read name ?offset? ?length?  read a stream without a channel
+ *   readmany list           read several streams and return a dict
  *   close                   close the storage or sub-storage
  *   stat name varname       get information about the named item
- *   commit                  not used
+ *   commit                  write any changes to the file
+ *   revert                  discard changes made since the last commit
+ *   serialize               get the compound file image as a byte array
+ *   share                   get a token to attach the storage in a thread
  *   rename oldname newname  rename a stream or sub-storage
  *   remove name             deletes a stream or sub-storage + contents
  *   names                   list all items in the current storage
+ *   extract destdir ?-threads n? ?-glob pattern?
+ *                           copy the streams into host files
  *   propertyset             subcommands to handle property sets
  *
  * ----------------------------------------------------------------------
@@ -60,30 +79,93 @@ static Tcl_ObjCmdProc StorageObjCmd;
 static Tcl_CmdDeleteProc StorageObjDeleteProc;
 static Tcl_ObjCmdProc StorageOpendirCmd;
 static Tcl_ObjCmdProc StorageOpenCmd;
+static Tcl_ObjCmdProc StorageReadCmd;
+static Tcl_ObjCmdProc StorageReadManyCmd;
 static Tcl_ObjCmdProc StorageStatCmd;
 static Tcl_ObjCmdProc StorageRenameCmd;
 static Tcl_ObjCmdProc StorageRemoveCmd;
 static Tcl_ObjCmdProc StorageCloseCmd;
 static Tcl_ObjCmdProc StorageCommitCmd;
+static Tcl_ObjCmdProc StorageRevertCmd;
+static Tcl_ObjCmdProc StorageSerializeCmd;
+static Tcl_ObjCmdProc StorageShareCmd;
+static Tcl_ObjCmdProc StorageCompactCmd;
+static Tcl_ObjCmdProc StorageAnalyzeCmd;
+static Tcl_ObjCmdProc StorageCacheCmd;
 static Tcl_ObjCmdProc StorageNamesCmd;
+static Tcl_ObjCmdProc StorageWalkCmd;
+static Tcl_ObjCmdProc StorageExtractCmd;
+static Tcl_ObjCmdProc BuilderOpendirCmd;
+static Tcl_ObjCmdProc BuilderOpenCmd;
+static void CreateStorageChannel(Tcl_Interp *interp, Storage *storagePtr,
+    IStream *pstm, CfbStream *stmPtr, CfbBuilder *builderPtr,
+    CfbSect builderId, int mode);
+static int  CloseChildren(Tcl_Interp *interp, Storage *storagePtr);
 
 extern Tcl_ObjCmdProc PropertySetOpenCmd;
 extern Tcl_ObjCmdProc PropertySetDeleteCmd;
 extern Tcl_ObjCmdProc PropertySetNamesCmd;
+extern Tcl_ObjCmdProc PropertySetRegisterCmd;
 
 static long UNIQUEID = 0;
 
+/*
+ * Storages published by the share command. This is the only table used
+ * by more than one thread. Each entry holds a reference to the compound
+ * file and is removed when the storage that shared it is closed.
+ */
+
+typedef struct SharedStorage {
+    Cfb     *cfbPtr;
+    CfbSect  dirId;
+} SharedStorage;
+
+static Tcl_HashTable shareTable;
+static int shareTableInitialized = 0;
+static long shareUid = 0;
+TCL_DECLARE_MUTEX(shareMutex)
+
+/*
+ * Information about a storage item common to both the OLE and the
+ * native implementations.
+ */
+
+typedef struct ItemInfo {
+    int          type;          /* STGTY_STORAGE or STGTY_STREAM */
+    Tcl_WideInt  size;
+    Tcl_WideUInt atime;         /* FILETIME values */
+    Tcl_WideUInt mtime;
+    Tcl_WideUInt ctime;
+    CfbSect      id;            /* native directory entry */
+} ItemInfo;
+
 static Tcl_InterpDeleteProc PackageDeleteProc;
-static int GetItemInfo(Tcl_Interp *interp, IStorage *pstg, 
-    Tcl_Obj *pathObj, STATSTG *pstatstg);
+static int GetItemInfo(Tcl_Interp *interp, Storage *storagePtr, 
+    Tcl_Obj *pathObj, ItemInfo *infoPtr);
+static void InfoFromEntry(const CfbEntry *entryPtr, CfbSect id,
+    ItemInfo *infoPtr);
+static Tcl_Obj *ItemInfoObj(int mode, const ItemInfo *infoPtr);
+static Tcl_Obj *CompactResultObj(const CfbUsage *beforePtr,
+    const CfbUsage *afterPtr);
+static int AnalyzeStreams(Cfb *cfbPtr, CfbSect dirId, Tcl_Obj *prefixObj,
+    Tcl_Obj *resultObj);
+static CfbCheckProc CheckProblemProc;
+static Tcl_Obj *WalkPath(Tcl_Obj *prefixObj, Tcl_Obj *nameObj);
+static time_t TimeFromFileTime(Tcl_WideUInt ft);
+#ifdef _WIN32
 static void TimeToFileTime(time_t t, LPFILETIME pft);
-static time_t TimeFromFileTime(const FILETIME *pft);
+static Tcl_WideUInt WideFromFileTime(const FILETIME *pft);
+static HRESULT StatItem(IStorage *pstg, LPCOLESTR pwcsName, STATSTG *statPtr);
+static void InfoFromStatStg(const STATSTG *statPtr, ItemInfo *infoPtr);
+#endif
 
 
 static Tcl_DriverCloseProc     StorageChannelClose;
 static Tcl_DriverInputProc     StorageChannelInput;
 static Tcl_DriverOutputProc    StorageChannelOutput;
 static Tcl_DriverSeekProc      StorageChannelSeek;
+static Tcl_DriverSetOptionProc StorageChannelSetOptions;
+static Tcl_DriverGetOptionProc StorageChannelGetOptions;
 static Tcl_DriverWatchProc     StorageChannelWatch;
 static Tcl_DriverGetHandleProc StorageChannelGetHandle;
 static Tcl_DriverWideSeekProc  StorageChannelWideSeek;
@@ -91,11 +173,17 @@ static Tcl_DriverWideSeekProc  StorageChannelWideSeek;
 static int EventProc(Tcl_Event *evPtr, int flags);
 static void SetupProc(ClientData clientData, int flags);
 static void CheckProc(ClientData clientData, int flags);
+static int EventDeleteProc(Tcl_Event *evPtr, ClientData clientData);
+static int ErrnoFromCfb(int code);
 
 #define STORAGE_PACKAGE_KEY  "StoragePackageKey"
 #define STORAGE_FLAG_ASYNC   (1<<1)
 #define STORAGE_FLAG_PENDING (1<<2)
 
+#define STORAGE_READAHEAD_SEQUENTIAL -1 /* read-ahead hints for channels */
+#define STORAGE_READAHEAD_RANDOM     -2
+#define STORAGE_SEQUENTIAL_SECTORS   64
+
 struct Package;
 
 typedef struct StorageChannel {
@@ -108,11 +196,17 @@ typedef struct StorageChannel {
     int validmask;
     int flags;
     IStream *pstm;
+    CfbStream *stmPtr;
+    CfbBuilder *builderPtr;     /* stream being generated by a builder */
+    CfbSect builderId;
+    Storage *storagePtr;        /* storage the stream was opened from */
+    int readahead;              /* sectors per read, a hint or 0 */
 } StorageChannel;
 
 typedef struct Package {
     struct StorageChannel *headPtr;
     unsigned long count;
+    unsigned long watchCount;   /* channels with a non-zero watchmask */
     unsigned long uid;
 } Package;
 
@@ -129,8 +223,8 @@ static Tcl_ChannelType StorageChannelType = {
     StorageChannelInput,
     StorageChannelOutput,
     StorageChannelSeek,
-    /* StorageChannelSetOptions */ NULL,
-    /* StorageChannelGetOptions */ NULL,
+    StorageChannelSetOptions,
+    StorageChannelGetOptions,
     StorageChannelWatch,
     StorageChannelGetHandle,
     /* StorageChannelClose2 */     NULL,
@@ -141,9 +235,19 @@ static Tcl_ChannelType StorageChannelType = {
 };
 
 
+static Ensemble StoragePropertySetEnsemble[] = {
+    { "register", PropertySetRegisterCmd, 0 },
+    { NULL,       0,                      0 }
+};
+
 static Ensemble StorageEnsemble[] = {
-    { "open",   Storage_OpenStorage,   0 },
-    { NULL,     0,                     0 }
+    { "open",    Storage_OpenStorage,    0 },
+    { "create",  Storage_CreateStorage,  0 },
+    { "attach",  Storage_AttachStorage,  0 },
+    { "compact", Storage_CompactStorage, 0 },
+    { "check",   Storage_CheckStorage,   0 },
+    { "propertyset", NULL, StoragePropertySetEnsemble },
+    { NULL,      0,                      0 }
 };
 
 static Ensemble PropertySetEnsemble[] = {
@@ -156,16 +260,33 @@ static Ensemble PropertySetEnsemble[] = {
 static Ensemble StorageObjEnsemble[] = {
     { "opendir",     StorageOpendirCmd,     0 },
     { "open",        StorageOpenCmd,        0 },
+    { "read",        StorageReadCmd,        0 },
+    { "readmany",    StorageReadManyCmd,    0 },
     { "close",       StorageCloseCmd,       0 },
     { "stat",        StorageStatCmd,        0 },
     { "commit",      StorageCommitCmd,      0 },
+    { "revert",      StorageRevertCmd,      0 },
+    { "serialize",   StorageSerializeCmd,   0 },
+    { "share",       StorageShareCmd,       0 },
+    { "compact",     StorageCompactCmd,     0 },
+    { "analyze",     StorageAnalyzeCmd,     0 },
+    { "cache",       StorageCacheCmd,       0 },
     { "rename",      StorageRenameCmd,      0 },
     { "remove",      StorageRemoveCmd,      0 },
     { "names",       StorageNamesCmd,       0 },
+    { "walk",        StorageWalkCmd,        0 },
+    { "extract",     StorageExtractCmd,     0 },
     { "propertyset", NULL, PropertySetEnsemble},
     { NULL,          0,                     0 }
 };
 
+static Ensemble BuilderObjEnsemble[] = {
+    { "opendir",     BuilderOpendirCmd,     0 },
+    { "open",        BuilderOpenCmd,        0 },
+    { "close",       StorageCloseCmd,       0 },
+    { NULL,          0,                     0 }
+};
+
 /* ---------------------------------------------------------------------- */
 
 typedef struct {
@@ -250,6 +371,7 @@ Storage_Init(Tcl_Interp *interp)
     pkgPtr = (Package *)ckalloc(sizeof(Package));
     pkgPtr->headPtr = NULL;
     pkgPtr->count = 0;
+    pkgPtr->watchCount = 0;
     pkgPtr->uid = 0;
     Tcl_CreateEventSource(SetupProc, CheckProc, pkgPtr);
     Tcl_SetAssocData(interp, STORAGE_PACKAGE_KEY, PackageDeleteProc, pkgPtr);
@@ -338,7 +460,9 @@ PackageDeleteProc(ClientData clientData, Tcl_Interp *interp)
  * CreateStorageCommand -
  *
  *	Utility function to create a unique Tcl command to represent
- *	a Structured storage instance.
+ *	a Structured storage instance. The storage is either an OLE
+ *	storage, a native compound file and directory entry or a
+ *	storage being generated by a builder.
  *
  * Results:
  *	A standard Tcl result. The name of the new command is returned
@@ -346,14 +470,16 @@ PackageDeleteProc(ClientData clientData, Tcl_Interp *interp)
  *
  * Side effects:
  *	A new command is created in the Tcl interpreter.
- *	The command name is added to a list held by the parent storage.
+ *	The storage is added to the table of children held by the parent
+ *	storage so that closing the parent closes it too.
  *
  * ----------------------------------------------------------------------
  */
 
 static int
 CreateStorageCommand(Tcl_Interp *interp, Storage *parentPtr, 
-    IStorage *pstg, int mode)
+    IStorage *pstg, Cfb *cfbPtr, CfbBuilder *builderPtr, CfbSect dirId,
+    int mode)
 {
     EnsembleCmdData *dataPtr = NULL;
     Storage *storagePtr = NULL;
@@ -368,18 +494,29 @@ CreateStorageCommand(Tcl_Interp *interp, Storage *parentPtr,
     storagePtr = (Storage *)ckalloc(sizeof(Storage));
     storagePtr->mode = mode;
     storagePtr->pstg = pstg;
-    storagePtr->children = Tcl_NewListObj(0, NULL);
+    storagePtr->cfbPtr = cfbPtr;
+    storagePtr->builderPtr = builderPtr;
+    storagePtr->dirId = dirId;
+    storagePtr->interp = interp;
+    storagePtr->parentPtr = parentPtr;
+    storagePtr->shareObj = NULL;
+    Tcl_InitHashTable(&storagePtr->children, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&storagePtr->channels, TCL_ONE_WORD_KEYS);
     
-    Tcl_IncrRefCount(storagePtr->children);
+    if (cfbPtr)
+        CfbIncrRefCount(cfbPtr);
+    if (builderPtr)
+        CfbBuilderIncrRefCount(builderPtr);
     
     dataPtr->clientData = storagePtr;
-    dataPtr->ensemble = StorageObjEnsemble;
+    dataPtr->ensemble = builderPtr ? BuilderObjEnsemble : StorageObjEnsemble;
     
-    Tcl_CreateObjCommand(interp, name, TclEnsembleCmd, 
+    storagePtr->token = Tcl_CreateObjCommand(interp, name, TclEnsembleCmd, 
 	(ClientData)dataPtr, (Tcl_CmdDeleteProc *)StorageObjDeleteProc);
     
     if (parentPtr) {
-        Tcl_ListObjAppendElement(interp, parentPtr->children, nameObj);
+        int isNew;
+        Tcl_CreateHashEntry(&parentPtr->children, (char *)storagePtr, &isNew);
     }
     
     Tcl_SetObjResult(interp, nameObj);
@@ -398,7 +535,14 @@ CreateStorageCommand(Tcl_Interp *interp, Storage *parentPtr,
  *	by the use of the close sub-command or by renaming the command
  *	to {}.
  *	The mode string is as per the Tcl open command. If w is specified
- *	the file will be created.
+ *	the file will be created. With -transacted changes are held
+ *	until the commit subcommand is used and are discarded if the
+ *	storage is closed without a commit.
+ *	With -data in place of the filename the storage is read from a
+ *	byte array and held in memory.
+ *	Without OLE the file is opened using the native implementation.
+ *	This maps the file unless -cachesize is given, when up to that
+ *	many bytes of sectors are cached instead.
  *
  * Results:
  *	A standard Tcl result. The name of the new command is placed in
@@ -415,26 +559,57 @@ int
 Storage_OpenStorage(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
-    HRESULT hr = S_OK;
-    int r = TCL_OK;
+    int r = TCL_OK, n, first = 3, haveMode = 0;
     int mode = STGM_DIRECT | STGM_SHARE_EXCLUSIVE;
-    IStorage *pstg = NULL;
+    Tcl_Obj *dataObj = NULL;
+    Tcl_WideInt cacheSize = 0;
     
-    if (objc < 3 || objc > 4) {
-        Tcl_WrongNumArgs(interp, 2, objv, "filename ?access?");
+    if (objc > 3 && strcmp(Tcl_GetString(objv[2]), "-data") == 0) {
+        dataObj = objv[3];
+        first = 4;
+    }
+    if (objc < 3 || objc > first + 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "filename|-data bytes"
+            " ?access? ?-transacted? ?-cachesize bytes?");
         return TCL_ERROR;
     }
-    if (objc == 4) {
-        r = GetStorageFlagsFromObj(interp, objv[3], &mode);
-    } else {
+    for (n = first; r == TCL_OK && n < objc; n++) {
+        if (strcmp(Tcl_GetString(objv[n]), "-transacted") == 0) {
+            mode |= STGM_TRANSACTED;
+        } else if (strcmp(Tcl_GetString(objv[n]), "-cachesize") == 0
+                   && n + 1 < objc) {
+            n++;
+            if (Tcl_GetWideIntFromObj(NULL, objv[n], &cacheSize) != TCL_OK
+                || cacheSize < 0) {
+                Tcl_AppendResult(interp, "bad cachesize \"",
+                    Tcl_GetString(objv[n]),
+                    "\": must be a non-negative number of bytes",
+                    (char *)NULL);
+                r = TCL_ERROR;
+            }
+        } else if (!haveMode) {
+            r = GetStorageFlagsFromObj(interp, objv[n], &mode);
+            haveMode = 1;
+        } else {
+            Tcl_WrongNumArgs(interp, 2, objv, "filename|-data bytes"
+                " ?access? ?-transacted? ?-cachesize bytes?");
+            r = TCL_ERROR;
+        }
+    }
+    if (!haveMode) {
         mode |= STGM_READ;
     }
     
+#ifdef _WIN32
     if (r == TCL_OK) {
-        if (mode & STGM_CREATE) {
+        HRESULT hr = S_OK;
+        IStorage *pstg = NULL;
+        if (dataObj && !(mode & STGM_CREATE)) {
+            hr = OpenOleData(dataObj, mode, &pstg);
+        } else if (mode & STGM_CREATE) {
 	    int cchFile = 0;
 	    LPCWSTR wszFile = Tcl_GetUnicodeFromObj(objv[2], &cchFile);
-	    if (cchFile < 1) {
+	    if (cchFile < 1 || dataObj) {
 		ILockBytes *pLockBytes = NULL;
 		hr = CreateILockBytesOnHGlobal(NULL, TRUE, &pLockBytes);
 		if (SUCCEEDED(hr)) {
@@ -452,16 +627,360 @@ Storage_OpenStorage(ClientData clientData, Tcl_Interp *interp,
 	}
 	
         if (SUCCEEDED(hr)) {
-            r = CreateStorageCommand(interp, NULL, pstg, mode);
+            r = CreateStorageCommand(interp, NULL, pstg, NULL, NULL, 0,
+                mode);
         } else {
             Tcl_Obj *errObj = Win32Error("failed to open storage", hr);
             Tcl_SetObjResult(interp, errObj);
             r = TCL_ERROR;
         }
     }
+#else
+    if (r == TCL_OK) {
+        Cfb *cfbPtr = NULL;
+        int code;
+        if (dataObj) {
+            int length = 0;
+            unsigned char *data = Tcl_GetByteArrayFromObj(dataObj, &length);
+            code = CfbOpenData(data, (Tcl_WideUInt)length, mode, &cfbPtr);
+        } else {
+            code = CfbOpen(objv[2], mode, (Tcl_WideUInt)cacheSize, &cfbPtr);
+        }
+        if (code == CFB_OK) {
+            r = CreateStorageCommand(interp, NULL, NULL, cfbPtr, NULL, 0,
+                mode);
+        } else {
+            Tcl_SetObjResult(interp, CfbError("failed to open storage", code));
+            r = TCL_ERROR;
+        }
+    }
+#endif
+    return r;
+}
+
+#ifdef _WIN32
+/*
+ * ----------------------------------------------------------------------
+ *
+ * OpenOleData, SerializeOle -
+ *
+ *	Open an OLE storage on a copy of a byte array held in global
+ *	memory, or copy a storage into global memory and return the image
+ *	as a byte array.
+ *
+ * Results:
+ *	A COM result code.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static HRESULT
+OpenOleData(Tcl_Obj *dataObj, int mode, IStorage **pstgPtr)
+{
+    ILockBytes *pLockBytes = NULL;
+    HGLOBAL hMem;
+    int length = 0;
+    unsigned char *data = Tcl_GetByteArrayFromObj(dataObj, &length);
+    HRESULT hr = E_OUTOFMEMORY;
+    
+    hMem = GlobalAlloc(GMEM_MOVEABLE, length);
+    if (hMem != NULL) {
+        memcpy(GlobalLock(hMem), data, length);
+        GlobalUnlock(hMem);
+        hr = CreateILockBytesOnHGlobal(hMem, TRUE, &pLockBytes);
+        if (FAILED(hr)) {
+            GlobalFree(hMem);
+        }
+    }
+    if (SUCCEEDED(hr)) {
+        hr = StgOpenStorageOnILockBytes(pLockBytes, NULL,
+            mode & STGM_WIN32MASK, NULL, 0, pstgPtr);
+        pLockBytes->lpVtbl->Release(pLockBytes);
+    }
+    return hr;
+}
+
+static HRESULT
+SerializeOle(IStorage *pstg, Tcl_Obj **objPtrPtr)
+{
+    ILockBytes *pLockBytes = NULL;
+    IStorage *pstgCopy = NULL;
+    HGLOBAL hMem = NULL;
+    STATSTG stat;
+    HRESULT hr;
+    
+    hr = CreateILockBytesOnHGlobal(NULL, TRUE, &pLockBytes);
+    if (SUCCEEDED(hr)) {
+        hr = StgCreateDocfileOnILockBytes(pLockBytes, 
+            STGM_CREATE | STGM_READWRITE | STGM_SHARE_EXCLUSIVE, 0, &pstgCopy);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = pstg->lpVtbl->CopyTo(pstg, 0, NULL, NULL, pstgCopy);
+        if (SUCCEEDED(hr)) {
+            hr = pstgCopy->lpVtbl->Commit(pstgCopy, STGC_DEFAULT);
+        }
+        pstgCopy->lpVtbl->Release(pstgCopy);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = pLockBytes->lpVtbl->Stat(pLockBytes, &stat, STATFLAG_NONAME);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = GetHGlobalFromILockBytes(pLockBytes, &hMem);
+    }
+    if (SUCCEEDED(hr)) {
+        *objPtrPtr = Tcl_NewByteArrayObj(GlobalLock(hMem),
+            (int)stat.cbSize.QuadPart);
+        GlobalUnlock(hMem);
+    }
+    if (pLockBytes) {
+        pLockBytes->lpVtbl->Release(pLockBytes);
+    }
+    return hr;
+}
+#endif /* _WIN32 */
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Storage_CreateStorage -
+ *
+ *	Create a new structured storage file. Without options this is
+ *	the same as opening the file with mode w+. With -stream the file
+ *	is generated in a single pass by a builder: stream data is
+ *	written out as it is produced and the directory and allocation
+ *	tables follow when the storage is closed. Only one stream may be
+ *	open at a time and items cannot be read back until the file is
+ *	reopened.
+ *
+ * Results:
+ *	A standard Tcl result. The name of the new command is placed in
+ *	the interpreters result.
+ *
+ * Side effects:
+ *	The file is created or truncated and a new Tcl command is created.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+Storage_CreateStorage(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    static const char *options[] = { "-stream", NULL };
+    CfbBuilder *builderPtr = NULL;
+    int index, code, r = TCL_OK;
+    
+    if (objc < 3 || objc > 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "filename ?-stream?");
+        return TCL_ERROR;
+    }
+    if (objc == 3) {
+        Tcl_Obj *argv[4];
+        argv[0] = objv[0];
+        argv[1] = objv[1];
+        argv[2] = objv[2];
+        argv[3] = Tcl_NewStringObj("w+", -1);
+        Tcl_IncrRefCount(argv[3]);
+        r = Storage_OpenStorage(clientData, interp, 4, argv);
+        Tcl_DecrRefCount(argv[3]);
+        return r;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[3], options, "option", 0,
+            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    
+    code = CfbBuilderCreate(objv[2], &builderPtr);
+    if (code == CFB_OK) {
+        r = CreateStorageCommand(interp, NULL, NULL, NULL, builderPtr, 0,
+            STGM_DIRECT | STGM_SHARE_EXCLUSIVE | STGM_WRITE | STGM_CREATE);
+    } else {
+        Tcl_SetObjResult(interp, CfbError("failed to create storage", code));
+        r = TCL_ERROR;
+    }
     return r;
 }
 
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Storage_AttachStorage -
+ *
+ *	Open a storage that has been shared by the share subcommand,
+ *	possibly in another thread. The new storage command uses the
+ *	same parsed compound file as the shared storage and is
+ *	read-only. It remains usable after the shared storage is closed.
+ *
+ * Results:
+ *	A standard Tcl result. The name of the new command is placed in
+ *	the interpreters result.
+ *
+ * Side effects:
+ *	A new command is created.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+Storage_AttachStorage(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Tcl_HashEntry *hPtr = NULL;
+    Cfb *cfbPtr = NULL;
+    CfbSect dirId = 0;
+    int r;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "token");
+        return TCL_ERROR;
+    }
+
+    Tcl_MutexLock(&shareMutex);
+    if (shareTableInitialized) {
+        hPtr = Tcl_FindHashEntry(&shareTable, Tcl_GetString(objv[2]));
+    }
+    if (hPtr) {
+        SharedStorage *sharePtr = Tcl_GetHashValue(hPtr);
+        cfbPtr = sharePtr->cfbPtr;
+        dirId = sharePtr->dirId;
+        CfbIncrRefCount(cfbPtr);
+    }
+    Tcl_MutexUnlock(&shareMutex);
+
+    if (cfbPtr == NULL) {
+        Tcl_AppendResult(interp, "no shared storage \"",
+            Tcl_GetString(objv[2]), "\"", (char *)NULL);
+        return TCL_ERROR;
+    }
+    r = CreateStorageCommand(interp, NULL, NULL, cfbPtr, NULL, dirId,
+        STGM_READ | STGM_SHARE_EXCLUSIVE);
+    CfbDecrRefCount(cfbPtr);
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Storage_CompactStorage -
+ *
+ *	Rewrite a structured storage file with each stream held in
+ *	consecutive sectors and without free space. With a destination
+ *	the compacted copy is written there and the source is unchanged.
+ *	Otherwise the copy replaces the source once it is complete. The
+ *	native implementation is used whether or not OLE is available.
+ *
+ * Results:
+ *	A standard Tcl result. The result describes the size and
+ *	fragmentation of the file before and after compaction.
+ *
+ * Side effects:
+ *	A file is written.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+Storage_CompactStorage(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Tcl_Obj *dstObj = NULL;
+    CfbUsage before, after;
+    Cfb *cfbPtr = NULL;
+    int mode = STGM_DIRECT | STGM_SHARE_EXCLUSIVE, code;
+
+    if (objc < 3 || objc > 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "source ?destination?");
+        return TCL_ERROR;
+    }
+    if (objc == 4 && !Tcl_FSEqualPaths(objv[2], objv[3])) {
+        dstObj = objv[3];
+    }
+    mode |= dstObj ? STGM_READ : STGM_READWRITE;
+    code = CfbOpen(objv[2], mode, 0, &cfbPtr);
+    if (code == CFB_OK) {
+        CfbIncrRefCount(cfbPtr);
+        code = CfbCompact(cfbPtr, dstObj, &before, &after);
+        CfbDecrRefCount(cfbPtr);
+    }
+    if (code != CFB_OK) {
+        Tcl_SetObjResult(interp, CfbError("failed to compact storage", code));
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, CompactResultObj(&before, &after));
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * Storage_CheckStorage -
+ *
+ *	Check the structure of a structured storage file without opening
+ *	it for use. With -first the check ends at the first problem so
+ *	damaged files can be rejected cheaply. The native implementation
+ *	is used whether or not OLE is available.
+ *
+ * Results:
+ *	A standard Tcl result. The result is a list of the problems
+ *	found, each a list of the area of the file, the sector or entry
+ *	concerned and a message. An empty list means no problem was found.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+typedef struct CheckResult {
+    Tcl_Obj *listObj;
+    int first;                  /* stop after the first problem */
+} CheckResult;
+
+int
+Storage_CheckStorage(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    CheckResult result;
+    int code;
+
+    if (objc == 4 && strcmp(Tcl_GetString(objv[3]), "-first") == 0) {
+        result.first = 1;
+    } else if (objc == 3) {
+        result.first = 0;
+    } else {
+        Tcl_WrongNumArgs(interp, 2, objv, "filename ?-first?");
+        return TCL_ERROR;
+    }
+    result.listObj = Tcl_NewListObj(0, NULL);
+    code = CfbCheck(objv[2], CheckProblemProc, (ClientData)&result);
+    if (code != CFB_OK) {
+        Tcl_DecrRefCount(result.listObj);
+        Tcl_SetObjResult(interp, CfbError("failed to check storage", code));
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, result.listObj);
+    return TCL_OK;
+}
+
+static int
+CheckProblemProc(ClientData clientData, const char *area, CfbSect item,
+    const char *message)
+{
+    CheckResult *resultPtr = (CheckResult *)clientData;
+    Tcl_Obj *objv[3];
+
+    objv[0] = Tcl_NewStringObj(area, -1);
+    objv[1] = (item == CFB_NOSTREAM) ? Tcl_NewObj()
+        : Tcl_NewWideIntObj((Tcl_WideInt)item);
+    objv[2] = Tcl_NewStringObj(message, -1);
+    Tcl_ListObjAppendElement(NULL, resultPtr->listObj,
+        Tcl_NewListObj(3, objv));
+    return resultPtr->first;
+}
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -473,9 +992,12 @@ Storage_OpenStorage(ClientData clientData, Tcl_Interp *interp,
  *	None.
  *
  * Side effects:
- *	Allocated resources are free'd and the IStorage pointer is
+ *	Any sub-storages and streams opened from this storage are closed
+ *	first. Allocated resources are free'd and the IStorage pointer is
  *	released which frees COM resources. This also unlocks the 
- *	associated file.
+ *	associated file. A native compound file is closed once the
+ *	last storage or stream using it is released. Deleting the root
+ *	storage of a builder completes the file.
  *
  * ----------------------------------------------------------------------
  */
@@ -485,13 +1007,97 @@ StorageObjDeleteProc(ClientData clientData)
 {
     EnsembleCmdData *dataPtr = (EnsembleCmdData *)clientData;
     Storage *storagePtr = (Storage *)dataPtr->clientData;
+    Tcl_InterpState state;
     
+    /* errors closing the children cannot be reported here */
+    state = Tcl_SaveInterpState(storagePtr->interp, TCL_OK);
+    CloseChildren(storagePtr->interp, storagePtr);
+    Tcl_RestoreInterpState(storagePtr->interp, state);
+    if (storagePtr->parentPtr) {
+        Tcl_DeleteHashEntry(Tcl_FindHashEntry(
+            &storagePtr->parentPtr->children, (char *)storagePtr));
+    }
+    
+#ifdef _WIN32
     if (storagePtr->pstg)
         storagePtr->pstg->lpVtbl->Release(storagePtr->pstg);
-    Tcl_DecrRefCount(storagePtr->children);
+#endif
+    if (storagePtr->shareObj) {
+        Tcl_HashEntry *hPtr;
+        Tcl_MutexLock(&shareMutex);
+        hPtr = Tcl_FindHashEntry(&shareTable,
+            Tcl_GetString(storagePtr->shareObj));
+        if (hPtr) {
+            SharedStorage *sharePtr = Tcl_GetHashValue(hPtr);
+            CfbDecrRefCount(sharePtr->cfbPtr);
+            ckfree((char *)sharePtr);
+            Tcl_DeleteHashEntry(hPtr);
+        }
+        Tcl_MutexUnlock(&shareMutex);
+        Tcl_DecrRefCount(storagePtr->shareObj);
+    }
+    if (storagePtr->cfbPtr)
+        CfbDecrRefCount(storagePtr->cfbPtr);
+    if (storagePtr->builderPtr) {
+        if (storagePtr->dirId == 0)
+            CfbBuilderFinish(storagePtr->builderPtr);
+        CfbBuilderDecrRefCount(storagePtr->builderPtr);
+    }
+    Tcl_DeleteHashTable(&storagePtr->children);
+    Tcl_DeleteHashTable(&storagePtr->channels);
     ckfree((char *)storagePtr);
     ckfree((char *)dataPtr);
 }
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CloseChildren -
+ *
+ *	Close every sub-storage and stream opened from a storage. Each is
+ *	detached from the storage before it is closed so the tables are
+ *	emptied one entry at a time. Sub-storages close their own children
+ *	in turn. While the interpreter is being deleted the children are
+ *	only detached as the interpreter closes them itself.
+ *
+ * Results:
+ *	A standard Tcl result. An error closing a stream is left in the
+ *	interpreter result but the remaining children are still closed.
+ *
+ * Side effects:
+ *	Commands are deleted and channels closed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+CloseChildren(Tcl_Interp *interp, Storage *storagePtr)
+{
+    int deleted = Tcl_InterpDeleted(interp), r = TCL_OK;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+
+    while ((hPtr = Tcl_FirstHashEntry(&storagePtr->channels, &search))) {
+        StorageChannel *instPtr = (StorageChannel *)
+            Tcl_GetHashKey(&storagePtr->channels, hPtr);
+        Tcl_DeleteHashEntry(hPtr);
+        instPtr->storagePtr = NULL;
+        if (!deleted && Tcl_UnregisterChannel(instPtr->interp,
+                instPtr->chan) != TCL_OK) {
+            r = TCL_ERROR;
+        }
+    }
+    while ((hPtr = Tcl_FirstHashEntry(&storagePtr->children, &search))) {
+        Storage *childPtr = (Storage *)
+            Tcl_GetHashKey(&storagePtr->children, hPtr);
+        Tcl_DeleteHashEntry(hPtr);
+        childPtr->parentPtr = NULL;
+        if (!deleted) {
+            Tcl_DeleteCommandFromToken(childPtr->interp, childPtr->token);
+        }
+    }
+    return r;
+}
 
 /*
  * ----------------------------------------------------------------------
@@ -504,7 +1110,11 @@ StorageObjDeleteProc(ClientData clientData)
  *	A standard Tcl result
  *
  * Side effects:
- *	See StorageObjDeleteProc
+ *	See StorageObjDeleteProc. Sub-storages and streams opened from
+ *	this storage are closed first. Closing the root storage of a
+ *	builder writes the directory and allocation tables. Closing the
+ *	root storage of a native file opened in direct mode commits any
+ *	outstanding changes.
  *
  * ----------------------------------------------------------------------
  */
@@ -514,18 +1124,34 @@ StorageCloseCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
     int r = TCL_OK;
     
     if (objc > 2) {
         Tcl_WrongNumArgs(interp, 2, objv, "");
         r = TCL_ERROR;
     } else {
-        /* We may need to delete all child storages too, because they
-         * will become unusable anyway. Alternatively we could refuse
-         * to close this one because it has children?  At the moment
-         * the tcl code in the vfs package does this for us.  
-         */
+        /* Children flush their data before the file is completed */
+        r = CloseChildren(interp, storagePtr);
+
+        /* Report any failure to complete a generated file */
+        if (storagePtr->builderPtr && storagePtr->dirId == 0) {
+            int code = CfbBuilderFinish(storagePtr->builderPtr);
+            if (code != CFB_OK) {
+                Tcl_SetObjResult(interp, 
+                    CfbError("error writing storage", code));
+                r = TCL_ERROR;
+            }
+        }
+        if (storagePtr->cfbPtr && storagePtr->dirId == 0
+            && !storagePtr->cfbPtr->inMemory
+            && !(storagePtr->mode & STGM_TRANSACTED)) {
+            int code = CfbCommit(storagePtr->cfbPtr);
+            if (code != CFB_OK) {
+                Tcl_SetObjResult(interp, 
+                    CfbError("error writing storage", code));
+                r = TCL_ERROR;
+            }
+        }
         Tcl_DeleteCommand(interp, Tcl_GetString(objv[0]));
     }
     return r;
@@ -537,17 +1163,16 @@ StorageCloseCmd(ClientData clientData, Tcl_Interp *interp,
  * StorageCommitCmd -
  *
  *	Flush changes to the underlying file.
- *	At the moment we always use STGM_DIRECT. In the future we may
- *	support transacted mode in which case this would do something.
- *	However, for multimegabyte files there is a _significant_
- *	performance hit when using transacted mode - especially during
- *	the commit.
+ *	The native implementation writes the modified sectors to space
+ *	not used by the committed file and then rewrites the header to
+ *	switch to the new directory and allocation tables. The whole
+ *	file is committed whichever storage is used.
  *
  * Results:
  *	A standard Tcl result
  *
  * Side effects:
- *	None. In the future this may flush unsaved changes to the file.
+ *	Unsaved changes are written to the file.
  *
  * ----------------------------------------------------------------------
  */
@@ -557,58 +1182,517 @@ StorageCommitCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
-    HRESULT hr = S_OK;
     int r = TCL_OK;
     
     if (objc > 2) {
         Tcl_WrongNumArgs(interp, 2, objv, "");
         r = TCL_ERROR;
-    } else {
-        hr = pstg->lpVtbl->Commit(pstg, 0);
+    } else if (storagePtr->cfbPtr) {
+        int code = CfbCommit(storagePtr->cfbPtr);
+        if (code != CFB_OK) {
+            Tcl_SetObjResult(interp, CfbError("commit error", code));
+            r = TCL_ERROR;
+        }
+    } else if (storagePtr->pstg) {
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
+        HRESULT hr = pstg->lpVtbl->Commit(pstg, 0);
         if (FAILED(hr)) {
             Tcl_SetObjResult(interp, Win32Error("commit error", hr));
             r = TCL_ERROR;
         }
+#endif
     }
     return r;
 }
-
+
 /*
  * ----------------------------------------------------------------------
  *
- * StorageOpendirCmd -
- *
- *	Opens a sub-storage. A new Tcl command is created to manage the
- *	resource and the mode is as per the Tcl open command. If 'w'
- *	is specified then the sub-storage is created as a child of the
- *	current storage if it is not already present.
- *	Note: Storages may be read-only or write-only or read-write.
+ * StorageRevertCmd -
  *
- *	The sub-storage is only usable if all it's parents are still
- *	open. This limitation is part of the COM architecture. 
- *	If a parent storage is closed then the only valid command
- *	on its children is a close.
+ *	Discard all changes made since the last commit. This is only
+ *	useful for storages opened with -transacted.
  *
  * Results:
- *	A standard Tcl result. The name of the new command is placed
- *	in the interpreter's result.
+ *	A standard Tcl result
  *
  * Side effects:
- *	A new command is created in the Tcl interpreter and associated
- *	with the sub-storage. 
+ *	Unsaved changes are lost. Channels open on streams that no longer
+ *	exist will fail.
  *
  * ----------------------------------------------------------------------
  */
 
 static int
-StorageOpendirCmd(ClientData clientData, Tcl_Interp *interp,
+StorageRevertCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
-    IStorage *pstgNew = NULL;
+    int r = TCL_OK;
+    
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        r = TCL_ERROR;
+    } else if (storagePtr->cfbPtr) {
+        int code = CfbRevert(storagePtr->cfbPtr);
+        if (code != CFB_OK) {
+            Tcl_SetObjResult(interp, CfbError("revert error", code));
+            r = TCL_ERROR;
+        }
+    } else if (storagePtr->pstg) {
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
+        HRESULT hr = pstg->lpVtbl->Revert(pstg);
+        if (FAILED(hr)) {
+            Tcl_SetObjResult(interp, Win32Error("revert error", hr));
+            r = TCL_ERROR;
+        }
+#endif
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageSerializeCmd -
+ *
+ *	Return the compound file image as a byte array. Storages that are
+ *	not transacted are committed first. For a transacted storage the
+ *	image does not include uncommitted changes.
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	Changes may be committed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageSerializeCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    Tcl_Obj *resultObj = NULL;
+    int r = TCL_OK;
+    
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        r = TCL_ERROR;
+    } else if (storagePtr->cfbPtr) {
+        int code = CfbSerialize(storagePtr->cfbPtr, &resultObj);
+        if (code != CFB_OK) {
+            Tcl_SetObjResult(interp, CfbError("serialize error", code));
+            r = TCL_ERROR;
+        }
+    } else if (storagePtr->pstg) {
+#ifdef _WIN32
+        HRESULT hr = SerializeOle(storagePtr->pstg, &resultObj);
+        if (FAILED(hr)) {
+            Tcl_SetObjResult(interp, Win32Error("serialize error", hr));
+            r = TCL_ERROR;
+        }
+#endif
+    }
+    if (resultObj) {
+        Tcl_SetObjResult(interp, resultObj);
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageShareCmd -
+ *
+ *	Publish a read-only native storage so that other threads may
+ *	open it with storage attach without opening and parsing the file
+ *	again. The attached storages share the file mapping and the
+ *	parsed tables which are not changed once the file is shared.
+ *
+ * Results:
+ *	A standard Tcl result. The result is the token to be passed to
+ *	storage attach. It is valid until this storage is closed.
+ *
+ * Side effects:
+ *	The storage is entered into the process wide share table.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageShareCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    SharedStorage *sharePtr;
+    Tcl_HashEntry *hPtr;
+    char token[6 + TCL_INTEGER_SPACE];
+    int code, isNew;
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        return TCL_ERROR;
+    }
+    if (storagePtr->shareObj) {
+        Tcl_SetObjResult(interp, storagePtr->shareObj);
+        return TCL_OK;
+    }
+    if (storagePtr->cfbPtr == NULL) {
+        Tcl_SetObjResult(interp, CfbError("share error", CFB_ENOTSUP));
+        return TCL_ERROR;
+    }
+    code = CfbShare(storagePtr->cfbPtr);
+    if (code != CFB_OK) {
+        Tcl_SetObjResult(interp, CfbError("share error", code));
+        return TCL_ERROR;
+    }
+
+    sharePtr = (SharedStorage *)ckalloc(sizeof(SharedStorage));
+    sharePtr->cfbPtr = storagePtr->cfbPtr;
+    sharePtr->dirId = storagePtr->dirId;
+    CfbIncrRefCount(sharePtr->cfbPtr);
+
+    Tcl_MutexLock(&shareMutex);
+    if (!shareTableInitialized) {
+        Tcl_InitHashTable(&shareTable, TCL_STRING_KEYS);
+        shareTableInitialized = 1;
+    }
+    _snprintf(token, sizeof(token), "share%ld", ++shareUid);
+    hPtr = Tcl_CreateHashEntry(&shareTable, token, &isNew);
+    Tcl_SetHashValue(hPtr, sharePtr);
+    Tcl_MutexUnlock(&shareMutex);
+
+    storagePtr->shareObj = Tcl_NewStringObj(token, -1);
+    Tcl_IncrRefCount(storagePtr->shareObj);
+    Tcl_SetObjResult(interp, storagePtr->shareObj);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageCompactCmd -
+ *
+ *	Compact the native file held open by this storage. Outstanding
+ *	changes are committed and the file is replaced by a copy with
+ *	each stream held in consecutive sectors. No other storage or
+ *	channel may be open on the file as the directory entries are
+ *	renumbered.
+ *
+ * Results:
+ *	A standard Tcl result. The result describes the size and
+ *	fragmentation of the file before and after compaction.
+ *
+ * Side effects:
+ *	The file is rewritten.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageCompactCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    CfbUsage before, after;
+    int code;
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        return TCL_ERROR;
+    }
+    if (storagePtr->cfbPtr == NULL) {
+        Tcl_SetObjResult(interp, CfbError("compact error", CFB_ENOTSUP));
+        return TCL_ERROR;
+    }
+    code = CfbCompact(storagePtr->cfbPtr, NULL, &before, &after);
+    if (code != CFB_OK) {
+        Tcl_SetObjResult(interp, CfbError("compact error", code));
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, CompactResultObj(&before, &after));
+    return TCL_OK;
+}
+
+/*
+ * Describe the result of compaction as a dict holding the size, free
+ * space, number of streams and number of fragments of the file before
+ * and after.
+ */
+
+static Tcl_Obj *
+CompactResultObj(const CfbUsage *beforePtr, const CfbUsage *afterPtr)
+{
+    Tcl_Obj *resultObj = Tcl_NewListObj(0, NULL);
+    const CfbUsage *usagePtr = beforePtr;
+    int n;
+
+    for (n = 0; n < 2; n++, usagePtr = afterPtr) {
+        Tcl_Obj *usageObj = Tcl_NewListObj(0, NULL);
+        Tcl_ListObjAppendElement(NULL, usageObj, Tcl_NewStringObj("size", -1));
+        Tcl_ListObjAppendElement(NULL, usageObj,
+            Tcl_NewWideIntObj((Tcl_WideInt)usagePtr->size));
+        Tcl_ListObjAppendElement(NULL, usageObj, Tcl_NewStringObj("free", -1));
+        Tcl_ListObjAppendElement(NULL, usageObj,
+            Tcl_NewWideIntObj((Tcl_WideInt)usagePtr->freeSize));
+        Tcl_ListObjAppendElement(NULL, usageObj,
+            Tcl_NewStringObj("streams", -1));
+        Tcl_ListObjAppendElement(NULL, usageObj,
+            Tcl_NewWideIntObj((Tcl_WideInt)usagePtr->streams));
+        Tcl_ListObjAppendElement(NULL, usageObj,
+            Tcl_NewStringObj("fragments", -1));
+        Tcl_ListObjAppendElement(NULL, usageObj,
+            Tcl_NewWideIntObj((Tcl_WideInt)usagePtr->fragments));
+        Tcl_ListObjAppendElement(NULL, resultObj,
+            Tcl_NewStringObj(n ? "after" : "before", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, usageObj);
+    }
+    return resultObj;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageAnalyzeCmd -
+ *
+ *	Report how the space of a native compound file is used. The
+ *	sector counts describe the whole file. The directory counts and
+ *	the list of streams cover the items below this storage, each
+ *	stream being identified by its path as reported by walk.
+ *
+ * Results:
+ *	A standard Tcl result. The result is a dict of sector, mini
+ *	stream, directory and stream statistics.
+ *
+ * Side effects:
+ *	The extents of every stream are resolved.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageAnalyzeCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    Cfb *cfbPtr = storagePtr->cfbPtr;
+    Tcl_Obj *resultv[10], *objv2[12], *streamsObj;
+    CfbAnalysis info;
+    int code;
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        return TCL_ERROR;
+    }
+    if (cfbPtr == NULL) {
+        Tcl_SetObjResult(interp, CfbError("analyze error", CFB_ENOTSUP));
+        return TCL_ERROR;
+    }
+    code = CfbAnalyze(cfbPtr, storagePtr->dirId, &info);
+    streamsObj = Tcl_NewListObj(0, NULL);
+    if (code == CFB_OK) {
+        code = AnalyzeStreams(cfbPtr, storagePtr->dirId, NULL, streamsObj);
+    }
+    if (code != CFB_OK) {
+        Tcl_DecrRefCount(streamsObj);
+        Tcl_SetObjResult(interp, CfbError("analyze error", code));
+        return TCL_ERROR;
+    }
+
+    resultv[0] = Tcl_NewStringObj("sectorsize", -1);
+    resultv[1] = Tcl_NewLongObj((long)cfbPtr->sectorSize);
+
+    objv2[0] = Tcl_NewStringObj("total", -1);
+    objv2[1] = Tcl_NewWideIntObj((Tcl_WideInt)info.sectors);
+    objv2[2] = Tcl_NewStringObj("used", -1);
+    objv2[3] = Tcl_NewWideIntObj((Tcl_WideInt)(info.sectors
+        - info.freeSectors));
+    objv2[4] = Tcl_NewStringObj("free", -1);
+    objv2[5] = Tcl_NewWideIntObj((Tcl_WideInt)info.freeSectors);
+    objv2[6] = Tcl_NewStringObj("largestfree", -1);
+    objv2[7] = Tcl_NewWideIntObj((Tcl_WideInt)info.largestFree);
+    objv2[8] = Tcl_NewStringObj("tables", -1);
+    objv2[9] = Tcl_NewWideIntObj((Tcl_WideInt)info.tableSectors);
+    resultv[2] = Tcl_NewStringObj("sectors", -1);
+    resultv[3] = Tcl_NewListObj(10, objv2);
+
+    objv2[0] = Tcl_NewStringObj("sectorsize", -1);
+    objv2[1] = Tcl_NewLongObj((long)cfbPtr->miniSectorSize);
+    objv2[2] = Tcl_NewStringObj("total", -1);
+    objv2[3] = Tcl_NewWideIntObj((Tcl_WideInt)info.miniSectors);
+    objv2[4] = Tcl_NewStringObj("used", -1);
+    objv2[5] = Tcl_NewWideIntObj((Tcl_WideInt)(info.miniSectors
+        - info.miniFree));
+    objv2[6] = Tcl_NewStringObj("free", -1);
+    objv2[7] = Tcl_NewWideIntObj((Tcl_WideInt)info.miniFree);
+    resultv[4] = Tcl_NewStringObj("ministream", -1);
+    resultv[5] = Tcl_NewListObj(8, objv2);
+
+    objv2[0] = Tcl_NewStringObj("entries", -1);
+    objv2[1] = Tcl_NewWideIntObj((Tcl_WideInt)info.entries);
+    objv2[2] = Tcl_NewStringObj("storages", -1);
+    objv2[3] = Tcl_NewWideIntObj((Tcl_WideInt)info.storages);
+    objv2[4] = Tcl_NewStringObj("streams", -1);
+    objv2[5] = Tcl_NewWideIntObj((Tcl_WideInt)info.streams);
+    objv2[6] = Tcl_NewStringObj("depth", -1);
+    objv2[7] = Tcl_NewWideIntObj((Tcl_WideInt)info.depth);
+    objv2[8] = Tcl_NewStringObj("treedepth", -1);
+    objv2[9] = Tcl_NewWideIntObj((Tcl_WideInt)info.treeDepth);
+    objv2[10] = Tcl_NewStringObj("balanceddepth", -1);
+    objv2[11] = Tcl_NewWideIntObj((Tcl_WideInt)info.balancedDepth);
+    resultv[6] = Tcl_NewStringObj("directory", -1);
+    resultv[7] = Tcl_NewListObj(12, objv2);
+
+    resultv[8] = Tcl_NewStringObj("streams", -1);
+    resultv[9] = streamsObj;
+    Tcl_SetObjResult(interp, Tcl_NewListObj(10, resultv));
+    return TCL_OK;
+}
+
+/*
+ * Append the path and layout of each stream below a storage to a dict.
+ * CfbAnalyze has already rejected any loop in the directory.
+ */
+
+static int
+AnalyzeStreams(Cfb *cfbPtr, CfbSect dirId, Tcl_Obj *prefixObj,
+    Tcl_Obj *resultObj)
+{
+    CfbSect *ids = NULL, count = 0, n;
+    int code;
+
+    code = CfbListChildren(cfbPtr, dirId, &ids, &count);
+    for (n = 0; code == CFB_OK && n < count; n++) {
+        const CfbEntry *entryPtr = &cfbPtr->entries[ids[n]];
+        Tcl_Obj *pathObj = WalkPath(prefixObj, CfbNameObj(entryPtr));
+
+        Tcl_IncrRefCount(pathObj);
+        if (entryPtr->type == CFB_TYPE_STORAGE) {
+            code = AnalyzeStreams(cfbPtr, ids[n], pathObj, resultObj);
+        } else {
+            unsigned long sectorSize;
+            CfbSect length, fragments;
+            Tcl_Obj *objv[8];
+
+            code = CfbEntryLayout(cfbPtr, ids[n], &sectorSize, &length,
+                &fragments);
+            if (code == CFB_OK) {
+                objv[0] = Tcl_NewStringObj("size", -1);
+                objv[1] = Tcl_NewWideIntObj((Tcl_WideInt)entryPtr->size);
+                objv[2] = Tcl_NewStringObj("sectorsize", -1);
+                objv[3] = Tcl_NewLongObj((long)sectorSize);
+                objv[4] = Tcl_NewStringObj("chain", -1);
+                objv[5] = Tcl_NewWideIntObj((Tcl_WideInt)length);
+                objv[6] = Tcl_NewStringObj("fragments", -1);
+                objv[7] = Tcl_NewWideIntObj((Tcl_WideInt)fragments);
+                Tcl_ListObjAppendElement(NULL, resultObj, pathObj);
+                Tcl_ListObjAppendElement(NULL, resultObj,
+                    Tcl_NewListObj(8, objv));
+            }
+        }
+        Tcl_DecrRefCount(pathObj);
+    }
+    if (ids) {
+        ckfree((char *)ids);
+    }
+    return code;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageCacheCmd -
+ *
+ *	Report the sector cache of a native compound file opened with
+ *	-cachesize or too large to be mapped. The counters cover every
+ *	storage and stream opened on the file. All values are zero for a
+ *	file that is mapped or held in memory.
+ *
+ * Results:
+ *	A standard Tcl result. The result is a dict of the cache size and
+ *	the number of frames, hits, misses and evictions.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageCacheCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    CfbCacheInfo info;
+    Tcl_Obj *resultv[14];
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        return TCL_ERROR;
+    }
+    if (storagePtr->cfbPtr == NULL) {
+        Tcl_SetObjResult(interp, CfbError("cache error", CFB_ENOTSUP));
+        return TCL_ERROR;
+    }
+    CfbGetCacheInfo(storagePtr->cfbPtr, &info);
+    resultv[0] = Tcl_NewStringObj("size", -1);
+    resultv[1] = Tcl_NewWideIntObj((Tcl_WideInt)info.size);
+    resultv[2] = Tcl_NewStringObj("frames", -1);
+    resultv[3] = Tcl_NewWideIntObj((Tcl_WideInt)info.frames);
+    resultv[4] = Tcl_NewStringObj("used", -1);
+    resultv[5] = Tcl_NewWideIntObj((Tcl_WideInt)info.used);
+    resultv[6] = Tcl_NewStringObj("pinned", -1);
+    resultv[7] = Tcl_NewWideIntObj((Tcl_WideInt)info.pinned);
+    resultv[8] = Tcl_NewStringObj("hits", -1);
+    resultv[9] = Tcl_NewWideIntObj((Tcl_WideInt)info.hits);
+    resultv[10] = Tcl_NewStringObj("misses", -1);
+    resultv[11] = Tcl_NewWideIntObj((Tcl_WideInt)info.misses);
+    resultv[12] = Tcl_NewStringObj("evictions", -1);
+    resultv[13] = Tcl_NewWideIntObj((Tcl_WideInt)info.evictions);
+    Tcl_SetObjResult(interp, Tcl_NewListObj(14, resultv));
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageOpendirCmd -
+ *
+ *	Opens a sub-storage. A new Tcl command is created to manage the
+ *	resource and the mode is as per the Tcl open command. If 'w'
+ *	is specified then the sub-storage is created as a child of the
+ *	current storage if it is not already present.
+ *	Note: Storages may be read-only or write-only or read-write.
+ *
+ *	The sub-storage is only usable if all it's parents are still
+ *	open. This limitation is part of the COM architecture. 
+ *	Closing a parent storage closes its children too.
+ *
+ * Results:
+ *	A standard Tcl result. The name of the new command is placed
+ *	in the interpreter's result.
+ *
+ * Side effects:
+ *	A new command is created in the Tcl interpreter and associated
+ *	with the sub-storage. 
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageOpendirCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+#ifdef _WIN32
+    IStorage *pstg = storagePtr->pstg;
+    IStorage *pstgNew = NULL;
     HRESULT hr = S_OK;
+#endif
     int mode = storagePtr->mode;
     int r = TCL_OK;
     
@@ -624,7 +1708,44 @@ StorageOpendirCmd(ClientData clientData, Tcl_Interp *interp,
     } else {
         mode &= ~STGM_CREATE;
     }
+    if (r != TCL_OK) {
+        return r;
+    }
+    
+    if (storagePtr->cfbPtr) {
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        CfbSect id = 0;
+        int code = CFB_OK;
+        if (mode & (STGM_WRITE|STGM_READWRITE|STGM_CREATE|STGM_APPEND)
+            && !StorageWritable(storagePtr)) {
+            code = CFB_EACCES;
+        }
+        if (code == CFB_OK) {
+            code = CfbFindChild(cfbPtr, storagePtr->dirId, objv[2], &id);
+            if (code == CFB_OK
+                && cfbPtr->entries[id].type != CFB_TYPE_STORAGE) {
+                code = CFB_ENOENT;
+            } else if (code == CFB_ENOENT && (mode & STGM_CREATE)) {
+                code = CfbCreateEntry(cfbPtr, storagePtr->dirId, objv[2],
+                    CFB_TYPE_STORAGE, &id);
+            }
+        }
+        if (code == CFB_OK) {
+            r = CreateStorageCommand(interp, storagePtr, NULL, cfbPtr,
+                NULL, id, mode);
+        } else {
+            Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+            Tcl_AppendStringsToObj(errObj, "could not ", 
+                (mode & STGM_CREATE) ? "create" : "open",
+                " \"", Tcl_GetString(objv[2]), "\"", (char *)NULL);
+            Tcl_AppendObjToObj(errObj, CfbError("", code));
+            Tcl_SetObjResult(interp, errObj);
+            r = TCL_ERROR;
+        }
+        return r;
+    }
     
+#ifdef _WIN32
     hr = pstg->lpVtbl->OpenStorage(pstg, Tcl_GetUnicode(objv[2]), NULL,
         (mode & ~STGM_CREATE) & STGM_WIN32MASK, NULL, 0, &pstgNew);
     if (FAILED(hr)) {
@@ -642,251 +1763,1600 @@ StorageOpendirCmd(ClientData clientData, Tcl_Interp *interp,
             r = TCL_ERROR;
         }
     }
-    if (SUCCEEDED(hr)) {
-        r = CreateStorageCommand(interp, storagePtr, pstgNew, mode);
+    if (SUCCEEDED(hr)) {
+        r = CreateStorageCommand(interp, storagePtr, pstgNew, NULL,
+            NULL, 0, mode);
+    }
+#endif
+    
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageOpenCmd -
+ *
+ *	Open a file within the storage. This opens the named item
+ *	and creates a Tcl channel to support reading and writing
+ *	data. Modes are as per the Tcl 'open' command and may depend upon
+ *	the mode settings of the owning storage.
+ *
+ * Results:
+ *	A standard Tcl result. The channel name is returned in the Tcl
+ *	interpreter result.
+ *
+ * Side effects:
+ *	A new stream may be created with the given name.
+ *	A Tcl channel is created in the Tcl interpreter.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageOpenCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    IStream *pstm = NULL;
+    CfbStream *stmPtr = NULL;
+    int r = TCL_OK;
+    int mode = storagePtr->mode;
+    
+    if (objc < 3 || objc > 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "filename mode");
+        return TCL_ERROR;
+    }
+    if (objc == 4) {
+        mode &= STGM_STREAMMASK; 
+        r = GetStorageFlagsFromObj(interp, objv[3], &mode);
+    } else {
+        mode &= STGM_STREAMMASK;
+        mode |= STGM_READ;
+    }
+    /* OLE does not support transacted streams */
+    mode &= ~STGM_TRANSACTED;
+    
+    if (r == TCL_OK && storagePtr->cfbPtr) {
+
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        CfbSect id = 0;
+        int code = CFB_OK;
+        if (mode & (STGM_WRITE|STGM_READWRITE|STGM_CREATE|STGM_APPEND)
+            && !StorageWritable(storagePtr)) {
+            code = CFB_EACCES;
+        }
+        if (code == CFB_OK) {
+            code = CfbFindChild(cfbPtr, storagePtr->dirId, objv[2], &id);
+            if (code == CFB_ENOENT && (mode & (STGM_CREATE|STGM_APPEND))) {
+                code = CfbCreateEntry(cfbPtr, storagePtr->dirId, objv[2],
+                    CFB_TYPE_STREAM, &id);
+            }
+        }
+        if (code == CFB_OK) {
+            code = CfbStreamOpen(cfbPtr, id, &stmPtr);
+        }
+        if (code == CFB_OK && (mode & STGM_CREATE)) {
+            /* w and w+ truncate an existing stream */
+            code = CfbStreamSetSize(stmPtr, 0);
+            if (code != CFB_OK) {
+                CfbStreamClose(stmPtr);
+            }
+        }
+        if (code != CFB_OK) {
+            Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+            Tcl_AppendStringsToObj(errObj, "error opening \"", 
+                Tcl_GetString(objv[2]), "\"", (char *)NULL);
+            Tcl_AppendObjToObj(errObj, CfbError("", code));
+            Tcl_SetObjResult(interp, errObj);
+            r = TCL_ERROR;
+        }
+
+    } else if (r == TCL_OK) {
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
+        HRESULT hr = S_OK;
+        if (mode & STGM_CREATE) {
+            hr = pstg->lpVtbl->CreateStream(pstg, Tcl_GetUnicode(objv[2]),
+		mode & STGM_WIN32MASK,  0, 0, &pstm);
+        } else {
+            hr = pstg->lpVtbl->OpenStream(pstg, Tcl_GetUnicode(objv[2]),
+		NULL, mode & STGM_WIN32MASK, 0, &pstm);
+            if (FAILED(hr) && mode & STGM_APPEND) {
+                hr = pstg->lpVtbl->CreateStream(pstg, Tcl_GetUnicode(objv[2]),
+		    mode & STGM_WIN32MASK,  0, 0, &pstm);
+            }
+        }
+	
+        if (FAILED(hr)) {
+            Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+            Tcl_AppendStringsToObj(errObj, "error opening \"", 
+		Tcl_GetString(objv[2]), "\"", (char *)NULL);
+	    Tcl_AppendObjToObj(errObj, Win32Error("", hr));
+            Tcl_SetObjResult(interp, errObj);
+            r = TCL_ERROR;
+        }
+#endif
+    }
+
+    if (r == TCL_OK) {
+        CreateStorageChannel(interp, storagePtr, pstm, stmPtr, NULL, 0,
+            mode);
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * CreateStorageChannel -
+ *
+ *	Create a Tcl channel for an OLE stream, a native stream or a
+ *	stream being written by a builder.
+ *
+ * Results:
+ *	None. The channel name is returned in the interpreter result.
+ *
+ * Side effects:
+ *	A Tcl channel is created and registered in the interpreter. It is
+ *	added to the channels of the storage so that closing the storage
+ *	closes it too.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+CreateStorageChannel(Tcl_Interp *interp, Storage *storagePtr, IStream *pstm,
+    CfbStream *stmPtr, CfbBuilder *builderPtr, CfbSect builderId, int mode)
+{
+    Package *pkgPtr;
+    StorageChannel *inst;
+    char name[3 + TCL_INTEGER_SPACE];
+    int isNew;
+
+    _snprintf(name, 3 + TCL_INTEGER_SPACE, "stm%ld", 
+        InterlockedIncrement(&UNIQUEID));
+    inst = (StorageChannel *)ckalloc(sizeof(StorageChannel));
+    inst->pstm = pstm;
+    inst->stmPtr = stmPtr;
+    inst->builderPtr = builderPtr;
+    inst->builderId = builderId;
+    inst->storagePtr = storagePtr;
+    if (builderPtr)
+        CfbBuilderIncrRefCount(builderPtr);
+    inst->grfMode = mode;
+    inst->interp = interp;
+    inst->watchmask = 0;
+    inst->flags = 0;
+    inst->readahead = 0;
+    /* bit0 set then not readable */
+    inst->validmask = (mode & STGM_WRITE) ? 0 : TCL_READABLE;
+    inst->validmask |= (mode & (STGM_WRITE|STGM_READWRITE)) 
+        ? TCL_WRITABLE : 0;
+    inst->chan = Tcl_CreateChannel(&StorageChannelType, name, 
+        inst, inst->validmask);
+    Tcl_RegisterChannel(interp, inst->chan);
+    if (mode & STGM_APPEND) {
+        Tcl_Seek(inst->chan, 0, SEEK_END);
+    }
+
+    /* insert at head of channels list */
+    pkgPtr = Tcl_GetAssocData(interp, STORAGE_PACKAGE_KEY, NULL);
+    inst->pkgPtr = pkgPtr;
+    inst->nextPtr = pkgPtr->headPtr;
+    pkgPtr->headPtr = inst;
+    ++pkgPtr->count;
+    Tcl_CreateHashEntry(&storagePtr->channels, (char *)inst, &isNew);
+
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * BuilderOpendirCmd, BuilderOpenCmd -
+ *
+ *	Add a sub-storage or a stream to a storage being generated by a
+ *	builder. Items may only be created so any mode given must allow
+ *	writing. The new stream channel is write-only and must be closed
+ *	before another stream may be opened.
+ *
+ * Results:
+ *	A standard Tcl result. The name of the new command or channel is
+ *	placed in the interpreter's result.
+ *
+ * Side effects:
+ *	A new directory entry is added to the file being generated.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+BuilderAdd(Tcl_Interp *interp, Storage *storagePtr, int objc,
+    Tcl_Obj *const objv[], int type, CfbSect *idPtr, int *modePtr)
+{
+    int mode = STGM_WRITE | STGM_CREATE;
+    int code = CFB_OK;
+    
+    if (objc < 3 || objc > 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, 
+            (type == CFB_TYPE_STORAGE) ? "dirname mode" : "filename mode");
+        return TCL_ERROR;
+    }
+    if (objc == 4) {
+        mode = 0;
+        if (GetStorageFlagsFromObj(interp, objv[3], &mode) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (!(mode & (STGM_WRITE|STGM_READWRITE))) {
+            code = CFB_EACCES;
+        }
+    }
+    if (code == CFB_OK) {
+        code = CfbBuilderAdd(storagePtr->builderPtr, storagePtr->dirId,
+            objv[2], type, idPtr);
+    }
+    if (code != CFB_OK) {
+        Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+        Tcl_AppendStringsToObj(errObj, "could not create \"",
+            Tcl_GetString(objv[2]), "\"", (char *)NULL);
+        Tcl_AppendObjToObj(errObj, CfbError("", code));
+        Tcl_SetObjResult(interp, errObj);
+        return TCL_ERROR;
+    }
+    *modePtr = (storagePtr->mode & ~(STGM_READWRITE|STGM_APPEND))
+        | STGM_WRITE | STGM_CREATE;
+    return TCL_OK;
+}
+
+static int
+BuilderOpendirCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    CfbSect id;
+    int mode;
+    
+    if (BuilderAdd(interp, storagePtr, objc, objv, CFB_TYPE_STORAGE,
+            &id, &mode) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    return CreateStorageCommand(interp, storagePtr, NULL, NULL,
+        storagePtr->builderPtr, id, mode);
+}
+
+static int
+BuilderOpenCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    CfbSect id;
+    int mode;
+    
+    if (BuilderAdd(interp, storagePtr, objc, objv, CFB_TYPE_STREAM,
+            &id, &mode) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    CreateStorageChannel(interp, storagePtr, NULL, NULL,
+        storagePtr->builderPtr, id, mode);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageReadCmd -
+ *
+ *	Read the contents of a stream without creating a channel.
+ *	Optionally an offset and a maximum length may be given. For
+ *	native storages the data is copied directly from the mapped file
+ *	into the result.
+ *
+ * Results:
+ *	A standard Tcl result. The result is a byte array.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageReadCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    Tcl_Obj *resultObj = NULL, *errObj = NULL;
+    Tcl_WideInt offset = 0, length = -1;
+    int r = TCL_OK;
+
+    if (objc < 3 || objc > 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name ?offset? ?length?");
+        return TCL_ERROR;
+    }
+    if (objc > 3) {
+        r = Tcl_GetWideIntFromObj(interp, objv[3], &offset);
+    }
+    if (r == TCL_OK && objc > 4) {
+        r = Tcl_GetWideIntFromObj(interp, objv[4], &length);
+    }
+    if (r == TCL_OK && (offset < 0 || (objc > 4 && length < 0))) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "offset and length must not be negative", -1));
+        r = TCL_ERROR;
+    }
+    if (r != TCL_OK) {
+        return r;
+    }
+
+    if (storagePtr->cfbPtr) {
+
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        CfbStream *stmPtr = NULL;
+        CfbSect id = 0;
+        int code, err;
+
+        code = CfbFindChild(cfbPtr, storagePtr->dirId, objv[2], &id);
+        if (code == CFB_OK) {
+            code = CfbStreamOpen(cfbPtr, id, &stmPtr);
+        }
+        if (code == CFB_OK) {
+            Tcl_WideInt avail = 0;
+            if ((Tcl_WideUInt)offset < stmPtr->size) {
+                avail = (Tcl_WideInt)(stmPtr->size - offset);
+            }
+            if (length < 0 || length > avail) {
+                length = avail;
+            }
+            if (length > INT_MAX) {
+                errObj = Tcl_NewStringObj(": stream is too large", -1);
+            } else {
+                unsigned char *buffer;
+                resultObj = Tcl_NewByteArrayObj(NULL, 0);
+                buffer = Tcl_SetByteArrayLength(resultObj, (int)length);
+                CfbStreamSeek(stmPtr, offset, SEEK_SET, &err);
+                if (CfbStreamRead(stmPtr, (char *)buffer, (int)length)
+                    != (int)length) {
+                    errObj = CfbError("", CFB_EFORMAT);
+                }
+            }
+            CfbStreamClose(stmPtr);
+        } else {
+            errObj = CfbError("", code);
+        }
+
+    } else {
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
+        IStream *pstm = NULL;
+        STATSTG stat;
+        HRESULT hr;
+
+        hr = pstg->lpVtbl->OpenStream(pstg, Tcl_GetUnicode(objv[2]), NULL,
+            STGM_READ | STGM_SHARE_EXCLUSIVE, 0, &pstm);
+        if (SUCCEEDED(hr)) {
+            hr = pstm->lpVtbl->Stat(pstm, &stat, STATFLAG_NONAME);
+        }
+        if (SUCCEEDED(hr)) {
+            Tcl_WideInt avail = 0;
+            if (offset < (Tcl_WideInt)stat.cbSize.QuadPart) {
+                avail = (Tcl_WideInt)stat.cbSize.QuadPart - offset;
+            }
+            if (length < 0 || length > avail) {
+                length = avail;
+            }
+            if (length > INT_MAX) {
+                errObj = Tcl_NewStringObj(": stream is too large", -1);
+            } else {
+                LARGE_INTEGER li;
+                unsigned char *buffer;
+                ULONG cb = 0;
+                li.QuadPart = offset;
+                resultObj = Tcl_NewByteArrayObj(NULL, 0);
+                buffer = Tcl_SetByteArrayLength(resultObj, (int)length);
+                hr = pstm->lpVtbl->Seek(pstm, li, STREAM_SEEK_SET, NULL);
+                if (SUCCEEDED(hr)) {
+                    hr = pstm->lpVtbl->Read(pstm, buffer, (ULONG)length, &cb);
+                }
+                Tcl_SetByteArrayLength(resultObj, (int)cb);
+            }
+        }
+        if (pstm)
+            pstm->lpVtbl->Release(pstm);
+        if (FAILED(hr)) {
+            errObj = Win32Error("", hr);
+        }
+#endif
+    }
+
+    if (errObj) {
+        Tcl_Obj *msgObj = Tcl_NewStringObj("", 0);
+        Tcl_AppendStringsToObj(msgObj, "error reading \"",
+            Tcl_GetString(objv[2]), "\"", (char *)NULL);
+        Tcl_AppendObjToObj(msgObj, errObj);
+        Tcl_DecrRefCount(errObj);
+        if (resultObj)
+            Tcl_DecrRefCount(resultObj);
+        Tcl_SetObjResult(interp, msgObj);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageReadManyCmd -
+ *
+ *	Read several streams or parts of streams in one call. Each element
+ *	of the list holds the arguments of the read command. For native
+ *	storages the sectors needed by every request are located first and
+ *	then copied in file order so the file is read in a single pass.
+ *	Other storages read each stream in turn.
+ *
+ * Results:
+ *	A standard Tcl result. The result is a dict of the data read as
+ *	byte arrays keyed by each element of the list as given, so that
+ *	several ranges of one stream are all returned.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageReadManyCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    Tcl_Obj **specv, **argv, **dataObjs = NULL, *dictObj, *errObj = NULL;
+    CfbRange *ranges = NULL;
+    int specc, argc, n, r;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "{name ?offset? ?length?} ...");
+        return TCL_ERROR;
+    }
+    r = Tcl_ListObjGetElements(interp, objv[2], &specc, &specv);
+    for (n = 0; r == TCL_OK && n < specc; n++) {
+        r = Tcl_ListObjGetElements(interp, specv[n], &argc, &argv);
+        if (r == TCL_OK && (argc < 1 || argc > 3)) {
+            Tcl_AppendResult(interp, "invalid read \"",
+                Tcl_GetString(specv[n]),
+                "\": should be \"name ?offset? ?length?\"", (char *)NULL);
+            r = TCL_ERROR;
+        }
+    }
+    if (r != TCL_OK) {
+        return r;
+    }
+
+    dictObj = Tcl_NewDictObj();
+    Tcl_IncrRefCount(dictObj);
+
+    if (storagePtr->cfbPtr == NULL) {
+        Tcl_Obj *readv[5];
+        readv[0] = objv[0];
+        readv[1] = Tcl_NewStringObj("read", -1);
+        Tcl_IncrRefCount(readv[1]);
+        for (n = 0; r == TCL_OK && n < specc; n++) {
+            Tcl_ListObjGetElements(NULL, specv[n], &argc, &argv);
+            memcpy(readv + 2, argv, argc * sizeof(Tcl_Obj *));
+            r = StorageReadCmd(clientData, interp, argc + 2, readv);
+            if (r == TCL_OK) {
+                Tcl_DictObjPut(NULL, dictObj, specv[n],
+                    Tcl_GetObjResult(interp));
+            }
+        }
+        Tcl_DecrRefCount(readv[1]);
+    } else {
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        ranges = (CfbRange *)ckalloc(sizeof(CfbRange) * (specc + 1));
+        dataObjs = (Tcl_Obj **)ckalloc(sizeof(Tcl_Obj *) * (specc + 1));
+        for (n = 0; n < specc; n++) {
+            CfbRange *rangePtr = &ranges[n];
+            Tcl_WideInt offset = 0, length = -1, avail = 0;
+            int code;
+
+            Tcl_ListObjGetElements(NULL, specv[n], &argc, &argv);
+            if (argc > 1) {
+                r = Tcl_GetWideIntFromObj(interp, argv[1], &offset);
+            }
+            if (r == TCL_OK && argc > 2) {
+                r = Tcl_GetWideIntFromObj(interp, argv[2], &length);
+            }
+            if (r == TCL_OK && (offset < 0 || (argc > 2 && length < 0))) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                    "offset and length must not be negative", -1));
+                r = TCL_ERROR;
+            }
+            if (r != TCL_OK) {
+                break;
+            }
+            code = CfbFindChild(cfbPtr, storagePtr->dirId, argv[0],
+                &rangePtr->id);
+            if (code != CFB_OK) {
+                errObj = CfbError("", code);
+                break;
+            }
+            if (cfbPtr->entries[rangePtr->id].type == CFB_TYPE_STREAM
+                && (Tcl_WideUInt)offset
+                   < cfbPtr->entries[rangePtr->id].size) {
+                avail = (Tcl_WideInt)
+                    (cfbPtr->entries[rangePtr->id].size - offset);
+            }
+            if (length < 0 || length > avail) {
+                length = avail;
+            }
+            if (length > INT_MAX) {
+                errObj = Tcl_NewStringObj(": stream is too large", -1);
+                break;
+            }
+            dataObjs[n] = Tcl_NewByteArrayObj(NULL, 0);
+            Tcl_IncrRefCount(dataObjs[n]);
+            rangePtr->offset = (Tcl_WideUInt)offset;
+            rangePtr->length = (int)length;
+            rangePtr->buffer = Tcl_SetByteArrayLength(dataObjs[n],
+                (int)length);
+        }
+        specc = n;
+        if (r == TCL_OK && errObj == NULL
+            && CfbReadRanges(cfbPtr, ranges, specc) != CFB_OK) {
+            for (n = 0; ranges[n].code == CFB_OK; n++) {
+                /* find the first failure */
+            }
+            errObj = CfbError("", ranges[n].code);
+        }
+        if (errObj) {
+            Tcl_ListObjGetElements(NULL, specv[n], &argc, &argv);
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("", 0));
+            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                "error reading \"", Tcl_GetString(argv[0]), "\"",
+                (char *)NULL);
+            Tcl_AppendObjToObj(Tcl_GetObjResult(interp), errObj);
+            Tcl_DecrRefCount(errObj);
+            r = TCL_ERROR;
+        }
+        for (n = 0; n < specc; n++) {
+            if (r == TCL_OK) {
+                Tcl_SetByteArrayLength(dataObjs[n], ranges[n].length);
+                Tcl_DictObjPut(NULL, dictObj, specv[n], dataObjs[n]);
+            }
+            Tcl_DecrRefCount(dataObjs[n]);
+        }
+        ckfree((char *)dataObjs);
+        ckfree((char *)ranges);
+    }
+
+    if (r == TCL_OK) {
+        Tcl_SetObjResult(interp, dictObj);
+    }
+    Tcl_DecrRefCount(dictObj);
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageStatCmd -
+ *
+ *	Fetch information about the named item as per [file stat]
+ *
+ * Results:
+ *	A standard Tcl result
+ *
+ * Side effects:
+ *	The array variable passed in will have a number of values added
+ *	or modified.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageStatCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    int r = TCL_OK;
+    
+    if (objc != 4) {
+
+        Tcl_WrongNumArgs(interp, 2, objv, "name varName");
+        r = TCL_ERROR;
+	
+    } else {
+	
+        ItemInfo stat;
+        Tcl_Obj *infoObj, **infov;
+        int infoc, n;
+
+        r = GetItemInfo(interp, storagePtr, objv[2], &stat);
+        if (r == TCL_OK) {
+            infoObj = ItemInfoObj(storagePtr->mode, &stat);
+            Tcl_IncrRefCount(infoObj);
+            Tcl_ListObjGetElements(NULL, infoObj, &infoc, &infov);
+            for (n = 0; r == TCL_OK && n < infoc; n += 2) {
+                if (Tcl_ObjSetVar2(interp, objv[3], infov[n], infov[n+1],
+                        TCL_LEAVE_ERR_MSG) == NULL) {
+                    r = TCL_ERROR;
+                }
+            }
+            Tcl_DecrRefCount(infoObj);
+        }
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageNamesCmd -
+ *
+ *	Obtain a list of all item names contained in this storage.
+ *	With -type only sub-storages (directory) or streams (file) are
+ *	listed. With -stat the result alternates each name with a list
+ *	of the fields returned by the stat command. All this information
+ *	is collected in a single pass over the storage contents.
+ *
+ * Results:
+ *	A standard Tcl result. The list of names is returned in the 
+ *	interpreters result.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageNamesCmd(ClientData clientData, Tcl_Interp *interp, 
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    static const char *options[] = { "-stat", "-type", NULL };
+    enum { OPT_STAT, OPT_TYPE };
+    static const char *types[] = { "file", "directory", NULL };
+    int wantStat = 0, wantType = 0, n, index, r = TCL_OK;
+    Tcl_Obj *listObj = NULL;
+    
+    for (n = 2; r == TCL_OK && n < objc; n++) {
+        r = Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index);
+        if (r == TCL_OK && index == OPT_STAT) {
+            wantStat = 1;
+        } else if (r == TCL_OK && index == OPT_TYPE) {
+            if (++n == objc) {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                    "?-stat? ?-type file|directory?");
+                r = TCL_ERROR;
+            } else {
+                r = Tcl_GetIndexFromObj(interp, objv[n], types, "type", 0,
+                                        &index);
+                wantType = (index == 0) ? STGTY_STREAM : STGTY_STORAGE;
+            }
+        }
+    }
+    if (r != TCL_OK) {
+        return r;
+    }
+
+    listObj = Tcl_NewListObj(0, NULL);
+    if (storagePtr->cfbPtr) {
+
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        CfbSect *ids = NULL, count = 0, i;
+        int code = CfbListChildren(cfbPtr, storagePtr->dirId, &ids, &count);
+        if (code != CFB_OK) {
+            Tcl_SetObjResult(interp, CfbError("names error", code));
+            r = TCL_ERROR;
+        } else {
+            for (i = 0; i < count; i++) {
+                const CfbEntry *entryPtr = &cfbPtr->entries[ids[i]];
+                ItemInfo info;
+                InfoFromEntry(entryPtr, ids[i], &info);
+                if (wantType && info.type != wantType) {
+                    continue;
+                }
+                Tcl_ListObjAppendElement(interp, listObj,
+                    CfbNameObj(entryPtr));
+                if (wantStat) {
+                    Tcl_ListObjAppendElement(interp, listObj,
+                        ItemInfoObj(storagePtr->mode, &info));
+                }
+            }
+            ckfree((char *)ids);
+        }
+
+    } else {
+	
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
+        IEnumSTATSTG *penum = NULL;
+        STATSTG stats[12];
+        ULONG count, i;
+        HRESULT hr = pstg->lpVtbl->EnumElements(pstg, 0, NULL, 0, &penum);
+        if (FAILED(hr)) {
+            Tcl_SetObjResult(interp, Win32Error("names error", hr));
+            r = TCL_ERROR;
+        } else {
+            while (hr == S_OK) {
+                hr = penum->lpVtbl->Next(penum, 12, stats, &count);
+                for (i = 0; SUCCEEDED(hr) && i < count; i++) {
+                    ItemInfo info;
+                    InfoFromStatStg(&stats[i], &info);
+                    if (!wantType || info.type == wantType) {
+                        Tcl_ListObjAppendElement(interp, listObj, 
+                            Tcl_NewUnicodeObj(stats[i].pwcsName, -1));
+                        if (wantStat) {
+                            Tcl_ListObjAppendElement(interp, listObj,
+                                ItemInfoObj(storagePtr->mode, &info));
+                        }
+                    }
+                    CoTaskMemFree(stats[i].pwcsName);
+                }
+            }
+            penum->lpVtbl->Release(penum);
+        }
+#endif
+    }
+
+    if (r == TCL_OK) {
+        Tcl_SetObjResult(interp, listObj);
+    } else {
+        Tcl_DecrRefCount(listObj);
+    }
+    return r;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageWalkCmd -
+ *
+ *	Visit every item below this storage. Each item is described by
+ *	its path relative to this storage and the fields returned by the
+ *	stat command. Storages are visited before their contents. The
+ *	-depth option limits how many levels are descended and -glob
+ *	selects the items reported by matching against the path.
+ *	Without a script a list alternating paths and stat lists is
+ *	returned. Otherwise the variables named in varList are set to the
+ *	path and the stat list and the script is evaluated for each item.
+ *	No Tcl commands are created for the sub-storages visited.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Whatever the script does.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+typedef struct WalkState {
+    Tcl_Interp *interp;
+    int         mode;           /* mode of the storage being walked */
+    int         maxDepth;       /* levels to descend or -1 for all */
+    Tcl_Obj    *globObj;        /* pattern for the reported paths */
+    Tcl_Obj    *pathVarObj;     /* variable names for the script */
+    Tcl_Obj    *infoVarObj;
+    Tcl_Obj    *scriptObj;      /* script or NULL to build a list */
+    Tcl_Obj    *listObj;
+    char       *visited;        /* native storages already walked */
+    CfbSect     visitedCount;   /* entries covered by visited */
+} WalkState;
+
+static int
+WalkVisit(WalkState *statePtr, Tcl_Obj *pathObj, const ItemInfo *infoPtr)
+{
+    Tcl_Interp *interp = statePtr->interp;
+    int r = TCL_OK;
+
+    if (statePtr->globObj && !Tcl_StringMatch(Tcl_GetString(pathObj),
+            Tcl_GetString(statePtr->globObj))) {
+        return TCL_OK;
+    }
+    if (statePtr->scriptObj == NULL) {
+        Tcl_ListObjAppendElement(interp, statePtr->listObj, pathObj);
+        Tcl_ListObjAppendElement(interp, statePtr->listObj,
+            ItemInfoObj(statePtr->mode, infoPtr));
+        return TCL_OK;
+    }
+
+    if (Tcl_ObjSetVar2(interp, statePtr->pathVarObj, NULL, pathObj,
+            TCL_LEAVE_ERR_MSG) == NULL) {
+        return TCL_ERROR;
+    }
+    if (statePtr->infoVarObj && Tcl_ObjSetVar2(interp, statePtr->infoVarObj,
+            NULL, ItemInfoObj(statePtr->mode, infoPtr),
+            TCL_LEAVE_ERR_MSG) == NULL) {
+        return TCL_ERROR;
+    }
+    r = Tcl_EvalObjEx(interp, statePtr->scriptObj, 0);
+    if (r == TCL_CONTINUE) {
+        r = TCL_OK;
+    } else if (r == TCL_ERROR) {
+        char msg[32 + TCL_INTEGER_SPACE];
+#if TCL_MAJOR_VERSION > 8 || TCL_MINOR_VERSION >= 6
+        int line = Tcl_GetErrorLine(interp);
+#else
+        int line = interp->errorLine;
+#endif
+        _snprintf(msg, sizeof(msg), "\n    (\"walk\" body line %d)", line);
+        Tcl_AddErrorInfo(interp, msg);
+    }
+    return r;
+}
+
+static Tcl_Obj *
+WalkPath(Tcl_Obj *prefixObj, Tcl_Obj *nameObj)
+{
+    Tcl_Obj *pathObj;
+
+    if (prefixObj == NULL) {
+        return nameObj;
+    }
+    pathObj = Tcl_DuplicateObj(prefixObj);
+    Tcl_AppendToObj(pathObj, "/", 1);
+    Tcl_AppendObjToObj(pathObj, nameObj);
+    Tcl_DecrRefCount(nameObj);
+    return pathObj;
+}
+
+static int
+WalkCfb(WalkState *statePtr, Cfb *cfbPtr, CfbSect dirId,
+    Tcl_Obj *prefixObj, int depth)
+{
+    CfbSect *ids = NULL, count = 0, n;
+    int code, r = TCL_OK;
+
+    /*
+     * The script may add entries to a writable storage while we walk.
+     */
+
+    if (dirId >= statePtr->visitedCount) {
+        statePtr->visited = ckrealloc(statePtr->visited, cfbPtr->entryCount);
+        memset(statePtr->visited + statePtr->visitedCount, 0,
+            cfbPtr->entryCount - statePtr->visitedCount);
+        statePtr->visitedCount = cfbPtr->entryCount;
+    }
+    if (statePtr->visited[dirId]) {
+        code = CFB_EFORMAT;
+    } else {
+        statePtr->visited[dirId] = 1;
+        code = CfbListChildren(cfbPtr, dirId, &ids, &count);
+    }
+    if (code != CFB_OK) {
+        Tcl_SetObjResult(statePtr->interp, CfbError("walk error", code));
+        return TCL_ERROR;
+    }
+    for (n = 0; r == TCL_OK && n < count; n++) {
+        const CfbEntry *entryPtr = &cfbPtr->entries[ids[n]];
+        Tcl_Obj *pathObj;
+        ItemInfo info;
+
+        if (entryPtr->type == CFB_TYPE_EMPTY) {
+            /* removed by the script since the children were listed */
+            continue;
+        }
+        InfoFromEntry(entryPtr, ids[n], &info);
+        pathObj = WalkPath(prefixObj, CfbNameObj(entryPtr));
+        Tcl_IncrRefCount(pathObj);
+        r = WalkVisit(statePtr, pathObj, &info);
+        if (r == TCL_OK && info.type == STGTY_STORAGE
+            && cfbPtr->entries[ids[n]].type == CFB_TYPE_STORAGE
+            && (statePtr->maxDepth < 0 || depth < statePtr->maxDepth)) {
+            r = WalkCfb(statePtr, cfbPtr, ids[n], pathObj, depth + 1);
+        }
+        Tcl_DecrRefCount(pathObj);
+    }
+    ckfree((char *)ids);
+    return r;
+}
+
+#ifdef _WIN32
+static int
+WalkOle(WalkState *statePtr, IStorage *pstg, Tcl_Obj *prefixObj, int depth)
+{
+    IEnumSTATSTG *penum = NULL;
+    STATSTG stats[12];
+    ULONG count = 0, n;
+    int r = TCL_OK;
+    HRESULT hr = pstg->lpVtbl->EnumElements(pstg, 0, NULL, 0, &penum);
+
+    while (r == TCL_OK && hr == S_OK) {
+        hr = penum->lpVtbl->Next(penum, 12, stats, &count);
+        for (n = 0; SUCCEEDED(hr) && n < count; n++) {
+            Tcl_Obj *pathObj;
+            ItemInfo info;
+
+            if (r != TCL_OK) {
+                CoTaskMemFree(stats[n].pwcsName);
+                continue;
+            }
+            InfoFromStatStg(&stats[n], &info);
+            pathObj = WalkPath(prefixObj,
+                Tcl_NewUnicodeObj(stats[n].pwcsName, -1));
+            Tcl_IncrRefCount(pathObj);
+            r = WalkVisit(statePtr, pathObj, &info);
+            if (r == TCL_OK && info.type == STGTY_STORAGE
+                && (statePtr->maxDepth < 0 || depth < statePtr->maxDepth)) {
+                IStorage *pstgSub = NULL;
+                hr = pstg->lpVtbl->OpenStorage(pstg, stats[n].pwcsName,
+                    NULL, STGM_READ | STGM_SHARE_EXCLUSIVE, NULL, 0,
+                    &pstgSub);
+                if (SUCCEEDED(hr)) {
+                    r = WalkOle(statePtr, pstgSub, pathObj, depth + 1);
+                    pstgSub->lpVtbl->Release(pstgSub);
+                }
+            }
+            Tcl_DecrRefCount(pathObj);
+            CoTaskMemFree(stats[n].pwcsName);
+        }
+    }
+    if (penum)
+        penum->lpVtbl->Release(penum);
+    if (r == TCL_OK && FAILED(hr)) {
+        Tcl_SetObjResult(statePtr->interp, Win32Error("walk error", hr));
+        r = TCL_ERROR;
+    }
+    return r;
+}
+#endif /* _WIN32 */
+
+static int
+StorageWalkCmd(ClientData clientData, Tcl_Interp *interp,
+    int objc, Tcl_Obj *const objv[])
+{
+    Storage *storagePtr = (Storage *)clientData;
+    static const char *options[] = { "-depth", "-glob", NULL };
+    enum { OPT_DEPTH, OPT_GLOB };
+    WalkState state;
+    int n, index, r = TCL_OK;
+
+    memset(&state, 0, sizeof(state));
+    state.interp = interp;
+    state.mode = storagePtr->mode;
+    state.maxDepth = -1;
+
+    for (n = 2; r == TCL_OK && n < objc; n++) {
+        const char *opt = Tcl_GetString(objv[n]);
+        if (opt[0] != '-') {
+            break;
+        }
+        r = Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index);
+        if (r == TCL_OK && n + 1 == objc) {
+            Tcl_AppendResult(interp, "value for \"", opt, "\" missing",
+                (char *)NULL);
+            r = TCL_ERROR;
+        }
+        if (r == TCL_OK && index == OPT_DEPTH) {
+            r = Tcl_GetIntFromObj(interp, objv[++n], &state.maxDepth);
+            if (r == TCL_OK && state.maxDepth < 1) {
+                Tcl_AppendResult(interp, "bad depth \"",
+                    Tcl_GetString(objv[n]), "\": must be at least 1",
+                    (char *)NULL);
+                r = TCL_ERROR;
+            }
+            /* depth counts levels below this storage */
+            state.maxDepth -= 1;
+        } else if (r == TCL_OK && index == OPT_GLOB) {
+            state.globObj = objv[++n];
+        }
+    }
+    if (r == TCL_OK && objc - n != 0 && objc - n != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+            "?-depth n? ?-glob pattern? ?varList script?");
+        r = TCL_ERROR;
+    }
+    if (r == TCL_OK && objc - n == 2) {
+        Tcl_Obj **varv;
+        int varc;
+        r = Tcl_ListObjGetElements(interp, objv[n], &varc, &varv);
+        if (r == TCL_OK && (varc < 1 || varc > 2)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                "varList must name a path variable and an optional "
+                "stat variable", -1));
+            r = TCL_ERROR;
+        } else if (r == TCL_OK) {
+            state.pathVarObj = varv[0];
+            state.infoVarObj = (varc > 1) ? varv[1] : NULL;
+            state.scriptObj = objv[n + 1];
+        }
+    }
+    if (r != TCL_OK) {
+        return r;
+    }
+
+    /*
+     * Hold our own references as the script may close the storage.
+     */
+
+    if (state.pathVarObj) {
+        Tcl_IncrRefCount(state.pathVarObj);
+        if (state.infoVarObj)
+            Tcl_IncrRefCount(state.infoVarObj);
+        Tcl_IncrRefCount(state.scriptObj);
+    } else {
+        state.listObj = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(state.listObj);
+    }
+    if (state.globObj)
+        Tcl_IncrRefCount(state.globObj);
+
+    if (storagePtr->cfbPtr) {
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        CfbIncrRefCount(cfbPtr);
+        state.visited = ckalloc(cfbPtr->entryCount);
+        memset(state.visited, 0, cfbPtr->entryCount);
+        state.visitedCount = cfbPtr->entryCount;
+        r = WalkCfb(&state, cfbPtr, storagePtr->dirId, NULL, 0);
+        ckfree(state.visited);
+        CfbDecrRefCount(cfbPtr);
+    } else {
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
+        pstg->lpVtbl->AddRef(pstg);
+        r = WalkOle(&state, pstg, NULL, 0);
+        pstg->lpVtbl->Release(pstg);
+#endif
+    }
+
+    if (r == TCL_BREAK) {
+        r = TCL_OK;
+    }
+    if (r == TCL_OK) {
+        Tcl_SetObjResult(interp, state.listObj
+            ? state.listObj : Tcl_NewObj());
+    }
+    if (state.listObj)
+        Tcl_DecrRefCount(state.listObj);
+    if (state.pathVarObj) {
+        Tcl_DecrRefCount(state.pathVarObj);
+        if (state.infoVarObj)
+            Tcl_DecrRefCount(state.infoVarObj);
+        Tcl_DecrRefCount(state.scriptObj);
     }
-    
+    if (state.globObj)
+        Tcl_DecrRefCount(state.globObj);
     return r;
 }
-
+
 /*
  * ----------------------------------------------------------------------
  *
- * StorageOpenCmd -
+ * StorageExtractCmd -
  *
- *	Open a file within the storage. This opens the named item
- *	and creates a Tcl channel to support reading and writing
- *	data. Modes are as per the Tcl 'open' command and may depend upon
- *	the mode settings of the owning storage.
+ *	Copy every stream below this storage into files under a host
+ *	directory. Sub-storages become directories and -glob selects the
+ *	streams copied by matching against their path as for walk. Names
+ *	are escaped where they hold characters that are not permitted in
+ *	host file names.
+ *
+ *	For native storages every stream is opened and its extents
+ *	resolved before any data is copied. The copying is then shared
+ *	between -threads workers, the calling thread being one of them.
+ *	The compound file is not changed while the workers run so they
+ *	need no locking beyond taking the next stream from the list. A
+ *	file opened with a sector cache is copied by the calling thread
+ *	alone as the cache is not locked. OLE storages are copied by the
+ *	calling thread only.
  *
  * Results:
- *	A standard Tcl result. The channel name is returned in the Tcl
- *	interpreter result.
+ *	A standard Tcl result. The result is a dict of the stream paths
+ *	and the number of bytes written for each.
  *
  * Side effects:
- *	A new stream may be created with the given name.
- *	A Tcl channel is created in the Tcl interpreter.
+ *	Files and directories are created.
  *
  * ----------------------------------------------------------------------
  */
 
+typedef struct ExtractJob {
+    Tcl_Obj      *nameObj;      /* path of the stream in the storage */
+    char         *fileName;     /* host file to be written */
+    CfbStream    *stmPtr;
+    Tcl_WideUInt  count;        /* bytes written */
+    int           code;         /* CFB status code */
+    int           errorNum;     /* errno value for CFB_EIO */
+} ExtractJob;
+
+typedef struct ExtractDir {
+    struct ExtractDir *parentPtr;
+    Tcl_Obj      *pathObj;      /* host directory */
+    int           made;         /* the directory has been created */
+} ExtractDir;
+
+typedef struct ExtractState {
+    Tcl_Interp   *interp;
+    Tcl_Obj      *globObj;
+    char         *visited;      /* native storages already walked */
+    ExtractJob   *jobs;
+    int           jobCount;
+    int           jobSpace;
+    int           next;         /* next job to be taken by a worker */
+    Tcl_Mutex     lock;
+    Tcl_Obj      *listObj;      /* results of the OLE copy */
+} ExtractState;
+
+/*
+ * Make a host file name from a storage item name. Control characters,
+ * the escape character itself, path separators and characters reserved
+ * on Windows are written as %XX. The names . and .. and a leading ~ are
+ * escaped too so that no name can refer outside its directory.
+ */
+
+static Tcl_Obj *
+ExtractFileName(Tcl_Obj *nameObj)
+{
+    const char *s = Tcl_GetString(nameObj);
+    Tcl_Obj *fileObj = Tcl_NewObj();
+    int dots = (strcmp(s, ".") == 0 || strcmp(s, "..") == 0);
+    char hex[4];
+
+    if (*s == '~') {
+        Tcl_AppendToObj(fileObj, "%7E", 3);
+        s++;
+    }
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c < 0x20 || strchr("%<>\"|?*/\\:", c) || dots) {
+            _snprintf(hex, sizeof(hex), "%%%02X", c);
+            Tcl_AppendToObj(fileObj, hex, 3);
+        } else {
+            Tcl_AppendToObj(fileObj, s, 1);
+        }
+    }
+    return fileObj;
+}
+
+/*
+ * Join an escaped item name to a host directory. The result must be a
+ * direct child of the directory and is returned with a reference held
+ * for the caller. Anything else is refused with an error left in the
+ * interpreter and NULL returned.
+ */
+
+static Tcl_Obj *
+ExtractJoin(Tcl_Interp *interp, Tcl_Obj *dirObj, Tcl_Obj *nameObj)
+{
+    Tcl_Obj *fileObj = ExtractFileName(nameObj), *pathObj, *partsObj;
+    Tcl_Obj *dirPartsObj, *tailObj = NULL;
+    int count = 0, dirCount = 0;
+
+    Tcl_IncrRefCount(fileObj);
+    pathObj = Tcl_FSJoinToPath(dirObj, 1, &fileObj);
+    Tcl_IncrRefCount(pathObj);
+    partsObj = Tcl_FSSplitPath(pathObj, &count);
+    dirPartsObj = Tcl_FSSplitPath(dirObj, &dirCount);
+    Tcl_IncrRefCount(partsObj);
+    Tcl_IncrRefCount(dirPartsObj);
+    if (count == dirCount + 1) {
+        Tcl_ListObjIndex(NULL, partsObj, dirCount, &tailObj);
+    }
+    if (tailObj == NULL
+        || strcmp(Tcl_GetString(tailObj), Tcl_GetString(fileObj)) != 0) {
+        Tcl_AppendResult(interp, "can't extract \"",
+            Tcl_GetString(nameObj), "\": name leaves \"",
+            Tcl_GetString(dirObj), "\"", (char *)NULL);
+        Tcl_DecrRefCount(pathObj);
+        pathObj = NULL;
+    }
+    Tcl_DecrRefCount(dirPartsObj);
+    Tcl_DecrRefCount(partsObj);
+    Tcl_DecrRefCount(fileObj);
+    return pathObj;
+}
+
 static int
-StorageOpenCmd(ClientData clientData, Tcl_Interp *interp,
-    int objc, Tcl_Obj *const objv[])
+ExtractMakeDir(Tcl_Interp *interp, ExtractDir *dirPtr)
 {
-    Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
-    IStream *pstm = NULL;
+    Tcl_StatBuf *statPtr;
     int r = TCL_OK;
-    int mode = storagePtr->mode;
-    
-    if (objc < 3 || objc > 4) {
-        Tcl_WrongNumArgs(interp, 2, objv, "filename mode");
-        return TCL_ERROR;
+
+    if (dirPtr->made) {
+        return TCL_OK;
     }
-    if (objc == 4) {
-        mode &= STGM_STREAMMASK; 
-        r = GetStorageFlagsFromObj(interp, objv[3], &mode);
-    } else {
-        mode &= STGM_STREAMMASK;
-        mode |= STGM_READ;
+    if (dirPtr->parentPtr) {
+        r = ExtractMakeDir(interp, dirPtr->parentPtr);
     }
-    
-    if (r == TCL_OK) {
-	
-        HRESULT hr = S_OK;
-        if (mode & STGM_CREATE) {
-            hr = pstg->lpVtbl->CreateStream(pstg, Tcl_GetUnicode(objv[2]),
-		mode & STGM_WIN32MASK,  0, 0, &pstm);
-        } else {
-            hr = pstg->lpVtbl->OpenStream(pstg, Tcl_GetUnicode(objv[2]),
-		NULL, mode & STGM_WIN32MASK, 0, &pstm);
-            if (FAILED(hr) && mode & STGM_APPEND) {
-                hr = pstg->lpVtbl->CreateStream(pstg, Tcl_GetUnicode(objv[2]),
-		    mode & STGM_WIN32MASK,  0, 0, &pstm);
-            }
-        }
-	
-        if (FAILED(hr)) {
-            Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
-            Tcl_AppendStringsToObj(errObj, "error opening \"", 
-		Tcl_GetString(objv[2]), "\"", (char *)NULL);
-	    Tcl_AppendObjToObj(errObj, Win32Error("", hr));
-            Tcl_SetObjResult(interp, errObj);
+    if (r == TCL_OK && Tcl_FSCreateDirectory(dirPtr->pathObj) != TCL_OK) {
+        int errorNum = Tcl_GetErrno();
+        statPtr = Tcl_AllocStatBuf();
+        if (errorNum != EEXIST || Tcl_FSStat(dirPtr->pathObj, statPtr) != 0
+            || (statPtr->st_mode & S_IFMT) != S_IFDIR) {
+            Tcl_AppendResult(interp, "can't create directory \"",
+                Tcl_GetString(dirPtr->pathObj), "\": ",
+                Tcl_ErrnoMsg(errorNum), (char *)NULL);
             r = TCL_ERROR;
-        } else {
-	    Package *pkgPtr;
-            StorageChannel *inst;
-            char name[3 + TCL_INTEGER_SPACE];
-	    
-            _snprintf(name, 3 + TCL_INTEGER_SPACE, "stm%ld", 
-		InterlockedIncrement(&UNIQUEID));
-            inst = (StorageChannel *)ckalloc(sizeof(StorageChannel));
-            inst->pstm = pstm;
-            inst->grfMode = mode;
-            inst->interp = interp;
-            inst->watchmask = 0;
-	    inst->flags = 0;
-	    /* bit0 set then not readable */
-            inst->validmask = (mode & STGM_WRITE) ? 0 : TCL_READABLE;
-            inst->validmask |= (mode & (STGM_WRITE|STGM_READWRITE)) 
-		? TCL_WRITABLE : 0;
-            inst->chan = Tcl_CreateChannel(&StorageChannelType, name, 
-		    inst, inst->validmask);
-            Tcl_RegisterChannel(interp, inst->chan);
-            if (mode & STGM_APPEND) {
-                Tcl_Seek(inst->chan, 0, SEEK_END);
-	    }
+        }
+        ckfree((char *)statPtr);
+    }
+    dirPtr->made = (r == TCL_OK);
+    return r;
+}
+
+static int
+ExtractMatch(ExtractState *statePtr, Tcl_Obj *pathObj)
+{
+    return statePtr->globObj == NULL || Tcl_StringMatch(
+        Tcl_GetString(pathObj), Tcl_GetString(statePtr->globObj));
+}
+
+static int
+ExtractCollect(ExtractState *statePtr, Cfb *cfbPtr, CfbSect dirId,
+    Tcl_Obj *prefixObj, ExtractDir *dirPtr)
+{
+    CfbSect *ids = NULL, count = 0, n;
+    int code, r = TCL_OK;
+
+    if (statePtr->visited[dirId]) {
+        code = CFB_EFORMAT;
+    } else {
+        statePtr->visited[dirId] = 1;
+        code = CfbListChildren(cfbPtr, dirId, &ids, &count);
+    }
+    if (code != CFB_OK) {
+        Tcl_SetObjResult(statePtr->interp, CfbError("extract error", code));
+        return TCL_ERROR;
+    }
+    for (n = 0; r == TCL_OK && n < count; n++) {
+        const CfbEntry *entryPtr = &cfbPtr->entries[ids[n]];
+        Tcl_Obj *nameObj = CfbNameObj(entryPtr), *pathObj;
 
-	    /* insert at head of channels list */
-	    pkgPtr = Tcl_GetAssocData(interp, STORAGE_PACKAGE_KEY, NULL);
-	    inst->pkgPtr = pkgPtr;
-	    inst->nextPtr = pkgPtr->headPtr;
-	    pkgPtr->headPtr = inst;
-	    ++pkgPtr->count;
+        Tcl_IncrRefCount(nameObj);
+        pathObj = WalkPath(prefixObj, Tcl_DuplicateObj(nameObj));
+        Tcl_IncrRefCount(pathObj);
+        if (entryPtr->type == CFB_TYPE_STORAGE) {
+            ExtractDir dir;
+            dir.parentPtr = dirPtr;
+            dir.pathObj = ExtractJoin(statePtr->interp, dirPtr->pathObj,
+                nameObj);
+            dir.made = 0;
+            if (dir.pathObj == NULL) {
+                r = TCL_ERROR;
+            } else {
+                r = ExtractCollect(statePtr, cfbPtr, ids[n], pathObj, &dir);
+                Tcl_DecrRefCount(dir.pathObj);
+            }
+        } else if (entryPtr->type == CFB_TYPE_STREAM
+                   && ExtractMatch(statePtr, pathObj)) {
+            ExtractJob *jobPtr;
+            Tcl_Obj *fileObj;
 
-            Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
-            r = TCL_OK;
+            fileObj = ExtractJoin(statePtr->interp, dirPtr->pathObj, nameObj);
+            r = (fileObj == NULL) ? TCL_ERROR
+                : ExtractMakeDir(statePtr->interp, dirPtr);
+            if (r == TCL_OK && statePtr->jobCount == statePtr->jobSpace) {
+                statePtr->jobSpace = statePtr->jobSpace ? 
+                    statePtr->jobSpace * 2 : 16;
+                statePtr->jobs = (ExtractJob *)ckrealloc(
+                    (char *)statePtr->jobs,
+                    statePtr->jobSpace * sizeof(ExtractJob));
+            }
+            if (r == TCL_OK) {
+                jobPtr = &statePtr->jobs[statePtr->jobCount];
+                memset(jobPtr, 0, sizeof(ExtractJob));
+                jobPtr->code = CfbStreamOpen(cfbPtr, ids[n], &jobPtr->stmPtr);
+                if (jobPtr->code != CFB_OK) {
+                    Tcl_SetObjResult(statePtr->interp,
+                        CfbError("extract error", jobPtr->code));
+                    r = TCL_ERROR;
+                }
+            }
+            if (r == TCL_OK) {
+                jobPtr->fileName = ckalloc(strlen(Tcl_GetString(fileObj)) + 1);
+                strcpy(jobPtr->fileName, Tcl_GetString(fileObj));
+                jobPtr->nameObj = pathObj;
+                Tcl_IncrRefCount(pathObj);
+                statePtr->jobCount++;
+            }
+            if (fileObj)
+                Tcl_DecrRefCount(fileObj);
         }
+        Tcl_DecrRefCount(pathObj);
+        Tcl_DecrRefCount(nameObj);
     }
+    ckfree((char *)ids);
     return r;
 }
-
+
 /*
- * ----------------------------------------------------------------------
- *
- * StorageStatCmd -
- *
- *	Fetch information about the named item as per [file stat]
- *
- * Results:
- *	A standard Tcl result
- *
- * Side effects:
- *	The array variable passed in will have a number of values added
- *	or modified.
- *
- * ----------------------------------------------------------------------
+ * Copy streams until none are left. This runs in each worker thread and
+ * uses no Tcl_Obj shared with any other thread.
  */
 
+static void
+ExtractWork(ExtractState *statePtr)
+{
+    for (;;) {
+        ExtractJob *jobPtr = NULL;
+        Tcl_Channel chan;
+        Tcl_Obj *fileObj;
+
+        Tcl_MutexLock(&statePtr->lock);
+        if (statePtr->next < statePtr->jobCount) {
+            jobPtr = &statePtr->jobs[statePtr->next++];
+        }
+        Tcl_MutexUnlock(&statePtr->lock);
+        if (jobPtr == NULL) {
+            break;
+        }
+
+        fileObj = Tcl_NewStringObj(jobPtr->fileName, -1);
+        Tcl_IncrRefCount(fileObj);
+        chan = Tcl_FSOpenFileChannel(NULL, fileObj, "w", 0666);
+        if (chan == NULL) {
+            jobPtr->code = CFB_EIO;
+        } else {
+            jobPtr->code = CfbStreamCopy(jobPtr->stmPtr, chan,
+                &jobPtr->count);
+            if (jobPtr->code == CFB_EIO) {
+                jobPtr->errorNum = Tcl_GetErrno();
+            }
+            if (Tcl_Close(NULL, chan) != TCL_OK
+                && jobPtr->code == CFB_OK) {
+                jobPtr->code = CFB_EIO;
+            }
+        }
+        if (jobPtr->code == CFB_EIO && jobPtr->errorNum == 0) {
+            jobPtr->errorNum = Tcl_GetErrno();
+        }
+        Tcl_DecrRefCount(fileObj);
+    }
+}
+
+static Tcl_ThreadCreateType
+ExtractThread(ClientData clientData)
+{
+    ExtractWork((ExtractState *)clientData);
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+#ifdef _WIN32
 static int
-StorageStatCmd(ClientData clientData, Tcl_Interp *interp,
-    int objc, Tcl_Obj *const objv[])
+ExtractOle(ExtractState *statePtr, IStorage *pstg, Tcl_Obj *prefixObj,
+    ExtractDir *dirPtr)
 {
-    Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
+    IEnumSTATSTG *penum = NULL;
+    STATSTG stat;
+    ULONG count = 0;
     int r = TCL_OK;
-    
-    if (objc != 4) {
+    HRESULT hr = pstg->lpVtbl->EnumElements(pstg, 0, NULL, 0, &penum);
 
-        Tcl_WrongNumArgs(interp, 2, objv, "name varName");
-        r = TCL_ERROR;
-	
-    } else {
-	
-        STATSTG stat;
-        int posixmode = 0;
-        const stgm_map_t *p = NULL;
-	
-        if (r == TCL_OK) {
-            r = GetItemInfo(interp, pstg, objv[2], &stat);
+    while (r == TCL_OK && hr == S_OK) {
+        Tcl_Obj *nameObj, *pathObj;
+
+        hr = penum->lpVtbl->Next(penum, 1, &stat, &count);
+        if (hr != S_OK) {
+            break;
+        }
+        nameObj = Tcl_NewUnicodeObj(stat.pwcsName, -1);
+        Tcl_IncrRefCount(nameObj);
+        pathObj = WalkPath(prefixObj, Tcl_DuplicateObj(nameObj));
+        Tcl_IncrRefCount(pathObj);
+        if (stat.type == STGTY_STORAGE) {
+            IStorage *pstgSub = NULL;
+            ExtractDir dir;
+            dir.parentPtr = dirPtr;
+            dir.pathObj = ExtractJoin(statePtr->interp, dirPtr->pathObj,
+                nameObj);
+            dir.made = 0;
+            if (dir.pathObj == NULL) {
+                r = TCL_ERROR;
+            } else {
+                hr = pstg->lpVtbl->OpenStorage(pstg, stat.pwcsName, NULL,
+                    STGM_READ | STGM_SHARE_EXCLUSIVE, NULL, 0, &pstgSub);
+                if (SUCCEEDED(hr)) {
+                    r = ExtractOle(statePtr, pstgSub, pathObj, &dir);
+                    pstgSub->lpVtbl->Release(pstgSub);
+                }
+                Tcl_DecrRefCount(dir.pathObj);
+            }
+        } else if (stat.type == STGTY_STREAM
+                   && ExtractMatch(statePtr, pathObj)) {
+            IStream *pstm = NULL;
+            Tcl_Channel chan = NULL;
+            Tcl_Obj *fileObj = ExtractJoin(statePtr->interp,
+                dirPtr->pathObj, nameObj);
+            Tcl_WideUInt total = 0;
+            char buffer[16384];
+            ULONG cb = 0;
+
+            r = (fileObj == NULL) ? TCL_ERROR
+                : ExtractMakeDir(statePtr->interp, dirPtr);
             if (r == TCL_OK) {
-                Tcl_ObjSetVar2(interp, objv[3], Tcl_NewStringObj("type", -1),
-                    (stat.type == STGTY_STORAGE) 
-		    ? Tcl_NewStringObj("directory", -1) 
-		    : Tcl_NewStringObj("file", -1),
-                    0);
-                Tcl_ObjSetVar2(interp, objv[3], Tcl_NewStringObj("size", -1),
-		    Tcl_NewWideIntObj(stat.cbSize.QuadPart), 0);
-                Tcl_ObjSetVar2(interp, objv[3], Tcl_NewStringObj("atime", -1),
-		    Tcl_NewLongObj(TimeFromFileTime(&stat.atime)), 0);
-                Tcl_ObjSetVar2(interp, objv[3], Tcl_NewStringObj("mtime", -1),
-		    Tcl_NewLongObj(TimeFromFileTime(&stat.mtime)), 0);
-                Tcl_ObjSetVar2(interp, objv[3], Tcl_NewStringObj("ctime", -1), 
-		    Tcl_NewLongObj(TimeFromFileTime(&stat.ctime)), 0);
-                Tcl_ObjSetVar2(interp, objv[3], 
-		    Tcl_NewStringObj("gid", -1), Tcl_NewLongObj(0), 0);
-                Tcl_ObjSetVar2(interp, objv[3], 
-		    Tcl_NewStringObj("uid", -1), Tcl_NewLongObj(0), 0);
-                Tcl_ObjSetVar2(interp, objv[3], 
-		    Tcl_NewStringObj("ino", -1), Tcl_NewLongObj(0), 0);
-                Tcl_ObjSetVar2(interp, objv[3], 
-		    Tcl_NewStringObj("dev", -1), Tcl_NewLongObj(0), 0);
-		
-                for (p = stgm_map; p->s != NULL; p++) {
-                    if ((storagePtr->mode & ~(STGM_STREAMMASK)) == p->f) {
-                        posixmode = p->posixmode;
-                        break;
-                    }
+                hr = pstg->lpVtbl->OpenStream(pstg, stat.pwcsName, NULL,
+                    STGM_READ | STGM_SHARE_EXCLUSIVE, 0, &pstm);
+            }
+            if (r == TCL_OK && SUCCEEDED(hr)) {
+                chan = Tcl_FSOpenFileChannel(statePtr->interp, fileObj,
+                    "w", 0666);
+                if (chan == NULL) {
+                    r = TCL_ERROR;
                 }
-                Tcl_ObjSetVar2(interp, objv[3], Tcl_NewStringObj("mode", -1),
-		    Tcl_NewLongObj(posixmode), 0);
-		
-                if (stat.pwcsName) {
-                    CoTaskMemFree(stat.pwcsName);
+            }
+            while (chan && SUCCEEDED(hr)) {
+                hr = pstm->lpVtbl->Read(pstm, buffer, sizeof(buffer), &cb);
+                if (FAILED(hr) || cb == 0) {
+                    break;
+                }
+                if (Tcl_WriteRaw(chan, buffer, (int)cb) != (int)cb) {
+                    Tcl_AppendResult(statePtr->interp, "error writing \"",
+                        Tcl_GetString(fileObj), "\": ",
+                        Tcl_PosixError(statePtr->interp), (char *)NULL);
+                    r = TCL_ERROR;
+                    break;
                 }
+                total += cb;
+            }
+            if (chan && Tcl_Close(r == TCL_OK ? statePtr->interp : NULL,
+                    chan) != TCL_OK) {
+                r = TCL_ERROR;
+            }
+            if (pstm)
+                pstm->lpVtbl->Release(pstm);
+            if (r == TCL_OK && SUCCEEDED(hr)) {
+                Tcl_ListObjAppendElement(NULL, statePtr->listObj, pathObj);
+                Tcl_ListObjAppendElement(NULL, statePtr->listObj,
+                    Tcl_NewWideIntObj((Tcl_WideInt)total));
             }
+            if (fileObj)
+                Tcl_DecrRefCount(fileObj);
         }
+        Tcl_DecrRefCount(pathObj);
+        Tcl_DecrRefCount(nameObj);
+        CoTaskMemFree(stat.pwcsName);
+    }
+    if (penum)
+        penum->lpVtbl->Release(penum);
+    if (r == TCL_OK && FAILED(hr)) {
+        Tcl_SetObjResult(statePtr->interp, Win32Error("extract error", hr));
+        r = TCL_ERROR;
     }
     return r;
 }
-
-/*
- * ----------------------------------------------------------------------
- *
- * StorageNamesCmd -
- *
- *	Obtain a list of all item names contained in this storage.
- *
- * Results:
- *	A standard Tcl result. The list of names is returned in the 
- *	interpreters result.
- *
- * Side effects:
- *	None.
- *
- * ----------------------------------------------------------------------
- */
+#endif /* _WIN32 */
 
 static int
-StorageNamesCmd(ClientData clientData, Tcl_Interp *interp, 
+StorageExtractCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
-    IEnumSTATSTG *penum = NULL;
-    STATSTG stats[12];
-    ULONG count, n, found = 0;
-    int r = TCL_OK;
-    
-    if (objc > 2) {
-	
-        Tcl_WrongNumArgs(interp, 2, objv, "");
-        r = TCL_ERROR;
-	
-    } else {
-	
-        HRESULT hr = pstg->lpVtbl->EnumElements(pstg, 0, NULL, 0, &penum);
-        if (FAILED(hr)) {
-            Tcl_SetObjResult(interp, Win32Error("names error", hr));
-            r = TCL_ERROR;
-        } else {
-            Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
-            while (hr == S_OK) {
-                hr = penum->lpVtbl->Next(penum, 12, stats, &count);
-                for (n = 0; SUCCEEDED(hr) && n < count; n++) {
-                    Tcl_ListObjAppendElement(interp, listObj, 
-                        Tcl_NewUnicodeObj(stats[n].pwcsName, -1));
-                    CoTaskMemFree(stats[n].pwcsName);
+    static const char *options[] = { "-threads", "-glob", NULL };
+    enum { OPT_THREADS, OPT_GLOB };
+    ExtractState state;
+    ExtractDir dir;
+    int n, index, threads = 1, r = TCL_OK;
+
+    if (objc < 3 || (objc & 1) == 0) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+            "destdir ?-threads n? ?-glob pattern?");
+        return TCL_ERROR;
+    }
+    memset(&state, 0, sizeof(state));
+    state.interp = interp;
+    for (n = 3; r == TCL_OK && n < objc; n += 2) {
+        r = Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index);
+        if (r == TCL_OK && index == OPT_THREADS) {
+            r = Tcl_GetIntFromObj(interp, objv[n + 1], &threads);
+            if (r == TCL_OK && threads < 1) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                    "the number of threads must be at least 1", -1));
+                r = TCL_ERROR;
+            }
+        } else if (r == TCL_OK) {
+            state.globObj = objv[n + 1];
+        }
+    }
+    if (r != TCL_OK) {
+        return r;
+    }
+
+    /*
+     * The workers are given absolute names as the current directory
+     * could be changed by another thread.
+     */
+
+    dir.parentPtr = NULL;
+    dir.pathObj = Tcl_FSGetNormalizedPath(interp, objv[2]);
+    dir.made = 0;
+    if (dir.pathObj == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_IncrRefCount(dir.pathObj);
+    if (state.globObj)
+        Tcl_IncrRefCount(state.globObj);
+
+    if (storagePtr->cfbPtr) {
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        Tcl_ThreadId *ids = NULL;
+        Tcl_Obj *listObj = NULL;
+        int started = 0, result;
+
+        CfbIncrRefCount(cfbPtr);
+        state.visited = ckalloc(cfbPtr->entryCount);
+        memset(state.visited, 0, cfbPtr->entryCount);
+        r = ExtractCollect(&state, cfbPtr, storagePtr->dirId, NULL, &dir);
+        ckfree(state.visited);
+
+        if (r == TCL_OK) {
+            if (cfbPtr->cachePtr) {
+                /* reads through the sector cache change it */
+                threads = 1;
+            }
+            if (threads > state.jobCount) {
+                threads = state.jobCount > 0 ? state.jobCount : 1;
+            }
+            ids = (Tcl_ThreadId *)ckalloc(threads * sizeof(Tcl_ThreadId));
+            for (n = 1; n < threads; n++) {
+                /* without thread support the calling thread does it all */
+                if (Tcl_CreateThread(&ids[started], ExtractThread,
+                        (ClientData)&state, TCL_THREAD_STACK_DEFAULT,
+                        TCL_THREAD_JOINABLE) != TCL_OK) {
+                    break;
                 }
+                started++;
             }
-            penum->lpVtbl->Release(penum);
+            ExtractWork(&state);
+            for (n = 0; n < started; n++) {
+                Tcl_JoinThread(ids[n], &result);
+            }
+            ckfree((char *)ids);
+            listObj = Tcl_NewListObj(0, NULL);
+        }
+
+        for (n = 0; n < state.jobCount; n++) {
+            ExtractJob *jobPtr = &state.jobs[n];
+            if (r == TCL_OK && jobPtr->code != CFB_OK) {
+                Tcl_Obj *msgObj = Tcl_NewStringObj("", 0);
+                Tcl_SetErrno(jobPtr->errorNum);
+                Tcl_AppendStringsToObj(msgObj, "error extracting \"",
+                    Tcl_GetString(jobPtr->nameObj), "\" to \"",
+                    jobPtr->fileName, "\"", (char *)NULL);
+                Tcl_AppendObjToObj(msgObj, CfbError("", jobPtr->code));
+                Tcl_SetObjResult(interp, msgObj);
+                r = TCL_ERROR;
+            } else if (r == TCL_OK) {
+                Tcl_ListObjAppendElement(NULL, listObj, jobPtr->nameObj);
+                Tcl_ListObjAppendElement(NULL, listObj,
+                    Tcl_NewWideIntObj((Tcl_WideInt)jobPtr->count));
+            }
+            CfbStreamClose(jobPtr->stmPtr);
+            ckfree(jobPtr->fileName);
+            Tcl_DecrRefCount(jobPtr->nameObj);
+        }
+        if (state.jobs)
+            ckfree((char *)state.jobs);
+        Tcl_MutexFinalize(&state.lock);
+        CfbDecrRefCount(cfbPtr);
+        if (r == TCL_OK) {
             Tcl_SetObjResult(interp, listObj);
+        } else if (listObj) {
+            Tcl_DecrRefCount(listObj);
         }
+    } else {
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
+        state.listObj = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(state.listObj);
+        pstg->lpVtbl->AddRef(pstg);
+        r = ExtractOle(&state, pstg, NULL, &dir);
+        pstg->lpVtbl->Release(pstg);
+        if (r == TCL_OK) {
+            Tcl_SetObjResult(interp, state.listObj);
+        }
+        Tcl_DecrRefCount(state.listObj);
+#endif
     }
+
+    if (state.globObj)
+        Tcl_DecrRefCount(state.globObj);
+    Tcl_DecrRefCount(dir.pathObj);
     return r;
 }
-
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -908,13 +3378,28 @@ StorageRenameCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
     int r = TCL_OK;
     
     if (objc != 4) {
         Tcl_WrongNumArgs(interp, 2, objv, "oldname newname");
         r = TCL_ERROR;
+    } else if (storagePtr->cfbPtr) {
+        int code = CFB_EACCES;
+        if (StorageWritable(storagePtr)) {
+            code = CfbRenameEntry(storagePtr->cfbPtr, storagePtr->dirId,
+                objv[2], objv[3]);
+        }
+        if (code != CFB_OK) {
+            Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+            Tcl_AppendStringsToObj(errObj, "error renaming \"", 
+                Tcl_GetString(objv[2]), "\"", (char *)NULL);
+            Tcl_AppendObjToObj(errObj, CfbError("", code));
+            Tcl_SetObjResult(interp, errObj);
+            r = TCL_ERROR;
+        }
     } else {
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
         HRESULT hr = pstg->lpVtbl->RenameElement(pstg, 
             Tcl_GetUnicode(objv[2]), Tcl_GetUnicode(objv[3]));
         if (FAILED(hr)) {
@@ -925,6 +3410,7 @@ StorageRenameCmd(ClientData clientData, Tcl_Interp *interp,
             Tcl_SetObjResult(interp, errObj);
             r = TCL_ERROR;
         }
+#endif
     }
     return r;
 }
@@ -951,7 +3437,6 @@ StorageRemoveCmd(ClientData clientData, Tcl_Interp *interp,
     int objc, Tcl_Obj *const objv[])
 {
     Storage *storagePtr = (Storage *)clientData;
-    IStorage *pstg = storagePtr->pstg;
     int r = TCL_OK;
     
     if (objc != 3) {
@@ -959,8 +3444,26 @@ StorageRemoveCmd(ClientData clientData, Tcl_Interp *interp,
         Tcl_WrongNumArgs(interp, 2, objv, "name");
         r = TCL_ERROR;
         
+    } else if (storagePtr->cfbPtr) {
+
+        int code = CFB_EACCES;
+        if (StorageWritable(storagePtr)) {
+            code = CfbRemoveEntry(storagePtr->cfbPtr, storagePtr->dirId,
+                objv[2]);
+        }
+        if (code != CFB_OK && code != CFB_ENOENT) {
+            Tcl_Obj *errObj = Tcl_NewStringObj("", 0);
+            Tcl_AppendStringsToObj(errObj, "error removing \"", 
+                Tcl_GetString(objv[2]), "\"", (char *)NULL);
+            Tcl_AppendObjToObj(errObj, CfbError("", code));
+            Tcl_SetObjResult(interp, errObj);
+            r = TCL_ERROR;
+        }
+
     } else {
         
+#ifdef _WIN32
+        IStorage *pstg = storagePtr->pstg;
         HRESULT hr = pstg->lpVtbl->DestroyElement(pstg, 
             Tcl_GetUnicode(objv[2]));
         if (FAILED(hr) && hr != STG_E_FILENOTFOUND) {
@@ -971,6 +3474,7 @@ StorageRemoveCmd(ClientData clientData, Tcl_Interp *interp,
             Tcl_SetObjResult(interp, errObj);
             r = TCL_ERROR;
         }
+#endif
     }
     return r;
 }
@@ -999,21 +3503,43 @@ StorageChannelClose(ClientData instanceData, Tcl_Interp *interp)
     StorageChannel *instPtr = instanceData;
     StorageChannel **tmpPtrPtr;
     Package *pkgPtr = instPtr->pkgPtr;
+    int code = 0;
     
-    /* remove this channel from the package list */
+    /* remove this channel from its storage and the package list */
+    if (instPtr->storagePtr) {
+        Tcl_DeleteHashEntry(Tcl_FindHashEntry(&instPtr->storagePtr->channels,
+            (char *)instPtr));
+    }
     tmpPtrPtr = &pkgPtr->headPtr;
     while (*tmpPtrPtr && *tmpPtrPtr != instPtr) {
 	tmpPtrPtr = &(*tmpPtrPtr)->nextPtr;
     }
     *tmpPtrPtr = instPtr->nextPtr;
     --pkgPtr->count;
+    if (instPtr->watchmask) {
+        --pkgPtr->watchCount;
+    }
+
+    /* discard any event still queued for this channel */
+    if (instPtr->flags & STORAGE_FLAG_PENDING) {
+        Tcl_DeleteEvents(EventDeleteProc, instPtr);
+    }
 
     /* free the stream and the memory */
+#ifdef _WIN32
     if (instPtr->pstm)
         instPtr->pstm->lpVtbl->Release(instPtr->pstm);
+#endif
+    if (instPtr->stmPtr)
+        CfbStreamClose(instPtr->stmPtr);
+    if (instPtr->builderPtr) {
+        code = CfbBuilderEndStream(instPtr->builderPtr, instPtr->builderId);
+        CfbBuilderDecrRefCount(instPtr->builderPtr);
+        code = ErrnoFromCfb(code);
+    }
     ckfree((char *)instPtr);
     
-    return TCL_OK;
+    return code;
 }
 
 /*
@@ -1039,6 +3565,13 @@ StorageChannelInput(ClientData instanceData,
     StorageChannel *chan = (StorageChannel *)instanceData;
     int cb = 0;
     
+    if (chan->stmPtr) {
+        cb = CfbStreamRead(chan->stmPtr, buffer, toRead);
+        if (cb < 0) {
+            *errorCodePtr = EINVAL;
+        }
+    }
+#ifdef _WIN32
     if (chan->pstm) {
         HRESULT hr = chan->pstm->lpVtbl->Read(chan->pstm, buffer, toRead, &cb);
         if (FAILED(hr)) {
@@ -1046,6 +3579,7 @@ StorageChannelInput(ClientData instanceData,
             *errorCodePtr = EINVAL;
         }
     }
+#endif
     
     return cb;
 }
@@ -1073,6 +3607,23 @@ StorageChannelOutput(ClientData instanceData,
     StorageChannel *chan = (StorageChannel *)instanceData;
     int cb = 0;
     
+    if (chan->stmPtr) {
+        int code = CFB_OK;
+        cb = CfbStreamWrite(chan->stmPtr, buffer, toWrite, &code);
+        if (cb < 0) {
+            *errorCodePtr = ErrnoFromCfb(code);
+        }
+    }
+    if (chan->builderPtr) {
+        int code = CfbBuilderWrite(chan->builderPtr, chan->builderId,
+            buffer, toWrite);
+        cb = toWrite;
+        if (code != CFB_OK) {
+            cb = -1;
+            *errorCodePtr = ErrnoFromCfb(code);
+        }
+    }
+#ifdef _WIN32
     if (chan->pstm) {
         HRESULT hr = chan->pstm->lpVtbl->Write(chan->pstm, buffer, 
             toWrite, &cb);
@@ -1081,6 +3632,7 @@ StorageChannelOutput(ClientData instanceData,
             *errorCodePtr = EINVAL;
         }
     }
+#endif
     
     return cb;
 }
@@ -1130,11 +3682,24 @@ StorageChannelWideSeek(ClientData instanceData, Tcl_WideInt offset,
     int seekMode, int *errorCodePtr)
 {
     StorageChannel *chan = (StorageChannel *)instanceData;
+#ifdef _WIN32
     HRESULT hr = S_OK;
-    int cb = 0;
     LARGE_INTEGER li; 
     ULARGE_INTEGER uli;
+#endif
     
+    if (chan->builderPtr) {
+        /* a stream being generated can only report its position */
+        if (offset != 0 || seekMode != SEEK_CUR) {
+            *errorCodePtr = EINVAL;
+            return -1;
+        }
+        return (Tcl_WideInt)chan->builderPtr->entries[chan->builderId].size;
+    }
+#ifdef _WIN32
+    if (chan->stmPtr) {
+        return CfbStreamSeek(chan->stmPtr, offset, seekMode, errorCodePtr);
+    }
     li.QuadPart = offset;
     uli.QuadPart = 0;
     if (chan->pstm) {
@@ -1151,8 +3716,221 @@ StorageChannelWideSeek(ClientData instanceData, Tcl_WideInt offset,
         }
     }
     return uli.QuadPart;
+#else
+    return CfbStreamSeek(chan->stmPtr, offset, seekMode, errorCodePtr);
+#endif
 }
 
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageChannelSetOptions -
+ *
+ *	Called by the Tcl channel layer to configure the channel. Only
+ *	-readahead may be set. It is given as a number of sectors or as
+ *	sequential or random and decides how much of the stream each read
+ *	from the channel fetches by setting the channel buffer size.
+ *	Sequential reading fetches many sectors at once while random
+ *	access fetches a single sector so that little is read that will
+ *	not be used. For native streams it also sets how far ahead of a
+ *	sequential reader the file is requested from the system: up to
+ *	the given number of sectors, the largest window from the start
+ *	for sequential and not at all for random.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The channel buffer size is changed.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static unsigned long
+ChannelSectorSize(StorageChannel *chan)
+{
+    unsigned long sectorSize = 512;
+    CfbSect fragments;
+
+    if (chan->stmPtr) {
+        CfbStreamLayout(chan->stmPtr, &sectorSize, &fragments);
+    }
+#ifdef _WIN32
+    if (chan->pstm) {
+        STATSTG stat;
+        if (SUCCEEDED(chan->pstm->lpVtbl->Stat(chan->pstm, &stat,
+                STATFLAG_NONAME)) && stat.cbSize.QuadPart < 4096) {
+            /* small streams are held in the mini stream */
+            sectorSize = 64;
+        }
+    }
+#endif
+    return sectorSize;
+}
+
+static int
+StorageChannelSetOptions(ClientData instanceData, Tcl_Interp *interp,
+    const char *optionName, const char *newValue)
+{
+    StorageChannel *chan = (StorageChannel *)instanceData;
+    int readahead = 0, sectors;
+    unsigned long size;
+
+    if (strcmp(optionName, "-readahead") != 0) {
+        return Tcl_BadChannelOption(interp, optionName, "readahead");
+    }
+    if (strcmp(newValue, "sequential") == 0) {
+        readahead = STORAGE_READAHEAD_SEQUENTIAL;
+        sectors = STORAGE_SEQUENTIAL_SECTORS;
+    } else if (strcmp(newValue, "random") == 0) {
+        readahead = STORAGE_READAHEAD_RANDOM;
+        sectors = 1;
+    } else if (Tcl_GetInt(NULL, newValue, &readahead) == TCL_OK
+               && readahead > 0) {
+        sectors = readahead;
+    } else {
+        if (interp) {
+            Tcl_AppendResult(interp, "bad readahead \"", newValue,
+                "\": must be sequential, random or a number of sectors",
+                (char *)NULL);
+        }
+        return TCL_ERROR;
+    }
+
+    /* sequential reads use full sectors even for a mini stream */
+    size = (readahead == STORAGE_READAHEAD_SEQUENTIAL)
+        ? 512 : ChannelSectorSize(chan);
+    if (chan->stmPtr) {
+        if (readahead == STORAGE_READAHEAD_SEQUENTIAL) {
+            CfbStreamReadAhead(chan->stmPtr, CFB_READAHEAD_MAX, 1);
+        } else {
+            CfbStreamReadAhead(chan->stmPtr,
+                (Tcl_WideUInt)(sectors > 1 ? sectors : 0) * size, 0);
+        }
+    }
+    if ((unsigned long)sectors > (1UL << 20) / size) {
+        sectors = (int)((1UL << 20) / size);
+    }
+    chan->readahead = readahead;
+    Tcl_SetChannelBufferSize(chan->chan, (int)(sectors * size));
+    return TCL_OK;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageChannelGetOptions -
+ *
+ *	Called by the Tcl channel layer to read the channel options.
+ *	-size is the current size of the stream, -sectorsize the size of
+ *	the sectors holding it and -fragments the number of runs of
+ *	consecutive sectors. Fragments are only known for the native
+ *	implementation. -readahead is the value last set.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The option values are appended to the DString.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+StorageChannelGetOptions(ClientData instanceData, Tcl_Interp *interp,
+    const char *optionName, Tcl_DString *dsPtr)
+{
+    StorageChannel *chan = (StorageChannel *)instanceData;
+    static const char *options[] = {
+        "-fragments", "-readahead", "-sectorsize", "-size", NULL
+    };
+    enum { OPT_FRAGMENTS, OPT_READAHEAD, OPT_SECTORSIZE, OPT_SIZE };
+    const char *optionList = chan->pstm
+        ? "readahead sectorsize size" : "fragments readahead sectorsize size";
+    char value[TCL_INTEGER_SPACE * 2];
+    Tcl_WideUInt size = 0;
+    unsigned long sectorSize = 512;
+    CfbSect fragments = 0;
+    int n;
+
+    if (chan->builderPtr) {
+        return optionName ? Tcl_BadChannelOption(interp, optionName, "")
+            : TCL_OK;
+    }
+    if (chan->stmPtr) {
+        int code = CfbStreamLayout(chan->stmPtr, &sectorSize, &fragments);
+        if (code != CFB_OK) {
+            if (interp) {
+                Tcl_SetObjResult(interp, CfbError("error reading stream",
+                        code));
+            }
+            return TCL_ERROR;
+        }
+        size = chan->stmPtr->size;
+    }
+#ifdef _WIN32
+    if (chan->pstm) {
+        STATSTG stat;
+        HRESULT hr = chan->pstm->lpVtbl->Stat(chan->pstm, &stat,
+            STATFLAG_NONAME);
+        if (FAILED(hr)) {
+            if (interp) {
+                Tcl_SetObjResult(interp,
+                    Win32Error("error reading stream", hr));
+            }
+            return TCL_ERROR;
+        }
+        size = stat.cbSize.QuadPart;
+        sectorSize = (size < 4096) ? 64 : 512;
+    }
+#endif
+
+    for (n = 0; options[n] != NULL; n++) {
+        if (optionName != NULL && strcmp(optionName, options[n]) != 0) {
+            continue;
+        }
+        if (n == OPT_FRAGMENTS && chan->pstm) {
+            continue;
+        }
+        switch (n) {
+            case OPT_FRAGMENTS:
+                _snprintf(value, sizeof(value), "%lu",
+                    (unsigned long)fragments);
+                break;
+            case OPT_READAHEAD:
+                if (chan->readahead == STORAGE_READAHEAD_SEQUENTIAL) {
+                    strcpy(value, "sequential");
+                } else if (chan->readahead == STORAGE_READAHEAD_RANDOM) {
+                    strcpy(value, "random");
+                } else {
+                    _snprintf(value, sizeof(value), "%d", chan->readahead);
+                }
+                break;
+            case OPT_SECTORSIZE:
+                _snprintf(value, sizeof(value), "%lu", sectorSize);
+                break;
+            case OPT_SIZE: {
+                Tcl_Obj *sizeObj = Tcl_NewWideIntObj((Tcl_WideInt)size);
+                Tcl_IncrRefCount(sizeObj);
+                strcpy(value, Tcl_GetString(sizeObj));
+                Tcl_DecrRefCount(sizeObj);
+                break;
+            }
+        }
+        if (optionName == NULL) {
+            Tcl_DStringAppendElement(dsPtr, options[n]);
+            Tcl_DStringAppendElement(dsPtr, value);
+        } else {
+            Tcl_DStringAppend(dsPtr, value, -1);
+            return TCL_OK;
+        }
+    }
+    if (optionName != NULL) {
+        return Tcl_BadChannelOption(interp, optionName, optionList);
+    }
+    return TCL_OK;
+}
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -1163,6 +3941,8 @@ StorageChannelWideSeek(ClientData instanceData, Tcl_WideInt offset,
  *	set the watchmask flag appropriately and set the blocktime to 0
  *	This allows the notified to call SetupProc and CheckProc to
  *	poll any of the channels from this package for events.
+ *	We keep a count of the watched channels so that the event source
+ *	does no work at all when nothing is being watched.
  *
  * Results:
  *	None.
@@ -1177,10 +3957,18 @@ static void
 StorageChannelWatch(ClientData instanceData, int mask)
 {
     StorageChannel *chan = (StorageChannel *)instanceData;
+    Package *pkgPtr = chan->pkgPtr;
     Tcl_Time blockTime = { 0, 0 };
+    int watched = (chan->watchmask != 0);
     
-    /* Set the block time to zero - we are always ready for events. */
     chan->watchmask = mask & chan->validmask;
+    if (chan->watchmask && !watched) {
+        ++pkgPtr->watchCount;
+    } else if (!chan->watchmask && watched) {
+        --pkgPtr->watchCount;
+    }
+
+    /* Set the block time to zero - we are always ready for events. */
     if (chan->watchmask) {
         Tcl_SetMaxBlockTime(&blockTime);
     }
@@ -1213,10 +4001,16 @@ static int
 StorageChannelGetHandle(ClientData instanceData, 
     int direction, ClientData *handlePtr)
 {
+#ifdef _WIN32
     StorageChannel *chan = (StorageChannel *)instanceData;
-    HRESULT hr = chan->pstm->lpVtbl->QueryInterface(chan->pstm, 
-        &IID_IStream, handlePtr);
-    return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
+    if (chan->pstm) {
+        HRESULT hr = chan->pstm->lpVtbl->QueryInterface(chan->pstm, 
+            &IID_IStream, handlePtr);
+        return SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
+    }
+#endif
+    /* native streams have no handle to offer */
+    return TCL_ERROR;
 }
 
 static int
@@ -1235,9 +4029,9 @@ EventProc(Tcl_Event *evPtr, int flags)
 
 /**
  * This function is called to setup the notifier to monitor our
- * channel for file events. Our CheckProc will be called anyway after some
- * interval so we really only need to ensure that it is called at some 
- * appropriate interval.
+ * channel for file events. Storage streams are always ready so if any
+ * watched channel has no event queued then the notifier must not block.
+ * When no channel is being watched we leave the block time alone.
  */
 
 static void
@@ -1245,19 +4039,18 @@ SetupProc(ClientData clientData, int flags)
 {
     Package *pkgPtr = clientData;
     StorageChannel *chanPtr = NULL;
-    int msec = 10000;
     Tcl_Time blockTime = {0, 0};
     
-    if (!(flags & TCL_FILE_EVENTS)) {
+    if (!(flags & TCL_FILE_EVENTS) || pkgPtr->watchCount == 0) {
 	return;
     }
     
     for (chanPtr = pkgPtr->headPtr; chanPtr != NULL; chanPtr = chanPtr->nextPtr) {
-	msec = 10;
+	if (chanPtr->watchmask && !(chanPtr->flags & STORAGE_FLAG_PENDING)) {
+	    Tcl_SetMaxBlockTime(&blockTime);
+	    break;
+	}
     }
-    blockTime.sec = msec / 1000;
-    blockTime.usec = (msec % 1000) * 1000;
-    Tcl_SetMaxBlockTime(&blockTime);
 }
 
 static void
@@ -1267,12 +4060,14 @@ CheckProc(ClientData clientData, int flags)
     StorageChannel *chanPtr = NULL;
     int mask;
 
-    if (!(flags & TCL_FILE_EVENTS)) {
+    if (!(flags & TCL_FILE_EVENTS) || pkgPtr->watchCount == 0) {
 	return;
     }
 
     for (chanPtr = pkgPtr->headPtr; chanPtr != NULL; chanPtr = chanPtr->nextPtr) {
-	if (chanPtr->watchmask == 0) {
+	/* one event at a time - the channel is notified when it runs */
+	if (chanPtr->watchmask == 0
+	    || (chanPtr->flags & STORAGE_FLAG_PENDING)) {
 	    continue;
 	}
 
@@ -1291,6 +4086,13 @@ CheckProc(ClientData clientData, int flags)
 	}
     }
 }
+
+static int
+EventDeleteProc(Tcl_Event *evPtr, ClientData clientData)
+{
+    ChannelEvent *eventPtr = (ChannelEvent *)evPtr;
+    return (evPtr->proc == EventProc && eventPtr->instPtr == clientData);
+}
 
 /*
  * ----------------------------------------------------------------------
@@ -1341,9 +4143,12 @@ TclEnsembleCmd(ClientData clientData, Tcl_Interp *interp,
  *
  * GetItemInfo -
  *
- *	Iterate over the items in the storage and return the
- *	STATSTG structure for the matching item or generate
- *	a suitable Tcl error message.
+ *	Find the named item in the storage and return information
+ *	about it or generate a suitable Tcl error message. If the name
+ *	is empty then the storage itself is described.
+ *	For OLE storages we iterate over the items in the storage. For
+ *	native storages the directory entry id of the item is returned
+ *	too.
  *
  * Results:
  *	A standard Tcl result
@@ -1355,30 +4160,55 @@ TclEnsembleCmd(ClientData clientData, Tcl_Interp *interp,
  */
 
 static int
-GetItemInfo(Tcl_Interp *interp, IStorage *pstg, 
-    Tcl_Obj *pathObj, STATSTG *pstatstg)
+GetItemInfo(Tcl_Interp *interp, Storage *storagePtr, 
+    Tcl_Obj *pathObj, ItemInfo *infoPtr)
 {
-    IEnumSTATSTG *penum = NULL;
-    STATSTG stats[12];
-    ULONG count, n, objc, found = 0, r = TCL_OK;
+    int objc, found = 0, r = TCL_OK;
     Tcl_Obj **objv;
-    HRESULT hr = S_OK;
     
     r = Tcl_ListObjGetElements(interp, pathObj, &objc, &objv);
-    if (r == TCL_OK) {
-        if (objc < 1) {
-            hr = pstg->lpVtbl->Stat(pstg, pstatstg, STATFLAG_DEFAULT);
+    if (r == TCL_OK && storagePtr->cfbPtr) {
+        Cfb *cfbPtr = storagePtr->cfbPtr;
+        CfbSect id = storagePtr->dirId;
+        if (objc < 1 || CfbFindChild(cfbPtr, storagePtr->dirId,
+                objv[objc-1], &id) == CFB_OK) {
             found = 1;
+            InfoFromEntry(&cfbPtr->entries[id], id, infoPtr);
+        }
+    }
+#ifdef _WIN32
+    else if (r == TCL_OK) {
+        IStorage *pstg = storagePtr->pstg;
+        IEnumSTATSTG *penum = NULL;
+        STATSTG stat, stats[12];
+        ULONG count, n;
+        HRESULT hr = S_OK;
+        if (objc < 1) {
+            hr = pstg->lpVtbl->Stat(pstg, &stat, STATFLAG_DEFAULT);
+            found = SUCCEEDED(hr);
         } else {
             LPCOLESTR pwcsName = Tcl_GetUnicode(objv[objc-1]);
-            hr = pstg->lpVtbl->EnumElements(pstg, 0, NULL, 0, &penum);
+            /*
+             * Opening the item lets OLE use the directory tree to find
+             * it. This fails if the item is already open so then we fall
+             * back to examining each item in turn.
+             */
+            hr = StatItem(pstg, pwcsName, &stat);
+            if (SUCCEEDED(hr)) {
+                found = 1;
+                hr = S_FALSE;
+            } else if (hr == STG_E_FILENOTFOUND) {
+                hr = S_FALSE;
+            } else {
+                hr = pstg->lpVtbl->EnumElements(pstg, 0, NULL, 0, &penum);
+            }
             while (hr == S_OK) {
                 hr = penum->lpVtbl->Next(penum, 12, stats, &count);
                 for (n = 0; SUCCEEDED(hr) && n < count; n++) {
                     if (!found && wcscmp(pwcsName, stats[n].pwcsName) == 0) {
                         /* we must finish the loop to cleanup the strings */
                         found = 1; 
-                        CopyMemory(pstatstg, &stats[n], sizeof(STATSTG));
+                        CopyMemory(&stat, &stats[n], sizeof(STATSTG));
                         hr = S_FALSE; /* avoid any additional calls to Next */
                     } else {
                         CoTaskMemFree(stats[n].pwcsName);
@@ -1388,15 +4218,166 @@ GetItemInfo(Tcl_Interp *interp, IStorage *pstg,
         }
         if (penum)
             penum->lpVtbl->Release(penum);
-        if (!found) {
-            Tcl_SetObjResult(interp, 
-                Tcl_NewStringObj("file does not exist", -1));
-            r = TCL_ERROR;
+        if (found) {
+            InfoFromStatStg(&stat, infoPtr);
+            CoTaskMemFree(stat.pwcsName);
         }
     }
+#endif
+    if (r == TCL_OK && !found) {
+        Tcl_SetObjResult(interp, 
+            Tcl_NewStringObj("file does not exist", -1));
+        r = TCL_ERROR;
+    }
     return r;
 }
 
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StatItem -
+ *
+ *	Obtain the status of a named item by opening it for reading.
+ *	OLE locates the item using the directory tree so this avoids
+ *	enumerating the storage contents.
+ *
+ * Results:
+ *	A COM result code. STG_E_FILENOTFOUND if there is no such item.
+ *	The name is not returned in the STATSTG structure.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+#ifdef _WIN32
+static HRESULT
+StatItem(IStorage *pstg, LPCOLESTR pwcsName, STATSTG *statPtr)
+{
+    IStream *pstm = NULL;
+    IStorage *pstgItem = NULL;
+    DWORD grfMode = STGM_READ | STGM_SHARE_EXCLUSIVE;
+    HRESULT hr;
+
+    hr = pstg->lpVtbl->OpenStream(pstg, pwcsName, NULL, grfMode, 0, &pstm);
+    if (SUCCEEDED(hr)) {
+        hr = pstm->lpVtbl->Stat(pstm, statPtr, STATFLAG_NONAME);
+        pstm->lpVtbl->Release(pstm);
+    } else if (hr == STG_E_FILENOTFOUND) {
+        hr = pstg->lpVtbl->OpenStorage(pstg, pwcsName, NULL, grfMode,
+                                       NULL, 0, &pstgItem);
+        if (SUCCEEDED(hr)) {
+            hr = pstgItem->lpVtbl->Stat(pstgItem, statPtr, STATFLAG_NONAME);
+            pstgItem->lpVtbl->Release(pstgItem);
+        }
+    }
+    return hr;
+}
+#endif /* _WIN32 */
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * InfoFromEntry, InfoFromStatStg -
+ *
+ *	Fill in an ItemInfo structure from a native directory entry or
+ *	from an OLE STATSTG structure.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static void
+InfoFromEntry(const CfbEntry *entryPtr, CfbSect id, ItemInfo *infoPtr)
+{
+    infoPtr->id = id;
+    if (entryPtr->type == CFB_TYPE_STREAM) {
+        infoPtr->type = STGTY_STREAM;
+        infoPtr->size = (Tcl_WideInt)entryPtr->size;
+    } else {
+        infoPtr->type = STGTY_STORAGE;
+        infoPtr->size = 0;
+    }
+    /* compound files do not record an access time */
+    infoPtr->atime = entryPtr->mtime;
+    infoPtr->mtime = entryPtr->mtime;
+    infoPtr->ctime = entryPtr->ctime;
+}
+
+#ifdef _WIN32
+static void
+InfoFromStatStg(const STATSTG *statPtr, ItemInfo *infoPtr)
+{
+    infoPtr->type = statPtr->type;
+    infoPtr->size = statPtr->cbSize.QuadPart;
+    infoPtr->atime = WideFromFileTime(&statPtr->atime);
+    infoPtr->mtime = WideFromFileTime(&statPtr->mtime);
+    infoPtr->ctime = WideFromFileTime(&statPtr->ctime);
+    infoPtr->id = 0;
+}
+#endif /* _WIN32 */
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ItemInfoObj -
+ *
+ *	Convert item information into a list of the fields returned by
+ *	[file stat]. The mode is that of the storage holding the item.
+ *
+ * Results:
+ *	A new list object of field names and values.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ItemInfoObj(int mode, const ItemInfo *infoPtr)
+{
+    Tcl_Obj *objv[20];
+    const stgm_map_t *p = NULL;
+    int posixmode = 0;
+
+    for (p = stgm_map; p->s != NULL; p++) {
+        if ((mode & ~(STGM_STREAMMASK)) == p->f) {
+            posixmode = p->posixmode;
+            break;
+        }
+    }
+
+    objv[0] = Tcl_NewStringObj("type", -1);
+    objv[1] = Tcl_NewStringObj(
+        (infoPtr->type == STGTY_STORAGE) ? "directory" : "file", -1);
+    objv[2] = Tcl_NewStringObj("size", -1);
+    objv[3] = Tcl_NewWideIntObj(infoPtr->size);
+    objv[4] = Tcl_NewStringObj("atime", -1);
+    objv[5] = Tcl_NewLongObj(TimeFromFileTime(infoPtr->atime));
+    objv[6] = Tcl_NewStringObj("mtime", -1);
+    objv[7] = Tcl_NewLongObj(TimeFromFileTime(infoPtr->mtime));
+    objv[8] = Tcl_NewStringObj("ctime", -1);
+    objv[9] = Tcl_NewLongObj(TimeFromFileTime(infoPtr->ctime));
+    objv[10] = Tcl_NewStringObj("gid", -1);
+    objv[11] = Tcl_NewLongObj(0);
+    objv[12] = Tcl_NewStringObj("uid", -1);
+    objv[13] = Tcl_NewLongObj(0);
+    objv[14] = Tcl_NewStringObj("ino", -1);
+    objv[15] = Tcl_NewLongObj(0);
+    objv[16] = Tcl_NewStringObj("dev", -1);
+    objv[17] = Tcl_NewLongObj(0);
+    objv[18] = Tcl_NewStringObj("mode", -1);
+    objv[19] = Tcl_NewLongObj(posixmode);
+    return Tcl_NewListObj(20, objv);
+}
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -1413,6 +4394,7 @@ GetItemInfo(Tcl_Interp *interp, IStorage *pstg,
  * ----------------------------------------------------------------------
  */
 
+#ifdef _WIN32
 Tcl_Obj *
 Win32Error(const char * szPrefix, HRESULT hr)
 {
@@ -1458,7 +4440,7 @@ Win32Error(const char * szPrefix, HRESULT hr)
     LocalFree((HLOCAL)lpBuffer);
     return msgObj;
 }
-
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -1483,12 +4465,40 @@ TimeToFileTime(time_t t, LPFILETIME pft)
     pft->dwHighDateTime = (DWORD)(t64 >> 32);
 }
 
+/*
+ * ----------------------------------------------------------------------
+ *
+ * WideFromFileTime -
+ *
+ *	Convert a Win32 FILETIME into a 64 bit value.
+ *
+ * Results:
+ *	The FILETIME as a wide integer.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static Tcl_WideUInt
+WideFromFileTime(const FILETIME *pft)
+{
+    Tcl_WideUInt t64 = pft->dwHighDateTime;
+    t64 <<= 32;
+    t64 |= pft->dwLowDateTime;
+    return t64;
+}
+#endif /* _WIN32 */
+
 /*
  * ----------------------------------------------------------------------
  *
  * TimeFromFileTime
  *
- *	Convert a FILETIME value into a localtime time_t value.
+ *	Convert a 64 bit FILETIME value into a localtime time_t value.
+ *	Compound files commonly leave the times of streams as zero,
+ *	which is reported as 0 rather than as a date in 1601.
  *
  * Results:
  *	The localtime in unix epoch seconds.
@@ -1500,14 +4510,72 @@ TimeToFileTime(time_t t, LPFILETIME pft)
  */
 
 static time_t
-TimeFromFileTime(const FILETIME *pft)
+TimeFromFileTime(Tcl_WideUInt ft)
 {
-    LONGLONG t64 = pft->dwHighDateTime;
-    t64 <<= 32;
-    t64 |= pft->dwLowDateTime;
+    Tcl_WideInt t64 = (Tcl_WideInt)ft;
+    if (ft == 0) {
+        return 0;
+    }
     t64 -= 116444736000000000;
     return (time_t)(t64 / 10000000);
 }
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * ErrnoFromCfb -
+ *
+ *	Convert a CFB status code into a POSIX error for the channel layer.
+ *
+ * Results:
+ *	An errno value or 0 for CFB_OK.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+static int
+ErrnoFromCfb(int code)
+{
+    switch (code) {
+        case CFB_OK:     return 0;
+        case CFB_ENOENT: return ENOENT;
+        case CFB_EIO:    return Tcl_GetErrno();
+        case CFB_EEXIST: return EEXIST;
+        case CFB_EBUSY:  return EBUSY;
+        case CFB_EINUSE: return EBUSY;
+        case CFB_ENOSPC: return ENOSPC;
+        case CFB_EINVAL: return EINVAL;
+        default:         return EACCES;
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *
+ * StorageWritable -
+ *
+ *	Check that items may be created or modified in a native storage.
+ *	Both the storage and the file must have been opened for writing.
+ *
+ * Results:
+ *	Non-zero if the storage may be modified.
+ *
+ * Side effects:
+ *	None.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+int
+StorageWritable(Storage *storagePtr)
+{
+    return storagePtr->cfbPtr && storagePtr->cfbPtr->writable
+        && (storagePtr->mode & (STGM_WRITE|STGM_READWRITE
+                                |STGM_CREATE|STGM_APPEND));
+}
 
 /* ----------------------------------------------------------------------
  *
@@ -3,16 +3,45 @@
  * $Id$
  */
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define STRICT
 #include <ole2.h>
+#endif
 #include <tcl.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+/*
+ * Without OLE only the native compound file implementation is available.
+ * Provide the Win32 definitions that are shared with the OLE code.
+ */
+typedef unsigned long DWORD;
+typedef struct IStorage IStorage;
+typedef struct IStream IStream;
+#define STGM_DIRECT             0x00000000
+#define STGM_READ               0x00000000
+#define STGM_WRITE              0x00000001
+#define STGM_READWRITE          0x00000002
+#define STGM_SHARE_EXCLUSIVE    0x00000010
+#define STGM_CREATE             0x00001000
+#define STGM_TRANSACTED         0x00010000
+#define STGTY_STORAGE           1
+#define STGTY_STREAM            2
+#define _snprintf               snprintf
+#define InterlockedIncrement(p) __sync_add_and_fetch((p), 1)
+#endif
 
 #undef TCL_STORAGE_CLASS
 #define TCL_STORAGE_CLASS DLLEXPORT
 
+#include "cfb.h"
+
 typedef struct Ensemble {
     const char *name;           /* subcommand name */
     Tcl_ObjCmdProc *command;    /* implementation OR */
@@ -24,10 +53,18 @@ typedef struct EnsembleCmdData {
     ClientData       clientData;
 } EnsembleCmdData;
 
-typedef struct {
-    IStorage *pstg;
+typedef struct Storage {
+    IStorage *pstg;             /* OLE storage or NULL */
+    Cfb      *cfbPtr;           /* native compound file or NULL */
+    CfbBuilder *builderPtr;     /* file being generated or NULL */
+    CfbSect   dirId;            /* native directory entry of this storage */
     int       mode;
-    Tcl_Obj  *children;
+    Tcl_Interp *interp;
+    Tcl_Command token;          /* the storage command */
+    struct Storage *parentPtr;  /* storage this was opened from or NULL */
+    Tcl_HashTable children;     /* sub-storages opened from this one */
+    Tcl_HashTable channels;     /* streams opened from this one */
+    Tcl_Obj  *shareObj;         /* token registered by share or NULL */
 } Storage;
 
 #define STGM_APPEND     0x00000004  /* unused bit in Win32 enum */
@@ -39,8 +76,15 @@ typedef struct {
 EXTERN int Storage_Init(Tcl_Interp *interp);
 EXTERN int Storage_SafeInit(Tcl_Interp *interp);
 EXTERN Tcl_ObjCmdProc Storage_OpenStorage;
+EXTERN Tcl_ObjCmdProc Storage_CreateStorage;
+EXTERN Tcl_ObjCmdProc Storage_AttachStorage;
+EXTERN Tcl_ObjCmdProc Storage_CompactStorage;
+EXTERN Tcl_ObjCmdProc Storage_CheckStorage;
 
 int GetStorageFlagsFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, int *flagsPtr);
+int StorageWritable(Storage *storagePtr);
 Tcl_ObjCmdProc StoragePropertySetCmd;
 Tcl_ObjCmdProc TclEnsembleCmd;
+#ifdef _WIN32
 Tcl_Obj *Win32Error(const char * szPrefix, HRESULT hr);
+#endif